@@ -1,6 +1,7 @@
 #ifndef _BAFS_H_
 #define _BAFS_H_
 
+#include <stddef.h>
 #include <linux/bafs.h>
 
 
@@ -13,6 +14,26 @@ struct bafs_dma_t {
     void* vaddr;
     void** dma_addrs;
     unsigned n_dma_addrs;
+    unsigned long page_size;
+};
+
+struct bafs_dma_extents_t {
+    void* vaddr;
+    struct bafs_dma_extent* extents;
+    unsigned n_extents;
+    unsigned map_gran;
+    unsigned* n_ctrl_extents;
+};
+
+struct bafs_dma_table_t {
+    void* vaddr;
+    /* one read-only table per controller, see struct bafs_dma_table_hdr */
+    const struct bafs_dma_table_hdr** tables;
+    unsigned n_ctrls;
+    unsigned long n_addrs;
+    unsigned long page_size;
+    unsigned long table_size;
+    unsigned long long generation;
 };
 
 struct bafs_ctrl_t {
@@ -22,6 +43,25 @@ struct bafs_ctrl_t {
     int type;
 };
 
+/* an io queue pair of a controller whose admin queue the driver owns */
+struct bafs_qp_t {
+    unsigned qid;
+    unsigned depth;
+    /* 64 byte submission and 16 byte completion entries */
+    void* sq;
+    void* cq;
+    /* sq tail and cq head doorbells, inside db_page */
+    volatile __u32* sq_db;
+    volatile __u32* cq_db;
+    void* db_page;
+    size_t db_len;
+    /* 0 when the rings live in registrations and were not mapped here */
+    size_t sq_len;
+    size_t cq_len;
+    /* msi-x vector of the cq, 0 when it is polled */
+    unsigned irq_vector;
+};
+
 /* BAFS CORE */
 int bafs_core_create_group(unsigned n_ctrls, char* ctrl_names[], char* ret_group_name);
 
@@ -32,13 +72,77 @@ int bafs_core_delete_group(char* group_name);
 int bafs_ctrl_open(const char* ctrl_dev_name, struct bafs_ctrl_t* ctrl_handle);
 
 
-int bafs_ctrl_reg_mem(unsigned size, unsigned loc, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t* ret_handle);
-int bafs_ctrl_pin_mem(void** addr, unsigned size, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t handle);
+/* registrations and their handles belong to the ctrl_handle they were made through, export a dma-buf to share one */
+int bafs_ctrl_reg_mem(size_t size, unsigned loc, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t* ret_handle);
+int bafs_ctrl_reg_mem_flags(size_t size, unsigned loc, unsigned flags, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t* ret_handle);
+int bafs_ctrl_reg_mem_placement(size_t size, unsigned loc, unsigned flags, unsigned placement, int* node,
+                                struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t* ret_handle);
+int bafs_ctrl_reg_user_mem(void* vaddr, size_t size, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t* ret_handle);
+int bafs_ctrl_reg_dmabuf_mem(int dmabuf_fd, void* vaddr, size_t size, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t* ret_handle);
+int bafs_ctrl_pin_mem(void** addr, size_t size, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t handle);
+int bafs_ctrl_prefault_mem(void* vaddr, unsigned long offset, unsigned long len, struct bafs_ctrl_t* ctrl_handle);
 
-int bafs_ctrl_map(void** addr, unsigned size, unsigned loc, struct bafs_ctrl_t* ctrl_handle);
+int bafs_ctrl_map(void** addr, size_t size, unsigned loc, struct bafs_ctrl_t* ctrl_handle);
 
 int bafs_ctrl_dma_map_mem(void* vaddr, struct bafs_dma_t* dma_handle, struct bafs_ctrl_t* ctrl_handle);
 
+/*
+ * layout is one of BAFS_DMA_LAYOUT_*, the strides are only read for BAFS_DMA_LAYOUT_STRIDED.
+ * On ENOSPC n_dma_addrs is set to the table size needed.
+ */
+int bafs_ctrl_dma_map_mem_layout(void* vaddr, struct bafs_dma_t* dma_handle, unsigned layout,
+                                 unsigned long page_stride, unsigned long ctrl_stride, struct bafs_ctrl_t* ctrl_handle);
+
+int bafs_ctrl_dma_map_mem_extents(void* vaddr, struct bafs_dma_extents_t* dma_handle, struct bafs_ctrl_t* ctrl_handle);
+
+/* len 0 maps or unmaps through the end of the region, unmap with offset 0 and len 0 drops every window */
+int bafs_ctrl_dma_map_mem_range(void* vaddr, unsigned long offset, unsigned long len, struct bafs_dma_extents_t* dma_handle,
+                                struct bafs_ctrl_t* ctrl_handle);
+
+int bafs_ctrl_dma_unmap_mem(void* vaddr, unsigned long offset, unsigned long len, struct bafs_ctrl_t* ctrl_handle);
+
+/* same as the range calls but name the registration by handle, dma_handle->vaddr is left as is */
+int bafs_ctrl_dma_map_mem_hnd(bafs_mem_hnd_t handle, unsigned long offset, unsigned long len,
+                              struct bafs_dma_extents_t* dma_handle, struct bafs_ctrl_t* ctrl_handle);
+
+int bafs_ctrl_dma_unmap_mem_hnd(bafs_mem_hnd_t handle, unsigned long offset, unsigned long len,
+                                struct bafs_ctrl_t* ctrl_handle);
+
+int bafs_ctrl_dereg_mem(bafs_mem_hnd_t handle, struct bafs_ctrl_t* ctrl_handle);
+
+/* needed is 0 when every mapping of the region is coherent and unbounced, syncs can then be skipped */
+int bafs_ctrl_dma_sync_needed(void* vaddr, int* needed, struct bafs_ctrl_t* ctrl_handle);
+
+int bafs_ctrl_dma_sync_mem(void* vaddr, const struct bafs_dma_sync_range* ranges, unsigned n_ranges,
+                           struct bafs_ctrl_t* ctrl_handle);
+
+int bafs_ctrl_export_dmabuf(void* vaddr, int* dmabuf_fd, struct bafs_ctrl_t* ctrl_handle);
+
+int bafs_ctrl_dma_map_mem_contig(void* vaddr, unsigned long long* dma_addr, struct bafs_ctrl_t* ctrl_handle);
+
+int bafs_ctrl_dma_map_mem_table(void* vaddr, struct bafs_dma_table_t* table_handle, struct bafs_ctrl_t* ctrl_handle);
+
+int bafs_dma_table_changed(const struct bafs_dma_table_t* table_handle);
+
+void bafs_dma_table_release(struct bafs_dma_table_t* table_handle);
+
+/* depth 0 picks the driver default, the queues are deleted when ctrl_handle is closed */
+int bafs_ctrl_create_qp(unsigned depth, struct bafs_ctrl_t* ctrl_handle, struct bafs_qp_t* qp);
+
+/* rings in two registrations of ctrl_handle, each must map to one contiguous dma range */
+int bafs_ctrl_create_qp_user_mem(unsigned depth, bafs_mem_hnd_t sq_handle, bafs_mem_hnd_t cq_handle,
+                                 void* sq, void* cq, struct bafs_ctrl_t* ctrl_handle, struct bafs_qp_t* qp);
+
+/*
+ * The eventfd is signalled when the controller interrupts for the cq, flags takes
+ * BAFS_QP_FLAG_IRQ_NO_COALESCE. Drain the cq and write its head doorbell before
+ * waiting again, the controller interrupts again while completions are left.
+ */
+int bafs_ctrl_create_qp_irq(unsigned depth, unsigned flags, int eventfd, struct bafs_ctrl_t* ctrl_handle,
+                            struct bafs_qp_t* qp);
+
+void bafs_qp_release(struct bafs_qp_t* qp);
+
 
 
 #ifdef __cplusplus
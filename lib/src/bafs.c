@@ -140,9 +140,8 @@ int bafs_ctrl_open(const char* ctrl_dev_name, struct bafs_ctrl_t* ctrl_handle) {
 }
 
 
-int bafs_ctrl_reg_mem(unsigned size, unsigned loc, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t* ret_handle) {
+static int bafs_ctrl_ioc_reg_mem(struct BAFS_IOC_REG_MEM2_PARAMS* params, struct bafs_ctrl_t* ctrl_handle) {
     int ret = 0;
-    struct BAFS_IOC_REG_MEM_PARAMS params;
 
     if (ctrl_handle->fd < 0) {
         ret = EINVAL;
@@ -150,13 +149,9 @@ int bafs_ctrl_reg_mem(unsigned size, unsigned loc, struct bafs_ctrl_t* ctrl_hand
         return ret;
     }
 
-    params.size = size;
-    params.loc = loc;
-    params.handle = 0;
-
     if (ctrl_handle->type == GROUP) {
 
-        ret = ioctl(ctrl_handle->fd, BAFS_GROUP_IOC_REG_MEM, &params);
+        ret = ioctl(ctrl_handle->fd, BAFS_GROUP_IOC_REG_MEM2, params);
         if (ret) {
             ret = errno;
             return ret;
@@ -166,7 +161,7 @@ int bafs_ctrl_reg_mem(unsigned size, unsigned loc, struct bafs_ctrl_t* ctrl_hand
     }
     else if (ctrl_handle->type == NOT_GROUP) {
 
-        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_REG_MEM, &params);
+        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_REG_MEM2, params);
         if (ret) {
             ret = errno;
             return ret;
@@ -179,13 +174,94 @@ int bafs_ctrl_reg_mem(unsigned size, unsigned loc, struct bafs_ctrl_t* ctrl_hand
         return ret;
     }
 
+    return 0;
+}
+
+int bafs_ctrl_reg_mem(size_t size, unsigned loc, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t* ret_handle) {
+    return bafs_ctrl_reg_mem_flags(size, loc, 0, ctrl_handle, ret_handle);
+}
+
+int bafs_ctrl_reg_mem_flags(size_t size, unsigned loc, unsigned flags, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t* ret_handle) {
+    return bafs_ctrl_reg_mem_placement(size, loc, flags, BAFS_MEM_PLACE_DEFAULT, NULL, ctrl_handle, ret_handle);
+}
+
+int bafs_ctrl_reg_mem_placement(size_t size, unsigned loc, unsigned flags, unsigned placement, int* node,
+                                struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t* ret_handle) {
+    int ret = 0;
+    struct BAFS_IOC_REG_MEM2_PARAMS params;
+
+    params.size = size;
+    params.loc = loc;
+    params.flags = flags;
+    params.handle = 0;
+    params.vaddr = 0;
+    params.placement = placement;
+    params.node = node ? *node : -1;
+    params.dmabuf_fd = -1;
+
+    ret = bafs_ctrl_ioc_reg_mem(&params, ctrl_handle);
+    if (ret) {
+        return ret;
+    }
+
+    if (node) {
+        *node = params.node;
+    }
+    *ret_handle = params.handle;
+
+    return 0;
+
+}
+
+int bafs_ctrl_reg_user_mem(void* vaddr, size_t size, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t* ret_handle) {
+    int ret = 0;
+    struct BAFS_IOC_REG_MEM2_PARAMS params;
+
+    params.size = size;
+    params.loc = BAFS_MEM_USER;
+    params.flags = 0;
+    params.handle = 0;
+    params.vaddr = (unsigned long) vaddr;
+    params.placement = BAFS_MEM_PLACE_DEFAULT;
+    params.node = -1;
+    params.dmabuf_fd = -1;
+
+    ret = bafs_ctrl_ioc_reg_mem(&params, ctrl_handle);
+    if (ret) {
+        return ret;
+    }
+
+    *ret_handle = params.handle;
+
+    return 0;
+
+}
+
+int bafs_ctrl_reg_dmabuf_mem(int dmabuf_fd, void* vaddr, size_t size, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t* ret_handle) {
+    int ret = 0;
+    struct BAFS_IOC_REG_MEM2_PARAMS params;
+
+    params.size = size;
+    params.loc = BAFS_MEM_DMABUF;
+    params.flags = 0;
+    params.handle = 0;
+    params.vaddr = (unsigned long) vaddr;
+    params.placement = BAFS_MEM_PLACE_DEFAULT;
+    params.node = -1;
+    params.dmabuf_fd = dmabuf_fd;
+
+    ret = bafs_ctrl_ioc_reg_mem(&params, ctrl_handle);
+    if (ret) {
+        return ret;
+    }
+
     *ret_handle = params.handle;
 
     return 0;
 
 }
 
-int bafs_ctrl_pin_mem(void** addr, unsigned size, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t handle) {
+int bafs_ctrl_pin_mem(void** addr, size_t size, struct bafs_ctrl_t* ctrl_handle, bafs_mem_hnd_t handle) {
     int ret = 0;
     void* addr_;
 
@@ -206,7 +282,7 @@ int bafs_ctrl_pin_mem(void** addr, unsigned size, struct bafs_ctrl_t* ctrl_handl
     return 0;
 }
 
-int bafs_ctrl_map(void** addr, unsigned size, unsigned loc, struct bafs_ctrl_t* ctrl_handle) {
+int bafs_ctrl_map(void** addr, size_t size, unsigned loc, struct bafs_ctrl_t* ctrl_handle) {
     int ret = 0;
     bafs_mem_hnd_t handle;
 
@@ -245,6 +321,7 @@ int bafs_ctrl_dma_map_mem(void* vaddr, struct bafs_dma_t* dma_handle, struct baf
     params.vaddr = (unsigned long) vaddr;
     params.dma_addrs = (unsigned long*) dma_handle->dma_addrs;
     params.n_dma_addrs = dma_handle->n_dma_addrs;
+    params.page_shift = 0;
 
     if (ctrl_handle->type == GROUP) {
 
@@ -273,6 +350,752 @@ int bafs_ctrl_dma_map_mem(void* vaddr, struct bafs_dma_t* dma_handle, struct baf
 
     dma_handle->vaddr = vaddr;
     dma_handle->n_dma_addrs = params.n_dma_addrs;
+    dma_handle->page_size = 1UL << params.page_shift;
+
+    return 0;
+}
+
+
+int bafs_ctrl_dma_map_mem_layout(void* vaddr, struct bafs_dma_t* dma_handle, unsigned layout,
+                                 unsigned long page_stride, unsigned long ctrl_stride, struct bafs_ctrl_t* ctrl_handle) {
+    int ret = 0;
+
+    struct BAFS_IOC_DMA_MAP_MEM2_PARAMS params;
+
+
+    if (ctrl_handle->fd < 0) {
+        ret = EBADF;
+        return ret;
+    }
+
+    params.vaddr = (unsigned long) vaddr;
+    params.dma_addrs = (unsigned long*) dma_handle->dma_addrs;
+    params.n_dma_addrs = dma_handle->n_dma_addrs;
+    params.page_stride = page_stride;
+    params.ctrl_stride = ctrl_stride;
+    params.n_addrs = 0;
+    params.layout = layout;
+    params.page_shift = 0;
+    params.n_ctrls = 0;
+    params.reserved = 0;
+
+    if (ctrl_handle->type == GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_GROUP_IOC_DMA_MAP_MEM2, &params);
+
+
+    }
+    else if (ctrl_handle->type == NOT_GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_DMA_MAP_MEM2, &params);
+
+
+    }
+    else {
+        ret = EINVAL;
+        return ret;
+    }
+
+    if (ret) {
+        ret = errno;
+        /* the kernel reports the table size it needs */
+        if (ret == ENOSPC)
+            dma_handle->n_dma_addrs = params.n_dma_addrs;
+        return ret;
+    }
+
+    dma_handle->vaddr = vaddr;
+    dma_handle->n_dma_addrs = params.n_dma_addrs;
+    dma_handle->page_size = 1UL << params.page_shift;
+
+    return 0;
+}
+
+
+int bafs_ctrl_dma_map_mem_extents(void* vaddr, struct bafs_dma_extents_t* dma_handle, struct bafs_ctrl_t* ctrl_handle) {
+    int ret = 0;
+
+    struct BAFS_IOC_DMA_MAP_MEM_EXTENTS_PARAMS params;
+
+
+    if (ctrl_handle->fd < 0) {
+        ret = EBADF;
+        return ret;
+    }
+
+    params.vaddr = (unsigned long) vaddr;
+    params.map_gran = dma_handle->map_gran;
+    params.n_extents = dma_handle->n_extents;
+    params.extents = dma_handle->extents;
+    params.n_ctrl_extents = dma_handle->n_ctrl_extents;
+
+    if (ctrl_handle->type == GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_GROUP_IOC_DMA_MAP_MEM_EXTENTS, &params);
+
+
+    }
+    else if (ctrl_handle->type == NOT_GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_DMA_MAP_MEM_EXTENTS, &params);
+
+
+    }
+    else {
+        ret = EINVAL;
+        return ret;
+    }
+
+    /* on ENOSPC n_extents holds the capacity needed per controller */
+    dma_handle->n_extents = params.n_extents;
+    if (ret) {
+        ret = errno;
+        return ret;
+    }
+
+    dma_handle->vaddr = vaddr;
+
+    return 0;
+}
+
+int bafs_ctrl_dma_map_mem_range(void* vaddr, unsigned long offset, unsigned long len, struct bafs_dma_extents_t* dma_handle,
+                                struct bafs_ctrl_t* ctrl_handle) {
+    int ret = 0;
+
+    struct BAFS_IOC_DMA_MAP_MEM_RANGE_PARAMS params;
+
+
+    if (ctrl_handle->fd < 0) {
+        ret = EBADF;
+        return ret;
+    }
+
+    params.vaddr = (unsigned long) vaddr;
+    params.offset = offset;
+    params.len = len;
+    params.map_gran = dma_handle->map_gran;
+    params.n_extents = dma_handle->n_extents;
+    params.extents = dma_handle->extents;
+    params.n_ctrl_extents = dma_handle->n_ctrl_extents;
+
+    if (ctrl_handle->type == GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_GROUP_IOC_DMA_MAP_MEM_RANGE, &params);
+
+
+    }
+    else if (ctrl_handle->type == NOT_GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_DMA_MAP_MEM_RANGE, &params);
+
+
+    }
+    else {
+        ret = EINVAL;
+        return ret;
+    }
+
+    /* on ENOSPC n_extents holds the capacity needed per controller */
+    dma_handle->n_extents = params.n_extents;
+    if (ret) {
+        ret = errno;
+        return ret;
+    }
+
+    dma_handle->vaddr = vaddr;
+
+    return 0;
+}
+
+int bafs_ctrl_dma_unmap_mem(void* vaddr, unsigned long offset, unsigned long len, struct bafs_ctrl_t* ctrl_handle) {
+    int ret = 0;
+
+    struct BAFS_IOC_DMA_UNMAP_MEM_PARAMS params;
+
+
+    if (ctrl_handle->fd < 0) {
+        ret = EBADF;
+        return ret;
+    }
+
+    params.vaddr = (unsigned long) vaddr;
+    params.offset = offset;
+    params.len = len;
+
+    if (ctrl_handle->type == GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_GROUP_IOC_DMA_UNMAP_MEM, &params);
+
+
+    }
+    else if (ctrl_handle->type == NOT_GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_DMA_UNMAP_MEM, &params);
+
+
+    }
+    else {
+        ret = EINVAL;
+        return ret;
+    }
+
+    if (ret) {
+        ret = errno;
+        return ret;
+    }
+
+    return 0;
+}
+
+int bafs_ctrl_dma_map_mem_hnd(bafs_mem_hnd_t handle, unsigned long offset, unsigned long len,
+                              struct bafs_dma_extents_t* dma_handle, struct bafs_ctrl_t* ctrl_handle) {
+    int ret = 0;
+
+    struct BAFS_IOC_DMA_MAP_MEM_HND_PARAMS params;
+
+
+    if (ctrl_handle->fd < 0) {
+        ret = EBADF;
+        return ret;
+    }
+
+    params.handle = handle;
+    params.offset = offset;
+    params.len = len;
+    params.map_gran = dma_handle->map_gran;
+    params.n_extents = dma_handle->n_extents;
+    params.reserved = 0;
+    params.extents = dma_handle->extents;
+    params.n_ctrl_extents = dma_handle->n_ctrl_extents;
+
+    if (ctrl_handle->type == GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_GROUP_IOC_DMA_MAP_MEM_HND, &params);
+
+
+    }
+    else if (ctrl_handle->type == NOT_GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_DMA_MAP_MEM_HND, &params);
+
+
+    }
+    else {
+        ret = EINVAL;
+        return ret;
+    }
+
+    /* on ENOSPC n_extents holds the capacity needed per controller */
+    dma_handle->n_extents = params.n_extents;
+    if (ret) {
+        ret = errno;
+        return ret;
+    }
 
     return 0;
 }
+
+int bafs_ctrl_dma_unmap_mem_hnd(bafs_mem_hnd_t handle, unsigned long offset, unsigned long len,
+                                struct bafs_ctrl_t* ctrl_handle) {
+    int ret = 0;
+
+    struct BAFS_IOC_DMA_UNMAP_MEM_HND_PARAMS params;
+
+
+    if (ctrl_handle->fd < 0) {
+        ret = EBADF;
+        return ret;
+    }
+
+    params.handle = handle;
+    params.reserved = 0;
+    params.offset = offset;
+    params.len = len;
+
+    if (ctrl_handle->type == GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_GROUP_IOC_DMA_UNMAP_MEM_HND, &params);
+
+
+    }
+    else if (ctrl_handle->type == NOT_GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_DMA_UNMAP_MEM_HND, &params);
+
+
+    }
+    else {
+        ret = EINVAL;
+        return ret;
+    }
+
+    if (ret) {
+        ret = errno;
+        return ret;
+    }
+
+    return 0;
+}
+
+static int bafs_ctrl_dma_sync_ioctl(struct BAFS_IOC_DMA_SYNC_MEM_PARAMS* params, struct bafs_ctrl_t* ctrl_handle) {
+    int ret = 0;
+
+
+    if (ctrl_handle->fd < 0) {
+        ret = EBADF;
+        return ret;
+    }
+
+    if (ctrl_handle->type == GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_GROUP_IOC_DMA_SYNC_MEM, params);
+
+
+    }
+    else if (ctrl_handle->type == NOT_GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_DMA_SYNC_MEM, params);
+
+
+    }
+    else {
+        ret = EINVAL;
+        return ret;
+    }
+
+    if (ret) {
+        ret = errno;
+        return ret;
+    }
+
+    return 0;
+}
+
+int bafs_ctrl_dma_sync_needed(void* vaddr, int* needed, struct bafs_ctrl_t* ctrl_handle) {
+    int ret = 0;
+
+    struct BAFS_IOC_DMA_SYNC_MEM_PARAMS params;
+
+
+    params.vaddr = (unsigned long) vaddr;
+    params.ranges = NULL;
+    params.n_ranges = 0;
+    params.flags = 0;
+
+    ret = bafs_ctrl_dma_sync_ioctl(&params, ctrl_handle);
+    if (ret) {
+        return ret;
+    }
+
+    *needed = (params.flags & BAFS_DMA_SYNC_NEEDED) != 0;
+
+    return 0;
+}
+
+int bafs_ctrl_dma_sync_mem(void* vaddr, const struct bafs_dma_sync_range* ranges, unsigned n_ranges,
+                           struct bafs_ctrl_t* ctrl_handle) {
+    struct BAFS_IOC_DMA_SYNC_MEM_PARAMS params;
+
+
+    params.vaddr = (unsigned long) vaddr;
+    params.ranges = (struct bafs_dma_sync_range*) ranges;
+    params.n_ranges = n_ranges;
+    params.flags = 0;
+
+    return bafs_ctrl_dma_sync_ioctl(&params, ctrl_handle);
+}
+
+int bafs_ctrl_dereg_mem(bafs_mem_hnd_t handle, struct bafs_ctrl_t* ctrl_handle) {
+    int ret = 0;
+
+    struct BAFS_IOC_DEREG_MEM_PARAMS params;
+
+
+    if (ctrl_handle->fd < 0) {
+        ret = EBADF;
+        return ret;
+    }
+
+    params.handle = handle;
+
+    if (ctrl_handle->type == GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_GROUP_IOC_DEREG_MEM, &params);
+
+
+    }
+    else if (ctrl_handle->type == NOT_GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_DEREG_MEM, &params);
+
+
+    }
+    else {
+        ret = EINVAL;
+        return ret;
+    }
+
+    if (ret) {
+        ret = errno;
+        return ret;
+    }
+
+    return 0;
+}
+
+int bafs_ctrl_prefault_mem(void* vaddr, unsigned long offset, unsigned long len, struct bafs_ctrl_t* ctrl_handle) {
+    int ret = 0;
+
+    struct BAFS_IOC_PREFAULT_MEM_PARAMS params;
+
+
+    if (ctrl_handle->fd < 0) {
+        ret = EBADF;
+        return ret;
+    }
+
+    params.vaddr = (unsigned long) vaddr;
+    params.offset = offset;
+    params.len = len;
+
+    if (ctrl_handle->type == GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_GROUP_IOC_PREFAULT_MEM, &params);
+
+
+    }
+    else if (ctrl_handle->type == NOT_GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_PREFAULT_MEM, &params);
+
+
+    }
+    else {
+        ret = EINVAL;
+        return ret;
+    }
+
+    if (ret) {
+        ret = errno;
+        return ret;
+    }
+
+    return 0;
+}
+
+int bafs_ctrl_export_dmabuf(void* vaddr, int* dmabuf_fd, struct bafs_ctrl_t* ctrl_handle) {
+    int ret = 0;
+
+    struct BAFS_IOC_EXPORT_DMABUF_PARAMS params;
+
+
+    if (ctrl_handle->fd < 0) {
+        ret = EBADF;
+        return ret;
+    }
+
+    params.vaddr = (unsigned long) vaddr;
+    params.fd = -1;
+
+    if (ctrl_handle->type == GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_GROUP_IOC_EXPORT_DMABUF, &params);
+
+
+    }
+    else if (ctrl_handle->type == NOT_GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_EXPORT_DMABUF, &params);
+
+
+    }
+    else {
+        ret = EINVAL;
+        return ret;
+    }
+
+    if (ret) {
+        ret = errno;
+        return ret;
+    }
+
+    *dmabuf_fd = params.fd;
+
+    return 0;
+}
+
+int bafs_ctrl_dma_map_mem_contig(void* vaddr, unsigned long long* dma_addr, struct bafs_ctrl_t* ctrl_handle) {
+    int ret = 0;
+
+    struct BAFS_IOC_DMA_MAP_MEM_CONTIG_PARAMS params;
+
+
+    if (ctrl_handle->fd < 0) {
+        ret = EBADF;
+        return ret;
+    }
+
+    params.vaddr = (unsigned long) vaddr;
+    params.dma_addr = 0;
+    params.len = 0;
+
+    if (ctrl_handle->type == GROUP) {
+
+        /* every controller of a group has its own iova space */
+        ret = EOPNOTSUPP;
+        return ret;
+
+
+    }
+    else if (ctrl_handle->type == NOT_GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_DMA_MAP_MEM_CONTIG, &params);
+
+
+    }
+    else {
+        ret = EINVAL;
+        return ret;
+    }
+
+    /* EOPNOTSUPP means no contiguous view, fall back to bafs_ctrl_dma_map_mem */
+    if (ret) {
+        ret = errno;
+        return ret;
+    }
+
+    *dma_addr = params.dma_addr;
+
+    return 0;
+}
+
+int bafs_ctrl_dma_map_mem_table(void* vaddr, struct bafs_dma_table_t* table_handle, struct bafs_ctrl_t* ctrl_handle) {
+    int ret = 0;
+    unsigned i;
+    void* table;
+    bafs_mem_hnd_t handle;
+
+    struct BAFS_IOC_DMA_MAP_MEM_TABLE_PARAMS params;
+
+
+    if (ctrl_handle->fd < 0) {
+        ret = EBADF;
+        return ret;
+    }
+
+    params.vaddr = (unsigned long) vaddr;
+    params.table_offset = 0;
+    params.table_size = 0;
+    params.n_addrs = 0;
+    params.generation = 0;
+    params.page_shift = 0;
+    params.n_ctrls = 0;
+
+    if (ctrl_handle->type == GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_GROUP_IOC_DMA_MAP_MEM_TABLE, &params);
+
+
+    }
+    else if (ctrl_handle->type == NOT_GROUP) {
+
+        ret = ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_DMA_MAP_MEM_TABLE, &params);
+
+
+    }
+    else {
+        ret = EINVAL;
+        return ret;
+    }
+
+    if (ret) {
+        ret = errno;
+        return ret;
+    }
+
+    table_handle->tables = calloc(params.n_ctrls, sizeof(*table_handle->tables));
+    if (table_handle->tables == NULL) {
+        ret = ENOMEM;
+        return ret;
+    }
+
+    /* the tables are read in place, nothing is copied out of the kernel */
+    handle = BAFS_MMAP_DMA_TABLE_HANDLE(params.table_offset);
+    for (i = 0; i < params.n_ctrls; i++) {
+        table = mmap(NULL, params.table_size, PROT_READ, MAP_SHARED, ctrl_handle->fd,
+                     BAFS_MMAP_DMA_TABLE_OFFSET(handle, i));
+        if (table == MAP_FAILED) {
+            ret = errno;
+            table_handle->n_ctrls = i;
+            table_handle->table_size = params.table_size;
+            bafs_dma_table_release(table_handle);
+            return ret;
+        }
+        table_handle->tables[i] = table;
+    }
+
+    table_handle->vaddr = vaddr;
+    table_handle->n_ctrls = params.n_ctrls;
+    table_handle->n_addrs = params.n_addrs;
+    table_handle->page_size = 1UL << params.page_shift;
+    table_handle->table_size = params.table_size;
+    table_handle->generation = params.generation;
+
+    return 0;
+}
+
+/* non-zero once any controller's table was superseded or revoked */
+int bafs_dma_table_changed(const struct bafs_dma_table_t* table_handle) {
+    unsigned i;
+
+    for (i = 0; i < table_handle->n_ctrls; i++) {
+        if (__atomic_load_n(&table_handle->tables[i]->generation, __ATOMIC_ACQUIRE) != table_handle->generation) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void bafs_dma_table_release(struct bafs_dma_table_t* table_handle) {
+    unsigned i;
+
+    for (i = 0; i < table_handle->n_ctrls; i++) {
+        munmap((void*) table_handle->tables[i], table_handle->table_size);
+    }
+    free(table_handle->tables);
+    table_handle->tables = NULL;
+    table_handle->n_ctrls = 0;
+}
+
+static int bafs_ctrl_create_qp_params(struct BAFS_IOC_CREATE_QP_PARAMS* params, void* sq, void* cq,
+                                      struct bafs_ctrl_t* ctrl_handle, struct bafs_qp_t* qp) {
+    int ret = 0;
+    void* addr;
+
+    if (ioctl(ctrl_handle->fd, BAFS_CTRL_IOC_CREATE_QP, params)) {
+        ret = errno;
+        return ret;
+    }
+
+    qp->qid = params->qid;
+    qp->depth = params->depth;
+    qp->sq = sq;
+    qp->cq = cq;
+    qp->sq_len = 0;
+    qp->cq_len = 0;
+    qp->db_page = NULL;
+    qp->db_len = params->db_len;
+    qp->irq_vector = params->irq_vector;
+
+    /* the driver allocated rings are mapped here, a failed mmap leaves the pair to the close */
+    if (params->sq_offset) {
+        addr = mmap(NULL, params->depth * 64, PROT_READ | PROT_WRITE, MAP_SHARED, ctrl_handle->fd, params->sq_offset);
+        if (addr == MAP_FAILED) {
+            ret = errno;
+            bafs_qp_release(qp);
+            return ret;
+        }
+        qp->sq = addr;
+        qp->sq_len = params->depth * 64;
+    }
+    if (params->cq_offset) {
+        addr = mmap(NULL, params->depth * 16, PROT_READ | PROT_WRITE, MAP_SHARED, ctrl_handle->fd, params->cq_offset);
+        if (addr == MAP_FAILED) {
+            ret = errno;
+            bafs_qp_release(qp);
+            return ret;
+        }
+        qp->cq = addr;
+        qp->cq_len = params->depth * 16;
+    }
+
+    addr = mmap(NULL, params->db_len, PROT_READ | PROT_WRITE, MAP_SHARED, ctrl_handle->fd, params->db_offset);
+    if (addr == MAP_FAILED) {
+        ret = errno;
+        bafs_qp_release(qp);
+        return ret;
+    }
+    qp->db_page = addr;
+    qp->sq_db = (volatile __u32*) ((char*) addr + params->sq_db);
+    qp->cq_db = (volatile __u32*) ((char*) addr + params->cq_db);
+
+    return 0;
+}
+
+int bafs_ctrl_create_qp(unsigned depth, struct bafs_ctrl_t* ctrl_handle, struct bafs_qp_t* qp) {
+    struct BAFS_IOC_CREATE_QP_PARAMS params;
+
+    if (ctrl_handle->fd < 0) {
+        return EBADF;
+    }
+    if (ctrl_handle->type != NOT_GROUP) {
+        return EINVAL;
+    }
+
+    params.depth = depth;
+    params.flags = 0;
+    params.sq_handle = 0;
+    params.cq_handle = 0;
+    params.eventfd = -1;
+
+    return bafs_ctrl_create_qp_params(&params, NULL, NULL, ctrl_handle, qp);
+}
+
+int bafs_ctrl_create_qp_user_mem(unsigned depth, bafs_mem_hnd_t sq_handle, bafs_mem_hnd_t cq_handle,
+                                 void* sq, void* cq, struct bafs_ctrl_t* ctrl_handle, struct bafs_qp_t* qp) {
+    struct BAFS_IOC_CREATE_QP_PARAMS params;
+
+    if (ctrl_handle->fd < 0) {
+        return EBADF;
+    }
+    if (ctrl_handle->type != NOT_GROUP) {
+        return EINVAL;
+    }
+
+    params.depth = depth;
+    params.flags = BAFS_QP_FLAG_USER_MEM;
+    params.sq_handle = sq_handle;
+    params.cq_handle = cq_handle;
+    params.eventfd = -1;
+
+    return bafs_ctrl_create_qp_params(&params, sq, cq, ctrl_handle, qp);
+}
+
+int bafs_ctrl_create_qp_irq(unsigned depth, unsigned flags, int eventfd, struct bafs_ctrl_t* ctrl_handle,
+                            struct bafs_qp_t* qp) {
+    struct BAFS_IOC_CREATE_QP_PARAMS params;
+
+    if (ctrl_handle->fd < 0) {
+        return EBADF;
+    }
+    if (ctrl_handle->type != NOT_GROUP) {
+        return EINVAL;
+    }
+
+    params.depth = depth;
+    params.flags = flags | BAFS_QP_FLAG_IRQ;
+    params.sq_handle = 0;
+    params.cq_handle = 0;
+    params.eventfd = eventfd;
+
+    return bafs_ctrl_create_qp_params(&params, NULL, NULL, ctrl_handle, qp);
+}
+
+/* only drops the mappings, the pair itself goes when the fd is closed */
+void bafs_qp_release(struct bafs_qp_t* qp) {
+    if (qp->sq_len) {
+        munmap(qp->sq, qp->sq_len);
+    }
+    if (qp->cq_len) {
+        munmap(qp->cq, qp->cq_len);
+    }
+    if (qp->db_page) {
+        munmap(qp->db_page, qp->db_len);
+    }
+    qp->sq = NULL;
+    qp->cq = NULL;
+    qp->sq_len = 0;
+    qp->cq_len = 0;
+    qp->db_page = NULL;
+}
@@ -11,6 +11,9 @@
 #include <linux/bafs/types.h>
 #include <linux/bafs/util.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/bafs.h>
+
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Zaid Qureshi <zaidq2@illinois.edu>");
@@ -19,6 +22,37 @@ MODULE_VERSION("0.1");
 
 #define BAFS_CORE_MINOR 0
 
+DEFINE_STATIC_KEY_FALSE(bafs_debug_key);
+
+static int bafs_debug_set(const char* val, const struct kernel_param* kp)
+{
+    int  ret;
+    bool on;
+
+    ret = kstrtobool(val, &on);
+    if (ret)
+        return ret;
+
+    if (on)
+        static_branch_enable(&bafs_debug_key);
+    else
+        static_branch_disable(&bafs_debug_key);
+    return 0;
+}
+
+static int bafs_debug_get(char* buf, const struct kernel_param* kp)
+{
+    return sprintf(buf, "%c\n", static_branch_unlikely(&bafs_debug_key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops bafs_debug_ops = {
+    .set = bafs_debug_set,
+    .get = bafs_debug_get,
+};
+
+module_param_cb(debug, &bafs_debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "Emit the debug messages, off by default, see the bafs trace events for profiling");
+
 dev_t bafs_major = {0};
 
 static int bafs_core_minor;
@@ -28,7 +62,31 @@ static struct class* bafs_core_class  = NULL;
 static struct cdev bafs_core_cdev;
 struct device*     bafs_core_device = NULL;
 
-struct xarray bafs_global_ctx_xa;
+
+static ssize_t node_pinned_bytes_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    int     nid;
+    ssize_t len = 0;
+
+    for_each_online_node(nid) {
+        len += sysfs_emit_at(buf, len, "node%d %lld\n", nid, (long long) atomic64_read(&bafs_node_pinned_bytes[nid]));
+    }
+
+    return len;
+}
+static DEVICE_ATTR_RO(node_pinned_bytes);
+
+static ssize_t pool_stats_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    return bafs_pool_emit_stats(buf);
+}
+static DEVICE_ATTR_RO(pool_stats);
+
+static ssize_t dma_cache_stats_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    return bafs_ctrl_emit_dma_cache_stats(buf);
+}
+static DEVICE_ATTR_RO(dma_cache_stats);
 
 static int bafs_ctrl_pci_probe(struct pci_dev* pdev, const struct pci_device_id* id)
 {
@@ -53,7 +111,7 @@ static void bafs_ctrl_pci_remove(struct pci_dev* pdev) {
 
     BAFS_CTRL_DEBUG("Started PCI remove for PCI device: %02x:%02x.%1x\n", pdev->bus->number, PCI_SLOT(pdev->devfn), PCI_FUNC(pdev->devfn));
 
-    bafs_ctrl_release(ctrl);
+    bafs_ctrl_kill(ctrl);
 
     BAFS_CTRL_DEBUG("Finished PCI remove for PCI device: %02x:%02x.%1x\n", pdev->bus->number, PCI_SLOT(pdev->devfn), PCI_FUNC(pdev->devfn));
 
@@ -241,20 +299,65 @@ static long bafs_core_ioctl(struct file* file, unsigned int cmd, unsigned long a
         goto out;
     }
 
+    ctx = (struct bafs_ctx*) file->private_data;
+    if (ctx)
+        bafs_stats_add(ctx, NULL, BAFS_STAT_IOCTLS, 1);
+
     switch (cmd) {
     case BAFS_CORE_IOC_REG_MEM:
+    case BAFS_CORE_IOC_REG_MEM2:
         ctx     = (struct bafs_ctx*) file->private_data;
         if (!ctx) {
             ret = -EFAULT;
             goto out;
         }
-        ret = bafs_core_reg_mem(argp, ctx);
+        ret = bafs_core_reg_mem(argp, (cmd == BAFS_CORE_IOC_REG_MEM2) ? BAFS_REG_MEM_V2 : BAFS_REG_MEM_V1,
+                                ctx, NULL, NULL);
         if (ret < 0) {
             BAFS_CORE_ERR("IOCTL to register memory failed\n");
             goto out;
         }
         break;
 
+    case BAFS_CORE_IOC_DEREG_MEM:
+        ctx     = (struct bafs_ctx*) file->private_data;
+        if (!ctx) {
+            ret = -EFAULT;
+            goto out;
+        }
+        ret = bafs_core_dereg_mem(argp, ctx);
+        if (ret < 0) {
+            BAFS_CORE_ERR("IOCTL to deregister memory failed\n");
+            goto out;
+        }
+        break;
+
+    case BAFS_CORE_IOC_PREFAULT_MEM:
+        ctx     = (struct bafs_ctx*) file->private_data;
+        if (!ctx) {
+            ret = -EFAULT;
+            goto out;
+        }
+        ret = bafs_core_prefault_mem(argp, ctx);
+        if (ret < 0) {
+            BAFS_CORE_ERR("IOCTL to prefault memory failed\n");
+            goto out;
+        }
+        break;
+
+    case BAFS_CORE_IOC_EXPORT_DMABUF:
+        ctx     = (struct bafs_ctx*) file->private_data;
+        if (!ctx) {
+            ret = -EFAULT;
+            goto out;
+        }
+        ret = bafs_core_export_dmabuf(argp, ctx);
+        if (ret < 0) {
+            BAFS_CORE_ERR("IOCTL to export dma-buf failed\n");
+            goto out;
+        }
+        break;
+
     case BAFS_CORE_IOC_CREATE_GROUP:
         ret = bafs_core_create_group(argp);
         if (ret < 0) {
@@ -282,85 +385,99 @@ out:
     return ret;
 }
 
-struct bafs_mem* bafs_get_mem_with_ctx(const unsigned long vaddr, struct bafs_ctx* ctx) {
-
-    struct bafs_mem* mem = NULL;
-    struct bafs_mem* mem_ = NULL;
-    struct bafs_mem* next = NULL;
-
-    kref_get(&ctx->ref);
+/* the caller holds ctx->lock, a LIVE region always holds its registration reference */
+void bafs_mem_index_locked(struct bafs_mem* mem)
+{
+    if (!RB_EMPTY_NODE(&mem->it.rb))
+        return;
+    mem->it.start = mem->vaddr;
+    mem->it.last  = mem->vaddr + (mem->n_pages << mem->page_shift) - 1;
+    write_seqcount_begin(&mem->ctx->mem_seq);
+    interval_tree_insert(&mem->it, &mem->ctx->mem_tree);
+    write_seqcount_end(&mem->ctx->mem_seq);
+}
 
+void bafs_mem_unindex_locked(struct bafs_mem* mem)
+{
+    if (RB_EMPTY_NODE(&mem->it.rb))
+        return;
+    write_seqcount_begin(&mem->ctx->mem_seq);
+    interval_tree_remove(&mem->it, &mem->ctx->mem_tree);
+    RB_CLEAR_NODE(&mem->it.rb);
+    write_seqcount_end(&mem->ctx->mem_seq);
+}
 
-    spin_lock(&ctx->lock);
-    list_for_each_entry_safe(mem_, next, &ctx->mem_list, mem_list) {
-        kref_get(&mem_->ref);
-        spin_lock(&mem_->lock);
-        if ((mem_->vaddr == vaddr) && (mem_->state != DEAD) && (mem_->state != DEAD_CB)) {
-            mem = mem_;
-            spin_unlock(&mem_->lock);
+/*
+ * Finds the LIVE region containing vaddr, preferring one that starts there when
+ * dead registrations still overlap it. Without ctx->lock a racing update can send
+ * the walk through unlinked nodes, so it gives up with -EAGAIN as soon as seq moves.
+ * Regions are freed after a grace period, the caller holds rcu_read_lock().
+ */
+static
+struct bafs_mem* __bafs_mem_lookup(struct bafs_ctx* ctx, const unsigned long vaddr, const bool locked,
+                                   const unsigned seq)
+{
+    struct bafs_mem*           mem;
+    struct bafs_mem*           found = NULL;
+    struct interval_tree_node* node;
+
+    for (node = interval_tree_iter_first(&ctx->mem_tree, vaddr, vaddr); node;
+         node = interval_tree_iter_next(node, vaddr, vaddr)) {
+        if (!locked && read_seqcount_retry(&ctx->mem_seq, seq))
+            return ERR_PTR(-EAGAIN);
+        mem  = container_of(node, struct bafs_mem, it);
+        if (READ_ONCE(mem->state) != LIVE)
+            continue;
+        found = mem;
+        if (mem->vaddr == vaddr)
+            break;
+    }
+
+    return found;
+}
 
-            goto out_unlock_ctx;
-        }
-        spin_unlock(&mem_->lock);
-        bafs_mem_put(mem_);
+static
+struct bafs_mem* bafs_mem_lookup(struct bafs_ctx* ctx, const unsigned long vaddr)
+{
+    unsigned         seq;
+    struct bafs_mem* mem;
+
+    rcu_read_lock();
+    seq = read_seqcount_begin(&ctx->mem_seq);
+    mem = __bafs_mem_lookup(ctx, vaddr, false, seq);
+    if (IS_ERR(mem) || read_seqcount_retry(&ctx->mem_seq, seq)) {
+        /* registrations are changing under us, walk once more with the writers held off */
+        spin_lock(&ctx->lock);
+        mem = __bafs_mem_lookup(ctx, vaddr, true, 0);
+        spin_unlock(&ctx->lock);
+    }
+
+    if (mem && !kref_get_unless_zero(&mem->ref))
+        mem = NULL;
+    rcu_read_unlock();
+    return mem;
+}
 
-    }
+/* the caller's open file holds ctx */
+struct bafs_mem* bafs_get_mem_with_ctx(const unsigned long vaddr, struct bafs_ctx* ctx) {
 
-out_unlock_ctx:
-    spin_unlock(&ctx->lock);
-    bafs_put_ctx(ctx);
-//out:
-    return mem;
+    return bafs_mem_lookup(ctx, vaddr);
 
 }
 
-struct bafs_mem* bafs_get_mem(const unsigned long vaddr) {
+struct bafs_mem* bafs_get_mem_by_handle(const bafs_mem_hnd_t handle, struct bafs_ctx* ctx) {
 
-    pid_t tgid;
-    struct pid* tgid_struct;
     struct bafs_mem* mem = NULL;
-    struct bafs_mem* mem_ = NULL;
-    struct bafs_mem* next = NULL;
-    struct bafs_ctx* ctx;
 
-    tgid = task_tgid_nr(current);
-    tgid_struct = find_get_pid(tgid);
-    if (!tgid_struct) {
+    if (handle == 0)
         goto out;
-    }
-
-    ctx = (struct bafs_ctx*) xa_load(&bafs_global_ctx_xa, tgid);
-    if ((!ctx)) {
-        goto out_put_pid;
-    }
 
-    kref_get(&ctx->ref);
-
-    if (ctx->tgid != tgid) {
-        goto out_put_ctx;
-    }
-
-    spin_lock(&ctx->lock);
-    list_for_each_entry_safe(mem_, next, &ctx->mem_list, mem_list) {
-        kref_get(&mem_->ref);
-        spin_lock(&mem_->lock);
-        if ((mem_->vaddr == vaddr) && (mem_->state != DEAD) && (mem_->state != DEAD_CB)) {
-            mem = mem_;
-            spin_unlock(&mem_->lock);
-
-            goto out_unlock_ctx;
-        }
-        spin_unlock(&mem_->lock);
-        bafs_mem_put(mem_);
-
-    }
-
-out_unlock_ctx:
-    spin_unlock(&ctx->lock);
-out_put_ctx:
-    bafs_put_ctx(ctx);
-out_put_pid:
-    put_pid(tgid_struct);
+    /* the xarray is rcu safe and regions are freed after a grace period */
+    rcu_read_lock();
+    mem = (struct bafs_mem*) xa_load(&ctx->bafs_mem_xa, handle - 1);
+    if (mem && ((READ_ONCE(mem->state) != LIVE) || !kref_get_unless_zero(&mem->ref)))
+        mem = NULL;
+    rcu_read_unlock();
 out:
     return mem;
 
@@ -371,40 +488,16 @@ static int bafs_core_open(struct inode* inode, struct file* file) {
     struct bafs_ctx* ctx;
 
 
-    ctx     = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    ctx = bafs_alloc_ctx(NULL, NULL);
     if (!ctx) {
         ret = -ENOMEM;
         goto out;
     }
-    ctx->tgid = task_tgid_nr(current);
-    ctx->tgid_struct = find_get_pid(ctx->tgid);
-    if (!ctx->tgid_struct) {
-        ret = -EFAULT;
-        goto out_free_ctx;
-    }
-
-
-
-    xa_init_flags(&ctx->bafs_mem_xa, XA_FLAGS_ALLOC);
-    spin_lock_init(&ctx->lock);
-    INIT_LIST_HEAD(&ctx->mem_list);
-    kref_init(&ctx->ref);
     file->private_data = ctx;
 
-    ret = xa_insert(&bafs_global_ctx_xa, ctx->tgid, ctx, GFP_KERNEL);
-    if (ret) {
-        ret = -ENOMEM;
-        goto out_reset_file;
-    }
     BAFS_CORE_DEBUG("Opened core and inited ctx\n");
     ret = 0;
     return ret;
-out_reset_file:
-    file->private_data = NULL;
-//out_put_tgid:
-    put_pid(ctx->tgid_struct);
-out_free_ctx:
-    kfree(ctx);
 out:
     return ret;
 }
@@ -419,9 +512,13 @@ void __bafs_core_ctx_release(struct kref* ref)
 
     if (ctx) {
         BAFS_CORE_DEBUG("Destroying ctx\n");
-        xa_erase(&bafs_global_ctx_xa, ctx->tgid);
-        put_pid(ctx->tgid_struct);
+        bafs_stats_ctx_debugfs_remove(ctx);
         xa_destroy(&ctx->bafs_mem_xa);
+        if (ctx->ctrl)
+            bafs_ctrl_release(ctx->ctrl);
+        if (ctx->group)
+            bafs_put_group(ctx->group);
+        bafs_stats_free(&ctx->stats);
         kfree(ctx);
 
     }
@@ -433,51 +530,45 @@ void bafs_put_ctx(struct bafs_ctx * ctx)
     kref_put(&ctx->ref, __bafs_core_ctx_release);
 }
 
-struct bafs_ctx* bafs_get_ctx(void) {
-    int                   ret;
+/*
+ * Every open file gets a ctx of its own, so threads working through their own
+ * fds never share a registration table or its lock. Registrations are shared
+ * across files by exporting them as a dma-buf. The ctx pins the ctrl or group
+ * it was opened on, whose stats it charges, until its last registration is gone.
+ */
+struct bafs_ctx* bafs_alloc_ctx(struct bafs_ctrl* ctrl, struct bafs_group* group) {
     struct bafs_ctx* ctx = NULL;
-    struct bafs_ctx* ctx_ = NULL;
-    void* xa_ret;
 
     ctx     = kzalloc(sizeof(*ctx), GFP_KERNEL);
     if (!ctx) {
-        ret = -ENOMEM;
         goto out;
     }
-    ctx->tgid = task_tgid_nr(current);
-    ctx->tgid_struct = find_get_pid(ctx->tgid);
-    if (!ctx->tgid_struct) {
-        ret = -EFAULT;
-        goto out_free_ctx;
+
+    if (bafs_stats_alloc(&ctx->stats)) {
+        kfree(ctx);
+        ctx = NULL;
+        goto out;
     }
 
     xa_init_flags(&ctx->bafs_mem_xa, XA_FLAGS_ALLOC);
     spin_lock_init(&ctx->lock);
     INIT_LIST_HEAD(&ctx->mem_list);
+    ctx->mem_tree = RB_ROOT_CACHED;
+    seqcount_spinlock_init(&ctx->mem_seq, &ctx->lock);
     kref_init(&ctx->ref);
 
-    xa_ret =  xa_cmpxchg(&bafs_global_ctx_xa, ctx->tgid, NULL, ctx, GFP_KERNEL);
-    ret = xa_err(xa_ret);
-
-    if (ret) {
-        goto out_free_mem_xa;
+    if (ctrl) {
+        bafs_get_ctrl(ctrl);
+        ctx->ctrl = ctrl;
     }
-    if (xa_ret != NULL) {
-        ctx_ = (struct bafs_ctx*) xa_ret;
-        kref_get(&ctx_->ref);
-        put_pid(ctx->tgid_struct);
-        kfree(ctx);
-        ctx = ctx_;
+    if (group) {
+        bafs_get_group(group);
+        ctx->group = group;
     }
+    bafs_stats_ctx_debugfs_add(ctx, ctrl ? dev_name(ctrl->device) :
+                                    group ? dev_name(group->device) : BAFS_CORE_DEVICE_NAME);
 
-    return ctx;
-
-out_free_mem_xa:
-    xa_destroy(&ctx->bafs_mem_xa);
-out_free_ctx:
-    kfree(ctx);
 out:
-    ctx = NULL;
     return ctx;
 }
 
@@ -486,8 +577,6 @@ bafs_core_release(struct inode* inode, struct file* file)
 {
     int                   ret = 0;
     struct bafs_ctx* ctx;
-    struct bafs_mem*      mem;
-    struct bafs_mem*      next;
 
     ctx = (struct bafs_ctx*) file->private_data;
     if (!ctx) {
@@ -495,27 +584,7 @@ bafs_core_release(struct inode* inode, struct file* file)
         goto out;
     }
 
-    spin_lock(&ctx->lock);
-    list_for_each_entry_safe(mem, next, &ctx->mem_list, mem_list) {
-        spin_lock(&mem->lock);
-        if (mem->state == STALE) {
-
-            list_del_init(&mem->mem_list);
-
-            xa_erase(&ctx->bafs_mem_xa, mem->mem_id);
-            BAFS_CORE_DEBUG("Deleting Stale mem registeration\n");
-            spin_unlock(&mem->lock);
-            kfree_rcu(mem, rh);
-            kref_put(&ctx->ref, __bafs_core_ctx_release);
-        }
-        else {
-            spin_unlock(&mem->lock);
-        }
-
-
-    }
-
-    spin_unlock(&ctx->lock);
+    bafs_mem_drop_stale(ctx);
 
     kref_put(&ctx->ref, __bafs_core_ctx_release);
     BAFS_CORE_DEBUG("Closed core and cleaned ctx\n");
@@ -565,6 +634,24 @@ static int __init bafs_init(void) {
         goto out_ctrl_fini;
     }
 
+    //create pin workqueue
+    ret = bafs_mem_init();
+    if(ret < 0) {
+        goto out_group_fini;
+    }
+
+    //create page pool and its scrubber
+    ret = bafs_pool_init();
+    if(ret < 0) {
+        goto out_mem_fini;
+    }
+
+    //create debugfs root of the per file stats
+    ret = bafs_stats_init();
+    if(ret < 0) {
+        goto out_pool_fini;
+    }
+
     //init dev objects
     cdev_init(&bafs_core_cdev, &bafs_core_fops);
     bafs_core_cdev.owner = THIS_MODULE;
@@ -575,7 +662,7 @@ static int __init bafs_init(void) {
     ret = bafs_get_minor_number();
     if (ret < 0) {
         BAFS_CORE_ERR("Failed to get minor instance id \t err = %d\n", ret);
-        goto out_group_fini;
+        goto out_stats_fini;
 
     }
     bafs_core_minor = ret;
@@ -596,22 +683,51 @@ static int __init bafs_init(void) {
     }
 
 
+    ret = device_create_file(bafs_core_device, &dev_attr_node_pinned_bytes);
+    if (ret < 0) {
+        BAFS_CORE_ERR("Failed to create node_pinned_bytes attribute \t err = %d\n", ret);
+        goto out_destroy_device;
+    }
+
+    ret = device_create_file(bafs_core_device, &dev_attr_pool_stats);
+    if (ret < 0) {
+        BAFS_CORE_ERR("Failed to create pool_stats attribute \t err = %d\n", ret);
+        goto out_remove_file;
+    }
+
+    ret = device_create_file(bafs_core_device, &dev_attr_dma_cache_stats);
+    if (ret < 0) {
+        BAFS_CORE_ERR("Failed to create dma_cache_stats attribute \t err = %d\n", ret);
+        goto out_remove_pool_file;
+    }
+
     BAFS_CORE_INFO("Initialized core device: %s\n", BAFS_CORE_DEVICE_NAME);
 
     ret = pci_register_driver(&bafs_ctrl_pci_driver);
     if (ret < 0) {
         BAFS_CORE_ERR("Failed to register pci driver \t err = %d\n", ret);
-        goto out_destroy_device;
+        goto out_remove_dma_cache_file;
     }
 
-    xa_init_flags(&bafs_global_ctx_xa, XA_FLAGS_ALLOC);
     BAFS_CORE_INFO("Finished loading module\n");
     return ret;
 
+out_remove_dma_cache_file:
+    device_remove_file(bafs_core_device, &dev_attr_dma_cache_stats);
+out_remove_pool_file:
+    device_remove_file(bafs_core_device, &dev_attr_pool_stats);
+out_remove_file:
+    device_remove_file(bafs_core_device, &dev_attr_node_pinned_bytes);
 out_destroy_device:
     device_destroy(bafs_core_class, MKDEV(MAJOR(bafs_major), bafs_core_minor));
 out_delete_core_cdev:
     cdev_del(&bafs_core_cdev);
+out_stats_fini:
+    bafs_stats_fini();
+out_pool_fini:
+    bafs_pool_fini();
+out_mem_fini:
+    bafs_mem_fini();
 out_group_fini:
     bafs_group_fini();
 
@@ -635,14 +751,19 @@ static void __exit bafs_exit(void) {
 
     pci_unregister_driver(&bafs_ctrl_pci_driver);
 
+    device_remove_file(bafs_core_device, &dev_attr_dma_cache_stats);
+    device_remove_file(bafs_core_device, &dev_attr_pool_stats);
+    device_remove_file(bafs_core_device, &dev_attr_node_pinned_bytes);
 
     device_destroy(bafs_core_class, MKDEV(MAJOR(bafs_major), bafs_core_minor));
     cdev_del(&bafs_core_cdev);
+    bafs_stats_fini();
+    bafs_pool_fini();
+    bafs_mem_fini();
     bafs_group_fini();
     bafs_ctrl_fini();
     class_destroy(bafs_core_class);
     unregister_chrdev_region(bafs_major, BAFS_MINORS);
-    xa_destroy(&bafs_global_ctx_xa);
 
     bafs_put_minor_number(bafs_core_minor);
 
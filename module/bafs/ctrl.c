@@ -1,25 +1,95 @@
 #include <linux/cdev.h>
+#include <linux/scatterlist.h>
+#include <linux/nvme.h>
+#include <linux/pci-p2pdma.h>
+#include <linux/iommu.h>
+#include <linux/vmalloc.h>
+#include <linux/io-64-nonatomic-hi-lo.h>
+#include <linux/overflow.h>
 
 #include <linux/bafs.h>
 
 #include <linux/bafs/util.h>
 #include <linux/bafs/types.h>
 
+#include <trace/events/bafs.h>
+
 static DEFINE_IDA(bafs_minor_ida);
 static DEFINE_IDA(bafs_ctrl_ida);
 
 static struct class *   bafs_ctrl_class = NULL;
+/* the last ctrl reference can drop from an rcu callback, teardown sleeps */
+static struct workqueue_struct* bafs_ctrl_wq = NULL;
+
+static atomic64_t       bafs_dma_cache_hits   = ATOMIC64_INIT(0);
+static atomic64_t       bafs_dma_cache_misses = ATOMIC64_INIT(0);
+
+static ssize_t stats_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct bafs_ctrl* ctrl = dev_get_drvdata(dev);
+
+    return bafs_stats_emit(&ctrl->stats, buf);
+}
+static DEVICE_ATTR_RO(stats);
+
+/* "<threshold> <time>", completions (0 based) and 100us units the controller may hold an interrupt back */
+static ssize_t irq_coalesce_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    u8                thr;
+    u8                time;
+    struct bafs_ctrl* ctrl = dev_get_drvdata(dev);
+
+    if (!ctrl->admin)
+        return -EOPNOTSUPP;
+    bafs_ctrl_get_irq_coalesce(ctrl, &thr, &time);
+    return sysfs_emit(buf, "%u %u\n", thr, time);
+}
+
+static ssize_t irq_coalesce_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+    int               ret;
+    u8                thr;
+    u8                time;
+    struct bafs_ctrl* ctrl = dev_get_drvdata(dev);
+
+    if (sscanf(buf, "%hhu %hhu", &thr, &time) != 2)
+        return -EINVAL;
+
+    ret = bafs_ctrl_set_irq_coalesce(ctrl, thr, time);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(irq_coalesce);
+
+static struct attribute* bafs_ctrl_attrs[] = {
+    &dev_attr_stats.attr,
+    &dev_attr_irq_coalesce.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(bafs_ctrl);
 
 int
 bafs_ctrl_init()
 {
     int ret = 0;
+    bafs_ctrl_wq = alloc_workqueue("bafs_ctrl", WQ_UNBOUND, 0);
+    if (bafs_ctrl_wq == NULL) {
+        ret = -ENOMEM;
+        BAFS_CORE_ERR("Failed to create ctrl workqueue\n");
+        goto out;
+    }
     bafs_ctrl_class = class_create(THIS_MODULE, BAFS_CTRL_CLASS_NAME);
     if (IS_ERR(bafs_ctrl_class)) {
         ret = PTR_ERR(bafs_ctrl_class);
+        bafs_ctrl_class = NULL;
         BAFS_CORE_ERR("Failed to create ctrl class \t err = %d\n", ret);
+        goto out_destroy_wq;
     }
     return ret;
+out_destroy_wq:
+    destroy_workqueue(bafs_ctrl_wq);
+    bafs_ctrl_wq = NULL;
+out:
+    return ret;
 }
 
 
@@ -27,6 +97,10 @@ void
 bafs_ctrl_fini()
 {
     if(bafs_ctrl_class == NULL) return;
+    /* killed refs switch to atomic mode from rcu callbacks, then queue their release */
+    rcu_barrier();
+    destroy_workqueue(bafs_ctrl_wq);
+    bafs_ctrl_wq = NULL;
     class_destroy(bafs_ctrl_class);
     bafs_ctrl_class = NULL;
 }
@@ -44,15 +118,12 @@ bafs_put_minor_number(int id)
 }
 
 
-static 
-void __bafs_ctrl_release(struct kref * ref)
+static
+void bafs_ctrl_release_work(struct work_struct * work)
 {
     struct bafs_ctrl* ctrl;
 
-    WARN_ON(ref == NULL);
-    if(ref == NULL) return;
-
-    ctrl = container_of(ref, struct bafs_ctrl, ref);
+    ctrl = container_of(work, struct bafs_ctrl, release_work);
     BAFS_CTRL_DEBUG("Removing PCI \t ctrl: %p\n", ctrl);
 
     BAFS_CORE_DEBUG("Attempting to remove ctrl with id %d major %d minor %d\n", ctrl->ctrl_id, ctrl->major, ctrl->minor);
@@ -61,7 +132,7 @@ void __bafs_ctrl_release(struct kref * ref)
     put_device(ctrl->core_dev);
     cdev_del(&ctrl->cdev);
 
-
+    bafs_ctrl_admin_fini(ctrl);
 
     pci_disable_device(ctrl->pdev);
     pci_release_region(ctrl->pdev, 0);
@@ -72,165 +143,1538 @@ void __bafs_ctrl_release(struct kref * ref)
 
     BAFS_CTRL_DEBUG("Removed PCI \t ctrl: %p\n", ctrl);
 
+    bafs_stats_free(&ctrl->stats);
+    percpu_ref_exit(&ctrl->ref);
     kfree_rcu(ctrl, rh);
 }
 
+/* may run in softirq context once the ref has been killed */
+static
+void __bafs_ctrl_release(struct percpu_ref * ref)
+{
+    struct bafs_ctrl* ctrl;
+
+    ctrl = container_of(ref, struct bafs_ctrl, ref);
+    queue_work(bafs_ctrl_wq, &ctrl->release_work);
+}
+
 
 void
 bafs_ctrl_release(struct bafs_ctrl * ctrl)
 {
-    BAFS_CTRL_DEBUG("In bafs_ctrl_release: %u \t kref_bef: %u\n", ctrl->ctrl_id, kref_read(&ctrl->ref));
-    kref_put(&ctrl->ref, __bafs_ctrl_release);
-    BAFS_CTRL_DEBUG("In bafs_ctrl_release: %u \t kref_aft: %u\n", ctrl->ctrl_id, kref_read(&ctrl->ref));
+    BAFS_CTRL_DEBUG("In bafs_ctrl_release: %u\n", ctrl->ctrl_id);
+    percpu_ref_put(&ctrl->ref);
+}
+
+/* drops the initial reference, the ctrl goes away with the last open file or mapping */
+void
+bafs_ctrl_kill(struct bafs_ctrl * ctrl)
+{
+    BAFS_CTRL_DEBUG("In bafs_ctrl_kill: %u\n", ctrl->ctrl_id);
+    percpu_ref_kill(&ctrl->ref);
 }
 
 
-int
-bafs_ctrl_dma_map_mem(struct bafs_ctrl * ctrl, struct bafs_ctx* ctx, unsigned long vaddr, __u32 * n_dma_addrs,
-                      unsigned long __user * dma_addrs_user, struct bafs_mem_dma ** dma_,
-                      const int ctrl_id)
+/* batch size for streaming address tables to userspace without a kernel copy of the table */
+#define BAFS_DMA_COPY_BATCH 32
+
+struct bafs_extent_writer {
+    struct bafs_dma_extent __user * user;
+    __u32                           cap;
+    __u32                           n;
+    __u32                           n_written;
+    __u64                           max_len;
+    struct bafs_dma_extent          cur;
+    unsigned                        n_buf;
+    struct bafs_dma_extent          buf[BAFS_DMA_COPY_BATCH / 2];
+};
+
+static
+int bafs_extent_writer_flush(struct bafs_extent_writer* w)
+{
+    int ret = 0;
+
+    if (w->n_buf && copy_to_user(w->user + w->n_written, w->buf, w->n_buf * sizeof(w->buf[0])))
+        ret = -EFAULT;
+    w->n_written += w->n_buf;
+    w->n_buf      = 0;
+    return ret;
+}
+
+static
+int bafs_extent_writer_emit(struct bafs_extent_writer* w)
+{
+    int ret = 0;
+
+    if (w->cur.len == 0)
+        goto out;
+
+    if (w->n < w->cap) {
+        w->buf[w->n_buf++] = w->cur;
+        w->n++;
+        if (w->n_buf == ARRAY_SIZE(w->buf))
+            ret = bafs_extent_writer_flush(w);
+    }
+    else {
+        /* keep counting so the caller learns how many extents it needs */
+        w->n++;
+    }
+    w->cur.len = 0;
+out:
+    return ret;
+}
+
+static
+int bafs_extent_writer_push(struct bafs_extent_writer* w, __u64 addr, __u64 len)
+{
+    int   ret = 0;
+    __u64 take;
+
+    while (len) {
+        if (w->cur.len && ((w->cur.dma_addr + w->cur.len) == addr) && (w->cur.len < w->max_len)) {
+            take        = min(len, w->max_len - w->cur.len);
+            w->cur.len += take;
+        }
+        else {
+            ret = bafs_extent_writer_emit(w);
+            if (ret)
+                goto out;
+            take            = min(len, w->max_len);
+            w->cur.dma_addr = addr;
+            w->cur.len      = take;
+        }
+        addr += take;
+        len  -= take;
+    }
+out:
+    return ret;
+}
+
+static inline
+struct sg_table* bafs_dma_sgt(struct bafs_mem_dma* dma)
+{
+    return (dma->mem->loc == BAFS_MEM_DMABUF) ? dma->attach_sgt : &dma->sgt;
+}
+
+int bafs_dma_copy_extents(struct bafs_mem_dma* dma, const unsigned map_gran, __u32* n_extents,
+                          struct bafs_dma_extent __user* extents_user)
+{
+    int ret = 0;
+    unsigned long i;
+
+    struct bafs_mem*          mem = dma->mem;
+    struct scatterlist*       sg;
+    struct bafs_extent_writer w   = {0};
+
+    w.user    = extents_user;
+    w.cap     = *n_extents;
+    w.max_len = map_gran ? map_gran : U64_MAX;
+
+    switch (mem->loc) {
+    case BAFS_MEM_CPU:
+    case BAFS_MEM_USER:
+    case BAFS_MEM_CMB:
+    case BAFS_MEM_DMABUF:
+        for_each_sgtable_dma_sg(bafs_dma_sgt(dma), sg, i) {
+            ret = bafs_extent_writer_push(&w, sg_dma_address(sg), sg_dma_len(sg));
+            if (ret)
+                goto out;
+        }
+        break;
+    case BAFS_MEM_CUDA:
+        for (i = 0; i < dma->cuda_mapping->entries; i++) {
+            ret = bafs_extent_writer_push(&w, dma->cuda_mapping->dma_addresses[i], mem->page_size);
+            if (ret)
+                goto out;
+        }
+        break;
+    default:
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = bafs_extent_writer_emit(&w);
+    if (ret)
+        goto out;
+    ret = bafs_extent_writer_flush(&w);
+    if (ret)
+        goto out;
+
+    if (w.n > w.cap) {
+        ret = -ENOSPC;
+        BAFS_CTRL_DEBUG("Extent buffer too small, need %u have %u\n", w.n, w.cap);
+    }
+    *n_extents = w.n;
+out:
+    return ret;
+}
+
+int bafs_dma_copy_addrs(struct bafs_mem_dma* dma, unsigned long __user* dma_addrs_user)
+{
+    int ret = 0;
+    unsigned long i;
+    unsigned long off;
+    unsigned long n     = 0;
+    unsigned      n_buf = 0;
+
+    struct bafs_mem*    mem = dma->mem;
+    struct scatterlist* sg;
+    unsigned long       buf[BAFS_DMA_COPY_BATCH];
+
+    switch (mem->loc) {
+    case BAFS_MEM_CPU:
+    case BAFS_MEM_USER:
+    case BAFS_MEM_CMB:
+    case BAFS_MEM_DMABUF:
+        for_each_sgtable_dma_sg(bafs_dma_sgt(dma), sg, i) {
+            for (off = 0; (off < sg_dma_len(sg)) && (n + n_buf < dma->n_addrs); off += mem->page_size) {
+                buf[n_buf++] = sg_dma_address(sg) + off;
+                if (n_buf == BAFS_DMA_COPY_BATCH) {
+                    if (copy_to_user(dma_addrs_user + n, buf, n_buf * sizeof(buf[0]))) {
+                        ret = -EFAULT;
+                        goto out;
+                    }
+                    n    += n_buf;
+                    n_buf = 0;
+                }
+            }
+        }
+        if (n_buf && copy_to_user(dma_addrs_user + n, buf, n_buf * sizeof(buf[0]))) {
+            ret = -EFAULT;
+            goto out;
+        }
+        break;
+    case BAFS_MEM_CUDA:
+        if (copy_to_user(dma_addrs_user, dma->cuda_mapping->dma_addresses, (dma->cuda_mapping->entries)*sizeof(unsigned long))) {
+            ret = -EFAULT;
+            goto out;
+        }
+        break;
+    default:
+        ret = -EINVAL;
+        break;
+    }
+out:
+    return ret;
+}
+
+/* walks the page addresses of a mapping in order */
+struct bafs_dma_addr_iter {
+    struct bafs_mem_dma* dma;
+    struct scatterlist*  sg;
+    unsigned long        off;
+    unsigned long        n;
+};
+
+static
+void bafs_dma_addr_iter_init(struct bafs_dma_addr_iter* it, struct bafs_mem_dma* dma)
+{
+    it->dma = dma;
+    it->sg  = (dma->mem->loc == BAFS_MEM_CUDA) ? NULL : bafs_dma_sgt(dma)->sgl;
+    it->off = 0;
+    it->n   = 0;
+}
+
+/* the caller stops after dma->n_addrs addresses */
+static
+u64 bafs_dma_addr_iter_next(struct bafs_dma_addr_iter* it)
+{
+    u64 addr;
+
+    if (!it->sg)
+        return it->dma->cuda_mapping->dma_addresses[it->n++];
+
+    while (it->off >= sg_dma_len(it->sg)) {
+        it->sg  = sg_next(it->sg);
+        it->off = 0;
+    }
+    addr     = sg_dma_address(it->sg) + it->off;
+    it->off += it->dma->mem->page_size;
+    it->n++;
+
+    return addr;
+}
+
+/* a layout as strides, the table must fit in u64 entries and no two addresses may share a slot */
+static
+int bafs_dma_layout_strides(struct BAFS_IOC_DMA_MAP_MEM2_PARAMS* params, const unsigned long n_addrs,
+                            const int n_ctrls, u64* span)
+{
+    u64 page_end;
+    u64 ctrl_end;
+
+    switch (params->layout) {
+    case BAFS_DMA_LAYOUT_CTRL_MAJOR:
+        params->page_stride = 1;
+        params->ctrl_stride = n_addrs;
+        break;
+    case BAFS_DMA_LAYOUT_INTERLEAVED:
+        params->page_stride = n_ctrls;
+        params->ctrl_stride = 1;
+        break;
+    case BAFS_DMA_LAYOUT_STRIDED:
+        if ((params->page_stride == 0) || ((n_ctrls > 1) && (params->ctrl_stride == 0)))
+            return -EINVAL;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (check_mul_overflow((u64) (n_addrs - 1), params->page_stride, &page_end) ||
+        check_mul_overflow((u64) (n_ctrls - 1), params->ctrl_stride, &ctrl_end) ||
+        check_add_overflow(page_end, ctrl_end + 1, span))
+        return -EINVAL;
+
+    /* one stride has to step over every slot of the other, otherwise rows and columns interleave */
+    if ((n_ctrls > 1) && (n_addrs > 1) && (params->page_stride < ctrl_end + 1) &&
+        (params->ctrl_stride < page_end + 1))
+        return -EINVAL;
+
+    return 0;
+}
+
+/* rows of the table buffered before a copy to userspace */
+#define BAFS_DMA_ROW_BATCH 512
+
+/*
+ * Writes the address tables of the mappings of one window, one per controller,
+ * into a single user table in the requested layout. Page p of mapping c goes to
+ * dma_addrs[p * page_stride + c * ctrl_stride], -ENOSPC reports the span needed.
+ */
+int bafs_dma_copy_addrs_layout(struct bafs_mem_dma** dmas, const int n_dmas, struct BAFS_IOC_DMA_MAP_MEM2_PARAMS* params)
+{
+    int ret = 0;
+    int c;
+    unsigned long p;
+    unsigned long n_rows = 0;
+    unsigned long rows_per_buf;
+    unsigned long n      = dmas[0]->n_addrs;
+    u64           span;
+
+    unsigned long __user*      user = params->dma_addrs;
+    unsigned long*             buf;
+    struct bafs_dma_addr_iter* its;
+
+    for (c = 1; c < n_dmas; c++) {
+        if (dmas[c]->n_addrs != n) {
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    ret = bafs_dma_layout_strides(params, n, n_dmas, &span);
+    if (ret < 0) {
+        BAFS_CTRL_ERR("Invalid dma table layout %u\n", params->layout);
+        goto out;
+    }
+
+    params->n_addrs    = n;
+    params->n_ctrls    = n_dmas;
+    params->page_shift = dmas[0]->mem->page_shift;
+    if (span > params->n_dma_addrs) {
+        BAFS_CTRL_DEBUG("Dma table too small, need %llu have %llu\n", span, params->n_dma_addrs);
+        params->n_dma_addrs = span;
+        ret = -ENOSPC;
+        goto out;
+    }
+    params->n_dma_addrs = span;
+
+    /* each controller's addresses are one run, the plain copy streams them */
+    if (params->page_stride == 1) {
+        for (c = 0; c < n_dmas; c++) {
+            ret = bafs_dma_copy_addrs(dmas[c], user + (c * params->ctrl_stride));
+            if (ret < 0)
+                goto out;
+        }
+        goto out;
+    }
+
+    its = kcalloc(n_dmas, sizeof(*its), GFP_KERNEL);
+    if (!its) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    rows_per_buf = max(1UL, BAFS_DMA_ROW_BATCH / (unsigned long) n_dmas);
+    buf          = kmalloc_array(rows_per_buf * n_dmas, sizeof(*buf), GFP_KERNEL);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out_free_its;
+    }
+
+    for (c = 0; c < n_dmas; c++)
+        bafs_dma_addr_iter_init(&its[c], dmas[c]);
+
+    for (p = 0; p < n; p++) {
+        if (params->ctrl_stride == 1) {
+            /* the addresses of page p sit next to each other, unpadded rows are copied together */
+            for (c = 0; c < n_dmas; c++)
+                buf[(n_rows * n_dmas) + c] = bafs_dma_addr_iter_next(&its[c]);
+            n_rows++;
+            if ((params->page_stride != n_dmas) || (n_rows == rows_per_buf) || (p == (n - 1))) {
+                if (copy_to_user(user + ((p + 1 - n_rows) * params->page_stride), buf,
+                                 n_rows * n_dmas * sizeof(*buf))) {
+                    ret = -EFAULT;
+                    goto out_free_buf;
+                }
+                n_rows = 0;
+            }
+        }
+        else {
+            for (c = 0; c < n_dmas; c++) {
+                if (put_user(bafs_dma_addr_iter_next(&its[c]),
+                             user + (p * params->page_stride) + (c * params->ctrl_stride))) {
+                    ret = -EFAULT;
+                    goto out_free_buf;
+                }
+            }
+        }
+        if ((p % BAFS_DMA_ROW_BATCH) == 0)
+            cond_resched();
+    }
+
+out_free_buf:
+    kfree(buf);
+out_free_its:
+    kfree(its);
+out:
+    return ret;
+}
+
+/* the table is the only copy of the addresses, userspace maps it instead of copying it out */
+static
+struct bafs_dma_table_hdr* bafs_dma_alloc_table(struct bafs_mem_dma* dma, unsigned long* size_)
+{
+    unsigned long i;
+    unsigned long off;
+    unsigned long n = 0;
+
+    struct bafs_mem*           mem = dma->mem;
+    struct scatterlist*        sg;
+    struct bafs_dma_table_hdr* table;
+    unsigned long              size;
+
+    size  = PAGE_ALIGN(sizeof(*table) + dma->n_addrs * sizeof(table->dma_addrs[0]));
+    table = vmalloc_user(size);
+    if (!table) {
+        BAFS_CTRL_ERR("Failed to allocate dma table of %lu bytes\n", size);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    switch (mem->loc) {
+    case BAFS_MEM_CPU:
+    case BAFS_MEM_USER:
+    case BAFS_MEM_CMB:
+    case BAFS_MEM_DMABUF:
+        for_each_sgtable_dma_sg(bafs_dma_sgt(dma), sg, i) {
+            for (off = 0; (off < sg_dma_len(sg)) && (n < dma->n_addrs); off += mem->page_size) {
+                table->dma_addrs[n++] = sg_dma_address(sg) + off;
+                if ((n % BAFS_DMA_COPY_BATCH) == 0)
+                    cond_resched();
+            }
+        }
+        break;
+    case BAFS_MEM_CUDA:
+        for (n = 0; n < dma->cuda_mapping->entries; n++)
+            table->dma_addrs[n] = dma->cuda_mapping->dma_addresses[n];
+        break;
+    default:
+        vfree(table);
+        return ERR_PTR(-EINVAL);
+    }
+
+    table->n_addrs    = n;
+    table->page_shift = mem->page_shift;
+    table->first_page = dma->first_page;
+
+    *size_ = size;
+    return table;
+}
+
+/*
+ * Installs a new table for dma. An existing one is superseded: its generation is
+ * bumped so readers of the old mmap retry, and the new one starts past it.
+ */
+static
+int bafs_dma_build_table(struct bafs_mem_dma* dma)
+{
+    unsigned long              size;
+    struct bafs_mem*           mem = dma->mem;
+    struct bafs_dma_table_hdr* table;
+    struct bafs_dma_table_hdr* old;
+
+    table = bafs_dma_alloc_table(dma, &size);
+    if (IS_ERR(table))
+        return PTR_ERR(table);
+
+    /* mmap holds table_lock while it remaps the table, the old one is freed after it */
+    mutex_lock(&dma->table_lock);
+    spin_lock(&mem->lock);
+    old = dma->table;
+    if (old) {
+        WRITE_ONCE(old->generation, old->generation + 1);
+        table->generation = old->generation;
+    }
+    dma->table_size = size;
+    dma->table      = table;
+    spin_unlock(&mem->lock);
+    mutex_unlock(&dma->table_lock);
+
+    /* the pages stay mapped in userspace after vfree, so the old header can still be read */
+    vfree(old);
+    return 0;
+}
+
+/* the pages stay mapped in userspace after vfree, so the header can still be read */
+void bafs_dma_table_revoke(struct bafs_mem_dma* dma)
+{
+    WRITE_ONCE(dma->table->revoked, 1);
+    smp_wmb();
+    WRITE_ONCE(dma->table->generation, dma->table->generation + 1);
+    vfree(dma->table);
+    dma->table = NULL;
+}
+
+int bafs_ctrl_emit_dma_cache_stats(char* buf)
+{
+    return sysfs_emit(buf, "hits %lld\nmisses %lld\n",
+                      atomic64_read(&bafs_dma_cache_hits), atomic64_read(&bafs_dma_cache_misses));
+}
+
+/*
+ * Controllers behind one translating iommu domain share its iova space, so a
+ * mapping of cpu memory made for one of them is valid for the others as long
+ * as they accept the same addresses and segment sizes.
+ */
+bool bafs_ctrl_same_iova_space(struct bafs_ctrl* a, struct bafs_ctrl* b)
+{
+    struct device*       dev_a = &a->pdev->dev;
+    struct device*       dev_b = &b->pdev->dev;
+    struct iommu_domain* domain;
+
+    domain = iommu_get_domain_for_dev(dev_a);
+    if (!domain || !(domain->type & __IOMMU_DOMAIN_DMA_API) || (domain != iommu_get_domain_for_dev(dev_b)))
+        return false;
+
+    return (dma_get_mask(dev_a) == dma_get_mask(dev_b)) &&
+           (dma_get_max_seg_size(dev_a) == dma_get_max_seg_size(dev_b));
+}
+
+static
+bool bafs_dma_shareable(struct bafs_mem_dma* dma, struct bafs_ctrl* ctrl)
+{
+    if (dma->ctrl == ctrl)
+        return true;
+
+    if ((dma->mem->loc != BAFS_MEM_CPU) && (dma->mem->loc != BAFS_MEM_USER))
+        return false;
+
+    return bafs_ctrl_same_iova_space(dma->ctrl, ctrl);
+}
+
+/* swiotlb bouncing or a non-coherent device, the mapping has to be synced around device access */
+static
+bool bafs_dma_need_sync(struct device* dev, struct sg_table* sgt)
+{
+    unsigned int        i;
+    struct scatterlist* sg;
+
+    for_each_sgtable_dma_sg(sgt, sg, i) {
+        if (dma_need_sync(dev, sg_dma_address(sg)))
+            return true;
+    }
+
+    return false;
+}
+
+/* the map references ctrl holds on dma, NULL if it took none, mem->lock held */
+static
+struct bafs_dma_ref* bafs_dma_ref_find_locked(struct bafs_mem_dma* dma, struct bafs_ctrl* ctrl)
+{
+    struct bafs_dma_ref* ref;
+
+    list_for_each_entry(ref, &dma->refs, list) {
+        if (ref->ctrl == ctrl)
+            return ref;
+    }
+
+    return NULL;
+}
+
+/* charges one map reference on dma to ctrl, spare is used up if ctrl had none, mem->lock held */
+static
+void bafs_dma_ref_get_locked(struct bafs_mem_dma* dma, struct bafs_ctrl* ctrl, struct bafs_dma_ref** spare)
+{
+    struct bafs_dma_ref* ref = bafs_dma_ref_find_locked(dma, ctrl);
+
+    if (!ref) {
+        ref       = *spare;
+        *spare    = NULL;
+        ref->ctrl = ctrl;
+        list_add(&ref->list, &dma->refs);
+    }
+    ref->n_maps++;
+    dma->n_maps++;
+}
+
+/*
+ * Drops n of the map references ctrl holds on dma, true when they were the last
+ * ones on the mapping and it was taken off the region. mem->lock held.
+ */
+static
+bool bafs_dma_ref_put_locked(struct bafs_mem_dma* dma, struct bafs_dma_ref* ref, const unsigned int n)
+{
+    ref->n_maps -= n;
+    dma->n_maps -= n;
+    if (ref->n_maps == 0) {
+        list_del(&ref->list);
+        kfree(ref);
+    }
+    if (dma->n_maps)
+        return false;
+
+    list_del_init(&dma->dma_list);
+    return true;
+}
+
+/* a mapping of the window ctrl can use, with one more map reference, mem->lock held */
+static
+struct bafs_mem_dma* bafs_dma_find_locked(struct bafs_mem* mem, struct bafs_ctrl* ctrl, const unsigned long first,
+                                          const unsigned long n, struct bafs_dma_ref** spare)
+{
+    struct bafs_mem_dma* dma;
+
+    list_for_each_entry(dma, &mem->dma_list, dma_list) {
+        if ((dma->first_page == first) && (dma->n_addrs == n) && bafs_dma_shareable(dma, ctrl)) {
+            bafs_dma_ref_get_locked(dma, ctrl, spare);
+            return dma;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Maps the window [offset, offset + len) of the region, len 0 maps up to its end.
+ * A window that is already mapped for the controller is handed out again with one
+ * more map reference charged to ctrl, bafs_ctrl_dma_unmap_mem() drops one. The caller keeps its
+ * reference on mem. Nothing is copied to userspace, so group members are mapped
+ * from worker threads.
+ */
+int bafs_ctrl_dma_map(struct bafs_ctrl * ctrl, struct bafs_mem* mem, const u64 offset, const u64 len,
+                      struct bafs_mem_dma ** dma_)
 {
     int ret = 0;
-    int i   = 0;
 
-    struct bafs_mem*       mem;
     struct bafs_mem_dma*   dma;
-    unsigned               map_gran;
+    struct bafs_dma_ref*   spare;
+    struct device*         dev = &ctrl->pdev->dev;
+    unsigned long          first;
+    unsigned long          n;
+    u64                    start = ktime_get_ns();
+
+    /* the map reference is charged to ctrl under mem->lock, where nothing can be allocated */
+    spare = kzalloc(sizeof(*spare), GFP_KERNEL);
+    if (!spare)
+        return -ENOMEM;
+
+    /* taken over by the mapping */
+    kref_get(&mem->ref);
+
+    first = offset >> mem->page_shift;
+    n     = len ? DIV_ROUND_UP(len, mem->page_size) : mem->n_pages - min(first, mem->n_pages);
+    if ((offset & ~mem->page_mask) || (first >= mem->n_pages) || (n > (mem->n_pages - first))) {
+        ret = -EINVAL;
+        BAFS_CTRL_ERR("Invalid dma map window %llx+%llx\n", offset, len);
+        goto out_put_mem;
+    }
 
+    spin_lock(&mem->lock);
+    *dma_ = bafs_dma_find_locked(mem, ctrl, first, n, &spare);
+    spin_unlock(&mem->lock);
+    if (*dma_) {
+        /* the cached mapping already holds a reference on the region */
+        atomic64_inc(&bafs_dma_cache_hits);
+        trace_bafs_dma_map_cached(*dma_);
+        goto out_put_mem;
+    }
+    atomic64_inc(&bafs_dma_cache_misses);
+
+    *dma_   = kzalloc(sizeof(*dma), GFP_KERNEL);
+    if (!(*dma_)){
+        ret = -ENOMEM;
+        BAFS_CTRL_ERR("Failed to allocate memory for bafs_mem_dma\n");
+        goto out_put_mem;
+    }
+
+    dma = *dma_;
+
+
+    bafs_get_ctrl(ctrl);
+
+    INIT_LIST_HEAD(&dma->dma_list);
+    INIT_LIST_HEAD(&dma->refs);
+    kref_init(&dma->ref);
+    mutex_init(&dma->table_lock);
+
+
+    dma->ctrl       = ctrl;
+    dma->mem        = mem;
+    dma->first_page = first;
+
+
+    switch (mem->loc) {
+    case BAFS_MEM_CPU:
+    case BAFS_MEM_USER:
+        /* lazy regions are populated across the window before the device can address it */
+        ret = bafs_mem_populate(mem, first, first + n);
+        if (ret) {
+            BAFS_CTRL_ERR("Failed to populate mem for dma map \t ret = %d\n", ret);
+            goto out_delete_dma;
+        }
+        /* physically adjacent pages share one sg entry, the IOMMU may merge further */
+        ret = bafs_mem_alloc_sgt(mem, &dma->sgt, dma_get_max_seg_size(dev), first, n);
+        if (ret) {
+            BAFS_CTRL_ERR("Failed to build sg table \t ret = %d\n", ret);
+            goto out_delete_dma;
+        }
+        ret = dma_map_sgtable(dev, &dma->sgt, DMA_BIDIRECTIONAL, 0);
+        if (ret) {
+            BAFS_CTRL_ERR("dma_map_sgtable failed \t ret = %d\n", ret);
+            goto out_free_sgt;
+        }
+        dma->sgt_mapped = true;
+        dma->n_addrs    = n;
+        dma->need_sync  = bafs_dma_need_sync(dev, &dma->sgt);
+        BAFS_CTRL_DEBUG("Mapped %lu pages in %u dma segments\n", n, dma->sgt.nents);
+        break;
+    case BAFS_MEM_CMB:
+        /* peers reach the slice through the switch, never through host memory */
+        if (pci_p2pdma_distance(mem->p2p_dev, dev, true) < 0) {
+            ret = -EXDEV;
+            BAFS_CTRL_ERR("Controller cannot reach cmb of %s peer to peer\n", pci_name(mem->p2p_dev));
+            goto out_delete_dma;
+        }
+        ret = bafs_mem_alloc_sgt(mem, &dma->sgt, dma_get_max_seg_size(dev), first, n);
+        if (ret) {
+            BAFS_CTRL_ERR("Failed to build sg table \t ret = %d\n", ret);
+            goto out_delete_dma;
+        }
+        dma->sgt.nents = pci_p2pdma_map_sg(dev, dma->sgt.sgl, dma->sgt.orig_nents, DMA_BIDIRECTIONAL);
+        if (dma->sgt.nents == 0) {
+            ret = -EIO;
+            BAFS_CTRL_ERR("pci_p2pdma_map_sg failed\n");
+            goto out_free_sgt;
+        }
+        dma->sgt_mapped = true;
+        dma->n_addrs    = n;
+        break;
+    case BAFS_MEM_DMABUF:
+        /* the exporter builds and maps the table for this controller */
+        if ((first != 0) || (n != mem->n_pages)) {
+            ret = -EOPNOTSUPP;
+            goto out_delete_dma;
+        }
+        dma->attach = dma_buf_attach(mem->dmabuf, dev);
+        if (IS_ERR(dma->attach)) {
+            ret         = PTR_ERR(dma->attach);
+            dma->attach = NULL;
+            BAFS_CTRL_ERR("dma_buf_attach failed \t ret = %d\n", ret);
+            goto out_delete_dma;
+        }
+        dma->attach_sgt = dma_buf_map_attachment(dma->attach, DMA_BIDIRECTIONAL);
+        if (IS_ERR(dma->attach_sgt)) {
+            ret             = PTR_ERR(dma->attach_sgt);
+            dma->attach_sgt = NULL;
+            BAFS_CTRL_ERR("dma_buf_map_attachment failed \t ret = %d\n", ret);
+            goto out_detach;
+        }
+        dma->n_addrs = mem->n_pages;
+        break;
+    case BAFS_MEM_CUDA:
+        if ((first != 0) || (n != mem->n_pages)) {
+            ret = -EOPNOTSUPP;
+            goto out_delete_dma;
+        }
+        ret      = nvidia_p2p_dma_map_pages(ctrl->pdev, mem->cuda_page_table, &dma->cuda_mapping);
+        if (ret != 0) {
+            BAFS_CTRL_ERR("nvidia_p2p_dma_map_pages failed \t ret = %d\n", ret);
+            goto out_delete_dma;
+        }
+        dma->n_addrs = dma->cuda_mapping->entries;
+        break;
+    default:
+        ret = -EINVAL;
+        goto out_delete_dma;
+        break;
+
+    }
+    /* given back when the mapping is released, whether or not it wins the race below */
+    bafs_stats_add(mem->ctx, ctrl, BAFS_STAT_DMA_MAPS, 1);
+    bafs_stats_add(mem->ctx, ctrl, BAFS_STAT_IOVA_BYTES, dma->n_addrs << mem->page_shift);
+
+    spin_lock(&mem->lock);
+    /*
+     * The region was only LIVE at lookup. Once dereg or the invalidate callback spliced
+     * the list nothing would tear a mapping added now down again, so ours is dropped.
+     */
+    if (mem->state != LIVE) {
+        spin_unlock(&mem->lock);
+        ret = -ENOENT;
+        BAFS_CTRL_DEBUG("Region went away while it was mapped\n");
+        bafs_mem_dma_put(dma);
+        goto out_put_mem;
+    }
+    /* a racing map of the same window won, ours is dropped */
+    *dma_ = bafs_dma_find_locked(mem, ctrl, first, n, &spare);
+    if (!*dma_) {
+        bafs_dma_ref_get_locked(dma, ctrl, &spare);
+        list_add(&dma->dma_list, &mem->dma_list);
+    }
+    spin_unlock(&mem->lock);
+
+    if (*dma_) {
+        bafs_mem_dma_put(dma);
+        trace_bafs_dma_map_cached(*dma_);
+        goto out_put_mem;
+    }
+    *dma_ = dma;
+    trace_bafs_dma_map(dma);
+    bafs_stats_latency(mem->ctx, ctrl, BAFS_OP_MAP, start);
+
+    kfree(spare);
+    ret = 0;
+    return ret;
+
+out_detach:
+    dma_buf_detach(mem->dmabuf, dma->attach);
+    goto out_delete_dma;
+out_free_sgt:
+    sg_free_table(&dma->sgt);
+out_delete_dma:
+
+
+    kfree(dma);
+
+    bafs_ctrl_release(ctrl);
+out_put_mem:
+    if (ret == 0)
+        bafs_stats_latency(mem->ctx, ctrl, BAFS_OP_MAP, start);
+    bafs_mem_put(mem);
+    kfree(spare);
+
+
+    return ret;
+
+}
+
+void
+bafs_ctrl_get_nodes(struct bafs_ctrl * ctrl, nodemask_t * nodes)
+{
+    int nid = dev_to_node(&ctrl->pdev->dev);
+
+    if (nid != NUMA_NO_NODE)
+        node_set(nid, *nodes);
+}
+
+int
+bafs_ctrl_dma_map_mem(struct bafs_ctrl * ctrl, struct bafs_mem* mem, __u32 * n_dma_addrs,
+                      unsigned long __user * dma_addrs_user, struct bafs_mem_dma ** dma_,
+                      const int ctrl_id)
+{
+    int ret = 0;
+
+    ret = bafs_ctrl_dma_map(ctrl, mem, 0, 0, dma_);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (ctrl_id      == 0)
+        *n_dma_addrs  = (*dma_)->n_addrs;
+    else
+        *n_dma_addrs += (*dma_)->n_addrs;
+
+    ret = bafs_dma_copy_addrs(*dma_, dma_addrs_user);
+    if (ret < 0) {
+        BAFS_CTRL_ERR("Failed to copy %lu dma addrs to user\n", (*dma_)->n_addrs);
+        goto out_unmap;
+    }
+
+    return ret;
+
+out_unmap:
+    bafs_ctrl_dma_unmap_mem(ctrl, *dma_);
+out:
+    return ret;
+}
+
+int
+bafs_ctrl_dma_map_mem_extents(struct bafs_ctrl * ctrl, struct bafs_mem* mem, unsigned map_gran,
+                              const u64 offset, const u64 len, __u32 * n_extents,
+                              struct bafs_dma_extent __user * extents_user, struct bafs_mem_dma ** dma_)
+{
+    int ret = 0;
+
+    if (map_gran & ~PAGE_MASK) {
+        ret = -EINVAL;
+        BAFS_CTRL_ERR("Invalid map granularity %u\n", map_gran);
+        goto out;
+    }
+
+    ret = bafs_ctrl_dma_map(ctrl, mem, offset, len, dma_);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = bafs_dma_copy_extents(*dma_, map_gran, n_extents, extents_user);
+    if (ret < 0) {
+        goto out_unmap;
+    }
+
+    return ret;
+
+out_unmap:
+    bafs_ctrl_dma_unmap_mem(ctrl, *dma_);
+out:
+    return ret;
+}
+
+/* unmaps this controller's mapping of the window, len 0 unmaps all of them */
+int
+bafs_ctrl_dma_unmap_range(struct bafs_ctrl* ctrl, struct bafs_mem* mem, const u64 offset, const u64 len)
+{
+    int ret = 0;
+
+    struct bafs_mem_dma* dma;
+    struct bafs_mem_dma* next;
+    struct bafs_dma_ref* ref;
+    unsigned long        first;
+    unsigned long        n;
+    unsigned long        n_unmapped = 0;
+    u64                  start = ktime_get_ns();
+    LIST_HEAD(dmas);
+
+    first = offset >> mem->page_shift;
+    if (first >= mem->n_pages) {
+        ret = -EINVAL;
+        goto out;
+    }
+    /* same window rules as the map, an offset and len of 0 drop every window */
+    n     = len ? DIV_ROUND_UP(len, mem->page_size) : (mem->n_pages - first);
+
+    /*
+     * Only references ctrl took count, a controller sharing the iova space cannot
+     * unmap what another one still uses. Dropping every window drops all of them.
+     */
+    spin_lock(&mem->lock);
+    list_for_each_entry_safe(dma, next, &mem->dma_list, dma_list) {
+        if ((offset || len) && ((dma->first_page != first) || (dma->n_addrs != n)))
+            continue;
+        ref = bafs_dma_ref_find_locked(dma, ctrl);
+        if (!ref)
+            continue;
+        n_unmapped++;
+        /* other users of a cached mapping keep it */
+        if (bafs_dma_ref_put_locked(dma, ref, (offset || len) ? 1 : ref->n_maps))
+            list_add(&dma->dma_list, &dmas);
+    }
+    spin_unlock(&mem->lock);
+
+    /* each mapping holds a reference on the region */
+    list_for_each_entry_safe(dma, next, &dmas, dma_list) {
+        unmap_dma(dma);
+        bafs_mem_put(mem);
+    }
+
+    if (n_unmapped == 0)
+        ret = -ENOENT;
+    else
+        bafs_stats_latency(mem->ctx, ctrl, BAFS_OP_UNMAP, start);
+    BAFS_CTRL_DEBUG("Unmapped %lu windows of mem %u\n", n_unmapped, mem->mem_id);
+
+out:
+    return ret;
+}
+
+/*
+ * Syncs the cpu segments of dma that overlap [start, end) of the region. Segments
+ * are synced whole, a merged iova range gives no exact address for a byte in it.
+ */
+static
+void bafs_dma_sync_range(struct bafs_mem_dma* dma, const u64 start, const u64 end, const __u32 dir)
+{
+    unsigned int        i;
+    unsigned int        n_run = 0;
+    u64                 pos   = (u64) dma->first_page << dma->mem->page_shift;
+    struct scatterlist* sg;
+    struct scatterlist* run   = NULL;
+    struct device*      dev   = &dma->ctrl->pdev->dev;
+
+    for_each_sgtable_sg(&dma->sgt, sg, i) {
+        if (pos >= end)
+            break;
+        if ((pos + sg->length) > start) {
+            if (!run)
+                run = sg;
+            n_run++;
+        }
+        pos += sg->length;
+    }
+
+    if (n_run == 0)
+        return;
+
+    if (dir == BAFS_DMA_SYNC_FOR_CPU)
+        dma_sync_sg_for_cpu(dev, run, n_run, DMA_BIDIRECTIONAL);
+    else
+        dma_sync_sg_for_device(dev, run, n_run, DMA_BIDIRECTIONAL);
+}
+
+/* true if any of ctrls can use dma, mem->lock held */
+static
+bool bafs_dma_used_by(struct bafs_mem_dma* dma, struct bafs_ctrl * const * ctrls, const int n_ctrls)
+{
+    int i;
+
+    for (i = 0; i < n_ctrls; i++) {
+        if (bafs_dma_shareable(dma, ctrls[i]))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Syncs a list of ranges of a region on every mapping the controllers use. A
+ * shared mapping is synced once. With no ranges only BAFS_DMA_SYNC_NEEDED is
+ * reported, so coherent hosts can skip the call altogether.
+ */
+long
+bafs_ctrl_dma_sync_mem(struct bafs_ctrl * const * ctrls, const int n_ctrls, struct bafs_ctx* ctx,
+                       void __user* user_params)
+{
+    long ret = 0;
+    __u32 i;
+    __u32 j;
+    __u32 n;
+
+    struct bafs_mem*                    mem;
+    struct bafs_mem_dma*                dma;
+    struct bafs_dma_sync_range          ranges[BAFS_DMA_COPY_BATCH / 2];
+    struct BAFS_IOC_DMA_SYNC_MEM_PARAMS params;
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        ret = -EINVAL;
+        BAFS_CTRL_ERR("Failed to find bafs_mem obj for dma sync\n");
+        goto out;
+    }
+
+    params.flags = 0;
+    spin_lock(&mem->lock);
+    list_for_each_entry(dma, &mem->dma_list, dma_list) {
+        if (dma->need_sync && bafs_dma_used_by(dma, ctrls, n_ctrls)) {
+            params.flags |= BAFS_DMA_SYNC_NEEDED;
+            break;
+        }
+    }
+    spin_unlock(&mem->lock);
+
+    for (i = 0; (params.flags & BAFS_DMA_SYNC_NEEDED) && (i < params.n_ranges); i += n) {
+        n = min_t(__u32, params.n_ranges - i, ARRAY_SIZE(ranges));
+        if (copy_from_user(ranges, params.ranges + i, n * sizeof(ranges[0]))) {
+            ret = -EFAULT;
+            goto out_put_mem;
+        }
+
+        for (j = 0; j < n; j++) {
+            if ((ranges[j].dir > BAFS_DMA_SYNC_FOR_DEVICE) || (ranges[j].offset > mem->size) ||
+                (ranges[j].len > (mem->size - ranges[j].offset))) {
+                ret = -EINVAL;
+                BAFS_CTRL_ERR("Invalid dma sync range %u\n", i + j);
+                goto out_put_mem;
+            }
+        }
+
+        /* syncs never sleep, the mappings stay on the list while the lock is held */
+        spin_lock(&mem->lock);
+        list_for_each_entry(dma, &mem->dma_list, dma_list) {
+            if (!dma->need_sync || !bafs_dma_used_by(dma, ctrls, n_ctrls))
+                continue;
+            for (j = 0; j < n; j++) {
+                if (ranges[j].len)
+                    bafs_dma_sync_range(dma, ranges[j].offset, ranges[j].offset + ranges[j].len, ranges[j].dir);
+            }
+        }
+        spin_unlock(&mem->lock);
+        cond_resched();
+    }
+
+    if (copy_to_user(user_params, &params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params to user\n");
+    }
+
+out_put_mem:
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
+
+int
+bafs_ctrl_dma_map_table(struct bafs_ctrl* ctrl, struct bafs_mem* mem, struct bafs_mem_dma** dma_)
+{
+    int ret = 0;
+
+    struct bafs_mem_dma* dma;
+
+    ret = bafs_ctrl_dma_map(ctrl, mem, 0, 0, dma_);
+    if (ret < 0) {
+        goto out;
+    }
+    dma = *dma_;
+
+    /* an explicit table map of a cached mapping supersedes the table it had */
+    ret = bafs_dma_build_table(dma);
+    if (ret < 0) {
+        goto out_unmap;
+    }
+
+    return ret;
+
+out_unmap:
+    bafs_ctrl_dma_unmap_mem(ctrl, dma);
+out:
+    return ret;
+}
+
+int
+bafs_ctrl_mmap_dma_table(struct bafs_ctrl* ctrl, struct bafs_ctx* ctx, struct vm_area_struct* vma)
+{
+    int ret = 0;
+
+    struct bafs_mem*     mem;
+    struct bafs_mem_dma* dma;
+    struct bafs_mem_dma* found = NULL;
+    bafs_mem_hnd_t       handle;
+
+    handle = BAFS_MMAP_DMA_TABLE_HANDLE((u64) vma->vm_pgoff << PAGE_SHIFT);
+
+    if (vma->vm_flags & VM_WRITE) {
+        ret = -EPERM;
+        goto out;
+    }
+
+    mem = bafs_get_mem_by_handle(handle, ctx);
+    if (!mem) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    spin_lock(&mem->lock);
+    list_for_each_entry(dma, &mem->dma_list, dma_list) {
+        if (dma->table && bafs_dma_shareable(dma, ctrl)) {
+            kref_get(&dma->ref);
+            found = dma;
+            break;
+        }
+    }
+    spin_unlock(&mem->lock);
+    if (!found) {
+        ret = -ENOENT;
+        BAFS_CTRL_ERR("No dma table of mem %u for this controller\n", mem->mem_id);
+        goto out_put_mem;
+    }
+
+    vma->vm_flags &= ~VM_MAYWRITE;
+    /* a table map may supersede the table, it is only freed once the remap is done */
+    mutex_lock(&found->table_lock);
+    ret = remap_vmalloc_range(vma, found->table, 0);
+    mutex_unlock(&found->table_lock);
+    if (ret)
+        BAFS_CTRL_ERR("Failed to map dma table \t ret = %d\n", ret);
+
+    bafs_mem_dma_put(found);
+out_put_mem:
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
+
+/* drops one map reference ctrl took, the mapping goes away with the last one of any ctrl */
+void
+bafs_ctrl_dma_unmap_mem(struct bafs_ctrl* ctrl, struct bafs_mem_dma* dma)
+{
+    bool                 last;
+    struct bafs_mem*     mem = dma->mem;
+    struct bafs_dma_ref* ref;
+
+    spin_lock(&mem->lock);
+    ref = bafs_dma_ref_find_locked(dma, ctrl);
+    /* the region was torn down under the caller and already took the mapping off its list */
+    if (!ref || list_empty(&dma->dma_list)) {
+        spin_unlock(&mem->lock);
+        return;
+    }
+    last = bafs_dma_ref_put_locked(dma, ref, 1);
+    spin_unlock(&mem->lock);
+    if (!last)
+        return;
+    /* dma-buf detach sleeps, so the mapping itself is torn down unlocked */
+    unmap_dma(dma);
+    bafs_mem_put(mem);
+}
+
+static long
+__bafs_ctrl_dma_map_mem(struct bafs_ctrl* ctrl, struct bafs_ctx* ctx, void __user * user_params)
+{
+    long ret = 0;
+
+    struct bafs_mem*                        mem;
+    struct bafs_mem_dma*                    dma;
+    struct BAFS_IOC_DMA_MAP_MEM_PARAMS params;
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        ret = -EINVAL;
+        BAFS_CTRL_ERR("Failed to find bafs_mem obj for dma map\n");
+        goto out;
+    }
+
+    ret = bafs_ctrl_dma_map_mem(ctrl, mem, &params.n_dma_addrs, params.dma_addrs, &dma, 0);
+    if (ret < 0) {
+        goto out_put_mem;
+    }
+    params.page_shift = dma->mem->page_shift;
+
+    if (copy_to_user(user_params, &params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params to user\n");
+        goto out_unmap_memory;
+    }
+    bafs_mem_put(mem);
+
+    return ret;
+out_unmap_memory:
+    bafs_ctrl_dma_unmap_mem(ctrl, dma);
+out_put_mem:
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
+
+static long
+__bafs_ctrl_dma_map_mem2(struct bafs_ctrl* ctrl, struct bafs_ctx* ctx, void __user * user_params)
+{
+    long ret = 0;
+
+    struct bafs_mem*                    mem;
+    struct bafs_mem_dma*                dma;
+    struct BAFS_IOC_DMA_MAP_MEM2_PARAMS params;
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        ret = -EINVAL;
+        BAFS_CTRL_ERR("Failed to find bafs_mem obj for dma map\n");
+        goto out;
+    }
+
+    ret = bafs_ctrl_dma_map(ctrl, mem, 0, 0, &dma);
+    if (ret < 0) {
+        goto out_put_mem;
+    }
+
+    ret = bafs_dma_copy_addrs_layout(&dma, 1, &params);
+    if (ret == -ENOSPC) {
+        /* report the table size needed */
+        if (copy_to_user(user_params, &params, sizeof(params)))
+            ret = -EFAULT;
+        goto out_unmap_memory;
+    }
+    if (ret < 0) {
+        goto out_unmap_memory;
+    }
+
+    if (copy_to_user(user_params, &params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params to user\n");
+        goto out_unmap_memory;
+    }
+    bafs_mem_put(mem);
+
+    return ret;
+out_unmap_memory:
+    bafs_ctrl_dma_unmap_mem(ctrl, dma);
+out_put_mem:
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
+
+static long
+__bafs_ctrl_dma_map_mem_extents(struct bafs_ctrl* ctrl, struct bafs_ctx* ctx, void __user * user_params)
+{
+    long ret = 0;
+
+    struct bafs_mem*                           mem;
+    struct bafs_mem_dma*                       dma;
+    struct BAFS_IOC_DMA_MAP_MEM_EXTENTS_PARAMS params;
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        ret = -EINVAL;
+        BAFS_CTRL_ERR("Failed to find bafs_mem obj for dma map\n");
+        goto out;
+    }
+
+    ret = bafs_ctrl_dma_map_mem_extents(ctrl, mem, params.map_gran, 0, 0, &params.n_extents,
+                                        params.extents, &dma);
+    if (ret == -ENOSPC) {
+        /* report the required number of extents */
+        if (copy_to_user(user_params, &params, sizeof(params)))
+            ret = -EFAULT;
+        goto out_put_mem;
+    }
+    if (ret < 0) {
+        goto out_put_mem;
+    }
+
+    if (copy_to_user(user_params, &params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params to user\n");
+        goto out_unmap_memory;
+    }
+    bafs_mem_put(mem);
+
+    return ret;
+out_unmap_memory:
+    bafs_ctrl_dma_unmap_mem(ctrl, dma);
+out_put_mem:
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
+
+
+
+/* the dma api hands out one iova range per sg table, only a translating domain makes it contiguous */
+int bafs_dma_contig_base(struct bafs_mem_dma* dma, dma_addr_t* base)
+{
+    unsigned int         i;
+    dma_addr_t           next;
+    struct scatterlist*  sg;
+    struct device*       dev    = &dma->ctrl->pdev->dev;
+    struct iommu_domain* domain = iommu_get_domain_for_dev(dev);
+
+    if (!domain || !(domain->type & __IOMMU_DOMAIN_DMA_API)) {
+        BAFS_CTRL_ERR("No translating iommu domain for %s, use the per page table\n", dev_name(dev));
+        return -EOPNOTSUPP;
+    }
+
+    if ((dma->mem->loc != BAFS_MEM_CPU) && (dma->mem->loc != BAFS_MEM_USER)) {
+        BAFS_CTRL_ERR("Memory location %u has no contiguous device view\n", dma->mem->loc);
+        return -EOPNOTSUPP;
+    }
+
+    *base = sg_dma_address(dma->sgt.sgl);
+    next  = *base;
+    for_each_sgtable_dma_sg(&dma->sgt, sg, i) {
+        /* segment boundary padding leaves holes the device cannot walk over */
+        if (sg_dma_address(sg) != next) {
+            BAFS_CTRL_ERR("Dma segment %u at %pad is not contiguous\n", i, &next);
+            return -EOPNOTSUPP;
+        }
+        next += sg_dma_len(sg);
+    }
+
+    return 0;
+}
+
+static long
+__bafs_ctrl_dma_map_mem_contig(struct bafs_ctrl* ctrl, struct bafs_ctx* ctx, void __user * user_params)
+{
+    long ret = 0;
+
+    dma_addr_t                               base;
+    struct bafs_mem*                         mem;
+    struct bafs_mem_dma*                     dma;
+    struct BAFS_IOC_DMA_MAP_MEM_CONTIG_PARAMS params;
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        ret = -EINVAL;
+        BAFS_CTRL_ERR("Failed to find bafs_mem obj for dma map\n");
+        goto out;
+    }
+
+    ret = bafs_ctrl_dma_map(ctrl, mem, 0, 0, &dma);
+    if (ret < 0) {
+        goto out_put_mem;
+    }
+
+    ret = bafs_dma_contig_base(dma, &base);
+    if (ret < 0) {
+        goto out_unmap_memory;
+    }
+    params.dma_addr = base;
+    params.len      = dma->mem->n_pages << dma->mem->page_shift;
+
+    if (copy_to_user(user_params, &params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params to user\n");
+        goto out_unmap_memory;
+    }
+
+    BAFS_CTRL_DEBUG("Mapped mem %u contiguously at %pad\n", dma->mem->mem_id, &base);
+    bafs_mem_put(mem);
+    return ret;
+out_unmap_memory:
+    bafs_ctrl_dma_unmap_mem(ctrl, dma);
+out_put_mem:
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
+
+
+static long
+__bafs_ctrl_dma_map_mem_table(struct bafs_ctrl* ctrl, struct bafs_ctx* ctx, void __user * user_params)
+{
+    long ret = 0;
+
+    struct bafs_mem*                         mem;
+    struct bafs_mem_dma*                     dma;
+    struct BAFS_IOC_DMA_MAP_MEM_TABLE_PARAMS params;
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params from user\n");
+        goto out;
+    }
 
-    mem     = bafs_get_mem_with_ctx(vaddr, ctx);
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
     if (!mem) {
         ret = -EINVAL;
         BAFS_CTRL_ERR("Failed to find bafs_mem obj for dma map\n");
         goto out;
     }
 
-
-    *dma_   = kzalloc(sizeof(*dma), GFP_KERNEL);
-    if (!(*dma_)){
-        ret = -ENOMEM;
-        BAFS_CTRL_ERR("Failed to allocate memory for bafs_mem_dma\n");
+    ret = bafs_ctrl_dma_map_table(ctrl, mem, &dma);
+    if (ret < 0) {
         goto out_put_mem;
     }
 
-    dma = *dma_;
-
-
-    bafs_get_ctrl(ctrl);
-
-    INIT_LIST_HEAD(&dma->dma_list);
-
-
-    dma->ctrl = ctrl;
-    dma->mem = mem;
-
-
-
+    params.table_offset = BAFS_MMAP_DMA_TABLE_OFFSET(dma->mem->mem_id + 1, 0);
+    params.table_size   = dma->table_size;
+    params.n_addrs      = dma->table->n_addrs;
+    params.generation   = dma->table->generation;
+    params.page_shift   = dma->mem->page_shift;
+    params.n_ctrls      = 1;
 
+    if (copy_to_user(user_params, &params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params to user\n");
+        goto out_unmap_memory;
+    }
+    bafs_mem_put(mem);
 
-    switch (mem->loc) {
-    case BAFS_MEM_CPU:
-        dma->map_gran = mem->page_size;
-        dma->addrs    = (unsigned long *) kcalloc(mem->n_pages, sizeof(unsigned long *), GFP_KERNEL);
-        if (!dma->addrs) {
-            ret       = -ENOMEM;
-            goto out_delete_dma;
-        }
-        for (i = 0; i < mem->n_pages; i++) {
-            map_gran      = dma->map_gran;
-            if ((i*dma->map_gran) > mem->size) {
-                map_gran -= ((i*dma->map_gran) - mem->size);
-            }
-            dma->addrs[i] = dma_map_single(&dma->ctrl->pdev->dev, page_to_virt(mem->cpu_page_table[i]), map_gran, DMA_BIDIRECTIONAL);
-            if (dma_mapping_error(&dma->ctrl->pdev->dev, dma->addrs[i])) {
-                ret       = -EFAULT;
-                goto out_unmap;
-            }
-        }
-        if (ctrl_id      == 0)
-            *n_dma_addrs  = mem->n_pages;
-        else
-            *n_dma_addrs += mem->n_pages;
+    return ret;
+out_unmap_memory:
+    bafs_ctrl_dma_unmap_mem(ctrl, dma);
+out_put_mem:
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
 
 
-        if (copy_to_user(dma_addrs_user, dma->addrs, (mem->n_pages)*sizeof(unsigned long))) {
-            ret = -EFAULT;
-            BAFS_CTRL_ERR("Failed to copy %u dma addrs to user\n", *n_dma_addrs);
-            goto out_unmap;
-        }
+static long
+__bafs_ctrl_dma_map_mem_range(struct bafs_ctrl* ctrl, struct bafs_ctx* ctx, void __user * user_params)
+{
+    long ret = 0;
 
-        break;
-    case BAFS_MEM_CUDA:
-        ret      = nvidia_p2p_dma_map_pages(ctrl->pdev, mem->cuda_page_table, &dma->cuda_mapping);
-        if (ret != 0) {
-            BAFS_CTRL_ERR("nvidia_p2p_dma_map_pages failed \t ret = %d\n", ret);
-            goto out_delete_dma;
-        }
-        if (ctrl_id      == 0)
-            *n_dma_addrs  = dma->cuda_mapping->entries;
-        else
-            *n_dma_addrs += dma->cuda_mapping->entries;
+    struct bafs_mem*                        mem;
+    struct bafs_mem_dma*                    dma;
+    struct BAFS_IOC_DMA_MAP_MEM_RANGE_PARAMS params;
 
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params from user\n");
+        goto out;
+    }
 
-        if (copy_to_user(dma_addrs_user, dma->cuda_mapping->dma_addresses, (dma->cuda_mapping->entries)*sizeof(unsigned long))) {
-            ret = -EFAULT;
-            BAFS_CTRL_ERR("Failed to copy dma addrs to user\n");
-            goto out_unmap;
-        }
-        break;
-    default:
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
         ret = -EINVAL;
-        goto out_delete_dma;
-        break;
-
+        BAFS_CTRL_ERR("Failed to find bafs_mem obj for dma map\n");
+        goto out;
     }
-    spin_lock(&mem->lock);
-    list_add(&dma->dma_list, &mem->dma_list);
-    spin_unlock(&mem->lock);
 
-    ret = 0;
-    return ret;
-
-out_unmap:
-    if (mem->loc == BAFS_MEM_CPU) {
-        for (i    = i - 1; i >= 0; i--)
-            dma_unmap_single(&dma->ctrl->pdev->dev, dma->addrs[i], dma->map_gran, DMA_BIDIRECTIONAL);
+    ret = bafs_ctrl_dma_map_mem_extents(ctrl, mem, params.map_gran, params.offset, params.len,
+                                        &params.n_extents, params.extents, &dma);
+    if (ret == -ENOSPC) {
+        /* report the required number of extents */
+        if (copy_to_user(user_params, &params, sizeof(params)))
+            ret = -EFAULT;
+        goto out_put_mem;
     }
-    else if(mem->loc == BAFS_MEM_CUDA) {
-        nvidia_p2p_dma_unmap_pages(dma->ctrl->pdev, mem->cuda_page_table, dma->cuda_mapping);
+    if (ret < 0) {
+        goto out_put_mem;
     }
-out_delete_dma:
-
 
-    kfree(dma);
+    if (copy_to_user(user_params, &params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params to user\n");
+        goto out_unmap_memory;
+    }
+    bafs_mem_put(mem);
 
-    bafs_ctrl_release(ctrl);
+    return ret;
+out_unmap_memory:
+    bafs_ctrl_dma_unmap_mem(ctrl, dma);
 out_put_mem:
     bafs_mem_put(mem);
-
-
 out:
     return ret;
-
-} 
-
-void
-bafs_ctrl_dma_unmap_mem(struct bafs_mem_dma* dma)
-{
-    struct bafs_mem* mem = dma->mem;
-    spin_lock(&mem->lock);
-    unmap_dma(dma);
-    spin_unlock(&mem->lock);
-    bafs_mem_put(mem);
 }
 
 static long
-__bafs_ctrl_dma_map_mem(struct bafs_ctrl* ctrl, struct bafs_ctx* ctx, void __user * user_params)
+__bafs_ctrl_dma_map_mem_hnd(struct bafs_ctrl* ctrl, struct bafs_ctx* ctx, void __user * user_params)
 {
     long ret = 0;
 
+    struct bafs_mem*                        mem;
     struct bafs_mem_dma*                    dma;
-    struct BAFS_IOC_DMA_MAP_MEM_PARAMS params;
+    struct BAFS_IOC_DMA_MAP_MEM_HND_PARAMS  params;
 
     if (copy_from_user(&params, user_params, sizeof(params))) {
         ret = -EFAULT;
@@ -238,25 +1682,88 @@ __bafs_ctrl_dma_map_mem(struct bafs_ctrl* ctrl, struct bafs_ctx* ctx, void __use
         goto out;
     }
 
-    ret = bafs_ctrl_dma_map_mem(ctrl, ctx, params.vaddr, &params.n_dma_addrs, params.dma_addrs, &dma, 0);
-    if (ret < 0) {
+    mem = bafs_get_mem_by_handle(params.handle, ctx);
+    if (!mem) {
+        ret = -ENOENT;
+        BAFS_CTRL_ERR("No live registration for handle %u\n", params.handle);
         goto out;
     }
 
+    ret = bafs_ctrl_dma_map_mem_extents(ctrl, mem, params.map_gran, params.offset, params.len,
+                                        &params.n_extents, params.extents, &dma);
+    if (ret == -ENOSPC) {
+        /* report the required number of extents */
+        if (copy_to_user(user_params, &params, sizeof(params)))
+            ret = -EFAULT;
+        goto out_put_mem;
+    }
+    if (ret < 0) {
+        goto out_put_mem;
+    }
+
     if (copy_to_user(user_params, &params, sizeof(params))) {
         ret = -EFAULT;
         BAFS_CTRL_ERR("Failed to copy params to user\n");
         goto out_unmap_memory;
     }
-
+    bafs_mem_put(mem);
 
     return ret;
 out_unmap_memory:
-    bafs_ctrl_dma_unmap_mem(dma);
+    bafs_ctrl_dma_unmap_mem(ctrl, dma);
+out_put_mem:
+    bafs_mem_put(mem);
 out:
     return ret;
 }
 
+static long
+__bafs_ctrl_dma_unmap_mem(struct bafs_ctrl* ctrl, struct bafs_ctx* ctx, void __user * user_params)
+{
+    long ret = 0;
+
+    struct bafs_mem*                     mem;
+    struct BAFS_IOC_DMA_UNMAP_MEM_PARAMS params;
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        BAFS_CTRL_ERR("Failed to copy params from user\n");
+        return -EFAULT;
+    }
+
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        BAFS_CTRL_ERR("Failed to find bafs_mem obj for dma unmap\n");
+        return -EINVAL;
+    }
+
+    ret = bafs_ctrl_dma_unmap_range(ctrl, mem, params.offset, params.len);
+    bafs_mem_put(mem);
+    return ret;
+}
+
+static long
+__bafs_ctrl_dma_unmap_mem_hnd(struct bafs_ctrl* ctrl, struct bafs_ctx* ctx, void __user * user_params)
+{
+    long ret = 0;
+
+    struct bafs_mem*                         mem;
+    struct BAFS_IOC_DMA_UNMAP_MEM_HND_PARAMS params;
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        BAFS_CTRL_ERR("Failed to copy params from user\n");
+        return -EFAULT;
+    }
+
+    mem = bafs_get_mem_by_handle(params.handle, ctx);
+    if (!mem) {
+        BAFS_CTRL_ERR("No live registration for handle %u\n", params.handle);
+        return -ENOENT;
+    }
+
+    ret = bafs_ctrl_dma_unmap_range(ctrl, mem, params.offset, params.len);
+    bafs_mem_put(mem);
+    return ret;
+}
 
 
 static long
@@ -268,6 +1775,7 @@ bafs_ctrl_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
     void __user*      argp = (void __user*) arg;
     struct bafs_ctrl* ctrl;
     struct bafs_ctx* ctx;
+    nodemask_t        nodes = NODE_MASK_NONE;
 
     struct bafs_ctrl_ctx* ctrl_ctx = file->private_data;
 
@@ -276,9 +1784,9 @@ bafs_ctrl_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
         goto out;
     }
 
+    /* the open file holds a ctrl reference for as long as the ioctl runs */
     ctrl = ctrl_ctx->ctrl;
     ctx = ctrl_ctx->ctx;
-    bafs_get_ctrl(ctrl);
 
     BAFS_CTRL_DEBUG("IOCTL called \t cmd = %u\n", cmd);
 
@@ -287,12 +1795,17 @@ bafs_ctrl_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
         ret = -EINVAL;
 
         BAFS_CTRL_ERR("Invalid IOCTL commad type  = %u\n", _IOC_TYPE(cmd));
-        goto out_release_ctrl;
+        goto out;
     }
 
+    bafs_stats_add(ctx, NULL, BAFS_STAT_IOCTLS, 1);
+
     switch (cmd) {
     case BAFS_CTRL_IOC_REG_MEM:
-        ret = bafs_core_reg_mem(argp, ctx);
+    case BAFS_CTRL_IOC_REG_MEM2:
+        bafs_ctrl_get_nodes(ctrl, &nodes);
+        ret = bafs_core_reg_mem(argp, (cmd == BAFS_CTRL_IOC_REG_MEM2) ? BAFS_REG_MEM_V2 : BAFS_REG_MEM_V1,
+                                ctx, &nodes, ctrl->cmb_size ? ctrl->pdev : NULL);
         if (ret < 0) {
             BAFS_CTRL_ERR("IOCTL to register memory failed\n");
             goto out;
@@ -302,19 +1815,108 @@ bafs_ctrl_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
         ret = __bafs_ctrl_dma_map_mem(ctrl, ctx, argp);
         if (ret < 0) {
             BAFS_CTRL_ERR("IOCTL to dma map memory failed\n");
-            goto out_release_ctrl;
+            goto out;
+        }
+        break;
+    case BAFS_CTRL_IOC_DMA_MAP_MEM_EXTENTS:
+        ret = __bafs_ctrl_dma_map_mem_extents(ctrl, ctx, argp);
+        if (ret < 0) {
+            BAFS_CTRL_ERR("IOCTL to dma map memory extents failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_CTRL_IOC_DMA_MAP_MEM_RANGE:
+        ret = __bafs_ctrl_dma_map_mem_range(ctrl, ctx, argp);
+        if (ret < 0) {
+            BAFS_CTRL_ERR("IOCTL to dma map memory range failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_CTRL_IOC_DMA_UNMAP_MEM:
+        ret = __bafs_ctrl_dma_unmap_mem(ctrl, ctx, argp);
+        if (ret < 0) {
+            BAFS_CTRL_ERR("IOCTL to dma unmap memory failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_CTRL_IOC_DMA_MAP_MEM_HND:
+        ret = __bafs_ctrl_dma_map_mem_hnd(ctrl, ctx, argp);
+        if (ret < 0) {
+            BAFS_CTRL_ERR("IOCTL to dma map memory by handle failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_CTRL_IOC_DMA_UNMAP_MEM_HND:
+        ret = __bafs_ctrl_dma_unmap_mem_hnd(ctrl, ctx, argp);
+        if (ret < 0) {
+            BAFS_CTRL_ERR("IOCTL to dma unmap memory by handle failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_CTRL_IOC_DMA_MAP_MEM2:
+        ret = __bafs_ctrl_dma_map_mem2(ctrl, ctx, argp);
+        if (ret < 0) {
+            BAFS_CTRL_ERR("IOCTL to dma map memory failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_CTRL_IOC_DMA_SYNC_MEM:
+        ret = bafs_ctrl_dma_sync_mem(&ctrl, 1, ctx, argp);
+        if (ret < 0) {
+            BAFS_CTRL_ERR("IOCTL to dma sync memory failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_CTRL_IOC_DEREG_MEM:
+        ret = bafs_core_dereg_mem(argp, ctx);
+        if (ret < 0) {
+            BAFS_CTRL_ERR("IOCTL to deregister memory failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_CTRL_IOC_DMA_MAP_MEM_TABLE:
+        ret = __bafs_ctrl_dma_map_mem_table(ctrl, ctx, argp);
+        if (ret < 0) {
+            BAFS_CTRL_ERR("IOCTL to dma map memory table failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_CTRL_IOC_DMA_MAP_MEM_CONTIG:
+        ret = __bafs_ctrl_dma_map_mem_contig(ctrl, ctx, argp);
+        if (ret < 0) {
+            BAFS_CTRL_ERR("IOCTL to dma map memory contiguously failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_CTRL_IOC_EXPORT_DMABUF:
+        ret = bafs_core_export_dmabuf(argp, ctx);
+        if (ret < 0) {
+            BAFS_CTRL_ERR("IOCTL to export dma-buf failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_CTRL_IOC_PREFAULT_MEM:
+        ret = bafs_core_prefault_mem(argp, ctx);
+        if (ret < 0) {
+            BAFS_CTRL_ERR("IOCTL to prefault memory failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_CTRL_IOC_CREATE_QP:
+        ret = bafs_ctrl_create_qp(ctrl, ctrl_ctx, argp);
+        if (ret < 0) {
+            BAFS_CTRL_ERR("IOCTL to create io queue pair failed\n");
+            goto out;
         }
         break;
     default:
         ret                                     = -EINVAL;
         BAFS_CTRL_ERR("Invalid IOCTL cmd \t cmd = %u\n", cmd);
-        goto out_release_ctrl;
+        goto out;
         break;
     }
 
     ret = 0;
-out_release_ctrl:
-    bafs_ctrl_release(ctrl);
 out:
     return ret;
 }
@@ -333,7 +1935,11 @@ bafs_ctrl_open(struct inode* inode, struct file* file)
         ret = -EINVAL;
         goto out;
     }
-    bafs_get_ctrl(ctrl);
+    /* a removed controller keeps its node until the last file is closed */
+    if (!percpu_ref_tryget_live(&ctrl->ref)) {
+        ret = -ENODEV;
+        goto out;
+    }
 
     ctrl_ctx = kzalloc(sizeof(*ctrl_ctx), GFP_KERNEL);
     if(ctrl_ctx == NULL) {
@@ -341,14 +1947,16 @@ bafs_ctrl_open(struct inode* inode, struct file* file)
         goto out_put_ctrl;
     }
 
-    ctx = bafs_get_ctx();
+    ctx = bafs_alloc_ctx(ctrl, NULL);
     if (ctx == NULL) {
-        ret = -EINVAL;
+        ret = -ENOMEM;
         goto out_free_ctrl_ctx;
     }
 
     ctrl_ctx->ctrl = ctrl;
     ctrl_ctx->ctx = ctx;
+    spin_lock_init(&ctrl_ctx->qp_lock);
+    INIT_LIST_HEAD(&ctrl_ctx->qp_list);
 
     file->private_data = ctrl_ctx;
     return ret;
@@ -366,8 +1974,6 @@ bafs_ctrl_file_release(struct inode* inode, struct file* file)
 {
     int ret = 0;
     struct bafs_ctx* ctx;
-    struct bafs_mem*      mem;
-    struct bafs_mem*      next;
     struct bafs_ctrl_ctx* ctrl_ctx = (struct bafs_ctrl_ctx*) file->private_data;
 
     if (!ctrl_ctx) {
@@ -376,28 +1982,9 @@ bafs_ctrl_file_release(struct inode* inode, struct file* file)
     }
 
     ctx = ctrl_ctx->ctx;
-    spin_lock(&ctx->lock);
-    list_for_each_entry_safe(mem, next, &ctx->mem_list, mem_list) {
-        spin_lock(&mem->lock);
-        if (mem->state == STALE) {
-
-            list_del_init(&mem->mem_list);
-
-            xa_erase(&ctx->bafs_mem_xa, mem->mem_id);
-            BAFS_CTRL_DEBUG("Deleting Stale mem registeration\n");
-            spin_unlock(&mem->lock);
-            kfree_rcu(mem, rh);
-            bafs_put_ctx(ctx);
-
-        }
-        else {
-            spin_unlock(&mem->lock);
-        }
-
-
-    }
-
-    spin_unlock(&ctx->lock);
+    /* the queues go first, they may hold registrations of the ctx */
+    bafs_ctrl_destroy_qps(ctrl_ctx->ctrl, ctrl_ctx);
+    bafs_mem_drop_stale(ctx);
 
     bafs_put_ctx(ctx);
     BAFS_CTRL_DEBUG("Closed core and cleaned ctx\n");
@@ -424,6 +2011,11 @@ bafs_ctrl_mmap(struct bafs_ctrl* ctrl, struct vm_area_struct* vma, const unsigne
         ret = -EINVAL;
         goto out;
     }
+    /* the driver owns the admin queue, processes only see their own doorbells */
+    if (ctrl->admin) {
+        ret = -EPERM;
+        goto out;
+    }
     bafs_get_ctrl(ctrl);
     vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
     *map_size         = pci_resource_len(ctrl->pdev, 0);
@@ -466,6 +2058,25 @@ __bafs_ctrl_mmap(struct file* file, struct vm_area_struct* vma)
 
     }
 
+    else if (((u64) vma->vm_pgoff << PAGE_SHIFT) & BAFS_MMAP_DMA_TABLE) {
+        /* a controller fd only has table 0 */
+        if (BAFS_MMAP_DMA_TABLE_CTRL((u64) vma->vm_pgoff << PAGE_SHIFT) != 0) {
+            ret = -EINVAL;
+            goto out;
+        }
+        ret = bafs_ctrl_mmap_dma_table(ctrl, ctx, vma);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    else if (((u64) vma->vm_pgoff << PAGE_SHIFT) & BAFS_MMAP_QP) {
+        ret = bafs_ctrl_mmap_qp(ctrl, ctrl_ctx, vma);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     else {
         ret = pin_bafs_mem(vma, ctx);
         if (ret < 0) {
@@ -488,6 +2099,69 @@ struct file_operations bafs_ctrl_fops = {
 
 };
 
+/*
+ * Find the controller memory buffer and hand it to the p2pdma allocator,
+ * following the nvme driver. A controller without a usable CMB is not an
+ * error, it just cannot back BAFS_MEM_CMB registrations.
+ */
+static void
+bafs_ctrl_map_cmb(struct bafs_ctrl * ctrl)
+{
+    struct pci_dev* pdev = ctrl->pdev;
+    void __iomem*   bar;
+    u64             cap;
+    u32             cmbsz;
+    u32             cmbloc;
+    u64             size;
+    u64             offset;
+    resource_size_t bar_size;
+    int             bir;
+
+    bar = pci_iomap(pdev, 0, NVME_REG_CMBMSC + sizeof(u64));
+    if (!bar)
+        return;
+
+    cap = lo_hi_readq(bar + NVME_REG_CAP);
+    /* NVMe 1.4 controllers only report the CMB once CMBMSC.CRE is set */
+    if (NVME_CAP_CMBS(cap))
+        writel(NVME_CMBMSC_CRE, bar + NVME_REG_CMBMSC);
+
+    cmbsz = readl(bar + NVME_REG_CMBSZ);
+    if (!cmbsz)
+        goto out_unmap;
+    cmbloc = readl(bar + NVME_REG_CMBLOC);
+
+    size     = 1ULL << (12 + 4 * ((cmbsz >> NVME_CMBSZ_SZU_SHIFT) & NVME_CMBSZ_SZU_MASK));
+    offset   = size * NVME_CMB_OFST(cmbloc);
+    size    *= (cmbsz >> NVME_CMBSZ_SZ_SHIFT) & NVME_CMBSZ_SZ_MASK;
+    bir      = NVME_CMB_BIR(cmbloc);
+    bar_size = pci_resource_len(pdev, bir);
+
+    if (offset > bar_size)
+        goto out_unmap;
+
+    if (NVME_CAP_CMBS(cap))
+        hi_lo_writeq(NVME_CMBMSC_CRE | NVME_CMBMSC_CMSE | (pci_bus_address(pdev, bir) + offset),
+                     bar + NVME_REG_CMBMSC);
+
+    size = min_t(u64, size, bar_size - offset);
+
+    if (pci_p2pdma_add_resource(pdev, bir, size, offset)) {
+        BAFS_CTRL_DEBUG("Failed to add cmb of ctrl %d to p2pdma\n", ctrl->ctrl_id);
+        goto out_unmap;
+    }
+    ctrl->cmb_size = size;
+
+    /* peers may only use it for data if the controller serves both reads and writes from it */
+    if ((cmbsz & (NVME_CMBSZ_WDS | NVME_CMBSZ_RDS)) == (NVME_CMBSZ_WDS | NVME_CMBSZ_RDS))
+        pci_p2pmem_publish(pdev, true);
+
+    BAFS_CTRL_INFO("Ctrl %d has a %llu byte cmb in BAR%d\n", ctrl->ctrl_id, size, bir);
+
+out_unmap:
+    pci_iounmap(pdev, bar);
+}
+
 int
 bafs_ctrl_alloc(struct bafs_ctrl ** out, struct pci_dev * pdev, int bafs_major,
                 struct device * bafs_core_device)
@@ -510,6 +2184,7 @@ bafs_ctrl_alloc(struct bafs_ctrl ** out, struct pci_dev * pdev, int bafs_major,
     pci_disable_msi(pdev);
     pci_disable_msix(pdev);
     dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64));
+    dma_set_max_seg_size(&pdev->dev, 0xffffffff);
 
     ret = pci_request_region(pdev, 0, BAFS_CTRL_CLASS_NAME);
     if (ret < 0) {
@@ -540,24 +2215,42 @@ bafs_ctrl_alloc(struct bafs_ctrl ** out, struct pci_dev * pdev, int bafs_major,
     }
     ctrl->ctrl_id = ret;
 
+    ret = bafs_ctrl_admin_init(ctrl);
+    if(ret < 0) {
+        goto out_ctrl_id_put;
+    }
+
+    ret = bafs_stats_alloc(&ctrl->stats);
+    if(ret < 0) {
+        goto out_admin_fini;
+    }
+
+    /* live before the node exists, open only takes references on a live ctrl */
+    INIT_WORK(&ctrl->release_work, bafs_ctrl_release_work);
+    ret = percpu_ref_init(&ctrl->ref, __bafs_ctrl_release, 0, GFP_KERNEL);
+    if(ret < 0) {
+        goto out_free_stats;
+    }
+
     cdev_init(&ctrl->cdev, &bafs_ctrl_fops);
     ctrl->cdev.owner = THIS_MODULE;
 
     ret = cdev_add(&ctrl->cdev, MKDEV(ctrl->major, ctrl->minor), 1);
     if(ret < 0) {
-        goto out_ctrl_id_put;
+        goto out_exit_ref;
     }
 
     ctrl->core_dev = get_device(bafs_core_device);
-    ctrl->device = device_create(bafs_ctrl_class, bafs_core_device,
-                                 MKDEV(ctrl->major, ctrl->minor),
-                                 ctrl, BAFS_CTRL_DEVICE_NAME, ctrl->ctrl_id);
+    ctrl->device = device_create_with_groups(bafs_ctrl_class, bafs_core_device,
+                                             MKDEV(ctrl->major, ctrl->minor), ctrl,
+                                             bafs_ctrl_groups, BAFS_CTRL_DEVICE_NAME, ctrl->ctrl_id);
     if(IS_ERR(ctrl->device)) {
         ret = PTR_ERR(ctrl->device);
         BAFS_CORE_ERR("Failed to create ctrl device \t err = %d\n", ret);
         goto out_cdev_del;
     }
-    kref_init(&ctrl->ref);
+
+    bafs_ctrl_map_cmb(ctrl);
 
     BAFS_CORE_DEBUG("Created ctrl with id %d major %d minor %d \t err = %d\n", ctrl->ctrl_id, ctrl->major, ctrl->minor, ret);
 
@@ -568,6 +2261,15 @@ out_cdev_del:
     put_device(ctrl->core_dev);
     cdev_del(&ctrl->cdev);
 
+out_exit_ref:
+    percpu_ref_exit(&ctrl->ref);
+
+out_free_stats:
+    bafs_stats_free(&ctrl->stats);
+
+out_admin_fini:
+    bafs_ctrl_admin_fini(ctrl);
+
 out_ctrl_id_put:
     ida_simple_remove(&bafs_ctrl_ida, ctrl->ctrl_id);
 
@@ -0,0 +1,222 @@
+#include <linux/mm.h>
+#include <linux/kernel.h>
+#include <linux/dma-buf.h>
+#include <linux/file.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+
+#include <linux/bafs.h>
+
+#include <linux/bafs/util.h>
+#include <linux/bafs/types.h>
+
+
+MODULE_IMPORT_NS(DMA_BUF);
+
+/* copy the bus addresses of an existing mapping, the pages are not mapped again */
+static
+int bafs_dmabuf_dup_sgt(struct bafs_mem_dma* dma, struct sg_table* sgt)
+{
+    int ret = 0;
+    unsigned int        i;
+    struct scatterlist* src;
+    struct scatterlist* dst;
+
+    ret = sg_alloc_table(sgt, dma->sgt.nents, GFP_KERNEL);
+    if (ret)
+        goto out;
+
+    dst = sgt->sgl;
+    for_each_sgtable_dma_sg(&dma->sgt, src, i) {
+        sg_dma_address(dst) = sg_dma_address(src);
+        sg_dma_len(dst)     = sg_dma_len(src);
+        dst                 = sg_next(dst);
+    }
+out:
+    return ret;
+}
+
+static
+struct sg_table* bafs_dmabuf_map(struct dma_buf_attachment* attach, enum dma_data_direction dir)
+{
+    int ret = 0;
+
+    struct bafs_mem*     mem = attach->dmabuf->priv;
+    struct bafs_mem_dma* dma;
+    struct sg_table*     sgt;
+
+    sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+    if (!sgt) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* a controller the owner already mapped for shares that mapping */
+    dma = bafs_mem_get_dma(mem, attach->dev);
+    if (dma) {
+        ret = bafs_dmabuf_dup_sgt(dma, sgt);
+        if (ret) {
+            bafs_mem_dma_put(dma);
+            goto out_free_sgt;
+        }
+        attach->priv = dma;
+        BAFS_CORE_DEBUG("Reusing dma mapping of mem %u for %s\n", mem->mem_id, dev_name(attach->dev));
+        return sgt;
+    }
+
+    ret = bafs_mem_alloc_sgt(mem, sgt, dma_get_max_seg_size(attach->dev), 0, mem->n_pages);
+    if (ret)
+        goto out_free_sgt;
+
+    ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+    if (ret) {
+        BAFS_CORE_ERR("dma_map_sgtable failed for dma-buf importer \t ret = %d\n", ret);
+        goto out_free_table;
+    }
+
+    return sgt;
+
+out_free_table:
+    sg_free_table(sgt);
+out_free_sgt:
+    kfree(sgt);
+out:
+    return ERR_PTR(ret);
+}
+
+static
+void bafs_dmabuf_unmap(struct dma_buf_attachment* attach, struct sg_table* sgt, enum dma_data_direction dir)
+{
+    if (attach->priv) {
+        bafs_mem_dma_put(attach->priv);
+        attach->priv = NULL;
+    }
+    else {
+        dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+    }
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+static
+int bafs_dmabuf_mmap(struct dma_buf* dmabuf, struct vm_area_struct* vma)
+{
+    int ret = 0;
+
+    struct bafs_mem* mem   = dmabuf->priv;
+    unsigned long    start = vma->vm_pgoff << PAGE_SHIFT;
+    unsigned long    end   = start + (vma->vm_end - vma->vm_start);
+    unsigned long    i;
+    unsigned long    lo;
+    unsigned long    hi;
+
+    if (end > (mem->n_pages << mem->page_shift))
+        return -EINVAL;
+
+    /* remap each page of the region that falls inside the requested window */
+    for (i = start >> mem->page_shift; (i < mem->n_pages) && ((i << mem->page_shift) < end); i++) {
+        lo  = max(start, i << mem->page_shift);
+        hi  = min(end, (i + 1) << mem->page_shift);
+        ret = remap_pfn_range(vma, vma->vm_start + (lo - start),
+                              page_to_pfn(mem->cpu_page_table[i]) + ((lo - (i << mem->page_shift)) >> PAGE_SHIFT),
+                              hi - lo, vma->vm_page_prot);
+        if (ret)
+            break;
+    }
+
+    return ret;
+}
+
+static
+void bafs_dmabuf_release(struct dma_buf* dmabuf)
+{
+    struct bafs_mem* mem = dmabuf->priv;
+
+    BAFS_CORE_DEBUG("Releasing dma-buf of mem %u\n", mem->mem_id);
+    bafs_mem_put(mem);
+}
+
+static const
+struct dma_buf_ops bafs_dmabuf_ops = {
+    .map_dma_buf   = bafs_dmabuf_map,
+    .unmap_dma_buf = bafs_dmabuf_unmap,
+    .mmap          = bafs_dmabuf_mmap,
+    .release       = bafs_dmabuf_release,
+};
+
+long bafs_core_export_dmabuf(void __user* user_params, struct bafs_ctx* ctx)
+{
+    long ret = 0;
+
+    struct bafs_mem*                     mem;
+    struct dma_buf*                      dmabuf;
+    struct BAFS_IOC_EXPORT_DMABUF_PARAMS params;
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CORE_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        ret = -EINVAL;
+        BAFS_CORE_ERR("Failed to find bafs_mem obj for dma-buf export\n");
+        goto out;
+    }
+
+    /* only page backed regions can be handed to other drivers */
+    if ((mem->loc != BAFS_MEM_CPU) && (mem->loc != BAFS_MEM_USER)) {
+        ret = -EINVAL;
+        goto out_put_mem;
+    }
+
+    ret = bafs_mem_populate(mem, 0, mem->n_pages);
+    if (ret)
+        goto out_put_mem;
+
+    exp_info.ops   = &bafs_dmabuf_ops;
+    exp_info.size  = mem->n_pages << mem->page_shift;
+    exp_info.flags = O_RDWR | O_CLOEXEC;
+    exp_info.priv  = mem;
+
+    /* the dma-buf keeps the lookup reference, the pages outlive the bafs mapping */
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf)) {
+        ret = PTR_ERR(dmabuf);
+        BAFS_CORE_ERR("dma_buf_export failed \t ret = %ld\n", ret);
+        goto out_put_mem;
+    }
+
+    /* the fd is only installed once the caller is known to learn it */
+    params.fd = get_unused_fd_flags(O_CLOEXEC);
+    if (params.fd < 0) {
+        ret = params.fd;
+        goto out_put_dmabuf;
+    }
+
+    if (copy_to_user(user_params, &params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CORE_ERR("Failed to copy params to user\n");
+        goto out_put_fd;
+    }
+
+    /* the fd takes over the file reference of the export */
+    fd_install(params.fd, dmabuf->file);
+
+    BAFS_CORE_DEBUG("Exported mem %u as dma-buf fd %d\n", mem->mem_id, params.fd);
+    ret = 0;
+    return ret;
+
+out_put_fd:
+    put_unused_fd(params.fd);
+out_put_dmabuf:
+    /* releasing the dma-buf drops the mem reference */
+    dma_buf_put(dmabuf);
+    goto out;
+out_put_mem:
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
@@ -1,4 +1,7 @@
 #include <linux/cdev.h>
+#include <linux/pci-p2pdma.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 #include <asm/uaccess.h>
 
 #include <linux/bafs.h>
@@ -9,6 +12,46 @@
 static DEFINE_IDA(bafs_group_ida);
 static struct class *   bafs_group_class = NULL;
 
+static bool map_parallel = true;
+module_param(map_parallel, bool, 0644);
+MODULE_PARM_DESC(map_parallel, "Dma map the members of a group in parallel on the bafs_map workqueue");
+
+static struct workqueue_struct* bafs_map_wq = NULL;
+
+static ssize_t stats_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+    struct bafs_group* group = dev_get_drvdata(dev);
+
+    return bafs_stats_emit(&group->stats, buf);
+}
+static DEVICE_ATTR_RO(stats);
+
+static struct attribute* bafs_group_attrs[] = {
+    &dev_attr_stats.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(bafs_group);
+
+struct bafs_group_map_ctl {
+    atomic_t          pending;
+    struct completion done;
+};
+
+struct bafs_group_map_work {
+    struct work_struct         work;
+    struct bafs_group_map_ctl* ctl;
+    struct bafs_ctrl*          ctrl;
+    /* the caller's reference keeps the region alive until every work item is done */
+    struct bafs_mem*           mem;
+    u64                        offset;
+    u64                        len;
+    bool                       table;
+    /* first member of its iova space, followers map after it and reuse its mapping */
+    bool                       leader;
+    struct bafs_mem_dma*       dma;
+    int                        ret;
+};
+
 static
 void __bafs_group_release(struct kref* ref)
 {
@@ -21,7 +64,7 @@ void __bafs_group_release(struct kref* ref)
     group = container_of(ref, struct bafs_group, ref);
     BAFS_GROUP_DEBUG("Removing GROUP \t group: %p\n", group);
 
-    spin_lock(&group->lock);
+    mutex_lock(&group->lock);
     device_destroy(bafs_group_class, MKDEV(group->major, group->minor));
     for (j = 0; j < group->n_ctrls; j++) {
         WARN_ON(group->ctrls[j] == NULL);
@@ -31,12 +74,13 @@ void __bafs_group_release(struct kref* ref)
     }
 
     kfree(group->ctrls);
+    bafs_stats_free(&group->stats);
 
     put_device(group->core_dev);
     cdev_del(&group->cdev);
     ida_simple_remove(&bafs_group_ida, group->group_id);
     bafs_put_minor_number(group->minor);
-    spin_unlock(&group->lock);
+    mutex_unlock(&group->lock);
     BAFS_CTRL_DEBUG("Removed GROUP \t group: %p\n", group);
 
     kfree(group);
@@ -51,13 +95,142 @@ void bafs_put_group(struct bafs_group * group)
 
 
 
+static
+void bafs_group_map_one(struct bafs_group_map_work* w)
+{
+    if (w->table)
+        w->ret = bafs_ctrl_dma_map_table(w->ctrl, w->mem, &w->dma);
+    else
+        w->ret = bafs_ctrl_dma_map(w->ctrl, w->mem, w->offset, w->len, &w->dma);
+}
+
+static
+void bafs_group_map_work_fn(struct work_struct* work)
+{
+    struct bafs_group_map_work* w;
+
+    w = container_of(work, struct bafs_group_map_work, work);
+    bafs_group_map_one(w);
+
+    if (atomic_dec_and_test(&w->ctl->pending))
+        complete(&w->ctl->done);
+}
+
+/* maps either the leaders or the followers, one work item each when there is more than one */
+static
+void bafs_group_map_round(struct bafs_group_map_work* works, const int n, const bool leaders)
+{
+    int i;
+    int nid;
+    int n_round = 0;
+
+    struct bafs_group_map_ctl ctl;
+
+    for (i = 0; i < n; i++) {
+        if (works[i].leader == leaders)
+            n_round++;
+    }
+
+    if ((n_round <= 1) || !map_parallel || !bafs_map_wq) {
+        for (i = 0; i < n; i++) {
+            if (works[i].leader == leaders)
+                bafs_group_map_one(&works[i]);
+        }
+        return;
+    }
+
+    atomic_set(&ctl.pending, n_round);
+    init_completion(&ctl.done);
+
+    for (i = 0; i < n; i++) {
+        if (works[i].leader != leaders)
+            continue;
+        works[i].ctl = &ctl;
+        INIT_WORK(&works[i].work, bafs_group_map_work_fn);
+        /* the sg table and table copy are allocated near the controller that walks them */
+        nid = dev_to_node(&works[i].ctrl->pdev->dev);
+        if (nid != NUMA_NO_NODE)
+            queue_work_node(nid, bafs_map_wq, &works[i].work);
+        else
+            queue_work(bafs_map_wq, &works[i].work);
+    }
+    wait_for_completion(&ctl.done);
+}
+
+/*
+ * Maps the window on every member and fills dmas, all or nothing. Members are
+ * mapped in parallel, except that controllers sharing an iova space wait for
+ * the first of them and take another reference on its mapping.
+ */
+static
+int bafs_group_dma_map_all(struct bafs_group* group, struct bafs_mem* mem, const u64 offset, const u64 len,
+                           const bool table, struct bafs_mem_dma** dmas)
+{
+    int ret = 0;
+    int i;
+    int j;
+
+    struct bafs_group_map_work* works;
+
+    works = kcalloc(group->n_ctrls, sizeof(*works), GFP_KERNEL);
+    if (!works) {
+        ret = -ENOMEM;
+        BAFS_GROUP_ERR("Failed to allocate memory for map work\n");
+        goto out;
+    }
+
+    for (i = 0; i < group->n_ctrls; i++) {
+        works[i].ctrl   = group->ctrls[i];
+        works[i].mem    = mem;
+        works[i].offset = offset;
+        works[i].len    = len;
+        works[i].table  = table;
+        works[i].leader = true;
+        for (j = 0; j < i; j++) {
+            if (bafs_ctrl_same_iova_space(group->ctrls[j], group->ctrls[i])) {
+                works[i].leader = false;
+                break;
+            }
+        }
+    }
+
+    bafs_group_map_round(works, group->n_ctrls, true);
+    for (i = 0; i < group->n_ctrls; i++) {
+        if (works[i].ret < 0)
+            ret = works[i].ret;
+    }
+    if (ret == 0)
+        bafs_group_map_round(works, group->n_ctrls, false);
+
+    for (i = 0; i < group->n_ctrls; i++) {
+        if (works[i].ret < 0) {
+            ret         = works[i].ret;
+            works[i].dma = NULL;
+        }
+        dmas[i] = works[i].dma;
+    }
+
+    if (ret < 0) {
+        BAFS_GROUP_DEBUG("Group dma map failed, rolling back \t ret = %d\n", ret);
+        for (i = 0; i < group->n_ctrls; i++) {
+            if (dmas[i])
+                bafs_ctrl_dma_unmap_mem(group->ctrls[i], dmas[i]);
+            dmas[i] = NULL;
+        }
+    }
+
+    kfree(works);
+out:
+    return ret;
+}
+
 long
 bafs_group_dma_map_mem(struct bafs_group* group, struct bafs_ctx* ctx, void __user* user_params)
 {
     long     ret                  = 0;
     int      i                    = 0;
-    uint64_t n_dma_addrs_per_ctrl = 0;
 
+    struct bafs_mem*                         mem;
     struct bafs_mem_dma**                    dmas;
 
     struct BAFS_IOC_DMA_MAP_MEM_PARAMS params = {0};
@@ -68,47 +241,490 @@ bafs_group_dma_map_mem(struct bafs_group* group, struct bafs_ctx* ctx, void __us
         BAFS_GROUP_ERR("Failed to copy params from user\n");
         goto out;
     }
-    spin_lock(&group->lock);
-    dmas = kzalloc(sizeof(*dmas) * group->n_ctrls, GFP_KERNEL);
+    if (group->n_ctrls == 0) {
+        ret = -EINVAL;
+        goto out;
+    }
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        ret = -EINVAL;
+        BAFS_GROUP_ERR("Failed to find bafs_mem obj for dma map\n");
+        goto out;
+    }
+    mutex_lock(&group->lock);
+    dmas = kcalloc(group->n_ctrls, sizeof(*dmas), GFP_KERNEL);
     if (!dmas) {
         ret = -ENOMEM;
         BAFS_GROUP_ERR("Failed to allocate memory for bafs_mem_dma*\n");
         goto out_unlock;
     }
 
+    ret = bafs_group_dma_map_all(group, mem, 0, 0, false, dmas);
+    if (ret < 0) {
+        goto out_free_dmas;
+    }
 
+    /* worker threads have no user mm, so the addresses are copied out here */
+    params.n_dma_addrs = 0;
     for (i  = 0; i < group->n_ctrls; i++) {
-        ret = bafs_ctrl_dma_map_mem(group->ctrls[i], ctx, params.vaddr, &params.n_dma_addrs, params.dma_addrs + (n_dma_addrs_per_ctrl * i), &dmas[i], i);
+        ret = bafs_dma_copy_addrs(dmas[i], params.dma_addrs + (dmas[0]->n_addrs * i));
         if (ret < 0) {
+            BAFS_GROUP_ERR("Failed to copy %lu dma addrs to user\n", dmas[i]->n_addrs);
             goto out_unmap_mems;
         }
-        if (i                    == 0)
-            n_dma_addrs_per_ctrl = params.n_dma_addrs;
+        params.n_dma_addrs += dmas[i]->n_addrs;
+    }
+    params.page_shift = dmas[0]->mem->page_shift;
+
+
+
+    if (copy_to_user(user_params, &params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_GROUP_ERR("Failed to copy params to user\n");
+        goto out_unmap_mems;
+    }
+    mutex_unlock(&group->lock);
+    kfree(dmas);
+    bafs_mem_put(mem);
+
+
+    return ret;
+out_unmap_mems:
+    for (i = 0; i < group->n_ctrls; i++) {
+        bafs_ctrl_dma_unmap_mem(group->ctrls[i], dmas[i]);
+    }
+out_free_dmas:
+    kfree(dmas);
+out_unlock:
+    mutex_unlock(&group->lock);
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
+
+static long
+bafs_group_dma_map_mem2(struct bafs_group* group, struct bafs_ctx* ctx, void __user* user_params)
+{
+    long ret = 0;
+    int  i;
+
+    struct bafs_mem*                    mem;
+    struct bafs_mem_dma**               dmas;
+
+    struct BAFS_IOC_DMA_MAP_MEM2_PARAMS params = {0};
+
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_GROUP_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+    if (group->n_ctrls == 0) {
+        ret = -EINVAL;
+        goto out;
+    }
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        ret = -EINVAL;
+        BAFS_GROUP_ERR("Failed to find bafs_mem obj for dma map\n");
+        goto out;
+    }
+    mutex_lock(&group->lock);
+    dmas = kcalloc(group->n_ctrls, sizeof(*dmas), GFP_KERNEL);
+    if (!dmas) {
+        ret = -ENOMEM;
+        BAFS_GROUP_ERR("Failed to allocate memory for bafs_mem_dma*\n");
+        goto out_unlock;
     }
 
+    ret = bafs_group_dma_map_all(group, mem, 0, 0, false, dmas);
+    if (ret < 0) {
+        goto out_free_dmas;
+    }
 
+    ret = bafs_dma_copy_addrs_layout(dmas, group->n_ctrls, &params);
+    if (ret == -ENOSPC) {
+        /* report the table size needed before rolling back */
+        if (copy_to_user(user_params, &params, sizeof(params)))
+            ret = -EFAULT;
+        goto out_unmap_mems;
+    }
+    if (ret < 0) {
+        goto out_unmap_mems;
+    }
 
     if (copy_to_user(user_params, &params, sizeof(params))) {
         ret = -EFAULT;
         BAFS_GROUP_ERR("Failed to copy params to user\n");
         goto out_unmap_mems;
     }
-    spin_unlock(&group->lock);
+    mutex_unlock(&group->lock);
+    kfree(dmas);
+    bafs_mem_put(mem);
 
 
     return ret;
 out_unmap_mems:
-    for (i = i - 1; i >= 0; i--) {
-        bafs_ctrl_dma_unmap_mem(dmas[i]);
+    for (i = 0; i < group->n_ctrls; i++) {
+        bafs_ctrl_dma_unmap_mem(group->ctrls[i], dmas[i]);
     }
-//out_free_mem:
+out_free_dmas:
     kfree(dmas);
 out_unlock:
-    spin_unlock(&group->lock);
+    mutex_unlock(&group->lock);
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
+
+/* maps the window on every member and writes the per-controller capacity used, or needed on -ENOSPC, to n_extents_out */
+static long
+__bafs_group_dma_map_extents(struct bafs_group* group, struct bafs_mem* mem, unsigned map_gran,
+                             const u64 offset, const u64 len, const __u32 capacity, __u32 __user* n_extents_out,
+                             struct bafs_dma_extent __user* extents, __u32 __user* n_ctrl_extents)
+{
+    long  ret       = 0;
+    long  ret_i;
+    int   i         = 0;
+    __u32 n_extents = 0;
+    __u32 max_extents = 0;
+
+    struct bafs_mem_dma**                      dmas;
+
+
+    if (map_gran & ~PAGE_MASK) {
+        BAFS_GROUP_ERR("Invalid map granularity %u\n", map_gran);
+        return -EINVAL;
+    }
+
+    mutex_lock(&group->lock);
+    dmas = kcalloc(group->n_ctrls, sizeof(*dmas), GFP_KERNEL);
+    if (!dmas) {
+        ret = -ENOMEM;
+        BAFS_GROUP_ERR("Failed to allocate memory for bafs_mem_dma*\n");
+        goto out_unlock;
+    }
+
+    ret = bafs_group_dma_map_all(group, mem, offset, len, false, dmas);
+    if (ret < 0) {
+        goto out_free_dmas;
+    }
+
+    /* controller i writes its extents at extents + (capacity * i), every member is measured even if one overflows */
+    for (i  = 0; i < group->n_ctrls; i++) {
+        n_extents = capacity;
+        ret_i = bafs_dma_copy_extents(dmas[i], map_gran, &n_extents, extents + ((unsigned long) capacity * i));
+        if ((ret_i < 0) && (ret_i != -ENOSPC)) {
+            ret = ret_i;
+            goto out_unmap_mems;
+        }
+        if (ret_i == -ENOSPC)
+            ret = ret_i;
+        max_extents = max(max_extents, n_extents);
+
+        if ((ret == 0) && n_ctrl_extents && put_user(n_extents, n_ctrl_extents + i)) {
+            ret = -EFAULT;
+            goto out_unmap_mems;
+        }
+    }
+
+    if (put_user(max_extents, n_extents_out)) {
+        ret = -EFAULT;
+        BAFS_GROUP_ERR("Failed to copy n_extents to user\n");
+        goto out_unmap_mems;
+    }
+    /* the capacity needed is reported, nothing stays mapped */
+    if (ret == -ENOSPC) {
+        goto out_unmap_mems;
+    }
+    mutex_unlock(&group->lock);
+    kfree(dmas);
+
+
+    return ret;
+out_unmap_mems:
+    for (i = 0; i < group->n_ctrls; i++) {
+        bafs_ctrl_dma_unmap_mem(group->ctrls[i], dmas[i]);
+    }
+out_free_dmas:
+    kfree(dmas);
+out_unlock:
+    mutex_unlock(&group->lock);
+    return ret;
+}
+
+long
+bafs_group_dma_map_mem_extents(struct bafs_group* group, struct bafs_ctx* ctx, void __user* user_params)
+{
+    long ret = 0;
+
+    struct bafs_mem*                         mem;
+    struct BAFS_IOC_DMA_MAP_MEM_EXTENTS_PARAMS params = {0};
+
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_GROUP_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        ret = -EINVAL;
+        BAFS_GROUP_ERR("Failed to find bafs_mem obj for dma map\n");
+        goto out;
+    }
+
+    ret = __bafs_group_dma_map_extents(group, mem, params.map_gran, 0, 0, params.n_extents,
+                                       &((struct BAFS_IOC_DMA_MAP_MEM_EXTENTS_PARAMS __user*) user_params)->n_extents,
+                                       params.extents, params.n_ctrl_extents);
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
+
+static long
+bafs_group_dma_map_mem_range(struct bafs_group* group, struct bafs_ctx* ctx, void __user* user_params)
+{
+    long ret = 0;
+
+    struct bafs_mem*                         mem;
+    struct BAFS_IOC_DMA_MAP_MEM_RANGE_PARAMS params = {0};
+
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_GROUP_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        ret = -EINVAL;
+        BAFS_GROUP_ERR("Failed to find bafs_mem obj for dma map\n");
+        goto out;
+    }
+
+    ret = __bafs_group_dma_map_extents(group, mem, params.map_gran, params.offset, params.len,
+                                       params.n_extents,
+                                       &((struct BAFS_IOC_DMA_MAP_MEM_RANGE_PARAMS __user*) user_params)->n_extents,
+                                       params.extents, params.n_ctrl_extents);
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
+
+static long
+bafs_group_dma_map_mem_hnd(struct bafs_group* group, struct bafs_ctx* ctx, void __user* user_params)
+{
+    long ret = 0;
+
+    struct bafs_mem*                       mem;
+    struct BAFS_IOC_DMA_MAP_MEM_HND_PARAMS params = {0};
+
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_GROUP_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+
+    mem = bafs_get_mem_by_handle(params.handle, ctx);
+    if (!mem) {
+        ret = -ENOENT;
+        BAFS_GROUP_ERR("No live registration for handle %u\n", params.handle);
+        goto out;
+    }
+
+    ret = __bafs_group_dma_map_extents(group, mem, params.map_gran, params.offset, params.len,
+                                       params.n_extents,
+                                       &((struct BAFS_IOC_DMA_MAP_MEM_HND_PARAMS __user*) user_params)->n_extents,
+                                       params.extents, params.n_ctrl_extents);
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
+
+/* members without a matching window are skipped, the others are still unmapped */
+static long
+__bafs_group_dma_unmap(struct bafs_group* group, struct bafs_mem* mem, const u64 offset, const u64 len)
+{
+    long ret    = 0;
+    long ret_i;
+    int  i;
+    int  n_found = 0;
+
+    for (i = 0; i < group->n_ctrls; i++) {
+        ret_i = bafs_ctrl_dma_unmap_range(group->ctrls[i], mem, offset, len);
+        if (ret_i == 0)
+            n_found++;
+        else if (ret_i != -ENOENT)
+            ret = ret_i;
+    }
+
+    if ((ret == 0) && (n_found == 0))
+        ret = -ENOENT;
+    return ret;
+}
+
+static long
+bafs_group_dma_unmap_mem(struct bafs_group* group, struct bafs_ctx* ctx, void __user* user_params)
+{
+    long ret = 0;
+
+    struct bafs_mem*                     mem;
+    struct BAFS_IOC_DMA_UNMAP_MEM_PARAMS params;
+
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        BAFS_GROUP_ERR("Failed to copy params from user\n");
+        return -EFAULT;
+    }
+
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        BAFS_GROUP_ERR("Failed to find bafs_mem obj for dma unmap\n");
+        return -EINVAL;
+    }
+
+    ret = __bafs_group_dma_unmap(group, mem, params.offset, params.len);
+    bafs_mem_put(mem);
+    return ret;
+}
+
+static long
+bafs_group_dma_unmap_mem_hnd(struct bafs_group* group, struct bafs_ctx* ctx, void __user* user_params)
+{
+    long ret = 0;
+
+    struct bafs_mem*                         mem;
+    struct BAFS_IOC_DMA_UNMAP_MEM_HND_PARAMS params;
+
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        BAFS_GROUP_ERR("Failed to copy params from user\n");
+        return -EFAULT;
+    }
+
+    mem = bafs_get_mem_by_handle(params.handle, ctx);
+    if (!mem) {
+        BAFS_GROUP_ERR("No live registration for handle %u\n", params.handle);
+        return -ENOENT;
+    }
+
+    ret = __bafs_group_dma_unmap(group, mem, params.offset, params.len);
+    bafs_mem_put(mem);
+    return ret;
+}
+
+/* the member list is fixed for the lifetime of the group and the caller holds a reference */
+static long
+bafs_group_dma_map_mem_table(struct bafs_group* group, struct bafs_ctx* ctx, void __user* user_params)
+{
+    long ret = 0;
+    int  i   = 0;
+
+    struct bafs_mem*                         mem;
+    struct bafs_mem_dma**                    dmas;
+
+    struct BAFS_IOC_DMA_MAP_MEM_TABLE_PARAMS params = {0};
+
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_GROUP_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+    if (group->n_ctrls == 0) {
+        ret = -EINVAL;
+        goto out;
+    }
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        ret = -EINVAL;
+        BAFS_GROUP_ERR("Failed to find bafs_mem obj for dma map\n");
+        goto out;
+    }
+    dmas = kcalloc(group->n_ctrls, sizeof(*dmas), GFP_KERNEL);
+    if (!dmas) {
+        ret = -ENOMEM;
+        BAFS_GROUP_ERR("Failed to allocate memory for bafs_mem_dma*\n");
+        goto out_put_mem;
+    }
+
+
+    /* every member gets its own table, all of them have the same length */
+    mutex_lock(&group->lock);
+    ret = bafs_group_dma_map_all(group, mem, 0, 0, true, dmas);
+    if (ret < 0) {
+        goto out_free_dmas;
+    }
+    for (i  = 0; i < group->n_ctrls; i++)
+        params.generation = max(params.generation, dmas[i]->table->generation);
+    /* one generation for the set so a single value tells if any member changed */
+    for (i = 0; i < group->n_ctrls; i++)
+        WRITE_ONCE(dmas[i]->table->generation, params.generation);
+
+    params.table_offset = BAFS_MMAP_DMA_TABLE_OFFSET(dmas[0]->mem->mem_id + 1, 0);
+    params.table_size   = dmas[0]->table_size;
+    params.n_addrs      = dmas[0]->table->n_addrs;
+    params.page_shift   = dmas[0]->mem->page_shift;
+    params.n_ctrls      = group->n_ctrls;
+
+    if (copy_to_user(user_params, &params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_GROUP_ERR("Failed to copy params to user\n");
+        goto out_unmap_mems;
+    }
+    mutex_unlock(&group->lock);
+    kfree(dmas);
+    bafs_mem_put(mem);
+
+
+    return ret;
+out_unmap_mems:
+    for (i = 0; i < group->n_ctrls; i++) {
+        bafs_ctrl_dma_unmap_mem(group->ctrls[i], dmas[i]);
+    }
+out_free_dmas:
+    mutex_unlock(&group->lock);
+    kfree(dmas);
+out_put_mem:
+    bafs_mem_put(mem);
 out:
     return ret;
 }
 
+/* prefer a member's own CMB, otherwise any published p2pmem every member can reach */
+static struct pci_dev*
+bafs_group_find_cmb(struct bafs_group* group)
+{
+    int              i;
+    struct device**  clients;
+    struct pci_dev*  provider = NULL;
+
+    clients = kcalloc(group->n_ctrls, sizeof(*clients), GFP_KERNEL);
+    if (!clients)
+        return NULL;
+
+    for (i = 0; i < group->n_ctrls; i++)
+        clients[i] = &group->ctrls[i]->pdev->dev;
+
+    for (i = 0; i < group->n_ctrls; i++) {
+        if (group->ctrls[i]->cmb_size &&
+            (pci_p2pdma_distance_many(group->ctrls[i]->pdev, clients, group->n_ctrls, false) >= 0)) {
+            provider = pci_dev_get(group->ctrls[i]->pdev);
+            break;
+        }
+    }
+
+    if (!provider)
+        provider = pci_p2pmem_find_many(clients, group->n_ctrls);
+
+    kfree(clients);
+    return provider;
+}
+
 static long
 bafs_group_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
 {
@@ -117,6 +733,12 @@ bafs_group_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
     void __user*      argp = (void __user*) arg;
     struct bafs_group* group;
     struct bafs_ctx* ctx;
+    nodemask_t         nodes = NODE_MASK_NONE;
+    int                i;
+    struct pci_dev*    provider;
+    __u32              loc;
+    __u32 __user*      uloc;
+    unsigned int       version;
 
     struct bafs_group_ctx* group_ctx = file->private_data;
 
@@ -125,9 +747,9 @@ bafs_group_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
         goto out;
     }
 
+    /* the open file holds a group reference for as long as the ioctl runs */
     group = group_ctx->group;
     ctx = group_ctx->ctx;
-    bafs_get_group(group);
 
     BAFS_GROUP_DEBUG("IOCTL called \t cmd = %u\n", cmd);
 
@@ -136,12 +758,28 @@ bafs_group_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
         ret = -EINVAL;
 
         BAFS_GROUP_ERR("Invalid IOCTL commad type = %u\n", _IOC_TYPE(cmd));
-        goto out_release_group;
+        goto out;
     }
 
+    bafs_stats_add(ctx, NULL, BAFS_STAT_IOCTLS, 1);
+
     switch (cmd) {
     case BAFS_GROUP_IOC_REG_MEM:
-        ret = bafs_core_reg_mem(argp, ctx);
+    case BAFS_GROUP_IOC_REG_MEM2:
+        for (i = 0; i < group->n_ctrls; i++)
+            bafs_ctrl_get_nodes(group->ctrls[i], &nodes);
+        version = (cmd == BAFS_GROUP_IOC_REG_MEM2) ? BAFS_REG_MEM_V2 : BAFS_REG_MEM_V1;
+        if (version == BAFS_REG_MEM_V2)
+            uloc = &((struct BAFS_IOC_REG_MEM2_PARAMS __user*) argp)->loc;
+        else
+            uloc = &((struct BAFS_IOC_REG_MEM_PARAMS __user*) argp)->loc;
+        /* a CMB slice must be reachable peer to peer from every member */
+        provider = NULL;
+        if (!get_user(loc, uloc) && (loc == BAFS_MEM_CMB))
+            provider = bafs_group_find_cmb(group);
+        ret = bafs_core_reg_mem(argp, version, ctx, &nodes, provider);
+        if (provider)
+            pci_dev_put(provider);
         if (ret < 0) {
             BAFS_CTRL_ERR("IOCTL to register memory failed\n");
             goto out;
@@ -151,19 +789,94 @@ bafs_group_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
         ret = bafs_group_dma_map_mem(group, ctx, argp);
         if (ret < 0) {
             BAFS_GROUP_ERR("IOCTL to dma map memory failed\n");
-            goto out_release_group;
+            goto out;
+        }
+        break;
+    case BAFS_GROUP_IOC_DMA_MAP_MEM_HND:
+        ret = bafs_group_dma_map_mem_hnd(group, ctx, argp);
+        if (ret < 0) {
+            BAFS_GROUP_ERR("IOCTL to dma map memory by handle failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_GROUP_IOC_DMA_UNMAP_MEM_HND:
+        ret = bafs_group_dma_unmap_mem_hnd(group, ctx, argp);
+        if (ret < 0) {
+            BAFS_GROUP_ERR("IOCTL to dma unmap memory by handle failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_GROUP_IOC_DMA_MAP_MEM2:
+        ret = bafs_group_dma_map_mem2(group, ctx, argp);
+        if (ret < 0) {
+            BAFS_GROUP_ERR("IOCTL to dma map memory failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_GROUP_IOC_DMA_MAP_MEM_EXTENTS:
+        ret = bafs_group_dma_map_mem_extents(group, ctx, argp);
+        if (ret < 0) {
+            BAFS_GROUP_ERR("IOCTL to dma map memory extents failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_GROUP_IOC_DMA_MAP_MEM_RANGE:
+        ret = bafs_group_dma_map_mem_range(group, ctx, argp);
+        if (ret < 0) {
+            BAFS_GROUP_ERR("IOCTL to dma map memory range failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_GROUP_IOC_DMA_UNMAP_MEM:
+        ret = bafs_group_dma_unmap_mem(group, ctx, argp);
+        if (ret < 0) {
+            BAFS_GROUP_ERR("IOCTL to dma unmap memory failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_GROUP_IOC_DMA_SYNC_MEM:
+        ret = bafs_ctrl_dma_sync_mem(group->ctrls, group->n_ctrls, ctx, argp);
+        if (ret < 0) {
+            BAFS_GROUP_ERR("IOCTL to dma sync memory failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_GROUP_IOC_DEREG_MEM:
+        ret = bafs_core_dereg_mem(argp, ctx);
+        if (ret < 0) {
+            BAFS_GROUP_ERR("IOCTL to deregister memory failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_GROUP_IOC_DMA_MAP_MEM_TABLE:
+        ret = bafs_group_dma_map_mem_table(group, ctx, argp);
+        if (ret < 0) {
+            BAFS_GROUP_ERR("IOCTL to dma map memory table failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_GROUP_IOC_EXPORT_DMABUF:
+        ret = bafs_core_export_dmabuf(argp, ctx);
+        if (ret < 0) {
+            BAFS_GROUP_ERR("IOCTL to export dma-buf failed\n");
+            goto out;
+        }
+        break;
+    case BAFS_GROUP_IOC_PREFAULT_MEM:
+        ret = bafs_core_prefault_mem(argp, ctx);
+        if (ret < 0) {
+            BAFS_GROUP_ERR("IOCTL to prefault memory failed\n");
+            goto out;
         }
         break;
     default:
         ret = -EINVAL;
         BAFS_GROUP_ERR("Invalid IOCTL cmd \t cmd = %u\n", cmd);
-        goto out_release_group;
+        goto out;
         break;
     }
 
     ret = 0;
-out_release_group:
-    bafs_put_group(group);
 out:
     return ret;
 }
@@ -190,9 +903,9 @@ bafs_group_open(struct inode* inode, struct file* file)
         goto out_put_group;
     }
 
-    ctx = bafs_get_ctx();
+    ctx = bafs_alloc_ctx(NULL, group);
     if (ctx == NULL) {
-        ret = -EINVAL;
+        ret = -ENOMEM;
         goto out_free_group_ctx;
     }
 
@@ -214,8 +927,6 @@ bafs_group_release(struct inode* inode, struct file* file)
 {
     int ret = 0;
     struct bafs_ctx* ctx;
-    struct bafs_mem*      mem;
-    struct bafs_mem*      next;
     struct bafs_group_ctx* group_ctx = (struct bafs_group_ctx*) file->private_data;
 
     if (!group_ctx) {
@@ -224,28 +935,7 @@ bafs_group_release(struct inode* inode, struct file* file)
     }
 
     ctx = group_ctx->ctx;
-    spin_lock(&ctx->lock);
-    list_for_each_entry_safe(mem, next, &ctx->mem_list, mem_list) {
-        spin_lock(&mem->lock);
-        if (mem->state == STALE) {
-
-            list_del_init(&mem->mem_list);
-
-            xa_erase(&ctx->bafs_mem_xa, mem->mem_id);
-            BAFS_GROUP_DEBUG("Deleting Stale mem registeration\n");
-            spin_unlock(&mem->lock);
-            kfree_rcu(mem, rh);
-            bafs_put_ctx(ctx);
-
-        }
-        else {
-            spin_unlock(&mem->lock);
-        }
-
-
-    }
-
-    spin_unlock(&ctx->lock);
+    bafs_mem_drop_stale(ctx);
 
     bafs_put_ctx(ctx);
     BAFS_GROUP_DEBUG("Closed core and cleaned ctx\n");
@@ -282,20 +972,34 @@ bafs_group_mmap(struct file* file, struct vm_area_struct* vma)
 
     if (vma->vm_pgoff == 0) {
 
+        /*
+         * The members are fixed once the group is allocated, so group->lock is not
+         * taken: mmap holds mmap_lock, and the map ioctls fault under group->lock.
+         */
         bafs_get_group(group);
-        spin_lock(&group->lock);
 
         for (i = 0; i < group->n_ctrls; i++) {
             ret = bafs_ctrl_mmap(group->ctrls[i], vma, vma->vm_start + map_size, &cur_map_size);
             if (ret < 0) {
-                goto out_unlock;
+                goto out_put_group;
             }
             map_size += cur_map_size;
         }
 
-        spin_unlock(&group->lock);
         bafs_put_group(group);
     }
+    else if (((u64) vma->vm_pgoff << PAGE_SHIFT) & BAFS_MMAP_DMA_TABLE) {
+        i = BAFS_MMAP_DMA_TABLE_CTRL((u64) vma->vm_pgoff << PAGE_SHIFT);
+        if (i >= group->n_ctrls) {
+            ret = -EINVAL;
+            goto out;
+        }
+        ret = bafs_ctrl_mmap_dma_table(group->ctrls[i], ctx, vma);
+        if (ret < 0) {
+            BAFS_GROUP_ERR("Failed to mmap dma table \t err = %d\n", ret);
+            goto out;
+        }
+    }
     else {
         ret = pin_bafs_mem(vma, ctx);
         if (ret < 0) {
@@ -305,8 +1009,7 @@ bafs_group_mmap(struct file* file, struct vm_area_struct* vma)
     }
     ret = 0;
     return ret;
-out_unlock:
-    spin_unlock(&group->lock);
+out_put_group:
     bafs_put_group(group);
 out:
     return ret;
@@ -362,7 +1065,7 @@ bafs_group_alloc(struct bafs_group ** out, int bafs_major, struct device * bafs_
 
     }
 
-    spin_lock_init(&group->lock);
+    mutex_init(&group->lock);
 
     group->ctrls = kzalloc(n_ctrls * sizeof(*(group->ctrls)), GFP_KERNEL);
     if (!group->ctrls) {
@@ -378,7 +1081,12 @@ bafs_group_alloc(struct bafs_group ** out, int bafs_major, struct device * bafs_
             BAFS_CORE_ERR("Failed to find ctrl device: %s\n", ctrls[i]);
             goto out_free_ctrls;
         }
-        bafs_get_ctrl(group->ctrls[i]);
+        /* a removed controller cannot join a group */
+        if (!percpu_ref_tryget_live(&group->ctrls[i]->ref)) {
+            ret = -ENODEV;
+            BAFS_CORE_ERR("Ctrl device %s is being removed\n", ctrls[i]);
+            goto out_free_ctrls;
+        }
     }
 
 
@@ -390,6 +1098,12 @@ bafs_group_alloc(struct bafs_group ** out, int bafs_major, struct device * bafs_
     group->group_id = ret;
     group->n_ctrls  = n_ctrls;
 
+    ret = bafs_stats_alloc(&group->stats);
+    if (ret < 0) {
+        BAFS_CORE_ERR("Failed to allocate group stats\n");
+        goto out_group_id_put;
+    }
+
     cdev_init(&group->cdev, &bafs_group_fops);
     group->cdev.owner = THIS_MODULE;
 
@@ -397,7 +1111,7 @@ bafs_group_alloc(struct bafs_group ** out, int bafs_major, struct device * bafs_
     ret = bafs_get_minor_number();
     if (ret < 0) {
         BAFS_CORE_ERR("Failed to get minor instance id \t err = %d\n", ret);
-        goto out_group_id_put;
+        goto out_free_stats;
     }
     group->minor = ret;
 
@@ -408,8 +1122,9 @@ bafs_group_alloc(struct bafs_group ** out, int bafs_major, struct device * bafs_
     }
     group->core_dev = bafs_core_device;
 
-    group->device = device_create(bafs_group_class, bafs_core_device, MKDEV(group->major,
-                                  group->minor), group, BAFS_GROUP_DEVICE_NAME, group->group_id);
+    group->device = device_create_with_groups(bafs_group_class, bafs_core_device,
+                                              MKDEV(group->major, group->minor), group, bafs_group_groups,
+                                              BAFS_GROUP_DEVICE_NAME, group->group_id);
     if(IS_ERR(group->device)) {
         ret = PTR_ERR(group->device);
         BAFS_CORE_ERR("Failed to create group device %s%d with minor %d \t err = %d\n", BAFS_GROUP_DEVICE_NAME, group->group_id, group->minor, ret);
@@ -432,6 +1147,8 @@ out_delete_cdev:
     cdev_del(&group->cdev);
 out_minor_put:
     bafs_put_minor_number(group->minor);
+out_free_stats:
+    bafs_stats_free(&group->stats);
 out_group_id_put:
     ida_simple_remove(&bafs_group_ida, group->group_id);
 out_free_ctrls:
@@ -467,13 +1184,28 @@ bafs_group_init()
     if (IS_ERR(bafs_group_class)) {
         ret = PTR_ERR(bafs_group_class);
         BAFS_CORE_ERR("Failed to create group class \t err = %d\n", ret);
+        goto out;
+    }
+
+    bafs_map_wq = alloc_workqueue("bafs_map", WQ_UNBOUND, 0);
+    if (!bafs_map_wq) {
+        ret = -ENOMEM;
+        BAFS_CORE_ERR("Failed to allocate map workqueue\n");
+        goto out_destroy_class;
     }
 
     return ret;
+
+out_destroy_class:
+    class_destroy(bafs_group_class);
+out:
+    return ret;
 }
 
 void
 bafs_group_fini()
 {
+    destroy_workqueue(bafs_map_wq);
+    bafs_map_wq = NULL;
     class_destroy(bafs_group_class);
 }
@@ -3,6 +3,14 @@
 #include <linux/list.h>
 #include <linux/spinlock.h>
 #include <linux/dma-mapping.h>
+#include <linux/huge_mm.h>
+#include <linux/pfn_t.h>
+#include <linux/mmu_notifier.h>
+#include <linux/workqueue.h>
+#include <linux/dma-buf.h>
+#include <linux/pci-p2pdma.h>
+#include <linux/mutex.h>
+#include <linux/sched/mm.h>
 
 #include <nv-p2p.h>
 
@@ -11,13 +19,426 @@
 #include <linux/bafs/util.h>
 #include <linux/bafs/types.h>
 
+#include <trace/events/bafs.h>
 
-static 
-int pin_bafs_cpu_mem(struct bafs_mem* mem, struct vm_area_struct* vma)
+
+atomic64_t bafs_node_pinned_bytes[MAX_NUMNODES];
+
+static
+void bafs_mem_account_nodes(struct bafs_mem* mem, const bool inc)
+{
+    unsigned long i;
+    unsigned long run   = 0;
+    int           nid   = NUMA_NO_NODE;
+    int           nid_;
+
+    /* batch runs of pages on the same node into one atomic update */
+    for (i = 0; i <= mem->n_pages; i++) {
+        /* lazy regions account their pages as they are populated */
+        if ((i < mem->n_pages) && !mem->cpu_page_table[i])
+            continue;
+        nid_ = (i < mem->n_pages) ? page_to_nid(mem->cpu_page_table[i]) : NUMA_NO_NODE;
+        if ((nid_ != nid) && run) {
+            atomic64_add(inc ? (s64) run : -(s64) run, &bafs_node_pinned_bytes[nid]);
+            run = 0;
+        }
+        nid  = nid_;
+        run += mem->page_size;
+    }
+}
+
+/* the bytes a region holds stay charged to its ctx until it is released */
+static inline
+void bafs_mem_charge_pinned(struct bafs_mem* mem, const unsigned long bytes)
+{
+    mem->pinned += bytes;
+    bafs_stats_add(mem->ctx, NULL, BAFS_STAT_PINNED + mem->loc, bytes);
+}
+
+static bool pin_parallel = true;
+module_param(pin_parallel, bool, 0644);
+MODULE_PARM_DESC(pin_parallel, "Allocate and zero large cpu registrations in parallel on the bafs_pin workqueue");
+
+/* registrations are split into chunks of at least this many bytes, one per work item */
+#define BAFS_PIN_CHUNK_MIN_BYTES (64UL << 20)
+/* pages pinned or inserted between reschedule points */
+#define BAFS_PIN_BATCH 65536
+/* every BAFS_MEM_FLAG_* bafs_core_reg_mem() knows */
+#define BAFS_MEM_FLAGS_ALL (BAFS_MEM_FLAG_HUGE_2M | BAFS_MEM_FLAG_HUGE_1G | BAFS_MEM_FLAG_LAZY | BAFS_MEM_FLAG_WC)
+
+static struct workqueue_struct* bafs_pin_wq = NULL;
+
+struct bafs_pin_ctl {
+    atomic_t          pending;
+    struct completion done;
+};
+
+struct bafs_pin_chunk {
+    struct work_struct   work;
+    struct bafs_pin_ctl* ctl;
+    struct bafs_mem*     mem;
+    unsigned long        start;
+    unsigned long        end;
+    unsigned long        n_done;
+    unsigned int         order;
+    int                  ret;
+};
+
+/* pin phases are only timed while the bafs_mem_pin event is enabled */
+static inline
+u64 bafs_pin_clock(void)
+{
+    return trace_bafs_mem_pin_enabled() ? ktime_get_ns() : 0;
+}
+
+static inline
+void bafs_trace_pin(struct bafs_mem* mem, enum bafs_pin_phase phase, unsigned long n_pages, u64 start)
+{
+    if (start)
+        trace_bafs_mem_pin(mem, phase, n_pages, ktime_get_ns() - start);
+}
+
+static
+int bafs_mem_page_nid(struct bafs_mem* mem, unsigned long i)
+{
+    int nid;
+
+    if (mem->placement != BAFS_MEM_PLACE_INTERLEAVE)
+        return mem->nid;
+
+    nid = first_node(mem->nodes);
+    for (i %= nodes_weight(mem->nodes); i; i--)
+        nid = next_node(nid, mem->nodes);
+
+    return nid;
+}
+
+static
+struct page* bafs_alloc_cpu_page(const int nid, const unsigned int order)
+{
+    struct page* page;
+
+    /* pooled pages were already zeroed by the scrubber */
+    page = bafs_pool_get(nid, order);
+    if (page)
+        return page;
+
+    if (order == 0)
+        return alloc_pages_node(nid, GFP_HIGHUSER | __GFP_DMA | __GFP_ZERO, 0);
+
+    /* orders the buddy allocator cannot serve (1 GiB on most configs) fall back to the next size */
+    if (order >= MAX_ORDER)
+        return NULL;
+
+    return alloc_pages_node(nid, GFP_HIGHUSER | __GFP_COMP | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY, order);
+}
+
+static
+void bafs_pin_chunk_alloc(struct bafs_pin_chunk* chunk)
+{
+    unsigned long    i;
+    struct bafs_mem* mem = chunk->mem;
+    int              nid = bafs_mem_page_nid(mem, chunk->start);
+
+    for (i = chunk->start; i < chunk->end; i++) {
+        mem->cpu_page_table[i] = bafs_alloc_cpu_page(nid, chunk->order);
+        if (!mem->cpu_page_table[i]) {
+            chunk->ret = -ENOMEM;
+            break;
+        }
+        chunk->n_done++;
+        if (mem->placement == BAFS_MEM_PLACE_INTERLEAVE)
+            nid = next_node_in(nid, mem->nodes);
+        cond_resched();
+    }
+}
+
+static
+void bafs_pin_chunk_work(struct work_struct* work)
+{
+    struct bafs_pin_chunk* chunk;
+
+    chunk = container_of(work, struct bafs_pin_chunk, work);
+    bafs_pin_chunk_alloc(chunk);
+
+    if (atomic_dec_and_test(&chunk->ctl->pending))
+        complete(&chunk->ctl->done);
+}
+
+static
+int bafs_alloc_cpu_pages(struct bafs_mem* mem, const unsigned int order)
+{
+    int                    ret      = 0;
+    int                    nid;
+    unsigned long          n_chunks = 1;
+    unsigned long          chunk_pages;
+    unsigned long          c;
+    unsigned long          i;
+    struct bafs_pin_chunk* chunks;
+    struct bafs_pin_ctl    ctl;
+    u64                    start = bafs_pin_clock();
+
+    if (pin_parallel && bafs_pin_wq)
+        n_chunks = clamp((mem->n_pages << mem->page_shift) / BAFS_PIN_CHUNK_MIN_BYTES,
+                         1UL, (unsigned long) num_online_cpus());
+    chunk_pages = DIV_ROUND_UP(mem->n_pages, n_chunks);
+    n_chunks    = DIV_ROUND_UP(mem->n_pages, chunk_pages);
+
+    chunks = kcalloc(n_chunks, sizeof(*chunks), GFP_KERNEL);
+    if (!chunks) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    atomic_set(&ctl.pending, n_chunks);
+    init_completion(&ctl.done);
+
+    for (c = 0; c < n_chunks; c++) {
+        chunks[c].ctl   = &ctl;
+        chunks[c].mem   = mem;
+        chunks[c].order = order;
+        chunks[c].start = c * chunk_pages;
+        chunks[c].end   = min(mem->n_pages, (c + 1) * chunk_pages);
+    }
+
+    if (n_chunks == 1) {
+        bafs_pin_chunk_alloc(&chunks[0]);
+    }
+    else {
+        for (c = 0; c < n_chunks; c++) {
+            INIT_WORK(&chunks[c].work, bafs_pin_chunk_work);
+            /* run each chunk on a cpu of the node its pages come from */
+            nid = bafs_mem_page_nid(mem, chunks[c].start);
+            if (nid != NUMA_NO_NODE)
+                queue_work_node(nid, bafs_pin_wq, &chunks[c].work);
+            else
+                queue_work(bafs_pin_wq, &chunks[c].work);
+        }
+        wait_for_completion(&ctl.done);
+    }
+
+    for (c = 0; c < n_chunks; c++) {
+        if (chunks[c].ret)
+            ret = chunks[c].ret;
+    }
+
+    if (ret) {
+        BAFS_CORE_DEBUG("Failed to alloc cpu pages of order %u, rolling back\n", order);
+        for (c = 0; c < n_chunks; c++) {
+            for (i = chunks[c].start; i < (chunks[c].start + chunks[c].n_done); i++)
+                __free_pages(mem->cpu_page_table[i], order);
+        }
+    }
+    else {
+        BAFS_CORE_DEBUG("Allocated %lu pages of order %u in %lu chunks\n", mem->n_pages, order, n_chunks);
+        bafs_trace_pin(mem, BAFS_PIN_ALLOC, mem->n_pages, start);
+    }
+
+    kfree(chunks);
+out:
+    return ret;
+}
+
+int bafs_mem_init(void)
+{
+    int ret = 0;
+
+    bafs_pin_wq = alloc_workqueue("bafs_pin", WQ_UNBOUND, 0);
+    if (!bafs_pin_wq) {
+        ret = -ENOMEM;
+        BAFS_CORE_ERR("Failed to allocate pin workqueue\n");
+    }
+
+    return ret;
+}
+
+void bafs_mem_fini(void)
+{
+    if (bafs_pin_wq == NULL) return;
+    destroy_workqueue(bafs_pin_wq);
+    bafs_pin_wq = NULL;
+}
+
+static
+void bafs_free_cpu_pages(struct bafs_mem* mem, const unsigned long n_pages)
+{
+    unsigned long i;
+    unsigned int  order = mem->page_shift - PAGE_SHIFT;
+
+    for (i = 0; i < n_pages; i++) {
+        if (mem->cpu_page_table[i] && !bafs_pool_put(mem->cpu_page_table[i], order))
+            __free_pages(mem->cpu_page_table[i], order);
+    }
+}
+
+/*
+ * Allocate the missing pages in [first, last) of a lazy region.
+ * Faults, prefault and dma map all serialize on populate_lock.
+ */
+int bafs_mem_populate(struct bafs_mem* mem, unsigned long first, unsigned long last)
+{
+    int           ret   = 0;
+    unsigned int  order = mem->page_shift - PAGE_SHIFT;
+    unsigned long i;
+    unsigned long n = 0;
+    struct page*  page;
+    u64           start;
+
+    if ((mem->loc != BAFS_MEM_CPU) || !(mem->flags & BAFS_MEM_FLAG_LAZY))
+        goto out;
+
+    last = min(last, mem->n_pages);
+
+    mutex_lock(&mem->populate_lock);
+    start = bafs_pin_clock();
+    for (i = first; i < last; i++) {
+        if (mem->cpu_page_table[i])
+            continue;
+        page = bafs_alloc_cpu_page(bafs_mem_page_nid(mem, i), order);
+        if (!page) {
+            ret = -ENOMEM;
+            BAFS_CORE_DEBUG("Failed to populate page %lu of mem %u\n", i, mem->mem_id);
+            break;
+        }
+        atomic64_add(mem->page_size, &bafs_node_pinned_bytes[page_to_nid(page)]);
+        /* pairs with the acquire in bafs_mem_huge_fault(), the page must be zeroed before it is seen */
+        smp_store_release(&mem->cpu_page_table[i], page);
+        n++;
+        cond_resched();
+    }
+    if (n) {
+        bafs_mem_charge_pinned(mem, n << mem->page_shift);
+        bafs_trace_pin(mem, BAFS_PIN_POPULATE, n, start);
+    }
+    mutex_unlock(&mem->populate_lock);
+
+out:
+    return ret;
+}
+
+long bafs_core_prefault_mem(void __user* user_params, struct bafs_ctx* ctx)
+{
+    long ret = 0;
+
+    struct bafs_mem*                    mem;
+    struct BAFS_IOC_PREFAULT_MEM_PARAMS params;
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CORE_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+
+    mem = bafs_get_mem_with_ctx(params.vaddr, ctx);
+    if (!mem) {
+        ret = -EINVAL;
+        BAFS_CORE_ERR("Failed to find bafs_mem obj for prefault\n");
+        goto out;
+    }
+
+    if ((mem->loc != BAFS_MEM_CPU) || (params.offset >= mem->size) || (params.len > (mem->size - params.offset))) {
+        ret = -EINVAL;
+        goto out_put_mem;
+    }
+
+    ret = bafs_mem_populate(mem, params.offset >> mem->page_shift,
+                            (params.offset + params.len + mem->page_size - 1) >> mem->page_shift);
+
+out_put_mem:
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
+
+static
+int pin_bafs_cpu_huge_mem(struct bafs_mem* mem, struct vm_area_struct* vma, const unsigned long shift)
+{
+    int ret = 0;
+
+    if (!IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE)) {
+        ret = -EOPNOTSUPP;
+        goto out;
+    }
+
+    /* huge PMD/PUD entries can only be inserted into shared pfn mappings */
+    if (!(vma->vm_flags & VM_SHARED)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    mem->page_size                     = 1UL << shift;
+    mem->page_shift                    = shift;
+    mem->n_pages                       = (mem->size + mem->page_size - 1) >> mem->page_shift;
+    mem->page_mask                     = ~(mem->page_size - 1);
+    if ((mem->vaddr & mem->page_mask) != mem->vaddr) {
+        ret                            = -EINVAL;
+        BAFS_CORE_DEBUG("Huge page pinning needs a %lu aligned vaddr\n", mem->page_size);
+        goto out;
+    }
+    mem->cpu_page_table = (struct page**) kvcalloc(mem->n_pages, sizeof(struct page*), GFP_KERNEL);
+    if (!mem->cpu_page_table){
+        ret             = -ENOMEM;
+        BAFS_CORE_DEBUG("Failed to pin cpu memory due to lack of memory\n");
+        goto out;
+    }
+
+    if ((shift - PAGE_SHIFT) >= MAX_ORDER) {
+        ret = -ENOMEM;
+        goto out_free_page_table;
+    }
+
+    if (mem->flags & BAFS_MEM_FLAG_LAZY)
+        ret = 0;
+    else
+        ret = bafs_alloc_cpu_pages(mem, shift - PAGE_SHIFT);
+    if (ret) {
+        BAFS_CORE_DEBUG("Failed to alloc cpu huge pages of size %lu\n", mem->page_size);
+        goto out_free_page_table;
+    }
+
+    /* pages are inserted by bafs_mem_huge_fault() with PMD/PUD entries on first touch */
+    vma->vm_flags |= VM_PFNMAP | VM_DONTDUMP | VM_HUGEPAGE;
+
+    BAFS_CORE_DEBUG("Pinned cpu mem with %lu huge pages of size %lu\n", mem->n_pages, mem->page_size);
+    ret = 0;
+    return ret;
+
+out_free_page_table:
+    kvfree(mem->cpu_page_table);
+    mem->cpu_page_table = NULL;
+out:
+    return ret;
+}
+
+/* large regions are inserted in batches so the mapping task can be rescheduled */
+static
+int bafs_mem_insert_pages(struct bafs_mem* mem, struct vm_area_struct* vma)
+{
+    int           ret = 0;
+    unsigned long i;
+    unsigned long n;
+    u64           start = bafs_pin_clock();
+
+    if (mem->n_pages > vma_pages(vma))
+        return -ENXIO;
+
+    for (i = 0; i < mem->n_pages; i += BAFS_PIN_BATCH) {
+        n   = min_t(unsigned long, mem->n_pages - i, BAFS_PIN_BATCH);
+        ret = vm_insert_pages(vma, vma->vm_start + (i << PAGE_SHIFT), mem->cpu_page_table + i, &n);
+        if (ret)
+            break;
+        cond_resched();
+    }
+
+    if (!ret)
+        bafs_trace_pin(mem, BAFS_PIN_INSERT, mem->n_pages, start);
+    return ret;
+}
+
+static
+int pin_bafs_cpu_base_mem(struct bafs_mem* mem, struct vm_area_struct* vma)
 {
     int ret = 0;
-    int i;
-    UNUSED(vma);
 
     mem->page_size                     = PAGE_SIZE;
     mem->page_shift                    = PAGE_SHIFT;
@@ -27,25 +448,28 @@ int pin_bafs_cpu_mem(struct bafs_mem* mem, struct vm_area_struct* vma)
         ret                            = -EINVAL;
         goto out;
     }
-    mem->cpu_page_table = (struct page**) kcalloc(mem->n_pages, sizeof(struct page*), GFP_KERNEL);
+    mem->cpu_page_table = (struct page**) kvcalloc(mem->n_pages, sizeof(struct page*), GFP_KERNEL);
     if (!mem->cpu_page_table){
         ret             = -ENOMEM;
         BAFS_CORE_DEBUG("Failed to pin cpu memory due to lack of memory\n");
         goto out;
     }
 
-    for(i = 0; i < mem->n_pages; i++) {
-        mem->cpu_page_table[i] = alloc_page(GFP_HIGHUSER | __GFP_DMA | __GFP_ZERO);
-        if (!mem->cpu_page_table[i]) {
-            ret = -ENOMEM;
-            BAFS_CORE_DEBUG("Failed to alloc cpu memory page\n");
-            goto out_clean_page_table;
-        }
+    if (mem->flags & BAFS_MEM_FLAG_LAZY) {
+        /* pages are allocated and inserted by bafs_mem_fault() on first touch */
+        vma->vm_flags |= VM_PFNMAP | VM_DONTDUMP;
+        ret = 0;
+        return ret;
+    }
 
+    ret = bafs_alloc_cpu_pages(mem, 0);
+    if (ret) {
+        BAFS_CORE_DEBUG("Failed to alloc cpu memory pages\n");
+        goto out_free_page_table;
     }
 
 
-    ret = vm_map_pages_zero(vma, mem->cpu_page_table, mem->n_pages);
+    ret = bafs_mem_insert_pages(mem, vma);
     if (ret) {
         ret = -ENOMEM;
         BAFS_CORE_DEBUG("Failed to vm_map cpu pages\n");
@@ -58,15 +482,101 @@ int pin_bafs_cpu_mem(struct bafs_mem* mem, struct vm_area_struct* vma)
     return ret;
 
 out_clean_page_table:
-    for (i = i - 1; i >= 0; i--)
-        __free_page(mem->cpu_page_table[i]);
+    bafs_free_cpu_pages(mem, mem->n_pages);
+out_free_page_table:
+    kvfree(mem->cpu_page_table);
+    mem->cpu_page_table = NULL;
+out:
+    return ret;
+}
+
+/* carve a slice out of the provider's CMB and map it straight into the vma */
+static
+int pin_bafs_cmb_mem(struct bafs_mem* mem, struct vm_area_struct* vma)
+{
+    int           ret = 0;
+    unsigned long i;
+
+    mem->page_size  = PAGE_SIZE;
+    mem->page_shift = PAGE_SHIFT;
+    mem->page_mask  = ~(mem->page_size - 1);
+    mem->n_pages    = (mem->size + mem->page_size - 1) >> mem->page_shift;
+    if ((mem->vaddr & mem->page_mask) != mem->vaddr) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    mem->cpu_page_table = (struct page**) kvcalloc(mem->n_pages, sizeof(struct page*), GFP_KERNEL);
+    if (!mem->cpu_page_table) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    mem->p2p_vaddr = pci_alloc_p2pmem(mem->p2p_dev, mem->n_pages << mem->page_shift);
+    if (!mem->p2p_vaddr) {
+        ret = -ENOMEM;
+        BAFS_CORE_DEBUG("Failed to alloc %lu bytes of cmb\n", mem->n_pages << mem->page_shift);
+        goto out_free_page_table;
+    }
+    /* the previous owner's data must not leak through a new registration */
+    memset(mem->p2p_vaddr, 0, mem->n_pages << mem->page_shift);
+
+    for (i = 0; i < mem->n_pages; i++)
+        mem->cpu_page_table[i] = virt_to_page(mem->p2p_vaddr + (i << mem->page_shift));
+
+    if (mem->flags & BAFS_MEM_FLAG_WC)
+        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+    else
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
 
-    kfree(mem->cpu_page_table);
+    /* p2pmem is one contiguous chunk of the BAR */
+    ret = io_remap_pfn_range(vma, mem->vaddr, page_to_pfn(mem->cpu_page_table[0]),
+                             mem->n_pages << mem->page_shift, vma->vm_page_prot);
+    if (ret) {
+        BAFS_CORE_DEBUG("Failed to remap cmb \t ret = %d\n", ret);
+        goto out_free_p2pmem;
+    }
+
+    BAFS_CORE_DEBUG("Pinned %lu bytes of cmb from %s\n", mem->n_pages << mem->page_shift, pci_name(mem->p2p_dev));
+    ret = 0;
+    return ret;
+
+out_free_p2pmem:
+    pci_free_p2pmem(mem->p2p_dev, mem->p2p_vaddr, mem->n_pages << mem->page_shift);
+    mem->p2p_vaddr = NULL;
+out_free_page_table:
+    kvfree(mem->cpu_page_table);
     mem->cpu_page_table = NULL;
 out:
     return ret;
 }
 
+static
+int pin_bafs_cpu_mem(struct bafs_mem* mem, struct vm_area_struct* vma)
+{
+    int ret = 0;
+
+    if (mem->flags & BAFS_MEM_FLAG_HUGE_1G) {
+        ret = pin_bafs_cpu_huge_mem(mem, vma, PUD_SHIFT);
+        if (ret == 0)
+            goto out;
+        BAFS_CORE_DEBUG("Falling back from 1G pages \t ret = %d\n", ret);
+    }
+
+    if (mem->flags & (BAFS_MEM_FLAG_HUGE_1G | BAFS_MEM_FLAG_HUGE_2M)) {
+        ret = pin_bafs_cpu_huge_mem(mem, vma, PMD_SHIFT);
+        if (ret == 0)
+            goto out;
+        BAFS_CORE_DEBUG("Falling back from 2M pages \t ret = %d\n", ret);
+    }
+
+    ret = pin_bafs_cpu_base_mem(mem, vma);
+out:
+    if (ret == 0)
+        bafs_mem_account_nodes(mem, true);
+    return ret;
+}
+
 
 /* static  */
 /* void __bafs_mem_release_cuda(struct kref* ref) */
@@ -114,7 +624,7 @@ void release_bafs_cuda_mem(void* data)
                     dma->cuda_mapping = NULL;
                 }
             }
-            mem->state           = DEAD_CB;
+            WRITE_ONCE(mem->state, DEAD_CB);
             nvidia_p2p_free_page_table(mem->cuda_page_table);
             mem->cuda_page_table = NULL;
         }
@@ -220,8 +730,7 @@ void __bafs_mem_release(struct kref* ref)
 {
     struct bafs_mem*      mem;
     struct bafs_ctx* ctx;
-
-    int i;
+    enum STATE            state;
 
     mem     = container_of(ref, struct bafs_mem, ref);
     BAFS_CORE_DEBUG("In __bafs_mem_release\n");
@@ -229,22 +738,63 @@ void __bafs_mem_release(struct kref* ref)
         ctx = mem->ctx;
         spin_lock(&ctx->lock);
         list_del(&mem->mem_list);
-        xa_erase(&ctx->bafs_mem_xa, mem->mem_id);
+        bafs_mem_unindex_locked(mem);
+        /* a deregistered handle may already have been reused by another registration */
+        xa_cmpxchg(&ctx->bafs_mem_xa, mem->mem_id, mem, NULL, 0);
         spin_unlock(&ctx->lock);
 
+        /*
+         * Nothing can take a reference any more, only the cuda free callback may still
+         * look at the state. Unpinning and the p2p put sleep, so they run unlocked.
+         */
         spin_lock(&mem->lock);
-        if (mem->state != STALE) {
+        state = mem->state;
+        if (state != STALE)
+            WRITE_ONCE(mem->state, DEAD);
+        spin_unlock(&mem->lock);
+        trace_bafs_mem_release(mem, state);
+
+        if (state != STALE) {
             switch (mem->loc) {
             case BAFS_MEM_CPU:
                 if (mem->cpu_page_table) {
                     BAFS_CORE_DEBUG("Releasing pages\n");
-                    for (i = 0; i < mem->n_pages; i++)
-                        __free_page(mem->cpu_page_table[i]);
-                    kfree(mem->cpu_page_table);
+                    bafs_mem_account_nodes(mem, false);
+                    bafs_free_cpu_pages(mem, mem->n_pages);
+                    kvfree(mem->cpu_page_table);
+                }
+                break;
+            case BAFS_MEM_USER:
+                if (mem->cpu_page_table) {
+                    BAFS_CORE_DEBUG("Unpinning user pages\n");
+                    bafs_mem_account_nodes(mem, false);
+                    unpin_user_pages_dirty_lock(mem->cpu_page_table, mem->n_pages, true);
+                    kvfree(mem->cpu_page_table);
+                }
+                /* an exported dma-buf may have kept the pins past the registration */
+                if (mem->locked_mm) {
+                    if (mmget_not_zero(mem->locked_mm)) {
+                        account_locked_vm(mem->locked_mm, mem->n_pages, false);
+                        mmput(mem->locked_mm);
+                    }
+                    mmdrop(mem->locked_mm);
+                    mem->locked_mm = NULL;
+                }
+                break;
+            case BAFS_MEM_CMB:
+                if (mem->p2p_vaddr) {
+                    pci_free_p2pmem(mem->p2p_dev, mem->p2p_vaddr, mem->n_pages << mem->page_shift);
+                    kvfree(mem->cpu_page_table);
+                }
+                break;
+            case BAFS_MEM_DMABUF:
+                if (mem->dmabuf) {
+                    dma_buf_put(mem->dmabuf);
+                    mem->dmabuf = NULL;
                 }
                 break;
             case BAFS_MEM_CUDA:
-                if ((mem->state != DEAD_CB) && (mem->cuda_page_table)) {
+                if ((state != DEAD_CB) && (mem->cuda_page_table)) {
                     nvidia_p2p_put_pages(0, 0, mem->vaddr, mem->cuda_page_table);
                     nvidia_p2p_free_page_table(mem->cuda_page_table);
                     mem->cuda_page_table = NULL;
@@ -254,34 +804,406 @@ void __bafs_mem_release(struct kref* ref)
                 break;
 
             }
-            mem->state = DEAD;
         }
-        spin_unlock(&mem->lock);
+        if (mem->pinned)
+            bafs_stats_add(ctx, NULL, BAFS_STAT_PINNED + mem->loc, -(s64) mem->pinned);
+        if (mem->p2p_dev)
+            pci_dev_put(mem->p2p_dev);
         kfree_rcu(mem, rh);
 
         bafs_put_ctx(ctx);
     }
 }
 
+/*
+ * Drops the registrations of ctx that were never mapped, once its file is closed.
+ * User and dma-buf regions are STALE only while the registering call pins them, and
+ * that call owns them. The references are dropped once both locks are released.
+ */
+void
+bafs_mem_drop_stale(struct bafs_ctx * ctx)
+{
+    struct bafs_mem* mem;
+    struct bafs_mem* next;
+    LIST_HEAD(stale);
+
+    spin_lock(&ctx->lock);
+    list_for_each_entry_safe(mem, next, &ctx->mem_list, mem_list) {
+        spin_lock(&mem->lock);
+        if ((mem->state == STALE) && (mem->loc != BAFS_MEM_USER) && (mem->loc != BAFS_MEM_DMABUF)) {
+            /* a racing mmap that already looked the handle up sees it gone */
+            WRITE_ONCE(mem->state, DEAD);
+            xa_erase(&ctx->bafs_mem_xa, mem->mem_id);
+            list_move(&mem->mem_list, &stale);
+        }
+        spin_unlock(&mem->lock);
+    }
+    spin_unlock(&ctx->lock);
+
+    list_for_each_entry_safe(mem, next, &stale, mem_list) {
+        BAFS_CORE_DEBUG("Deleting Stale mem registeration\n");
+        list_del_init(&mem->mem_list);
+        bafs_mem_put(mem);
+    }
+}
+
 void
 bafs_mem_put(struct bafs_mem * mem)
 {
     kref_put(&mem->ref, __bafs_mem_release);
 }
 
-long bafs_core_reg_mem(void __user* user_params, struct bafs_ctx* ctx)
+static
+void bafs_user_mem_release_work(struct work_struct* work)
 {
-    long ret = 0;
+    struct bafs_mem* mem;
+
+    mem = container_of(work, struct bafs_mem, release_work);
+    BAFS_CORE_DEBUG("Releasing user mem registration vaddr: %lx\n", mem->vaddr);
+
+    mmu_interval_notifier_remove(&mem->notifier);
+    bafs_mem_put(mem);
+}
+
+static
+bool bafs_user_mem_invalidate(struct mmu_interval_notifier* mni, const struct mmu_notifier_range* range,
+                              unsigned long cur_seq)
+{
+    struct bafs_mem*     mem;
+    struct bafs_mem_dma* dma;
+    struct bafs_mem_dma* next;
+    LIST_HEAD(dmas);
+
+    mem = container_of(mni, struct bafs_mem, notifier);
+
+    switch (range->event) {
+    case MMU_NOTIFY_PROTECTION_VMA:
+    case MMU_NOTIFY_PROTECTION_PAGE:
+    case MMU_NOTIFY_SOFT_DIRTY:
+        /* the pinned pages stay where they are */
+        spin_lock(&mem->lock);
+        mmu_interval_set_seq(mni, cur_seq);
+        spin_unlock(&mem->lock);
+        return true;
+    default:
+        break;
+    }
+
+    if (!mmu_notifier_range_blockable(range))
+        return false;
+
+    spin_lock(&mem->lock);
+    mmu_interval_set_seq(mni, cur_seq);
+    if (mem->state == LIVE) {
+        BAFS_CORE_DEBUG("User mem vaddr: %lx invalidated, unmapping dma\n", mem->vaddr);
+        /* dma-buf detach sleeps, so the mappings are torn down outside the lock */
+        list_splice_init(&mem->dma_list, &dmas);
+        WRITE_ONCE(mem->state, DEAD_CB);
+        /* the notifier cannot be removed from its own callback */
+        schedule_work(&mem->release_work);
+    }
+    spin_unlock(&mem->lock);
+
+    /* the release work still holds the registration reference */
+    list_for_each_entry_safe(dma, next, &dmas, dma_list) {
+        unmap_dma(dma);
+        kref_put(&mem->ref, __bafs_mem_release);
+    }
+
+    return true;
+}
+
+static const
+struct mmu_interval_notifier_ops bafs_user_mem_notifier_ops = {
+    .invalidate = bafs_user_mem_invalidate,
+};
+
+static
+int pin_bafs_user_mem(struct bafs_mem* mem, const unsigned long vaddr)
+{
+    int           ret      = 0;
+    long          pinned;
+    unsigned long n_pinned = 0;
+    unsigned long seq;
+    u64           start;
+    u64           pin_start = ktime_get_ns();
+
+    mem->vaddr      = vaddr;
+    mem->page_size  = PAGE_SIZE;
+    mem->page_shift = PAGE_SHIFT;
+    mem->page_mask  = ~(mem->page_size - 1);
+    mem->n_pages    = (mem->size + mem->page_size - 1) >> mem->page_shift;
+
+    if (((mem->vaddr & mem->page_mask) != mem->vaddr) || (mem->n_pages == 0)) {
+        ret = -EINVAL;
+        BAFS_CORE_DEBUG("Failed to pin user memory due to unaligned vaddr or empty range\n");
+        goto out;
+    }
+
+    mem->cpu_page_table = (struct page**) kvcalloc(mem->n_pages, sizeof(struct page*), GFP_KERNEL);
+    if (!mem->cpu_page_table) {
+        ret = -ENOMEM;
+        BAFS_CORE_DEBUG("Failed to pin user memory due to lack of memory\n");
+        goto out;
+    }
+
+    ret = account_locked_vm(current->mm, mem->n_pages, true);
+    if (ret) {
+        BAFS_CORE_DEBUG("Failed to pin user memory, over RLIMIT_MEMLOCK\n");
+        goto out_free_page_table;
+    }
+
+    ret = mmu_interval_notifier_insert(&mem->notifier, current->mm, mem->vaddr,
+                                       mem->n_pages << mem->page_shift, &bafs_user_mem_notifier_ops);
+    if (ret) {
+        BAFS_CORE_DEBUG("Failed to insert mmu interval notifier \t ret = %d\n", ret);
+        goto out_unaccount;
+    }
+
+    seq   = mmu_interval_read_begin(&mem->notifier);
+    start = bafs_pin_clock();
+    while (n_pinned < mem->n_pages) {
+        pinned = pin_user_pages_fast(mem->vaddr + (n_pinned << mem->page_shift),
+                                     min_t(unsigned long, mem->n_pages - n_pinned, BAFS_PIN_BATCH),
+                                     FOLL_WRITE | FOLL_LONGTERM, mem->cpu_page_table + n_pinned);
+        if (pinned <= 0) {
+            ret = pinned ? pinned : -EFAULT;
+            BAFS_CORE_DEBUG("pin_user_pages_fast failed after %lu pages \t ret = %d\n", n_pinned, ret);
+            goto out_unpin;
+        }
+        n_pinned += pinned;
+        cond_resched();
+    }
+    bafs_trace_pin(mem, BAFS_PIN_USER, n_pinned, start);
+
+    spin_lock(&mem->ctx->lock);
+    spin_lock(&mem->lock);
+    if (mmu_interval_read_retry(&mem->notifier, seq)) {
+        spin_unlock(&mem->lock);
+        spin_unlock(&mem->ctx->lock);
+        ret = -EAGAIN;
+        BAFS_CORE_DEBUG("User range changed while pinning\n");
+        goto out_unpin;
+    }
+    /* charged before the handle goes live, a dereg may release it right after */
+    bafs_mem_charge_pinned(mem, mem->n_pages << mem->page_shift);
+    mmgrab(current->mm);
+    mem->locked_mm = current->mm;
+    bafs_stats_latency(mem->ctx, NULL, BAFS_OP_PIN, pin_start);
+    WRITE_ONCE(mem->state, LIVE);
+    bafs_mem_index_locked(mem);
+    spin_unlock(&mem->lock);
+    spin_unlock(&mem->ctx->lock);
+    bafs_mem_account_nodes(mem, true);
+
+    BAFS_CORE_DEBUG("Pinned user mem vaddr: %lx\tsize: %lu\tn_pages: %lu\n", mem->vaddr, mem->size, mem->n_pages);
+    ret = 0;
+    return ret;
+
+out_unpin:
+    unpin_user_pages(mem->cpu_page_table, n_pinned);
+    mmu_interval_notifier_remove(&mem->notifier);
+out_unaccount:
+    account_locked_vm(current->mm, mem->n_pages, false);
+out_free_page_table:
+    kvfree(mem->cpu_page_table);
+    mem->cpu_page_table = NULL;
+out:
+    return ret;
+}
+
+/*
+ * An imported dma-buf must be mmap'd by the caller at vaddr. That mapping
+ * names the registration for the dma map ioctls, and unmapping it tears the
+ * registration down through the same notifier as user memory.
+ */
+static
+int pin_bafs_dmabuf_mem(struct bafs_mem* mem, const int fd, const unsigned long vaddr)
+{
+    int ret = 0;
+    u64 pin_start = ktime_get_ns();
+
+    struct vm_area_struct* vma;
+
+    mem->dmabuf = dma_buf_get(fd);
+    if (IS_ERR(mem->dmabuf)) {
+        ret         = PTR_ERR(mem->dmabuf);
+        mem->dmabuf = NULL;
+        BAFS_CORE_DEBUG("Failed to get dma-buf for fd %d \t ret = %d\n", fd, ret);
+        goto out;
+    }
+
+    if (mem->size == 0)
+        mem->size = mem->dmabuf->size;
+
+    mem->vaddr      = vaddr;
+    mem->page_size  = PAGE_SIZE;
+    mem->page_shift = PAGE_SHIFT;
+    mem->page_mask  = ~(mem->page_size - 1);
+    mem->n_pages    = (mem->size + mem->page_size - 1) >> mem->page_shift;
+
+    if (((mem->vaddr & mem->page_mask) != mem->vaddr) || (mem->size > mem->dmabuf->size)) {
+        ret = -EINVAL;
+        BAFS_CORE_DEBUG("Failed to import dma-buf due to unaligned vaddr or size past the buffer\n");
+        goto out_put_dmabuf;
+    }
+
+    mmap_read_lock(current->mm);
+    vma = find_vma(current->mm, mem->vaddr);
+    if (!vma || (vma->vm_start > mem->vaddr) || ((mem->vaddr + mem->size) > vma->vm_end) ||
+        (vma->vm_file != mem->dmabuf->file)) {
+        ret = -EINVAL;
+    }
+    mmap_read_unlock(current->mm);
+    if (ret) {
+        BAFS_CORE_DEBUG("vaddr %lx is not a mapping of dma-buf fd %d\n", mem->vaddr, fd);
+        goto out_put_dmabuf;
+    }
+
+    ret = mmu_interval_notifier_insert(&mem->notifier, current->mm, mem->vaddr,
+                                       mem->n_pages << mem->page_shift, &bafs_user_mem_notifier_ops);
+    if (ret) {
+        BAFS_CORE_DEBUG("Failed to insert mmu interval notifier \t ret = %d\n", ret);
+        goto out_put_dmabuf;
+    }
+
+    bafs_mem_charge_pinned(mem, mem->n_pages << mem->page_shift);
+    bafs_stats_latency(mem->ctx, NULL, BAFS_OP_PIN, pin_start);
+
+    spin_lock(&mem->ctx->lock);
+    spin_lock(&mem->lock);
+    WRITE_ONCE(mem->state, LIVE);
+    bafs_mem_index_locked(mem);
+    spin_unlock(&mem->lock);
+    spin_unlock(&mem->ctx->lock);
+
+    BAFS_CORE_DEBUG("Imported dma-buf vaddr: %lx\tsize: %lu\n", mem->vaddr, mem->size);
+    ret = 0;
+    return ret;
+
+out_put_dmabuf:
+    dma_buf_put(mem->dmabuf);
+    mem->dmabuf = NULL;
+out:
+    return ret;
+}
+
+static
+int bafs_mem_set_placement(struct bafs_mem* mem, struct BAFS_IOC_REG_MEM2_PARAMS* params,
+                           const nodemask_t* ctrl_nodes)
+{
+    int ret = 0;
+
+    mem->placement = params->placement;
+    mem->nid       = NUMA_NO_NODE;
+    nodes_clear(mem->nodes);
+
+    switch (mem->placement) {
+    case BAFS_MEM_PLACE_DEFAULT:
+        break;
+    case BAFS_MEM_PLACE_CTRL:
+        /* core fds have no controller, a group uses its first controller's node */
+        if (ctrl_nodes && !nodes_empty(*ctrl_nodes))
+            mem->nid = first_node(*ctrl_nodes);
+        break;
+    case BAFS_MEM_PLACE_NODE:
+        if ((params->node < 0) || (params->node >= MAX_NUMNODES) || !node_online(params->node)) {
+            ret = -EINVAL;
+            BAFS_CORE_ERR("Invalid node %d for mem placement\n", params->node);
+            goto out;
+        }
+        mem->nid = params->node;
+        break;
+    case BAFS_MEM_PLACE_INTERLEAVE:
+        if (ctrl_nodes && (nodes_weight(*ctrl_nodes) > 1)) {
+            mem->nodes = *ctrl_nodes;
+        }
+        else {
+            mem->placement = BAFS_MEM_PLACE_CTRL;
+            if (ctrl_nodes && !nodes_empty(*ctrl_nodes))
+                mem->nid = first_node(*ctrl_nodes);
+        }
+        break;
+    default:
+        ret = -EINVAL;
+        BAFS_CORE_ERR("Invalid mem placement %u\n", mem->placement);
+        goto out;
+    }
+
+    params->node = mem->nid;
+out:
+    return ret;
+}
+
+/* v1 params carry a 32-bit size, both layouts are handled as v2 internally */
+static
+int bafs_reg_mem_params_get(struct BAFS_IOC_REG_MEM2_PARAMS* params, const void __user* user_params,
+                            const unsigned int version)
+{
+    struct BAFS_IOC_REG_MEM_PARAMS v1;
+
+    if (version == BAFS_REG_MEM_V2)
+        return copy_from_user(params, user_params, sizeof(*params)) ? -EFAULT : 0;
+
+    if (copy_from_user(&v1, user_params, sizeof(v1)))
+        return -EFAULT;
+
+    params->size      = v1.size;
+    params->vaddr     = v1.vaddr;
+    params->loc       = v1.loc;
+    params->flags     = v1.flags;
+    params->placement = v1.placement;
+    params->node      = v1.node;
+    params->dmabuf_fd = v1.dmabuf_fd;
+    params->handle    = v1.handle;
+    return 0;
+}
+
+static
+int bafs_reg_mem_params_put(void __user* user_params, const struct BAFS_IOC_REG_MEM2_PARAMS* params,
+                            const unsigned int version)
+{
+    struct BAFS_IOC_REG_MEM_PARAMS __user* v1 = user_params;
+
+    if (version == BAFS_REG_MEM_V2)
+        return copy_to_user(user_params, params, sizeof(*params)) ? -EFAULT : 0;
+
+    /* only the out fields are written back */
+    if (put_user(params->handle, &v1->handle) || put_user(params->node, &v1->node))
+        return -EFAULT;
+    return 0;
+}
+
+long bafs_core_reg_mem(void __user* user_params, const unsigned int version, struct bafs_ctx* ctx,
+                       const nodemask_t* ctrl_nodes, struct pci_dev* cmb_provider)
+{
+    long ret = 0;
 
     struct bafs_mem*                    mem;
-    struct BAFS_IOC_REG_MEM_PARAMS params;
+    struct BAFS_IOC_REG_MEM2_PARAMS params;
+    u64                                 start = ktime_get_ns();
 
-    if (copy_from_user(&params, user_params, sizeof(params))) {
-        ret = -EFAULT;
+    ret = bafs_reg_mem_params_get(&params, user_params, version);
+    if (ret < 0) {
         BAFS_CORE_ERR("Failed to copy params from user\n");
         goto out;
     }
 
+    /* page tables are indexed by unsigned long, anything larger cannot be described */
+    if (params.size > (MAX_LFS_FILESIZE & PAGE_MASK)) {
+        ret = -EINVAL;
+        BAFS_CORE_ERR("Invalid mem size %llu\n", params.size);
+        goto out;
+    }
+
+    /* unknown bits are refused so they can be given a meaning later */
+    if ((params.flags & ~BAFS_MEM_FLAGS_ALL) ||
+        ((params.flags & BAFS_MEM_FLAG_HUGE_2M) && (params.flags & BAFS_MEM_FLAG_HUGE_1G))) {
+        ret = -EINVAL;
+        BAFS_CORE_ERR("Invalid mem flags %#x\n", params.flags);
+        goto out;
+    }
+
     mem     = kzalloc(sizeof(*mem), GFP_KERNEL);
     if (!mem) {
         ret = -ENOMEM;
@@ -289,18 +1211,38 @@ long bafs_core_reg_mem(void __user* user_params, struct bafs_ctx* ctx)
         goto out;
     }
 
+    ret = bafs_mem_set_placement(mem, &params, ctrl_nodes);
+    if (ret < 0) {
+        kfree(mem);
+        goto out;
+    }
+
+    if (params.loc == BAFS_MEM_CMB) {
+        if (!cmb_provider) {
+            ret = -ENODEV;
+            BAFS_CORE_ERR("No controller memory buffer reachable for this registration\n");
+            kfree(mem);
+            goto out;
+        }
+        mem->p2p_dev = pci_dev_get(cmb_provider);
+    }
+
     kref_get(&ctx->ref);
     mem->state = STALE;
 
-    mem->size = params.size;
-    mem->loc  = params.loc;
+    mem->size  = params.size;
+    mem->loc   = params.loc;
+    mem->flags = params.flags;
     mem->ctx  = ctx;
     spin_lock_init(&mem->lock);
+    mutex_init(&mem->populate_lock);
     kref_init(&mem->ref);
     INIT_LIST_HEAD(&mem->dma_list);
     INIT_LIST_HEAD(&mem->mem_list);
+    RB_CLEAR_NODE(&mem->it.rb);
+    INIT_WORK(&mem->release_work, bafs_user_mem_release_work);
 
-    spin_lock(&ctx->lock);
+    /* the xarray takes its own lock and may sleep to allocate, ctx->lock only guards the list */
     ret     = xa_alloc(&ctx->bafs_mem_xa, &(mem->mem_id), mem, xa_limit_31b, GFP_KERNEL);
     if (ret < 0) {
         ret = -ENOMEM;
@@ -309,16 +1251,35 @@ long bafs_core_reg_mem(void __user* user_params, struct bafs_ctx* ctx)
     }
     params.handle = mem->mem_id+1;
 
+    spin_lock(&ctx->lock);
     list_add(&mem->mem_list, &ctx->mem_list);
     spin_unlock(&ctx->lock);
 
 
-    if (copy_to_user(user_params, &params, sizeof(params))) {
-        ret = -EFAULT;
+    ret = bafs_reg_mem_params_put(user_params, &params, version);
+    if (ret < 0) {
         BAFS_CORE_ERR("Failed to copy params to user\n");
         goto out_erase_xa_entry;
     }
 
+    /* user memory already exists, so it is pinned now instead of at mmap time */
+    if (mem->loc == BAFS_MEM_USER) {
+        ret = pin_bafs_user_mem(mem, params.vaddr);
+        if (ret < 0) {
+            BAFS_CORE_ERR("Failed to pin user memory \t ret = %ld\n", ret);
+            goto out_erase_xa_entry;
+        }
+    }
+    else if (mem->loc == BAFS_MEM_DMABUF) {
+        ret = pin_bafs_dmabuf_mem(mem, params.dmabuf_fd, params.vaddr);
+        if (ret < 0) {
+            BAFS_CORE_ERR("Failed to import dma-buf \t ret = %ld\n", ret);
+            goto out_erase_xa_entry;
+        }
+    }
+
+    trace_bafs_reg_mem(mem);
+    bafs_stats_latency(ctx, NULL, BAFS_OP_REG, start);
 
     ret = 0;
     return ret;
@@ -328,44 +1289,198 @@ out_erase_xa_entry:
 
     spin_lock(&ctx->lock);
     list_del_init(&mem->mem_list);
+    bafs_mem_unindex_locked(mem);
     xa_erase(&ctx->bafs_mem_xa, mem->mem_id);
+    spin_unlock(&ctx->lock);
 
 out_delete_mem:
-    spin_unlock(&ctx->lock);
     bafs_put_ctx(ctx);
-    kfree(mem);
+    if (mem->p2p_dev)
+        pci_dev_put(mem->p2p_dev);
+    /* lockless lookups may still be looking at it */
+    kfree_rcu(mem, rh);
 out:
     return ret;
 }
 
 
-void unmap_dma(struct bafs_mem_dma* dma)
+/*
+ * Drop a registration by handle. The handle is unlinked and every dma mapping of the
+ * region is torn down, user and dma-buf regions are unpinned right away while pages
+ * backing a bafs mmap stay until the vma is unmapped.
+ */
+long bafs_core_dereg_mem(void __user* user_params, struct bafs_ctx* ctx)
 {
-    unsigned map_gran;
-    int      i;
+    long ret     = 0;
+    bool put_reg = false;
+    bool unpin   = false;
 
-    struct bafs_mem* mem;
-    struct pci_dev*  pdev;
-    struct bafs_ctrl* ctrl;
-    BAFS_CORE_DEBUG("In unmap_dma\n");
+    struct bafs_mem*                 mem;
+    struct bafs_mem_dma*             dma;
+    struct bafs_mem_dma*             next;
+    struct BAFS_IOC_DEREG_MEM_PARAMS params;
+    LIST_HEAD(dmas);
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CORE_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+
+    if (params.handle == 0) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    spin_lock(&ctx->lock);
+    mem = (struct bafs_mem*) xa_load(&ctx->bafs_mem_xa, params.handle - 1);
+    if (!mem) {
+        spin_unlock(&ctx->lock);
+        ret = -ENOENT;
+        goto out;
+    }
+
+    spin_lock(&mem->lock);
+    /* user and dma-buf regions are STALE only while the registering call pins them */
+    if ((mem->state == PINNING) ||
+        ((mem->state == STALE) && ((mem->loc == BAFS_MEM_USER) || (mem->loc == BAFS_MEM_DMABUF)))) {
+        spin_unlock(&mem->lock);
+        spin_unlock(&ctx->lock);
+        ret = -EBUSY;
+        goto out;
+    }
+
+    xa_erase(&ctx->bafs_mem_xa, mem->mem_id);
+    list_del_init(&mem->mem_list);
+    bafs_mem_unindex_locked(mem);
+    list_splice_init(&mem->dma_list, &dmas);
+
+    if (mem->state == STALE) {
+        /* never mapped, the registration reference is dropped here */
+        WRITE_ONCE(mem->state, DEAD);
+        put_reg    = true;
+    }
+    else if ((mem->state == LIVE) && ((mem->loc == BAFS_MEM_USER) || (mem->loc == BAFS_MEM_DMABUF))) {
+        /* keeps the invalidate callback from scheduling the release a second time */
+        WRITE_ONCE(mem->state, DEAD_CB);
+        unpin      = true;
+    }
+    spin_unlock(&mem->lock);
+    spin_unlock(&ctx->lock);
+
+    list_for_each_entry_safe(dma, next, &dmas, dma_list) {
+        unmap_dma(dma);
+        bafs_mem_put(mem);
+    }
+
+    /* drops the registration reference once the notifier is gone */
+    if (unpin)
+        bafs_user_mem_release_work(&mem->release_work);
+    else if (put_reg)
+        bafs_mem_put(mem);
+
+out:
+    return ret;
+}
+
+
+static inline
+bool bafs_mem_pages_adjacent(struct bafs_mem* mem, const unsigned long i)
+{
+    return page_to_pfn(mem->cpu_page_table[i]) ==
+        (page_to_pfn(mem->cpu_page_table[i-1]) + (mem->page_size >> PAGE_SHIFT));
+}
+
+/* builds the table for pages [first, first + n) of the region */
+int bafs_mem_alloc_sgt(struct bafs_mem* mem, struct sg_table* sgt, unsigned long max_seg,
+                       const unsigned long first, const unsigned long n)
+{
+    int ret = 0;
+    unsigned long       i;
+    unsigned long       seg_len = 0;
+    unsigned int        n_segs  = 0;
+    struct scatterlist* sg      = NULL;
+
+    /* sg entries carry unsigned int lengths */
+    max_seg = min_t(unsigned long, max_seg, UINT_MAX) & mem->page_mask;
+    max_seg = max(max_seg, mem->page_size);
+
+    for (i = first; i < first + n; i++) {
+        if ((i == first) || !bafs_mem_pages_adjacent(mem, i) || ((seg_len + mem->page_size) > max_seg)) {
+            n_segs++;
+            seg_len = 0;
+        }
+        seg_len += mem->page_size;
+    }
+
+    ret = sg_alloc_table(sgt, n_segs, GFP_KERNEL);
+    if (ret) {
+        goto out;
+    }
+
+    seg_len = 0;
+    for (i = first; i < first + n; i++) {
+        if ((i == first) || !bafs_mem_pages_adjacent(mem, i) || ((seg_len + mem->page_size) > max_seg)) {
+            sg = sg ? sg_next(sg) : sgt->sgl;
+            sg_set_page(sg, mem->cpu_page_table[i], mem->page_size, 0);
+            seg_len = 0;
+        }
+        else {
+            sg->length += mem->page_size;
+        }
+        seg_len += mem->page_size;
+    }
+
+    BAFS_CORE_DEBUG("Built sg table with %u entries for %lu pages\n", n_segs, n);
+out:
+    return ret;
+}
+
+/*
+ * The mapping may outlive its place on mem->dma_list while another process
+ * reuses it through a shared dma-buf, so the teardown runs on the last put.
+ */
+static
+void __bafs_mem_dma_release(struct kref* ref)
+{
+    struct bafs_mem*     mem;
+    struct pci_dev*      pdev;
+    struct bafs_ctrl*    ctrl;
+    struct bafs_mem_dma* dma;
+    struct bafs_dma_ref* dref;
+    struct bafs_dma_ref* next_ref;
+
+    dma = container_of(ref, struct bafs_mem_dma, ref);
+    BAFS_CORE_DEBUG("In __bafs_mem_dma_release\n");
 
     if (dma) {
+        trace_bafs_dma_unmap(dma);
         mem                  = dma->mem;
-        list_del(&dma->dma_list);
+        bafs_stats_add(mem->ctx, dma->ctrl, BAFS_STAT_DMA_MAPS, -1);
+        bafs_stats_add(mem->ctx, dma->ctrl, BAFS_STAT_IOVA_BYTES, -(s64) (dma->n_addrs << mem->page_shift));
         switch (mem->loc) {
         case BAFS_MEM_CPU:
-            if (dma->addrs) {
-                for (i = 0; i < mem->n_pages; i++) {
-                    map_gran = dma->map_gran;
-                    if ((i*dma->map_gran) > mem->size) {
-                        map_gran -= ((i*dma->map_gran) - mem->size);
-                    }
-                    dma_unmap_single(&dma->ctrl->pdev->dev, dma->addrs[i], map_gran, DMA_BIDIRECTIONAL);
-                }
-
-                kfree(dma->addrs);
-                dma->addrs = NULL;
+        case BAFS_MEM_USER:
+            if (dma->sgt_mapped) {
+                dma_unmap_sgtable(&dma->ctrl->pdev->dev, &dma->sgt, DMA_BIDIRECTIONAL, 0);
+                dma->sgt_mapped = false;
+            }
+            sg_free_table(&dma->sgt);
+            break;
+        case BAFS_MEM_CMB:
+            if (dma->sgt_mapped) {
+                pci_p2pdma_unmap_sg(&dma->ctrl->pdev->dev, dma->sgt.sgl, dma->sgt.orig_nents, DMA_BIDIRECTIONAL);
+                dma->sgt_mapped = false;
             }
+            sg_free_table(&dma->sgt);
+            break;
+        case BAFS_MEM_DMABUF:
+            if (dma->attach_sgt)
+                dma_buf_unmap_attachment(dma->attach, dma->attach_sgt, DMA_BIDIRECTIONAL);
+            if (dma->attach)
+                dma_buf_detach(mem->dmabuf, dma->attach);
+            dma->attach_sgt = NULL;
+            dma->attach     = NULL;
             break;
         case BAFS_MEM_CUDA:
             if ((mem->state != DEAD_CB) && (dma->cuda_mapping)) {
@@ -379,6 +1494,14 @@ void unmap_dma(struct bafs_mem_dma* dma)
 
         }
 
+        /* the addresses are gone, tell anyone still reading the table */
+        if (dma->table)
+            bafs_dma_table_revoke(dma);
+
+        /* references left when the region was torn down under the controllers */
+        list_for_each_entry_safe(dref, next_ref, &dma->refs, list)
+            kfree(dref);
+
         pdev = dma->ctrl->pdev;
         ctrl = dma->ctrl;
 
@@ -387,6 +1510,42 @@ void unmap_dma(struct bafs_mem_dma* dma)
     }
 }
 
+void bafs_mem_dma_put(struct bafs_mem_dma* dma)
+{
+    kref_put(&dma->ref, __bafs_mem_dma_release);
+}
+
+/* a live mapping of mem for dev with a reference taken, or NULL */
+struct bafs_mem_dma* bafs_mem_get_dma(struct bafs_mem* mem, struct device* dev)
+{
+    struct bafs_mem_dma* dma;
+    struct bafs_mem_dma* found = NULL;
+
+    spin_lock(&mem->lock);
+    list_for_each_entry(dma, &mem->dma_list, dma_list) {
+        /* a window mapping cannot stand in for the whole buffer */
+        if (dma->sgt_mapped && (&dma->ctrl->pdev->dev == dev) &&
+            (dma->first_page == 0) && (dma->n_addrs == mem->n_pages)) {
+            kref_get(&dma->ref);
+            found = dma;
+            break;
+        }
+    }
+    spin_unlock(&mem->lock);
+
+    return found;
+}
+
+void unmap_dma(struct bafs_mem_dma* dma)
+{
+    BAFS_CORE_DEBUG("In unmap_dma\n");
+
+    if (dma) {
+        list_del_init(&dma->dma_list);
+        bafs_mem_dma_put(dma);
+    }
+}
+
 static
 void bafs_mem_release(struct vm_area_struct* vma)
 {
@@ -394,6 +1553,7 @@ void bafs_mem_release(struct vm_area_struct* vma)
     struct bafs_ctx* ctx;
     struct bafs_mem_dma*  dma;
     struct bafs_mem_dma*  next;
+    LIST_HEAD(dmas);
 
 
     mem     = (struct bafs_mem*) vma->vm_private_data;
@@ -404,14 +1564,16 @@ void bafs_mem_release(struct vm_area_struct* vma)
     ctx = mem->ctx;
     kref_get(&ctx->ref);
 
+    /* revoking a mapped table frees it, so the mappings are torn down outside the lock */
     spin_lock(&mem->lock);
-    list_for_each_entry_safe(dma, next, &mem->dma_list, dma_list) {
+    list_splice_init(&mem->dma_list, &dmas);
+    spin_unlock(&mem->lock);
+
+    list_for_each_entry_safe(dma, next, &dmas, dma_list) {
         unmap_dma(dma);
         kref_put(&mem->ref, __bafs_mem_release);
     }
 
-    spin_unlock(&mem->lock);
-
     vma->vm_private_data = NULL;
     kref_put(&mem->ref, __bafs_mem_release);
     bafs_put_ctx(ctx);
@@ -422,8 +1584,89 @@ out:
     return;
 }
 
+static
+vm_fault_t bafs_mem_huge_fault(struct vm_fault* vmf, enum page_entry_size pe_size)
+{
+    struct vm_area_struct* vma = vmf->vma;
+    struct bafs_mem*       mem;
+    struct page*           page;
+    unsigned long          fault_size;
+    unsigned long          addr;
+    unsigned long          offset;
+    unsigned long          pfn;
+
+    /* eagerly inserted base pages are normal pages, a zapped one stays gone as before */
+    if (!(vma->vm_flags & VM_PFNMAP))
+        return VM_FAULT_SIGBUS;
+
+    mem = (struct bafs_mem*) vma->vm_private_data;
+    if (!mem || (mem->loc != BAFS_MEM_CPU) || !mem->cpu_page_table)
+        return VM_FAULT_SIGBUS;
+
+    switch (pe_size) {
+    case PE_SIZE_PTE:
+        fault_size = PAGE_SIZE;
+        break;
+    case PE_SIZE_PMD:
+        fault_size = PMD_SIZE;
+        break;
+    case PE_SIZE_PUD:
+        fault_size = PUD_SIZE;
+        break;
+    default:
+        return VM_FAULT_FALLBACK;
+    }
+
+    addr = vmf->address & ~(fault_size - 1);
+    if ((fault_size > mem->page_size) || (addr < vma->vm_start) || ((addr + fault_size) > vma->vm_end))
+        return VM_FAULT_FALLBACK;
+
+    offset = addr - mem->vaddr;
+    if ((offset >> mem->page_shift) >= mem->n_pages)
+        return VM_FAULT_SIGBUS;
+
+    page = smp_load_acquire(&mem->cpu_page_table[offset >> mem->page_shift]);
+    if (!page) {
+        /*
+         * A huge page that cannot be found is fragmentation, not a lack of memory, so the
+         * OOM killer stays out of it: a huge fault retries as a pte fault and the pte
+         * fault, which has nothing smaller to fall back to, fails the access.
+         */
+        if (bafs_mem_populate(mem, offset >> mem->page_shift, (offset >> mem->page_shift) + 1)) {
+            if (pe_size != PE_SIZE_PTE)
+                return VM_FAULT_FALLBACK;
+            return mem->page_size > PAGE_SIZE ? VM_FAULT_SIGBUS : VM_FAULT_OOM;
+        }
+        page = smp_load_acquire(&mem->cpu_page_table[offset >> mem->page_shift]);
+    }
+    pfn  = page_to_pfn(page) + ((offset & ~mem->page_mask) >> PAGE_SHIFT);
+
+    switch (pe_size) {
+    case PE_SIZE_PTE:
+        return vmf_insert_pfn(vma, addr, pfn);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    case PE_SIZE_PMD:
+        return vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(pfn), vmf->flags & FAULT_FLAG_WRITE);
+#endif
+#ifdef CONFIG_HAVE_ARCH_TRANSPARENT_HUGEPAGE_PUD
+    case PE_SIZE_PUD:
+        return vmf_insert_pfn_pud(vmf, pfn_to_pfn_t(pfn), vmf->flags & FAULT_FLAG_WRITE);
+#endif
+    default:
+        return VM_FAULT_FALLBACK;
+    }
+}
+
+static
+vm_fault_t bafs_mem_fault(struct vm_fault* vmf)
+{
+    return bafs_mem_huge_fault(vmf, PE_SIZE_PTE);
+}
+
 const struct vm_operations_struct bafs_mem_ops = {
-    .close = bafs_mem_release,
+    .close      = bafs_mem_release,
+    .fault      = bafs_mem_fault,
+    .huge_fault = bafs_mem_huge_fault,
 };
 
 
@@ -433,25 +1676,32 @@ int pin_bafs_mem(struct vm_area_struct* vma, struct bafs_ctx* ctx)
 
     struct bafs_mem* mem;
     bafs_mem_hnd_t   mem_id;
+    u64              start = ktime_get_ns();
 
+    /* the mmap'ing file holds ctx, a STALE region can still be dropped under us */
     mem_id = vma->vm_pgoff-1;
-    kref_get(&ctx->ref);
-    spin_lock(&ctx->lock);
+    rcu_read_lock();
     mem    = (struct bafs_mem*) xa_load(&ctx->bafs_mem_xa, mem_id);
-    spin_unlock(&ctx->lock);
-
-    bafs_put_ctx(ctx);
+    if (mem && !kref_get_unless_zero(&mem->ref))
+        mem = NULL;
+    rcu_read_unlock();
 
     if (!mem) {
         ret = -EINVAL;
         goto out;
     }
     BAFS_CORE_DEBUG("Got the mem handle %d\n", mem->mem_id);
-    kref_get(&mem->ref);
-    spin_lock(&mem->lock);
 
+    /* claim the registration so the pages can be allocated without holding the spinlock */
+    spin_lock(&mem->lock);
+    if (mem->state != STALE) {
+        spin_unlock(&mem->lock);
+        ret = -EBUSY;
+        goto out_put;
+    }
+    WRITE_ONCE(mem->state, PINNING);
     mem->vaddr = vma->vm_start;
-
+    spin_unlock(&mem->lock);
 
     switch (mem->loc) {
 
@@ -463,6 +1713,14 @@ int pin_bafs_mem(struct vm_area_struct* vma, struct bafs_ctx* ctx)
         }
         break;
 
+    case BAFS_MEM_CMB:
+        ret = pin_bafs_cmb_mem(mem, vma);
+        if (ret) {
+            BAFS_CORE_DEBUG("pin_bafs_cmb_mem failed \t ret = %d\n", ret);
+            goto out_release;
+        }
+        break;
+
     case BAFS_MEM_CUDA:
         ret = pin_bafs_cuda_mem(mem, vma);
         if (ret) {
@@ -479,15 +1737,30 @@ int pin_bafs_mem(struct vm_area_struct* vma, struct bafs_ctx* ctx)
         break;
     }
 
+    /* lazy regions are charged as they are populated, which may start once the vma is live */
+    if (!(mem->flags & BAFS_MEM_FLAG_LAZY))
+        bafs_mem_charge_pinned(mem, mem->n_pages << mem->page_shift);
+    bafs_stats_latency(ctx, NULL, BAFS_OP_PIN, start);
+
+    spin_lock(&mem->ctx->lock);
+    spin_lock(&mem->lock);
     vma->vm_ops          = &bafs_mem_ops;
-    mem->state           = LIVE;
+    WRITE_ONCE(mem->state, LIVE);
     vma->vm_private_data = mem;
     vma->vm_flags |= VM_DONTCOPY;
     vma->vm_flags |= VM_DONTEXPAND;
+    bafs_mem_index_locked(mem);
+    spin_unlock(&mem->lock);
+    spin_unlock(&mem->ctx->lock);
 
     ret = 0;
+    goto out_put;
+
 out_release:
+    spin_lock(&mem->lock);
+    WRITE_ONCE(mem->state, STALE);
     spin_unlock(&mem->lock);
+out_put:
     kref_put(&mem->ref, __bafs_mem_release);
 out:
     return ret;
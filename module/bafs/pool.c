@@ -0,0 +1,346 @@
+#include <linux/mm.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/shrinker.h>
+#include <linux/nodemask.h>
+#include <linux/wait.h>
+
+#include <linux/bafs.h>
+
+#include <linux/bafs/util.h>
+#include <linux/bafs/types.h>
+
+
+static unsigned int pool_max_mb = 1024;
+module_param(pool_max_mb, uint, 0644);
+MODULE_PARM_DESC(pool_max_mb, "Upper bound in MiB on released cpu pages kept for reuse, 0 disables the pool");
+
+/* pooled page sizes: base pages and PMD sized huge pages */
+enum {
+    BAFS_POOL_BASE,
+    BAFS_POOL_PMD,
+    BAFS_POOL_CLASSES
+};
+
+struct bafs_pool_node {
+    spinlock_t       lock;
+    struct list_head clean[BAFS_POOL_CLASSES];
+    struct list_head dirty[BAFS_POOL_CLASSES];
+    unsigned long    n_clean[BAFS_POOL_CLASSES];
+    unsigned long    n_dirty[BAFS_POOL_CLASSES];
+};
+
+static struct bafs_pool_node* bafs_pool_nodes[MAX_NUMNODES];
+
+/* pooled bytes across all nodes, clean and dirty */
+static atomic_long_t          bafs_pool_bytes = ATOMIC_LONG_INIT(0);
+static atomic64_t             bafs_pool_hits  = ATOMIC64_INIT(0);
+static atomic64_t             bafs_pool_misses = ATOMIC64_INIT(0);
+static atomic_t               bafs_pool_n_dirty = ATOMIC_INIT(0);
+
+static struct task_struct*    bafs_pool_scrubber = NULL;
+static DECLARE_WAIT_QUEUE_HEAD(bafs_pool_scrub_wq);
+
+static inline
+int bafs_pool_class(const unsigned int order)
+{
+    if (order == 0)
+        return BAFS_POOL_BASE;
+    if (order == (PMD_SHIFT - PAGE_SHIFT))
+        return BAFS_POOL_PMD;
+    return -1;
+}
+
+static inline
+unsigned int bafs_pool_order(const int class)
+{
+    return (class == BAFS_POOL_PMD) ? (PMD_SHIFT - PAGE_SHIFT) : 0;
+}
+
+/* returns a zeroed page of the given order from the pool, or NULL on a miss */
+struct page* bafs_pool_get(int nid, const unsigned int order)
+{
+    int                    class = bafs_pool_class(order);
+    struct page*           page  = NULL;
+    struct bafs_pool_node* pn;
+
+    if (class < 0)
+        return NULL;
+
+    if (nid == NUMA_NO_NODE)
+        nid = numa_mem_id();
+
+    pn = bafs_pool_nodes[nid];
+    if (pn) {
+        spin_lock(&pn->lock);
+        page = list_first_entry_or_null(&pn->clean[class], struct page, lru);
+        if (page) {
+            list_del(&page->lru);
+            pn->n_clean[class]--;
+        }
+        spin_unlock(&pn->lock);
+    }
+
+    if (page) {
+        atomic_long_sub(PAGE_SIZE << order, &bafs_pool_bytes);
+        atomic64_inc(&bafs_pool_hits);
+    }
+    else {
+        atomic64_inc(&bafs_pool_misses);
+    }
+
+    return page;
+}
+
+/* hands a released page to the pool for scrubbing, false if the caller must free it */
+bool bafs_pool_put(struct page* page, const unsigned int order)
+{
+    int                    class = bafs_pool_class(order);
+    struct bafs_pool_node* pn    = bafs_pool_nodes[page_to_nid(page)];
+
+    if ((class < 0) || !pn || !bafs_pool_scrubber)
+        return false;
+
+    /* a page somebody else still holds a reference to must not be handed out again */
+    if (page_count(page) != 1)
+        return false;
+
+    if ((atomic_long_add_return(PAGE_SIZE << order, &bafs_pool_bytes) >> 20) > pool_max_mb) {
+        atomic_long_sub(PAGE_SIZE << order, &bafs_pool_bytes);
+        return false;
+    }
+
+    spin_lock(&pn->lock);
+    list_add_tail(&page->lru, &pn->dirty[class]);
+    pn->n_dirty[class]++;
+    spin_unlock(&pn->lock);
+
+    atomic_inc(&bafs_pool_n_dirty);
+    wake_up(&bafs_pool_scrub_wq);
+
+    return true;
+}
+
+static
+struct page* bafs_pool_take_dirty(int* class_)
+{
+    int                    nid;
+    int                    class;
+    struct page*           page = NULL;
+    struct bafs_pool_node* pn;
+
+    for_each_node(nid) {
+        pn = bafs_pool_nodes[nid];
+        if (!pn)
+            continue;
+        spin_lock(&pn->lock);
+        for (class = 0; class < BAFS_POOL_CLASSES; class++) {
+            page = list_first_entry_or_null(&pn->dirty[class], struct page, lru);
+            if (page) {
+                list_del(&page->lru);
+                pn->n_dirty[class]--;
+                *class_ = class;
+                break;
+            }
+        }
+        spin_unlock(&pn->lock);
+        if (page)
+            break;
+    }
+
+    return page;
+}
+
+static
+int bafs_pool_scrub(void* data)
+{
+    int                    class = 0;
+    unsigned long          i;
+    struct page*           page;
+    struct bafs_pool_node* pn;
+
+    /* scrubbing is background work, it must not compete with the workers */
+    set_user_nice(current, MAX_NICE);
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(bafs_pool_scrub_wq,
+                                 atomic_read(&bafs_pool_n_dirty) || kthread_should_stop());
+
+        while (!kthread_should_stop() && (page = bafs_pool_take_dirty(&class))) {
+            atomic_dec(&bafs_pool_n_dirty);
+
+            for (i = 0; i < (1UL << bafs_pool_order(class)); i++) {
+                clear_highpage(page + i);
+                cond_resched();
+            }
+
+            pn = bafs_pool_nodes[page_to_nid(page)];
+            spin_lock(&pn->lock);
+            list_add(&page->lru, &pn->clean[class]);
+            pn->n_clean[class]++;
+            spin_unlock(&pn->lock);
+        }
+    }
+
+    return 0;
+}
+
+static
+unsigned long bafs_pool_drain(unsigned long nr_to_scan)
+{
+    int                    nid;
+    int                    class;
+    unsigned long          freed = 0;
+    struct page*           page;
+    struct bafs_pool_node* pn;
+    LIST_HEAD(victims);
+
+    for_each_node(nid) {
+        pn = bafs_pool_nodes[nid];
+        if (!pn)
+            continue;
+        spin_lock(&pn->lock);
+        for (class = 0; (class < BAFS_POOL_CLASSES) && (freed < nr_to_scan); class++) {
+            /* dirty pages have not been paid for yet, drop them first */
+            while ((freed < nr_to_scan) &&
+                   (page = list_first_entry_or_null(&pn->dirty[class], struct page, lru))) {
+                list_move(&page->lru, &victims);
+                pn->n_dirty[class]--;
+                atomic_dec(&bafs_pool_n_dirty);
+                freed += 1UL << bafs_pool_order(class);
+            }
+            while ((freed < nr_to_scan) &&
+                   (page = list_first_entry_or_null(&pn->clean[class], struct page, lru))) {
+                list_move(&page->lru, &victims);
+                pn->n_clean[class]--;
+                freed += 1UL << bafs_pool_order(class);
+            }
+        }
+        spin_unlock(&pn->lock);
+        if (freed >= nr_to_scan)
+            break;
+    }
+
+    while ((page = list_first_entry_or_null(&victims, struct page, lru))) {
+        list_del(&page->lru);
+        /* compound pages carry their order */
+        atomic_long_sub(page_size(page), &bafs_pool_bytes);
+        __free_pages(page, compound_order(page));
+    }
+
+    return freed;
+}
+
+static
+unsigned long bafs_pool_count_objects(struct shrinker* shrink, struct shrink_control* sc)
+{
+    unsigned long n = atomic_long_read(&bafs_pool_bytes) >> PAGE_SHIFT;
+
+    return n ? n : SHRINK_EMPTY;
+}
+
+static
+unsigned long bafs_pool_scan_objects(struct shrinker* shrink, struct shrink_control* sc)
+{
+    unsigned long freed = bafs_pool_drain(sc->nr_to_scan);
+
+    return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker bafs_pool_shrinker = {
+    .count_objects = bafs_pool_count_objects,
+    .scan_objects  = bafs_pool_scan_objects,
+    .seeks         = DEFAULT_SEEKS,
+};
+
+int bafs_pool_emit_stats(char* buf)
+{
+    int                    nid;
+    int                    len = 0;
+    struct bafs_pool_node* pn;
+
+    for_each_node(nid) {
+        pn = bafs_pool_nodes[nid];
+        if (!pn)
+            continue;
+        spin_lock(&pn->lock);
+        len += sysfs_emit_at(buf, len, "node%d clean %lu %lu dirty %lu %lu\n", nid,
+                             pn->n_clean[BAFS_POOL_BASE], pn->n_clean[BAFS_POOL_PMD],
+                             pn->n_dirty[BAFS_POOL_BASE], pn->n_dirty[BAFS_POOL_PMD]);
+        spin_unlock(&pn->lock);
+    }
+    len += sysfs_emit_at(buf, len, "bytes %ld\nhits %lld\nmisses %lld\n",
+                         atomic_long_read(&bafs_pool_bytes),
+                         atomic64_read(&bafs_pool_hits), atomic64_read(&bafs_pool_misses));
+
+    return len;
+}
+
+int bafs_pool_init(void)
+{
+    int ret = 0;
+    int nid;
+    int class;
+    struct bafs_pool_node* pn;
+
+    for_each_node(nid) {
+        pn = kzalloc_node(sizeof(*pn), GFP_KERNEL, nid);
+        if (!pn) {
+            ret = -ENOMEM;
+            BAFS_CORE_ERR("Failed to allocate pool for node %d\n", nid);
+            goto out_free_nodes;
+        }
+        spin_lock_init(&pn->lock);
+        for (class = 0; class < BAFS_POOL_CLASSES; class++) {
+            INIT_LIST_HEAD(&pn->clean[class]);
+            INIT_LIST_HEAD(&pn->dirty[class]);
+        }
+        bafs_pool_nodes[nid] = pn;
+    }
+
+    ret = register_shrinker(&bafs_pool_shrinker);
+    if (ret) {
+        BAFS_CORE_ERR("Failed to register pool shrinker \t err = %d\n", ret);
+        goto out_free_nodes;
+    }
+
+    bafs_pool_scrubber = kthread_run(bafs_pool_scrub, NULL, "bafs_scrub");
+    if (IS_ERR(bafs_pool_scrubber)) {
+        ret                = PTR_ERR(bafs_pool_scrubber);
+        bafs_pool_scrubber = NULL;
+        BAFS_CORE_ERR("Failed to start pool scrubber \t err = %d\n", ret);
+        goto out_unregister_shrinker;
+    }
+
+    return ret;
+
+out_unregister_shrinker:
+    unregister_shrinker(&bafs_pool_shrinker);
+out_free_nodes:
+    for_each_node(nid) {
+        kfree(bafs_pool_nodes[nid]);
+        bafs_pool_nodes[nid] = NULL;
+    }
+    return ret;
+}
+
+void bafs_pool_fini(void)
+{
+    int nid;
+
+    if (bafs_pool_scrubber == NULL) return;
+
+    kthread_stop(bafs_pool_scrubber);
+    bafs_pool_scrubber = NULL;
+    unregister_shrinker(&bafs_pool_shrinker);
+
+    bafs_pool_drain(ULONG_MAX);
+
+    for_each_node(nid) {
+        kfree(bafs_pool_nodes[nid]);
+        bafs_pool_nodes[nid] = NULL;
+    }
+}
@@ -0,0 +1,796 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/pci.h>
+#include <linux/nvme.h>
+#include <linux/delay.h>
+#include <linux/dma-mapping.h>
+#include <linux/mm.h>
+#include <linux/interrupt.h>
+#include <linux/eventfd.h>
+#include <linux/io-64-nonatomic-lo-hi.h>
+#include <asm/uaccess.h>
+
+#include <linux/bafs.h>
+
+#include <linux/bafs/util.h>
+#include <linux/bafs/types.h>
+
+
+static bool admin_queue = false;
+module_param(admin_queue, bool, 0444);
+MODULE_PARM_DESC(admin_queue, "Reset controllers at probe and keep their admin queue in the driver, processes then create io queue pairs instead of mapping BAR0");
+
+static bool admin_db_shared = false;
+module_param(admin_db_shared, bool, 0444);
+MODULE_PARM_DESC(admin_db_shared, "Hand out io queues whose doorbell page also holds the admin doorbells, only for trusted processes");
+
+static unsigned int queue_irqs = 0;
+module_param(queue_irqs, uint, 0444);
+MODULE_PARM_DESC(queue_irqs, "Msi-x vectors per controller for io cqs that wait on an eventfd, 0 keeps every queue polled");
+
+#define BAFS_ADMIN_DEPTH      32
+#define BAFS_QP_DEFAULT_DEPTH 256
+#define BAFS_ADMIN_TIMEOUT    (10 * HZ)
+
+static
+int bafs_admin_wait_ready(struct bafs_admin* admin, const bool enabled)
+{
+    u32           csts;
+    unsigned long timeout = jiffies + ((NVME_CAP_TIMEOUT(admin->cap) + 1) * HZ / 2);
+
+    for (;;) {
+        csts = readl(admin->bar + NVME_REG_CSTS);
+        /* a removed device reads all ones */
+        if (csts == ~0U)
+            return -ENODEV;
+        if (!!(csts & NVME_CSTS_RDY) == enabled)
+            return 0;
+        if (enabled && (csts & NVME_CSTS_CFS))
+            return -EIO;
+        if (time_after(jiffies, timeout))
+            return -ETIMEDOUT;
+        msleep(1);
+    }
+}
+
+static
+void bafs_admin_disable(struct bafs_admin* admin)
+{
+    u32 cc = readl(admin->bar + NVME_REG_CC);
+
+    writel(cc & ~NVME_CC_ENABLE, admin->bar + NVME_REG_CC);
+    if (bafs_admin_wait_ready(admin, false))
+        BAFS_CTRL_ERR("Controller did not leave ready after the reset\n");
+}
+
+/*
+ * Submits one command and polls for its completion, interrupts stay off on bafs controllers.
+ * With admin_db_shared a process can ring the admin doorbells, so completions of other
+ * command ids are consumed and dropped, and used slots are zeroed: a replayed slot is a
+ * delete of sq 0, which the controller rejects. The caller holds admin->lock.
+ */
+static
+int bafs_admin_submit_locked(struct bafs_admin* admin, struct nvme_command* cmd, u32* result)
+{
+    int                     ret = 0;
+    u16                     slot;
+    u16                     status;
+    u16                     command_id;
+    unsigned long           timeout;
+    struct nvme_completion* cqe;
+
+    if (admin->dead) {
+        ret = -EIO;
+        goto out;
+    }
+
+    command_id             = admin->command_id++;
+    cmd->common.command_id = command_id;
+    slot                   = admin->sq_tail;
+    memcpy(&admin->sq[slot], cmd, sizeof(*cmd));
+    if (++admin->sq_tail == admin->depth)
+        admin->sq_tail = 0;
+    /* writel orders the entry before the doorbell */
+    writel(admin->sq_tail, admin->bar + NVME_REG_DBS);
+
+    timeout = jiffies + BAFS_ADMIN_TIMEOUT;
+    for (;;) {
+        cqe = &admin->cq[admin->cq_head];
+        while ((le16_to_cpu(READ_ONCE(cqe->status)) & 1) != admin->cq_phase) {
+            if (time_after(jiffies, timeout)) {
+                admin->dead = true;
+                ret         = -ETIMEDOUT;
+                BAFS_CTRL_ERR("Admin command %#x timed out, the admin queue is disabled\n", cmd->common.opcode);
+                goto out;
+            }
+            usleep_range(10, 50);
+        }
+        /* the rest of the entry is only valid once its phase flipped */
+        dma_rmb();
+        status = le16_to_cpu(cqe->status) >> 1;
+        if (result)
+            *result = le32_to_cpu(cqe->result.u32);
+
+        if (++admin->cq_head == admin->depth) {
+            admin->cq_head   = 0;
+            admin->cq_phase ^= 1;
+        }
+        writel(admin->cq_head, admin->bar + NVME_REG_DBS + admin->db_stride);
+
+        if (cqe->command_id == command_id)
+            break;
+        BAFS_CTRL_ERR("Dropped an admin completion of command id %u the driver did not submit\n",
+                      cqe->command_id);
+    }
+    memset(&admin->sq[slot], 0, sizeof(admin->sq[slot]));
+
+    if (status) {
+        ret = -EIO;
+        BAFS_CTRL_ERR("Admin command %#x failed \t status = %#x\n", cmd->common.opcode, status);
+    }
+
+out:
+    return ret;
+}
+
+static
+int bafs_admin_submit(struct bafs_admin* admin, struct nvme_command* cmd, u32* result)
+{
+    int ret;
+
+    mutex_lock(&admin->lock);
+    ret = bafs_admin_submit_locked(admin, cmd, result);
+    mutex_unlock(&admin->lock);
+    return ret;
+}
+
+/*
+ * With the admin_queue parameter set the controller is reset and its admin
+ * queue brought up here, following the nvme driver. Without it nothing is
+ * touched and userspace drives the controller through BAR0 as before.
+ */
+int bafs_ctrl_admin_init(struct bafs_ctrl* ctrl)
+{
+    int                 ret = 0;
+    u32                 cc;
+    u32                 result;
+    u32                 mps = PAGE_SHIFT - 12;
+    struct pci_dev*     pdev = ctrl->pdev;
+    struct bafs_admin*  admin;
+    struct nvme_command cmd = {};
+
+    if (!admin_queue)
+        goto out;
+
+    admin = kzalloc(sizeof(*admin), GFP_KERNEL);
+    if (!admin) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    mutex_init(&admin->lock);
+    ida_init(&admin->qids);
+    ida_init(&admin->vecs);
+    admin->depth    = BAFS_ADMIN_DEPTH;
+    admin->cq_phase = 1;
+
+    admin->bar = pci_iomap(pdev, 0, 0);
+    if (!admin->bar) {
+        ret = -ENOMEM;
+        goto out_free_admin;
+    }
+
+    admin->cap = lo_hi_readq(admin->bar + NVME_REG_CAP);
+    if (admin->cap == ~0ULL) {
+        ret = -ENODEV;
+        goto out_unmap;
+    }
+    admin->db_stride = 4 << NVME_CAP_STRIDE(admin->cap);
+    admin->mqes      = NVME_CAP_MQES(admin->cap);
+    if ((mps < NVME_CAP_MPSMIN(admin->cap)) || (mps > NVME_CAP_MPSMAX(admin->cap))) {
+        ret = -ENODEV;
+        BAFS_CTRL_ERR("Ctrl %d does not support the host page size\n", ctrl->ctrl_id);
+        goto out_unmap;
+    }
+
+    /* whatever a previous owner left in the queues goes away with the reset */
+    cc = readl(admin->bar + NVME_REG_CC);
+    if (cc & NVME_CC_ENABLE)
+        writel(cc & ~NVME_CC_ENABLE, admin->bar + NVME_REG_CC);
+    ret = bafs_admin_wait_ready(admin, false);
+    if (ret) {
+        BAFS_CTRL_ERR("Failed to reset ctrl %d \t err = %d\n", ctrl->ctrl_id, ret);
+        goto out_unmap;
+    }
+    /* the admin cq always interrupts and nothing handles INTx, msi-x turns it off again anyway */
+    pci_intx(pdev, 0);
+
+    admin->sq = dma_alloc_coherent(&pdev->dev, admin->depth * sizeof(*admin->sq), &admin->sq_dma, GFP_KERNEL);
+    if (!admin->sq) {
+        ret = -ENOMEM;
+        goto out_unmap;
+    }
+    admin->cq = dma_alloc_coherent(&pdev->dev, admin->depth * sizeof(*admin->cq), &admin->cq_dma, GFP_KERNEL);
+    if (!admin->cq) {
+        ret = -ENOMEM;
+        goto out_free_sq;
+    }
+
+    writel((admin->depth - 1) | ((admin->depth - 1) << 16), admin->bar + NVME_REG_AQA);
+    lo_hi_writeq(admin->sq_dma, admin->bar + NVME_REG_ASQ);
+    lo_hi_writeq(admin->cq_dma, admin->bar + NVME_REG_ACQ);
+
+    cc = NVME_CC_CSS_NVM | (mps << NVME_CC_MPS_SHIFT) | NVME_CC_AMS_RR | NVME_CC_SHN_NONE |
+         NVME_CC_IOSQES | NVME_CC_IOCQES | NVME_CC_ENABLE;
+    writel(cc, admin->bar + NVME_REG_CC);
+    ret = bafs_admin_wait_ready(admin, true);
+    if (ret) {
+        BAFS_CTRL_ERR("Failed to enable ctrl %d \t err = %d\n", ctrl->ctrl_id, ret);
+        goto out_disable;
+    }
+
+    /* ask for every queue, the controller answers with how many it allocated */
+    cmd.features.opcode  = nvme_admin_set_features;
+    cmd.features.fid     = cpu_to_le32(NVME_FEAT_NUM_QUEUES);
+    cmd.features.dword11 = cpu_to_le32(0xfffe | (0xfffe << 16));
+    ret = bafs_admin_submit(admin, &cmd, &result);
+    if (ret)
+        goto out_disable;
+    admin->max_qid = min(result & 0xffff, result >> 16) + 1;
+
+    /* queues from first_qid on have doorbell pages without the admin doorbells, when there are any */
+    admin->admin_db_end = PAGE_ALIGN(NVME_REG_DBS + 2 * admin->db_stride);
+    admin->first_qid    = DIV_ROUND_UP(admin->admin_db_end - NVME_REG_DBS, 2 * admin->db_stride);
+    if (admin->first_qid > admin->max_qid)
+        admin->first_qid = 1;
+
+    /* the reset leaves coalescing at the controller default, which irq_coalesce reports */
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.features.opcode = nvme_admin_get_features;
+    cmd.features.fid    = cpu_to_le32(NVME_FEAT_IRQ_COALESCE);
+    if (bafs_admin_submit(admin, &cmd, &result)) {
+        BAFS_CTRL_INFO("Ctrl %d did not report its interrupt coalescing, assuming none\n", ctrl->ctrl_id);
+    }
+    else {
+        admin->irq_thr  = result & 0xff;
+        admin->irq_time = (result >> 8) & 0xff;
+    }
+
+    /* the admin queue keeps vector 0 without ever enabling it, it is polled */
+    if (queue_irqs) {
+        ret = pci_alloc_irq_vectors(pdev, 2, min_t(unsigned, queue_irqs, admin->max_qid) + 1, PCI_IRQ_MSIX);
+        if (ret < 0)
+            BAFS_CTRL_INFO("Ctrl %d has no msi-x vectors for io queues, they stay polled \t err = %d\n",
+                           ctrl->ctrl_id, ret);
+        else
+            admin->n_vecs = ret;
+        ret = 0;
+    }
+
+    ctrl->admin = admin;
+    BAFS_CTRL_INFO("Ctrl %d admin queue owned by the driver, %u io queue pairs of up to %u entries, %u with interrupts\n",
+                   ctrl->ctrl_id, admin->max_qid, admin->mqes + 1, admin->n_vecs ? admin->n_vecs - 1 : 0);
+    return ret;
+
+out_disable:
+    bafs_admin_disable(admin);
+    dma_free_coherent(&pdev->dev, admin->depth * sizeof(*admin->cq), admin->cq, admin->cq_dma);
+out_free_sq:
+    dma_free_coherent(&pdev->dev, admin->depth * sizeof(*admin->sq), admin->sq, admin->sq_dma);
+out_unmap:
+    pci_iounmap(pdev, admin->bar);
+out_free_admin:
+    ida_destroy(&admin->vecs);
+    ida_destroy(&admin->qids);
+    kfree(admin);
+out:
+    return ret;
+}
+
+/* every queue pair went with the files holding the ctrl, the reset stops the admin queue */
+void bafs_ctrl_admin_fini(struct bafs_ctrl* ctrl)
+{
+    struct pci_dev*    pdev  = ctrl->pdev;
+    struct bafs_admin* admin = ctrl->admin;
+
+    if (!admin)
+        return;
+
+    bafs_admin_disable(admin);
+    if (admin->n_vecs)
+        pci_free_irq_vectors(pdev);
+    dma_free_coherent(&pdev->dev, admin->depth * sizeof(*admin->cq), admin->cq, admin->cq_dma);
+    dma_free_coherent(&pdev->dev, admin->depth * sizeof(*admin->sq), admin->sq, admin->sq_dma);
+    pci_iounmap(pdev, admin->bar);
+    ida_destroy(&admin->vecs);
+    ida_destroy(&admin->qids);
+    kfree(admin);
+    ctrl->admin = NULL;
+}
+
+/* coalescing applies to every vector that did not opt out, thr is 0 based and time in 100us */
+int bafs_ctrl_set_irq_coalesce(struct bafs_ctrl* ctrl, const u8 thr, const u8 time)
+{
+    int                 ret = 0;
+    struct bafs_admin*  admin = ctrl->admin;
+    struct nvme_command cmd = {};
+
+    if (!admin || !admin->n_vecs) {
+        ret = -EOPNOTSUPP;
+        goto out;
+    }
+
+    cmd.features.opcode  = nvme_admin_set_features;
+    cmd.features.fid     = cpu_to_le32(NVME_FEAT_IRQ_COALESCE);
+    cmd.features.dword11 = cpu_to_le32(thr | (time << 8));
+
+    /* the cached setting changes with the command, so concurrent stores cannot leave it stale */
+    mutex_lock(&admin->lock);
+    ret = bafs_admin_submit_locked(admin, &cmd, NULL);
+    if (!ret) {
+        admin->irq_thr  = thr;
+        admin->irq_time = time;
+    }
+    mutex_unlock(&admin->lock);
+    if (ret)
+        goto out;
+
+    BAFS_CTRL_DEBUG("Ctrl %d coalesces %u completions or %uus\n", ctrl->ctrl_id, thr + 1, time * 100);
+
+out:
+    return ret;
+}
+
+void bafs_ctrl_get_irq_coalesce(struct bafs_ctrl* ctrl, u8* thr, u8* time)
+{
+    struct bafs_admin* admin = ctrl->admin;
+
+    mutex_lock(&admin->lock);
+    *thr  = admin->irq_thr;
+    *time = admin->irq_time;
+    mutex_unlock(&admin->lock);
+}
+
+static
+int bafs_admin_delete_queue(struct bafs_admin* admin, const u8 opcode, const u16 qid)
+{
+    struct nvme_command cmd = {};
+
+    cmd.delete_queue.opcode = opcode;
+    cmd.delete_queue.qid    = cpu_to_le16(qid);
+    return bafs_admin_submit(admin, &cmd, NULL);
+}
+
+/*
+ * The pair holds its own reference on the mapping and the region, so an unmap
+ * or dereg through the fd cannot pull the ring out from under the controller.
+ */
+static
+int bafs_qp_map_ring(struct bafs_ctrl* ctrl, struct bafs_ctx* ctx, const bafs_mem_hnd_t handle,
+                     const size_t size, struct bafs_mem_dma** dma_, dma_addr_t* base)
+{
+    int ret = 0;
+
+    struct bafs_mem*     mem;
+    struct bafs_mem_dma* dma;
+
+    mem = bafs_get_mem_by_handle(handle, ctx);
+    if (!mem) {
+        ret = -ENOENT;
+        goto out;
+    }
+
+    if ((mem->loc != BAFS_MEM_CPU) && (mem->loc != BAFS_MEM_USER)) {
+        ret = -EOPNOTSUPP;
+        BAFS_CTRL_ERR("Queues can only live in cpu or user memory\n");
+        goto out_put_mem;
+    }
+
+    ret = bafs_ctrl_dma_map(ctrl, mem, 0, size, &dma);
+    if (ret < 0) {
+        goto out_put_mem;
+    }
+
+    /* the controller walks a queue as one physically contiguous range */
+    if (dma->sgt.nents == 1)
+        *base = sg_dma_address(dma->sgt.sgl);
+    else
+        ret = bafs_dma_contig_base(dma, base);
+    if (ret < 0) {
+        bafs_ctrl_dma_unmap_mem(ctrl, dma);
+        goto out_put_mem;
+    }
+
+    kref_get(&dma->ref);
+    bafs_ctrl_dma_unmap_mem(ctrl, dma);
+    *dma_ = dma;
+    return ret;
+
+out_put_mem:
+    bafs_mem_put(mem);
+out:
+    return ret;
+}
+
+static
+void bafs_qp_unmap_ring(struct bafs_mem_dma* dma)
+{
+    struct bafs_mem* mem = dma->mem;
+
+    bafs_mem_dma_put(dma);
+    bafs_mem_put(mem);
+}
+
+static
+int bafs_qp_alloc_rings(struct bafs_ctrl* ctrl, struct bafs_qp* qp)
+{
+    struct device* dev = &ctrl->pdev->dev;
+
+    qp->sq = dma_alloc_coherent(dev, PAGE_ALIGN(qp->sq_size), &qp->sq_dma, GFP_KERNEL);
+    if (!qp->sq)
+        return -ENOMEM;
+
+    qp->cq = dma_alloc_coherent(dev, PAGE_ALIGN(qp->cq_size), &qp->cq_dma, GFP_KERNEL);
+    if (!qp->cq) {
+        dma_free_coherent(dev, PAGE_ALIGN(qp->sq_size), qp->sq, qp->sq_dma);
+        qp->sq = NULL;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static
+void bafs_qp_free_rings(struct bafs_ctrl* ctrl, struct bafs_qp* qp)
+{
+    struct device* dev = &ctrl->pdev->dev;
+
+    if (qp->sq)
+        dma_free_coherent(dev, PAGE_ALIGN(qp->sq_size), qp->sq, qp->sq_dma);
+    if (qp->cq)
+        dma_free_coherent(dev, PAGE_ALIGN(qp->cq_size), qp->cq, qp->cq_dma);
+    if (qp->sq_map)
+        bafs_qp_unmap_ring(qp->sq_map);
+    if (qp->cq_map)
+        bafs_qp_unmap_ring(qp->cq_map);
+}
+
+/* the process drains the cq itself, the handler only wakes it */
+static
+irqreturn_t bafs_qp_irq(int irq, void* data)
+{
+    struct bafs_qp* qp = data;
+
+    eventfd_signal(qp->eventfd, 1);
+    return IRQ_HANDLED;
+}
+
+static
+int bafs_qp_irq_setup(struct bafs_ctrl* ctrl, struct bafs_qp* qp, const int fd)
+{
+    int                ret = 0;
+    int                vec;
+    struct bafs_admin* admin = ctrl->admin;
+
+    if (admin->n_vecs < 2) {
+        ret = -EOPNOTSUPP;
+        BAFS_CTRL_ERR("Ctrl %d has no vectors for io queues, load with queue_irqs set\n", ctrl->ctrl_id);
+        goto out;
+    }
+
+    qp->eventfd = eventfd_ctx_fdget(fd);
+    if (IS_ERR(qp->eventfd)) {
+        ret         = PTR_ERR(qp->eventfd);
+        qp->eventfd = NULL;
+        goto out;
+    }
+
+    vec = ida_alloc_range(&admin->vecs, 1, admin->n_vecs - 1, GFP_KERNEL);
+    if (vec < 0) {
+        ret = (vec == -ENOSPC) ? -EBUSY : vec;
+        BAFS_CTRL_ERR("No free msi-x vector on ctrl %d\n", ctrl->ctrl_id);
+        goto out_put_eventfd;
+    }
+    qp->vector = vec;
+
+    snprintf(qp->irq_name, sizeof(qp->irq_name), BAFS_CTRL_DEVICE_NAME "q%u", ctrl->ctrl_id, qp->qid);
+    ret = request_irq(pci_irq_vector(ctrl->pdev, vec), bafs_qp_irq, 0, qp->irq_name, qp);
+    if (ret < 0) {
+        goto out_free_vec;
+    }
+
+    return ret;
+
+out_free_vec:
+    ida_free(&admin->vecs, vec);
+    qp->vector = 0;
+out_put_eventfd:
+    eventfd_ctx_put(qp->eventfd);
+    qp->eventfd = NULL;
+out:
+    return ret;
+}
+
+/* a vector the controller may still target is not handed out again */
+static
+void bafs_qp_irq_teardown(struct bafs_ctrl* ctrl, struct bafs_qp* qp, const bool reuse_vector)
+{
+    if (!qp->eventfd)
+        return;
+
+    free_irq(pci_irq_vector(ctrl->pdev, qp->vector), qp);
+    if (reuse_vector)
+        ida_free(&ctrl->admin->vecs, qp->vector);
+    eventfd_ctx_put(qp->eventfd);
+    qp->eventfd = NULL;
+    qp->vector  = 0;
+}
+
+static
+void bafs_qp_destroy(struct bafs_ctrl* ctrl, struct bafs_qp* qp)
+{
+    int ret;
+
+    ret = bafs_admin_delete_queue(ctrl->admin, nvme_admin_delete_sq, qp->qid);
+    if (!ret)
+        ret = bafs_admin_delete_queue(ctrl->admin, nvme_admin_delete_cq, qp->qid);
+    if (ret) {
+        /* the controller may still write the rings, they are leaked rather than reused */
+        BAFS_CTRL_ERR("Failed to delete io queue %u of ctrl %d, leaking its rings\n", qp->qid, ctrl->ctrl_id);
+        bafs_qp_irq_teardown(ctrl, qp, false);
+        kfree(qp);
+        return;
+    }
+
+    bafs_qp_irq_teardown(ctrl, qp, true);
+    bafs_qp_free_rings(ctrl, qp);
+    ida_free(&ctrl->admin->qids, qp->qid);
+    kfree(qp);
+}
+
+long bafs_ctrl_create_qp(struct bafs_ctrl* ctrl, struct bafs_ctrl_ctx* ctrl_ctx, void __user* user_params)
+{
+    long ret = 0;
+
+    int                              qid;
+    u32                              depth;
+    resource_size_t                  db;
+    struct bafs_qp*                  qp;
+    struct bafs_admin*               admin = ctrl->admin;
+    struct nvme_command              cmd;
+    struct BAFS_IOC_CREATE_QP_PARAMS params;
+
+    if (!admin) {
+        ret = -EOPNOTSUPP;
+        BAFS_CTRL_ERR("Ctrl %d is driven from userspace, load with admin_queue=1 for queue pairs\n", ctrl->ctrl_id);
+        goto out;
+    }
+
+    if (copy_from_user(&params, user_params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params from user\n");
+        goto out;
+    }
+
+    if ((params.flags & ~(BAFS_QP_FLAG_USER_MEM | BAFS_QP_FLAG_IRQ | BAFS_QP_FLAG_IRQ_NO_COALESCE)) ||
+        ((params.flags & BAFS_QP_FLAG_IRQ_NO_COALESCE) && !(params.flags & BAFS_QP_FLAG_IRQ))) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    depth = params.depth ? params.depth : BAFS_QP_DEFAULT_DEPTH;
+    depth = clamp_t(u32, depth, 2, admin->mqes + 1);
+
+    qp = kzalloc(sizeof(*qp), GFP_KERNEL);
+    if (!qp) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    qid = ida_alloc_range(&admin->qids, admin->first_qid, admin->max_qid, GFP_KERNEL);
+    if (qid < 0) {
+        ret = (qid == -ENOSPC) ? -EBUSY : qid;
+        BAFS_CTRL_ERR("No free io queue on ctrl %d\n", ctrl->ctrl_id);
+        goto out_free_qp;
+    }
+
+    /*
+     * The sq tail doorbell is followed by the cq head doorbell. Unless the stride is
+     * a page the page is shared with the doorbells of other queues, so the split
+     * between processes is only as strong as their cooperation. A page that also
+     * holds the admin doorbells would let the process move the admin tail.
+     */
+    db          = NVME_REG_DBS + 2 * qid * admin->db_stride;
+    qp->db_page = db & PAGE_MASK;
+    qp->db_len  = PAGE_ALIGN(db + admin->db_stride + sizeof(u32)) - qp->db_page;
+    if (qp->db_page < admin->admin_db_end && !admin_db_shared) {
+        ret = -EPERM;
+        BAFS_CTRL_ERR("Doorbells of io queue %d share a page with the admin doorbells of ctrl %d, load with admin_db_shared=1 to allow\n",
+                      qid, ctrl->ctrl_id);
+        goto out_free_qid;
+    }
+
+    qp->qid     = qid;
+    qp->depth   = depth;
+    qp->sq_size = depth * sizeof(struct nvme_command);
+    qp->cq_size = depth * sizeof(struct nvme_completion);
+
+    if (params.flags & BAFS_QP_FLAG_USER_MEM) {
+        ret = bafs_qp_map_ring(ctrl, ctrl_ctx->ctx, params.sq_handle, qp->sq_size, &qp->sq_map, &qp->sq_dma);
+        if (!ret)
+            ret = bafs_qp_map_ring(ctrl, ctrl_ctx->ctx, params.cq_handle, qp->cq_size, &qp->cq_map, &qp->cq_dma);
+    }
+    else {
+        ret = bafs_qp_alloc_rings(ctrl, qp);
+    }
+    if (ret < 0) {
+        goto out_free_rings;
+    }
+
+    /* the handler is in place before the controller can raise the vector */
+    if (params.flags & BAFS_QP_FLAG_IRQ) {
+        ret = bafs_qp_irq_setup(ctrl, qp, params.eventfd);
+        if (ret < 0) {
+            goto out_free_rings;
+        }
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.create_cq.opcode     = nvme_admin_create_cq;
+    cmd.create_cq.prp1       = cpu_to_le64(qp->cq_dma);
+    cmd.create_cq.cqid       = cpu_to_le16(qid);
+    cmd.create_cq.qsize      = cpu_to_le16(depth - 1);
+    cmd.create_cq.cq_flags   = cpu_to_le16(NVME_QUEUE_PHYS_CONTIG | (qp->eventfd ? NVME_CQ_IRQ_ENABLED : 0));
+    cmd.create_cq.irq_vector = cpu_to_le16(qp->vector);
+    ret = bafs_admin_submit(admin, &cmd, NULL);
+    if (ret < 0) {
+        goto out_irq_teardown;
+    }
+
+    if (params.flags & BAFS_QP_FLAG_IRQ_NO_COALESCE) {
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.features.opcode  = nvme_admin_set_features;
+        cmd.features.fid     = cpu_to_le32(NVME_FEAT_IRQ_CONFIG);
+        cmd.features.dword11 = cpu_to_le32(qp->vector | (1 << 16));
+        ret = bafs_admin_submit(admin, &cmd, NULL);
+        if (ret < 0) {
+            goto out_delete_cq;
+        }
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.create_sq.opcode   = nvme_admin_create_sq;
+    cmd.create_sq.prp1     = cpu_to_le64(qp->sq_dma);
+    cmd.create_sq.sqid     = cpu_to_le16(qid);
+    cmd.create_sq.qsize    = cpu_to_le16(depth - 1);
+    cmd.create_sq.sq_flags = cpu_to_le16(NVME_QUEUE_PHYS_CONTIG | NVME_SQ_PRIO_MEDIUM);
+    cmd.create_sq.cqid     = cpu_to_le16(qid);
+    ret = bafs_admin_submit(admin, &cmd, NULL);
+    if (ret < 0) {
+        goto out_delete_cq;
+    }
+
+    params.depth     = depth;
+    params.qid       = qid;
+    params.db_stride = admin->db_stride;
+    params.sq_offset = qp->sq ? BAFS_MMAP_QP_OFFSET(qid, BAFS_QP_SQ) : 0;
+    params.cq_offset = qp->cq ? BAFS_MMAP_QP_OFFSET(qid, BAFS_QP_CQ) : 0;
+    params.db_offset = BAFS_MMAP_QP_OFFSET(qid, BAFS_QP_DB);
+    params.db_len    = qp->db_len;
+    params.sq_db     = db - qp->db_page;
+    params.cq_db     = params.sq_db + admin->db_stride;
+    params.irq_vector = qp->vector;
+
+    /* nothing can mmap the pair before it is on the list, so a failed copy just deletes it */
+    if (copy_to_user(user_params, &params, sizeof(params))) {
+        ret = -EFAULT;
+        BAFS_CTRL_ERR("Failed to copy params to user\n");
+        bafs_qp_destroy(ctrl, qp);
+        goto out;
+    }
+
+    spin_lock(&ctrl_ctx->qp_lock);
+    list_add(&qp->list, &ctrl_ctx->qp_list);
+    spin_unlock(&ctrl_ctx->qp_lock);
+
+    BAFS_CTRL_DEBUG("Created io queue %u of depth %u on ctrl %d\n", qid, depth, ctrl->ctrl_id);
+    return ret;
+
+out_delete_cq:
+    if (bafs_admin_delete_queue(admin, nvme_admin_delete_cq, qid)) {
+        BAFS_CTRL_ERR("Failed to delete io cq %u of ctrl %d, leaking its ring\n", qid, ctrl->ctrl_id);
+        bafs_qp_irq_teardown(ctrl, qp, false);
+        goto out_free_qp;
+    }
+out_irq_teardown:
+    bafs_qp_irq_teardown(ctrl, qp, true);
+out_free_rings:
+    bafs_qp_free_rings(ctrl, qp);
+out_free_qid:
+    ida_free(&admin->qids, qid);
+out_free_qp:
+    kfree(qp);
+out:
+    return ret;
+}
+
+/* the file is going away, so no mmap or ioctl can look at the pairs any more */
+void bafs_ctrl_destroy_qps(struct bafs_ctrl* ctrl, struct bafs_ctrl_ctx* ctrl_ctx)
+{
+    struct bafs_qp* qp;
+    struct bafs_qp* next;
+    LIST_HEAD(qps);
+
+    spin_lock(&ctrl_ctx->qp_lock);
+    list_splice_init(&ctrl_ctx->qp_list, &qps);
+    spin_unlock(&ctrl_ctx->qp_lock);
+
+    list_for_each_entry_safe(qp, next, &qps, list) {
+        list_del(&qp->list);
+        bafs_qp_destroy(ctrl, qp);
+    }
+}
+
+/* every mapping holds the file, so the pair outlives it */
+int bafs_ctrl_mmap_qp(struct bafs_ctrl* ctrl, struct bafs_ctrl_ctx* ctrl_ctx, struct vm_area_struct* vma)
+{
+    int ret = 0;
+
+    u64             offset = (u64) vma->vm_pgoff << PAGE_SHIFT;
+    u16             qid    = BAFS_MMAP_QP_QID(offset);
+    unsigned long   size   = vma->vm_end - vma->vm_start;
+    struct bafs_qp* qp;
+    struct bafs_qp* found  = NULL;
+
+    spin_lock(&ctrl_ctx->qp_lock);
+    list_for_each_entry(qp, &ctrl_ctx->qp_list, list) {
+        if (qp->qid == qid) {
+            found = qp;
+            break;
+        }
+    }
+    spin_unlock(&ctrl_ctx->qp_lock);
+    if (!found) {
+        ret = -EINVAL;
+        goto out;
+    }
+    qp = found;
+
+    vma->vm_flags |= VM_DONTCOPY;
+    switch (BAFS_MMAP_QP_PART(offset)) {
+    case BAFS_QP_SQ:
+        if (!qp->sq || (size > PAGE_ALIGN(qp->sq_size))) {
+            ret = -EINVAL;
+            goto out;
+        }
+        /* dma_mmap_coherent takes the offset into the buffer from vm_pgoff */
+        vma->vm_pgoff = 0;
+        ret = dma_mmap_coherent(&ctrl->pdev->dev, vma, qp->sq, qp->sq_dma, PAGE_ALIGN(qp->sq_size));
+        break;
+    case BAFS_QP_CQ:
+        if (!qp->cq || (size > PAGE_ALIGN(qp->cq_size))) {
+            ret = -EINVAL;
+            goto out;
+        }
+        vma->vm_pgoff = 0;
+        ret = dma_mmap_coherent(&ctrl->pdev->dev, vma, qp->cq, qp->cq_dma, PAGE_ALIGN(qp->cq_size));
+        break;
+    case BAFS_QP_DB:
+        if (size > qp->db_len) {
+            ret = -EINVAL;
+            goto out;
+        }
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+        ret = io_remap_pfn_range(vma, vma->vm_start,
+                                 (pci_resource_start(ctrl->pdev, 0) + qp->db_page) >> PAGE_SHIFT,
+                                 size, vma->vm_page_prot);
+        break;
+    default:
+        ret = -EINVAL;
+        break;
+    }
+    if (ret)
+        BAFS_CTRL_ERR("Failed to mmap part %u of io queue %u \t err = %d\n", BAFS_MMAP_QP_PART(offset), qid, ret);
+
+out:
+    return ret;
+}
@@ -0,0 +1,188 @@
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+
+#include <linux/bafs.h>
+
+#include <linux/bafs/util.h>
+#include <linux/bafs/types.h>
+
+
+static const char* const bafs_stat_names[BAFS_STAT_N] = {
+    [BAFS_STAT_IOCTLS]                        = "ioctls",
+    [BAFS_STAT_PINNED + BAFS_MEM_CPU]         = "pinned_cpu_bytes",
+    [BAFS_STAT_PINNED + BAFS_MEM_CUDA]        = "pinned_cuda_bytes",
+    [BAFS_STAT_PINNED + BAFS_MEM_USER]        = "pinned_user_bytes",
+    [BAFS_STAT_PINNED + BAFS_MEM_DMABUF]      = "pinned_dmabuf_bytes",
+    [BAFS_STAT_PINNED + BAFS_MEM_CMB]         = "pinned_cmb_bytes",
+    [BAFS_STAT_DMA_MAPS]                      = "dma_maps",
+    [BAFS_STAT_IOVA_BYTES]                    = "iova_bytes",
+};
+
+static const char* const bafs_stat_op_names[BAFS_OP_N] = {
+    [BAFS_OP_REG]   = "reg",
+    [BAFS_OP_PIN]   = "pin",
+    [BAFS_OP_MAP]   = "map",
+    [BAFS_OP_UNMAP] = "unmap",
+};
+
+static struct dentry* bafs_debugfs_root = NULL;
+static struct dentry* bafs_debugfs_ctx  = NULL;
+static atomic_t       bafs_ctx_seq      = ATOMIC_INIT(0);
+
+int bafs_stats_alloc(struct bafs_stats* stats)
+{
+    stats->cpu = alloc_percpu(struct bafs_stats_cpu);
+    return stats->cpu ? 0 : -ENOMEM;
+}
+
+void bafs_stats_free(struct bafs_stats* stats)
+{
+    free_percpu(stats->cpu);
+    stats->cpu = NULL;
+}
+
+static inline
+struct bafs_stats* bafs_ctx_parent_stats(struct bafs_ctx* ctx)
+{
+    if (ctx->ctrl)
+        return &ctx->ctrl->stats;
+    if (ctx->group)
+        return &ctx->group->stats;
+    return NULL;
+}
+
+/*
+ * Charges the ctx, the device it was opened on and, when it is another one,
+ * the controller the event happened on. Safe in atomic context.
+ */
+void bafs_stats_add(struct bafs_ctx* ctx, struct bafs_ctrl* ctrl, unsigned stat, s64 delta)
+{
+    struct bafs_stats* parent = bafs_ctx_parent_stats(ctx);
+
+    this_cpu_add(ctx->stats.cpu->val[stat], delta);
+    if (parent)
+        this_cpu_add(parent->cpu->val[stat], delta);
+    if (ctrl && (ctrl != ctx->ctrl))
+        this_cpu_add(ctrl->stats.cpu->val[stat], delta);
+}
+
+static inline
+unsigned bafs_stats_bucket(const u64 ns)
+{
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+
+    if (us < 2)
+        return 0;
+    return min_t(unsigned, ilog2(us), BAFS_STAT_LAT_BUCKETS - 1);
+}
+
+/* records the time since start, a ktime_get_ns() taken when the operation began */
+void bafs_stats_latency(struct bafs_ctx* ctx, struct bafs_ctrl* ctrl, unsigned op, const u64 start)
+{
+    struct bafs_stats* parent = bafs_ctx_parent_stats(ctx);
+    unsigned           b      = bafs_stats_bucket(ktime_get_ns() - start);
+
+    this_cpu_inc(ctx->stats.cpu->lat[op][b]);
+    if (parent)
+        this_cpu_inc(parent->cpu->lat[op][b]);
+    if (ctrl && (ctrl != ctx->ctrl))
+        this_cpu_inc(ctrl->stats.cpu->lat[op][b]);
+}
+
+/*
+ * One "name value" line per counter, then one "<op>_us <lower bound> <count>"
+ * line per non empty latency bucket. Counters updated while the cpus are summed
+ * may be off by the updates in flight.
+ */
+int bafs_stats_emit(struct bafs_stats* stats, char* buf)
+{
+    int                    cpu;
+    int                    len = 0;
+    unsigned               i;
+    unsigned               b;
+    s64                    val;
+    u64                    n;
+    struct bafs_stats_cpu* sc;
+
+    for (i = 0; i < BAFS_STAT_N; i++) {
+        val = 0;
+        for_each_possible_cpu(cpu) {
+            sc   = per_cpu_ptr(stats->cpu, cpu);
+            val += READ_ONCE(sc->val[i]);
+        }
+        len += sysfs_emit_at(buf, len, "%s %lld\n", bafs_stat_names[i], (long long) val);
+    }
+
+    for (i = 0; i < BAFS_OP_N; i++) {
+        for (b = 0; b < BAFS_STAT_LAT_BUCKETS; b++) {
+            n = 0;
+            for_each_possible_cpu(cpu) {
+                sc = per_cpu_ptr(stats->cpu, cpu);
+                n += READ_ONCE(sc->lat[i][b]);
+            }
+            if (n)
+                len += sysfs_emit_at(buf, len, "%s_us %llu %llu\n", bafs_stat_op_names[i],
+                                     b ? 1ULL << b : 0ULL, (unsigned long long) n);
+        }
+    }
+
+    return len;
+}
+
+static int bafs_ctx_stats_show(struct seq_file* m, void* v)
+{
+    struct bafs_ctx* ctx = m->private;
+    char*            buf;
+
+    /* sysfs_emit_at wants a page aligned buffer */
+    buf = (char*) __get_free_page(GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    seq_write(m, buf, bafs_stats_emit(&ctx->stats, buf));
+    free_page((unsigned long) buf);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bafs_ctx_stats);
+
+/* bafs/ctx/<device>.<tgid>.<seq>, a missing debugfs only costs the file */
+void bafs_stats_ctx_debugfs_add(struct bafs_ctx* ctx, const char* dev)
+{
+    char name[64];
+
+    if (IS_ERR_OR_NULL(bafs_debugfs_ctx))
+        return;
+
+    snprintf(name, sizeof(name), "%s.%d.%u", dev, task_tgid_nr(current),
+             (unsigned) atomic_inc_return(&bafs_ctx_seq));
+    ctx->debugfs = debugfs_create_file(name, 0444, bafs_debugfs_ctx, ctx, &bafs_ctx_stats_fops);
+}
+
+/* waits for readers of the file, so it must run before the ctx is freed */
+void bafs_stats_ctx_debugfs_remove(struct bafs_ctx* ctx)
+{
+    debugfs_remove(ctx->debugfs);
+    ctx->debugfs = NULL;
+}
+
+int bafs_stats_init(void)
+{
+    bafs_debugfs_root = debugfs_create_dir(BAFS_CORE_CLASS_NAME, NULL);
+    bafs_debugfs_ctx  = debugfs_create_dir("ctx", bafs_debugfs_root);
+    if (IS_ERR(bafs_debugfs_ctx))
+        BAFS_CORE_INFO("Per file stats not in debugfs \t err = %ld\n", PTR_ERR(bafs_debugfs_ctx));
+
+    return 0;
+}
+
+void bafs_stats_fini(void)
+{
+    debugfs_remove_recursive(bafs_debugfs_root);
+    bafs_debugfs_root = NULL;
+    bafs_debugfs_ctx  = NULL;
+}
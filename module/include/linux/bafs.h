@@ -8,18 +8,66 @@ typedef __u32           bafs_group_hnd_t;
 
 #define BAFS_MEM_CPU     0
 #define BAFS_MEM_CUDA    1
-
+#define BAFS_MEM_USER    2
+#define BAFS_MEM_DMABUF  3
+#define BAFS_MEM_CMB     4
+
+/* BAFS_IOC_REG_MEM_PARAMS.placement */
+#define BAFS_MEM_PLACE_DEFAULT      0
+#define BAFS_MEM_PLACE_CTRL         1
+#define BAFS_MEM_PLACE_NODE         2
+#define BAFS_MEM_PLACE_INTERLEAVE   3
+
+/* BAFS_IOC_REG_MEM_PARAMS.flags */
+#define BAFS_MEM_FLAG_HUGE_2M    (1U << 0)
+#define BAFS_MEM_FLAG_HUGE_1G    (1U << 1)
+/* BAFS_MEM_CPU only: allocate pages on first touch instead of at mmap time */
+#define BAFS_MEM_FLAG_LAZY       (1U << 2)
+/* BAFS_MEM_CMB only: map the slice write-combined instead of uncached */
+#define BAFS_MEM_FLAG_WC         (1U << 3)
 
 /** Common **/
 struct BAFS_IOC_REG_MEM_PARAMS {
     /* in */
     __u32       size;
     __u32       loc;
-    /* out */
+    __u32       flags;
+    /* out, names the registration on the fd it was made through only */
     bafs_mem_hnd_t handle;
+    /* in, BAFS_MEM_USER only: existing user range to pin */
+    __u64       vaddr;
+    /* in */
+    __u32       placement;
+    /* in-out: node for BAFS_MEM_PLACE_NODE, chosen node or -1 out */
+    __s32       node;
+    /* in, BAFS_MEM_DMABUF only: dma-buf to import, mmap'd by the caller at vaddr */
+    __s32       dmabuf_fd;
 
 };
 
+/* version 2 of the registration params, sizes and addresses are 64-bit */
+struct BAFS_IOC_REG_MEM2_PARAMS {
+    /* in */
+    __u64       size;
+    /* in, BAFS_MEM_USER and BAFS_MEM_DMABUF only: existing user range */
+    __u64       vaddr;
+    /* in */
+    __u32       loc;
+    __u32       flags;
+    __u32       placement;
+    /* in-out: node for BAFS_MEM_PLACE_NODE, chosen node or -1 out */
+    __s32       node;
+    /* in, BAFS_MEM_DMABUF only: dma-buf to import, mmap'd by the caller at vaddr */
+    __s32       dmabuf_fd;
+    /* out, names the registration on the fd it was made through only */
+    bafs_mem_hnd_t handle;
+
+};
+
+/*
+ * The vaddr of the dma ioctls names a registration by any address inside it,
+ * window offsets always count from the start of the region.
+ */
 struct BAFS_IOC_DMA_MAP_MEM_PARAMS {
     /* in */
     unsigned long   vaddr;
@@ -28,6 +76,261 @@ struct BAFS_IOC_DMA_MAP_MEM_PARAMS {
 
     /* in-out */
     __u32           n_dma_addrs;
+    /* out */
+    __u32           page_shift;
+
+};
+
+/* order of the group address table, see struct BAFS_IOC_DMA_MAP_MEM2_PARAMS */
+#define BAFS_DMA_LAYOUT_CTRL_MAJOR  0
+#define BAFS_DMA_LAYOUT_INTERLEAVED 1
+#define BAFS_DMA_LAYOUT_STRIDED     2
+
+/*
+ * Page p of controller c is written to dma_addrs[p * page_stride + c * ctrl_stride].
+ * CTRL_MAJOR uses page_stride 1 and ctrl_stride n_addrs, INTERLEAVED uses
+ * page_stride n_ctrls and ctrl_stride 1, STRIDED takes both from the caller.
+ */
+struct BAFS_IOC_DMA_MAP_MEM2_PARAMS {
+    /* in */
+    __u64           vaddr;
+    /* out */
+    unsigned long * dma_addrs;
+    /* in: entries dma_addrs holds, out: entries the layout spans, also on -ENOSPC */
+    __u64           n_dma_addrs;
+    /* in, BAFS_DMA_LAYOUT_STRIDED only */
+    __u64           page_stride;
+    __u64           ctrl_stride;
+    /* out: addresses per controller */
+    __u64           n_addrs;
+    /* in: BAFS_DMA_LAYOUT_* */
+    __u32           layout;
+    /* out */
+    __u32           page_shift;
+    __u32           n_ctrls;
+    __u32           reserved;
+
+};
+
+struct bafs_dma_extent {
+    __u64           dma_addr;
+    __u64           len;
+};
+
+struct BAFS_IOC_DMA_MAP_MEM_EXTENTS_PARAMS {
+    /* in */
+    unsigned long            vaddr;
+    /* max extent length, 0 for no limit */
+    __u32                    map_gran;
+    /* in-out: capacity per controller in, extents per controller out */
+    __u32                    n_extents;
+    /* out */
+    struct bafs_dma_extent * extents;
+    /* out, group only: one count per controller */
+    __u32 *                  n_ctrl_extents;
+
+};
+
+struct BAFS_IOC_DMA_MAP_MEM_CONTIG_PARAMS {
+    /* in */
+    __u64           vaddr;
+    /* out: device address of the region start, offset o is at dma_addr + o */
+    __u64           dma_addr;
+    /* out */
+    __u64           len;
+
+};
+
+/*
+ * Header of a dma address table mmap'd read-only from a ctrl or group fd.
+ * generation changes whenever the table is superseded by another table map
+ * of the region, also one that reuses a cached mapping, or revoked. Read it
+ * before and after using dma_addrs and retry on a change.
+ */
+struct bafs_dma_table_hdr {
+    __u64           generation;
+    __u64           n_addrs;
+    __u32           page_shift;
+    __u32           revoked;
+    /* page of the region dma_addrs[0] belongs to */
+    __u64           first_page;
+    __u64           reserved[4];
+    __u64           dma_addrs[];
+};
+
+/* mmap offsets with this bit set map the table of a registration instead of its pages */
+#define BAFS_MMAP_DMA_TABLE                      (1ULL << 62)
+#define BAFS_MMAP_DMA_TABLE_OFFSET(handle, ctrl) (BAFS_MMAP_DMA_TABLE | ((__u64) (ctrl) << 48) | \
+                                                  ((__u64) (handle) << 16))
+#define BAFS_MMAP_DMA_TABLE_HANDLE(offset)       ((bafs_mem_hnd_t) (((offset) >> 16) & 0xffffffffULL))
+#define BAFS_MMAP_DMA_TABLE_CTRL(offset)         ((__u32) (((offset) >> 48) & 0x3fffULL))
+
+struct BAFS_IOC_DMA_MAP_MEM_TABLE_PARAMS {
+    /* in */
+    __u64           vaddr;
+    /* out: mmap offset of controller 0's table, controller i is at BAFS_MMAP_DMA_TABLE_OFFSET(handle, i) */
+    __u64           table_offset;
+    /* out: bytes to mmap per controller */
+    __u64           table_size;
+    /* out: addresses per controller */
+    __u64           n_addrs;
+    /* out: generation of the new tables */
+    __u64           generation;
+    /* out */
+    __u32           page_shift;
+    __u32           n_ctrls;
+
+};
+
+struct BAFS_IOC_DMA_MAP_MEM_RANGE_PARAMS {
+    /* in: start of the region and the window inside it, len 0 maps to the end */
+    __u64                    vaddr;
+    __u64                    offset;
+    __u64                    len;
+    /* in: max extent length, 0 for no limit */
+    __u32                    map_gran;
+    /* in-out: capacity per controller in, extents per controller out */
+    __u32                    n_extents;
+    /* out */
+    struct bafs_dma_extent * extents;
+    /* out, group only: one count per controller */
+    __u32 *                  n_ctrl_extents;
+
+};
+
+/* BAFS_IOC_DMA_MAP_MEM_RANGE_PARAMS naming the registration by handle, skips the address lookup */
+struct BAFS_IOC_DMA_MAP_MEM_HND_PARAMS {
+    /* in: registration and the window inside it, len 0 maps to the end */
+    bafs_mem_hnd_t           handle;
+    /* in: max extent length, 0 for no limit */
+    __u32                    map_gran;
+    __u64                    offset;
+    __u64                    len;
+    /* in-out: capacity per controller in, extents per controller out */
+    __u32                    n_extents;
+    __u32                    reserved;
+    /* out */
+    struct bafs_dma_extent * extents;
+    /* out, group only: one count per controller */
+    __u32 *                  n_ctrl_extents;
+
+};
+
+struct BAFS_IOC_DMA_UNMAP_MEM_HND_PARAMS {
+    /* in: same window rules as BAFS_IOC_DMA_UNMAP_MEM_PARAMS */
+    bafs_mem_hnd_t  handle;
+    __u32           reserved;
+    __u64           offset;
+    __u64           len;
+
+};
+
+struct BAFS_IOC_DMA_UNMAP_MEM_PARAMS {
+    /* in: window given to the map call, an offset and len of 0 unmap every window of the region */
+    __u64           vaddr;
+    __u64           offset;
+    __u64           len;
+
+};
+
+/* ownership moves to the cpu before it reads what the device wrote, to the device before it reads */
+#define BAFS_DMA_SYNC_FOR_CPU    0
+#define BAFS_DMA_SYNC_FOR_DEVICE 1
+
+struct bafs_dma_sync_range {
+    /* byte range of the region */
+    __u64           offset;
+    __u64           len;
+    /* BAFS_DMA_SYNC_FOR_CPU or BAFS_DMA_SYNC_FOR_DEVICE */
+    __u32           dir;
+    __u32           reserved;
+};
+
+/* flags: the region has mappings that are bounced or not cache coherent */
+#define BAFS_DMA_SYNC_NEEDED     (1U << 0)
+
+struct BAFS_IOC_DMA_SYNC_MEM_PARAMS {
+    /* in: start of the region */
+    __u64                        vaddr;
+    /* in: ranges to sync, not read when nothing needs syncing, n_ranges 0 only reports flags */
+    struct bafs_dma_sync_range * ranges;
+    __u32                        n_ranges;
+    /* out: BAFS_DMA_SYNC_NEEDED */
+    __u32                        flags;
+
+};
+
+struct BAFS_IOC_DEREG_MEM_PARAMS {
+    /* in */
+    bafs_mem_hnd_t  handle;
+
+};
+
+struct BAFS_IOC_PREFAULT_MEM_PARAMS {
+    /* in: start of the region and the byte range inside it to populate */
+    __u64           vaddr;
+    __u64           offset;
+    __u64           len;
+
+};
+
+struct BAFS_IOC_EXPORT_DMABUF_PARAMS {
+    /* in: start of a cpu or user region */
+    __u64           vaddr;
+    /* out */
+    __s32           fd;
+
+};
+
+/*
+ * mmap offsets with this bit set map one part of an io queue pair of the fd,
+ * the rings when the driver allocated them and the page with its doorbells
+ */
+#define BAFS_MMAP_QP                   (1ULL << 61)
+#define BAFS_MMAP_QP_OFFSET(qid, part) (BAFS_MMAP_QP | ((__u64) (qid) << 20) | ((__u64) (part) << 16))
+#define BAFS_MMAP_QP_QID(offset)       ((__u16) (((offset) >> 20) & 0xffffULL))
+#define BAFS_MMAP_QP_PART(offset)      ((__u32) (((offset) >> 16) & 0xfULL))
+
+#define BAFS_QP_SQ 0
+#define BAFS_QP_CQ 1
+#define BAFS_QP_DB 2
+
+/* BAFS_IOC_CREATE_QP_PARAMS.flags: the rings live in registrations of the fd instead of driver memory */
+#define BAFS_QP_FLAG_USER_MEM        (1U << 0)
+/* the cq gets an msi-x vector of its own, every interrupt signals the eventfd */
+#define BAFS_QP_FLAG_IRQ             (1U << 1)
+/* with BAFS_QP_FLAG_IRQ: the vector interrupts on every completion, ignoring the irq_coalesce setting */
+#define BAFS_QP_FLAG_IRQ_NO_COALESCE (1U << 2)
+
+/*
+ * Only on controllers whose admin queue is owned by the driver, see the admin_queue
+ * module parameter. The pair lives until the fd it was created through is closed.
+ */
+struct BAFS_IOC_CREATE_QP_PARAMS {
+    /* in-out: entries per queue, 0 for the default, clamped to what the controller supports */
+    __u32           depth;
+    /* in: BAFS_QP_FLAG_* */
+    __u32           flags;
+    /* in, BAFS_QP_FLAG_USER_MEM only: registrations holding 64 byte sq and 16 byte cq entries */
+    bafs_mem_hnd_t  sq_handle;
+    bafs_mem_hnd_t  cq_handle;
+    /* out */
+    __u32           qid;
+    /* out: bytes between doorbells */
+    __u32           db_stride;
+    /* out: mmap offsets of the rings, 0 when they live in registrations */
+    __u64           sq_offset;
+    __u64           cq_offset;
+    /* out: mmap offset and length of the doorbell mapping */
+    __u64           db_offset;
+    __u64           db_len;
+    /* out: byte offsets in the doorbell mapping of the sq tail and cq head doorbells */
+    __u32           sq_db;
+    __u32           cq_db;
+    /* in, BAFS_QP_FLAG_IRQ only: eventfd signalled when the controller interrupts for the cq */
+    __s32           eventfd;
+    /* out: msi-x vector of the cq, 0 without BAFS_QP_FLAG_IRQ */
+    __u32           irq_vector;
 
 };
 
@@ -59,6 +362,14 @@ struct BAFS_CORE_IOC_DELETE_GROUP_PARAMS {
 
 #define BAFS_CORE_IOC_DELETE_GROUP _IOWR(BAFS_CORE_IOCTL, 3, struct BAFS_CORE_IOC_DELETE_GROUP_PARAMS)
 
+#define BAFS_CORE_IOC_PREFAULT_MEM _IOW(BAFS_CORE_IOCTL, 4, struct BAFS_IOC_PREFAULT_MEM_PARAMS)
+
+#define BAFS_CORE_IOC_EXPORT_DMABUF _IOWR(BAFS_CORE_IOCTL, 5, struct BAFS_IOC_EXPORT_DMABUF_PARAMS)
+
+#define BAFS_CORE_IOC_REG_MEM2 _IOWR(BAFS_CORE_IOCTL, 7, struct BAFS_IOC_REG_MEM2_PARAMS)
+
+#define BAFS_CORE_IOC_DEREG_MEM _IOW(BAFS_CORE_IOCTL, 11, struct BAFS_IOC_DEREG_MEM_PARAMS)
+
 
 
 /* BAFS Controller IOCTL */
@@ -70,6 +381,34 @@ struct BAFS_CORE_IOC_DELETE_GROUP_PARAMS {
 
 #define BAFS_CTRL_IOC_DMA_MAP_MEM _IOWR(BAFS_CTRL_IOCTL, 2, struct BAFS_IOC_DMA_MAP_MEM_PARAMS)
 
+#define BAFS_CTRL_IOC_DMA_MAP_MEM_EXTENTS _IOWR(BAFS_CTRL_IOCTL, 3, struct BAFS_IOC_DMA_MAP_MEM_EXTENTS_PARAMS)
+
+#define BAFS_CTRL_IOC_PREFAULT_MEM _IOW(BAFS_CTRL_IOCTL, 4, struct BAFS_IOC_PREFAULT_MEM_PARAMS)
+
+#define BAFS_CTRL_IOC_EXPORT_DMABUF _IOWR(BAFS_CTRL_IOCTL, 5, struct BAFS_IOC_EXPORT_DMABUF_PARAMS)
+
+#define BAFS_CTRL_IOC_DMA_MAP_MEM_CONTIG _IOWR(BAFS_CTRL_IOCTL, 6, struct BAFS_IOC_DMA_MAP_MEM_CONTIG_PARAMS)
+
+#define BAFS_CTRL_IOC_REG_MEM2 _IOWR(BAFS_CTRL_IOCTL, 7, struct BAFS_IOC_REG_MEM2_PARAMS)
+
+#define BAFS_CTRL_IOC_DMA_MAP_MEM_TABLE _IOWR(BAFS_CTRL_IOCTL, 8, struct BAFS_IOC_DMA_MAP_MEM_TABLE_PARAMS)
+
+#define BAFS_CTRL_IOC_DMA_MAP_MEM_RANGE _IOWR(BAFS_CTRL_IOCTL, 9, struct BAFS_IOC_DMA_MAP_MEM_RANGE_PARAMS)
+
+#define BAFS_CTRL_IOC_DMA_UNMAP_MEM _IOW(BAFS_CTRL_IOCTL, 10, struct BAFS_IOC_DMA_UNMAP_MEM_PARAMS)
+
+#define BAFS_CTRL_IOC_DEREG_MEM _IOW(BAFS_CTRL_IOCTL, 11, struct BAFS_IOC_DEREG_MEM_PARAMS)
+
+#define BAFS_CTRL_IOC_DMA_SYNC_MEM _IOWR(BAFS_CTRL_IOCTL, 12, struct BAFS_IOC_DMA_SYNC_MEM_PARAMS)
+
+#define BAFS_CTRL_IOC_DMA_MAP_MEM2 _IOWR(BAFS_CTRL_IOCTL, 13, struct BAFS_IOC_DMA_MAP_MEM2_PARAMS)
+
+#define BAFS_CTRL_IOC_DMA_MAP_MEM_HND _IOWR(BAFS_CTRL_IOCTL, 14, struct BAFS_IOC_DMA_MAP_MEM_HND_PARAMS)
+
+#define BAFS_CTRL_IOC_DMA_UNMAP_MEM_HND _IOW(BAFS_CTRL_IOCTL, 15, struct BAFS_IOC_DMA_UNMAP_MEM_HND_PARAMS)
+
+#define BAFS_CTRL_IOC_CREATE_QP _IOWR(BAFS_CTRL_IOCTL, 16, struct BAFS_IOC_CREATE_QP_PARAMS)
+
 
 /* BAFS Group IOCTL */
 
@@ -80,57 +419,180 @@ struct BAFS_CORE_IOC_DELETE_GROUP_PARAMS {
 
 #define BAFS_GROUP_IOC_DMA_MAP_MEM _IOWR(BAFS_GROUP_IOCTL, 2, struct BAFS_IOC_DMA_MAP_MEM_PARAMS)
 
+#define BAFS_GROUP_IOC_DMA_MAP_MEM_EXTENTS _IOWR(BAFS_GROUP_IOCTL, 3, struct BAFS_IOC_DMA_MAP_MEM_EXTENTS_PARAMS)
+
+#define BAFS_GROUP_IOC_PREFAULT_MEM _IOW(BAFS_GROUP_IOCTL, 4, struct BAFS_IOC_PREFAULT_MEM_PARAMS)
+
+#define BAFS_GROUP_IOC_EXPORT_DMABUF _IOWR(BAFS_GROUP_IOCTL, 5, struct BAFS_IOC_EXPORT_DMABUF_PARAMS)
+
+#define BAFS_GROUP_IOC_REG_MEM2 _IOWR(BAFS_GROUP_IOCTL, 7, struct BAFS_IOC_REG_MEM2_PARAMS)
+
+#define BAFS_GROUP_IOC_DMA_MAP_MEM_TABLE _IOWR(BAFS_GROUP_IOCTL, 8, struct BAFS_IOC_DMA_MAP_MEM_TABLE_PARAMS)
+
+#define BAFS_GROUP_IOC_DMA_MAP_MEM_RANGE _IOWR(BAFS_GROUP_IOCTL, 9, struct BAFS_IOC_DMA_MAP_MEM_RANGE_PARAMS)
+
+#define BAFS_GROUP_IOC_DMA_UNMAP_MEM _IOW(BAFS_GROUP_IOCTL, 10, struct BAFS_IOC_DMA_UNMAP_MEM_PARAMS)
+
+#define BAFS_GROUP_IOC_DEREG_MEM _IOW(BAFS_GROUP_IOCTL, 11, struct BAFS_IOC_DEREG_MEM_PARAMS)
+
+#define BAFS_GROUP_IOC_DMA_SYNC_MEM _IOWR(BAFS_GROUP_IOCTL, 12, struct BAFS_IOC_DMA_SYNC_MEM_PARAMS)
+
+#define BAFS_GROUP_IOC_DMA_MAP_MEM2 _IOWR(BAFS_GROUP_IOCTL, 13, struct BAFS_IOC_DMA_MAP_MEM2_PARAMS)
+
+#define BAFS_GROUP_IOC_DMA_MAP_MEM_HND _IOWR(BAFS_GROUP_IOCTL, 14, struct BAFS_IOC_DMA_MAP_MEM_HND_PARAMS)
+
+#define BAFS_GROUP_IOC_DMA_UNMAP_MEM_HND _IOW(BAFS_GROUP_IOCTL, 15, struct BAFS_IOC_DMA_UNMAP_MEM_HND_PARAMS)
+
 
 
 #if defined(__KERNEL__)
 
+#include <linux/nodemask.h>
+
 struct vm_area_struct;
 struct pci_dev;
+struct sg_table;
 
 struct bafs_ctrl;
+struct bafs_ctrl_ctx;
 struct bafs_ctx;
 struct bafs_group;
 struct bafs_mem;
 struct bafs_mem_dma;
+struct bafs_stats;
 
 int  bafs_ctrl_init(void);
 void bafs_ctrl_fini(void);
 
 int  bafs_ctrl_alloc(struct bafs_ctrl **, struct pci_dev *, int, struct device *);
 void bafs_ctrl_release(struct bafs_ctrl *);
+void bafs_ctrl_kill(struct bafs_ctrl *);
 
 int  bafs_get_minor_number(void);
 void bafs_put_minor_number(int);
 
 void bafs_put_ctx(struct bafs_ctx *);
-struct bafs_ctx* bafs_get_ctx(void);
-struct bafs_mem* bafs_get_mem(const unsigned long);
+struct bafs_ctx* bafs_alloc_ctx(struct bafs_ctrl *, struct bafs_group *);
 struct bafs_mem* bafs_get_mem_with_ctx(const unsigned long, struct bafs_ctx*);
+struct bafs_mem* bafs_get_mem_by_handle(const bafs_mem_hnd_t, struct bafs_ctx*);
+void bafs_mem_index_locked(struct bafs_mem*);
+void bafs_mem_unindex_locked(struct bafs_mem*);
 
 int  bafs_group_init(void);
 void bafs_group_fini(void);
 
+int  bafs_mem_init(void);
+void bafs_mem_fini(void);
+
+int  bafs_pool_init(void);
+void bafs_pool_fini(void);
+int  bafs_pool_emit_stats(char *);
+
+int  bafs_stats_init(void);
+void bafs_stats_fini(void);
+int  bafs_stats_alloc(struct bafs_stats *);
+void bafs_stats_free(struct bafs_stats *);
+int  bafs_stats_emit(struct bafs_stats *, char *);
+void bafs_stats_add(struct bafs_ctx *, struct bafs_ctrl *, unsigned, s64);
+void bafs_stats_latency(struct bafs_ctx *, struct bafs_ctrl *, unsigned, const u64);
+void bafs_stats_ctx_debugfs_add(struct bafs_ctx *, const char *);
+void bafs_stats_ctx_debugfs_remove(struct bafs_ctx *);
+
 int  bafs_group_alloc(struct bafs_group **, int, struct device *, size_t,
                       ctrl_name *);
 
 void bafs_put_group(struct bafs_group *);
 
 int
-bafs_ctrl_dma_map_mem(struct bafs_ctrl *, struct bafs_ctx*, unsigned long, __u32 *, unsigned long __user *,
+bafs_ctrl_dma_map(struct bafs_ctrl *, struct bafs_mem *, const u64, const u64, struct bafs_mem_dma **);
+
+int
+bafs_dma_copy_addrs(struct bafs_mem_dma *, unsigned long __user *);
+
+int
+bafs_dma_copy_extents(struct bafs_mem_dma *, const unsigned, __u32 *, struct bafs_dma_extent __user *);
+
+bool
+bafs_ctrl_same_iova_space(struct bafs_ctrl *, struct bafs_ctrl *);
+
+int
+bafs_dma_copy_addrs_layout(struct bafs_mem_dma **, const int, struct BAFS_IOC_DMA_MAP_MEM2_PARAMS *);
+
+int
+bafs_ctrl_dma_map_mem(struct bafs_ctrl *, struct bafs_mem *, __u32 *, unsigned long __user *,
                       struct bafs_mem_dma **, const int);
 
+int
+bafs_ctrl_dma_map_mem_extents(struct bafs_ctrl *, struct bafs_mem *, unsigned, const u64, const u64,
+                              __u32 *, struct bafs_dma_extent __user *, struct bafs_mem_dma **);
+
+void
+bafs_ctrl_dma_unmap_mem(struct bafs_ctrl *, struct bafs_mem_dma *);
+
+int
+bafs_ctrl_dma_unmap_range(struct bafs_ctrl *, struct bafs_mem *, const u64, const u64);
+
+long
+bafs_ctrl_dma_sync_mem(struct bafs_ctrl * const *, const int, struct bafs_ctx *, void __user *);
+
+int
+bafs_ctrl_dma_map_table(struct bafs_ctrl *, struct bafs_mem *, struct bafs_mem_dma **);
+
+int
+bafs_ctrl_mmap_dma_table(struct bafs_ctrl *, struct bafs_ctx *, struct vm_area_struct *);
+
 void
-bafs_ctrl_dma_unmap_mem(struct bafs_mem_dma *);
+bafs_dma_table_revoke(struct bafs_mem_dma *);
 
 int
 bafs_ctrl_mmap(struct bafs_ctrl *, struct vm_area_struct *, const unsigned long, unsigned long *);
 
+int
+bafs_dma_contig_base(struct bafs_mem_dma *, dma_addr_t *);
+
+int
+bafs_ctrl_admin_init(struct bafs_ctrl *);
+
+void
+bafs_ctrl_admin_fini(struct bafs_ctrl *);
+
+long
+bafs_ctrl_create_qp(struct bafs_ctrl *, struct bafs_ctrl_ctx *, void __user *);
+
+void
+bafs_ctrl_destroy_qps(struct bafs_ctrl *, struct bafs_ctrl_ctx *);
+
+int
+bafs_ctrl_mmap_qp(struct bafs_ctrl *, struct bafs_ctrl_ctx *, struct vm_area_struct *);
+
+int
+bafs_ctrl_set_irq_coalesce(struct bafs_ctrl *, const u8, const u8);
+
+void
+bafs_ctrl_get_irq_coalesce(struct bafs_ctrl *, u8 *, u8 *);
+
 
 int
 pin_bafs_mem(struct vm_area_struct *, struct bafs_ctx *);
 
+/* layout of the user params passed to bafs_core_reg_mem */
+#define BAFS_REG_MEM_V1 1
+#define BAFS_REG_MEM_V2 2
+
 long
-bafs_core_reg_mem(void __user *, struct bafs_ctx *);
+bafs_core_reg_mem(void __user *, const unsigned int, struct bafs_ctx *, const nodemask_t *, struct pci_dev *);
+
+long
+bafs_core_dereg_mem(void __user *, struct bafs_ctx *);
+
+void
+bafs_mem_drop_stale(struct bafs_ctx *);
+
+void
+bafs_ctrl_get_nodes(struct bafs_ctrl *, nodemask_t *);
+
+int
+bafs_ctrl_emit_dma_cache_stats(char *);
 
 void
 bafs_mem_put(struct bafs_mem *);
@@ -138,6 +600,30 @@ bafs_mem_put(struct bafs_mem *);
 void
 unmap_dma(struct bafs_mem_dma *);
 
+void
+bafs_mem_dma_put(struct bafs_mem_dma *);
+
+struct bafs_mem_dma*
+bafs_mem_get_dma(struct bafs_mem *, struct device *);
+
+int
+bafs_mem_alloc_sgt(struct bafs_mem *, struct sg_table *, unsigned long, const unsigned long, const unsigned long);
+
+int
+bafs_mem_populate(struct bafs_mem *, unsigned long, unsigned long);
+
+long
+bafs_core_prefault_mem(void __user *, struct bafs_ctx *);
+
+struct page*
+bafs_pool_get(int, const unsigned int);
+
+bool
+bafs_pool_put(struct page *, const unsigned int);
+
+long
+bafs_core_export_dmabuf(void __user *, struct bafs_ctx *);
+
 #endif
 
 #endif
@@ -7,8 +7,19 @@
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
 #include <linux/pci.h>
+#include <linux/mmu_notifier.h>
+#include <linux/workqueue.h>
+#include <linux/nodemask.h>
+#include <linux/dma-buf.h>
+#include <linux/interval_tree.h>
+#include <linux/percpu-refcount.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/idr.h>
 
 
 #include <nv-p2p.h>
@@ -21,19 +32,63 @@
 
 extern const struct pci_device_id pci_dev_id_table[];
 
+extern atomic64_t bafs_node_pinned_bytes[MAX_NUMNODES];
 
+
+/* per cpu counters charged to a ctx and to the device it was opened on */
+enum bafs_stat {
+    BAFS_STAT_IOCTLS,
+    /* one per location, indexed by BAFS_STAT_PINNED + BAFS_MEM_* */
+    BAFS_STAT_PINNED,
+    BAFS_STAT_PINNED_LAST = BAFS_STAT_PINNED + BAFS_MEM_CMB,
+    BAFS_STAT_DMA_MAPS,
+    BAFS_STAT_IOVA_BYTES,
+    BAFS_STAT_N
+};
+
+enum bafs_stat_op {
+    BAFS_OP_REG,
+    BAFS_OP_PIN,
+    BAFS_OP_MAP,
+    BAFS_OP_UNMAP,
+    BAFS_OP_N
+};
+
+/* log2 buckets of microseconds, the first holds everything under 2us, the last everything above */
+#define BAFS_STAT_LAT_BUCKETS 32
+
+struct bafs_stats_cpu {
+    s64 val[BAFS_STAT_N];
+    u64 lat[BAFS_OP_N][BAFS_STAT_LAT_BUCKETS];
+};
+
+/* only ever added to on the local cpu, readers sum every cpu */
+struct bafs_stats {
+    struct bafs_stats_cpu __percpu* cpu;
+};
+
+
+/* registrations made through one open file */
 struct bafs_ctx {
     spinlock_t       lock;
     struct xarray    bafs_mem_xa;
     struct list_head mem_list;
+    /* registrations with a mapped range, keyed by [vaddr, vaddr + size) */
+    struct rb_root_cached mem_tree;
+    /* bumped under lock around every mem_tree update, lookups walk the tree under rcu */
+    seqcount_spinlock_t mem_seq;
     struct kref      ref;
-    pid_t tgid;
-    struct pid* tgid_struct;
+    /* the device the file was opened on, held until the last registration is gone */
+    struct bafs_ctrl*  ctrl;
+    struct bafs_group* group;
+    struct bafs_stats  stats;
+    struct dentry*     debugfs;
 };
 
 
 struct bafs_group {
-    spinlock_t         lock;
+    /* serializes group maps, which sleep and fault while the members are mapped, never taken under mmap_lock */
+    struct mutex       lock;
     struct kref        ref;
     bafs_group_hnd_t   group_id;
     dev_t              major;
@@ -44,6 +99,7 @@ struct bafs_group {
     struct bafs_ctrl** ctrls;
     unsigned int       n_ctrls;
     struct bafs_ctx*    ctx;
+    struct bafs_stats  stats;
 };
 
 struct bafs_group_ctx {
@@ -61,6 +117,63 @@ static inline void bafs_get_group(struct bafs_group* group) {
 }
 
 
+/* admin queue of a controller the driver reset and owns, commands are polled one at a time */
+struct bafs_admin {
+    struct mutex            lock;
+    void __iomem*           bar;
+    u64                     cap;
+    u32                     db_stride;
+    /* largest io queue the controller takes, 0 based */
+    u16                     mqes;
+    u16                     depth;
+    struct nvme_command*    sq;
+    dma_addr_t              sq_dma;
+    struct nvme_completion* cq;
+    dma_addr_t              cq_dma;
+    u16                     sq_tail;
+    u16                     cq_head;
+    u16                     cq_phase;
+    u16                     command_id;
+    /* a command timed out, what the controller does with the queue from then on is unknown */
+    bool                    dead;
+    /* io queue ids first_qid to max_qid, each names an sq and the cq it completes to */
+    struct ida              qids;
+    u16                     max_qid;
+    u16                     first_qid;
+    /* end of the page holding the admin doorbells, io doorbell pages below it are refused */
+    u32                     admin_db_end;
+    /* msi-x vectors 1 to n_vecs - 1 go to io cqs, 0 stays with the polled admin queue */
+    struct ida              vecs;
+    u16                     n_vecs;
+    /* controller wide coalescing, 0 based completions and 100us units, under lock */
+    u8                      irq_thr;
+    u8                      irq_time;
+};
+
+/* an io sq/cq pair, owned by the ctrl file that created it */
+struct bafs_qp {
+    struct list_head     list;
+    u16                  qid;
+    u32                  depth;
+    size_t               sq_size;
+    size_t               cq_size;
+    /* rings allocated by the driver, NULL when they live in registrations */
+    void*                sq;
+    void*                cq;
+    dma_addr_t           sq_dma;
+    dma_addr_t           cq_dma;
+    /* rings in registrations, mapped for the controller until the pair is deleted */
+    struct bafs_mem_dma* sq_map;
+    struct bafs_mem_dma* cq_map;
+    /* offset in BAR0 and length of the pages holding the two doorbells */
+    resource_size_t      db_page;
+    size_t               db_len;
+    /* msi-x vector of the cq and what its handler signals, 0 and NULL when polled */
+    u16                  vector;
+    struct eventfd_ctx*  eventfd;
+    char                 irq_name[32];
+};
+
 struct bafs_ctrl {
 
     spinlock_t       lock;
@@ -72,26 +185,35 @@ struct bafs_ctrl {
     int              ctrl_id;
     struct list_head group_list;
     struct rcu_head  rh;
-    struct kref      ref;
+    /* every open file and dma mapping holds one, killed on pci remove */
+    struct percpu_ref ref;
+    struct work_struct release_work;
     struct device* core_dev;
+    /* bytes of the controller memory buffer handed to the p2pdma allocator, 0 if none */
+    resource_size_t  cmb_size;
+    struct bafs_stats stats;
+    /* NULL unless the driver owns the admin queue, userspace then maps BAR0 itself */
+    struct bafs_admin* admin;
 
 };
 
 struct bafs_ctrl_ctx {
     struct bafs_ctrl* ctrl;
     struct bafs_ctx*    ctx;
+    /* io queue pairs of the file, deleted when it is closed */
+    spinlock_t        qp_lock;
+    struct list_head  qp_list;
 };
 
 
 
 static inline struct device* bafs_get_ctrl(struct bafs_ctrl* ctrl) {
     struct device* dev;
-    BAFS_CTRL_DEBUG("In bafs_get_ctrl: %u \t kref_bef: %u\n", ctrl->ctrl_id, kref_read(&ctrl->ref));
-    kref_get(&ctrl->ref);
+    percpu_ref_get(&ctrl->ref);
     dev = ctrl->device;
 
 
-    BAFS_CTRL_DEBUG("In bafs_get_ctrl: %u \t kref_bef: %u\n", ctrl->ctrl_id, kref_read(&ctrl->ref));
+    BAFS_CTRL_DEBUG("In bafs_get_ctrl: %u\n", ctrl->ctrl_id);
     return dev;
 
 }
@@ -99,6 +221,7 @@ static inline struct device* bafs_get_ctrl(struct bafs_ctrl* ctrl) {
 
 enum STATE {
     STALE,
+    PINNING,
     LIVE,
     DEAD,
     DEAD_CB
@@ -107,12 +230,19 @@ enum STATE {
 struct bafs_mem {
     struct bafs_ctx*    ctx;
     spinlock_t               lock;
+    struct mutex             populate_lock;
     struct rcu_head          rh;
     struct list_head         mem_list;
+    /* node in ctx->mem_tree, cleared while the range is not indexed */
+    struct interval_tree_node it;
     struct list_head         dma_list;
     struct kref              ref;
     bafs_mem_hnd_t           mem_id;
     unsigned                 loc;
+    unsigned                 flags;
+    unsigned                 placement;
+    int                      nid;
+    nodemask_t               nodes;
     enum STATE               state;
     unsigned long            vaddr;
     unsigned long            size;
@@ -122,19 +252,51 @@ struct bafs_mem {
     unsigned long            n_pages;
     nvidia_p2p_page_table_t* cuda_page_table;
     struct page**            cpu_page_table;
+    struct dma_buf*          dmabuf;
+    struct pci_dev*          p2p_dev;
+    void*                    p2p_vaddr;
+    struct mmu_interval_notifier notifier;
+    struct work_struct       release_work;
+    /* RLIMIT_MEMLOCK charge of user pages, kept with the pins until the last reference */
+    struct mm_struct*        locked_mm;
+    /* bytes charged to the pinned stats, given back on release */
+    unsigned long            pinned;
 
 };
 
+/* map references one controller holds on a mapping it may share with others */
+struct bafs_dma_ref {
+    struct list_head  list;
+    struct bafs_ctrl* ctrl;
+    unsigned int      n_maps;
+};
+
 struct bafs_mem_dma {
     spinlock_t                lock;
     struct rcu_head           rh;
+    struct kref               ref;
     struct list_head          dma_list;
     struct bafs_mem*          mem;
     struct bafs_ctrl*         ctrl;
     nvidia_p2p_dma_mapping_t* cuda_mapping;
+    struct sg_table           sgt;
+    bool                      sgt_mapped;
+    /* bounced or non-coherent, cpu and device accesses must be synced */
+    bool                      need_sync;
+    struct dma_buf_attachment* attach;
+    struct sg_table*          attach_sgt;
     unsigned long             n_addrs;
-    unsigned long *           addrs;
-    unsigned                  map_gran;
+    /* first page of the mapped window, n_addrs pages from there */
+    unsigned long             first_page;
+    /* map requests sharing this mapping, under mem->lock */
+    unsigned int              n_maps;
+    /* the same requests per controller, struct bafs_dma_ref, under mem->lock */
+    struct list_head          refs;
+    /* vmalloc_user'd table userspace can mmap, NULL unless requested */
+    struct bafs_dma_table_hdr* table;
+    unsigned long             table_size;
+    /* held while the table is replaced or remapped into userspace */
+    struct mutex              table_lock;
 
 };
 
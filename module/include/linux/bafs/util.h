@@ -1,6 +1,8 @@
 #ifndef _LINUX_BAFS_UTIL_H_
 #define _LINUX_BAFS_UTIL_H_
 
+#include <linux/jump_label.h>
+
 #define BAFS_MINORS     (1U << MINORBITS)
 
 #define                      BAFS_CORE_DEVICE_NAME "bafs"
@@ -20,10 +22,11 @@
     printk(LEVEL DEV_CLASS ": "  FMT, ##__VA_ARGS__)
 
 
-static int debug = 1;
+/* flipped by the debug module parameter, a patched out branch while off */
+DECLARE_STATIC_KEY_FALSE(bafs_debug_key);
 #define BAFS_DEBUG(DEV_CLASS, FMT, ...)         \
     do {                                        \
-        if (debug)                              \
+        if (static_branch_unlikely(&bafs_debug_key)) \
             BAFS_MSG(KERN_DEBUG, DEV_CLASS, FMT, ##__VA_ARGS__); \
     } while (0)
 
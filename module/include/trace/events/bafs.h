@@ -0,0 +1,174 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM bafs
+
+#if !defined(_TRACE_BAFS_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_BAFS_H_
+
+#include <linux/tracepoint.h>
+
+#include <linux/bafs.h>
+#include <linux/bafs/types.h>
+
+#ifndef _TRACE_BAFS_PIN_PHASE_
+#define _TRACE_BAFS_PIN_PHASE_
+/* zeroing is done by the page allocator or the pool scrubber, it is part of alloc */
+enum bafs_pin_phase {
+    BAFS_PIN_ALLOC,
+    BAFS_PIN_POPULATE,
+    BAFS_PIN_USER,
+    BAFS_PIN_INSERT,
+};
+#endif
+
+TRACE_DEFINE_ENUM(BAFS_PIN_ALLOC);
+TRACE_DEFINE_ENUM(BAFS_PIN_POPULATE);
+TRACE_DEFINE_ENUM(BAFS_PIN_USER);
+TRACE_DEFINE_ENUM(BAFS_PIN_INSERT);
+
+#define show_bafs_pin_phase(phase)                      \
+    __print_symbolic(phase,                             \
+                     { BAFS_PIN_ALLOC,    "alloc" },    \
+                     { BAFS_PIN_POPULATE, "populate" }, \
+                     { BAFS_PIN_USER,     "pin" },      \
+                     { BAFS_PIN_INSERT,   "insert" })
+
+#define show_bafs_mem_loc(loc)                      \
+    __print_symbolic(loc,                           \
+                     { BAFS_MEM_CPU,    "cpu" },    \
+                     { BAFS_MEM_CUDA,   "cuda" },   \
+                     { BAFS_MEM_USER,   "user" },   \
+                     { BAFS_MEM_DMABUF, "dmabuf" }, \
+                     { BAFS_MEM_CMB,    "cmb" })
+
+TRACE_EVENT(bafs_reg_mem,
+
+    TP_PROTO(const struct bafs_mem* mem),
+
+    TP_ARGS(mem),
+
+    TP_STRUCT__entry(
+        __field(u32,           handle)
+        __field(unsigned,      loc)
+        __field(unsigned,      flags)
+        __field(unsigned long, size)
+        __field(unsigned long, vaddr)
+    ),
+
+    TP_fast_assign(
+        __entry->handle = mem->mem_id + 1;
+        __entry->loc    = mem->loc;
+        __entry->flags  = mem->flags;
+        __entry->size   = mem->size;
+        __entry->vaddr  = mem->vaddr;
+    ),
+
+    TP_printk("handle=%u loc=%s flags=%#x size=%lu vaddr=%#lx",
+              __entry->handle, show_bafs_mem_loc(__entry->loc), __entry->flags,
+              __entry->size, __entry->vaddr)
+);
+
+TRACE_EVENT(bafs_mem_pin,
+
+    TP_PROTO(const struct bafs_mem* mem, enum bafs_pin_phase phase, unsigned long n_pages, u64 ns),
+
+    TP_ARGS(mem, phase, n_pages, ns),
+
+    TP_STRUCT__entry(
+        __field(u32,           handle)
+        __field(unsigned,      loc)
+        __field(int,           phase)
+        __field(unsigned long, n_pages)
+        __field(unsigned long, bytes)
+        __field(u64,           ns)
+    ),
+
+    TP_fast_assign(
+        __entry->handle  = mem->mem_id + 1;
+        __entry->loc     = mem->loc;
+        __entry->phase   = phase;
+        __entry->n_pages = n_pages;
+        __entry->bytes   = n_pages << mem->page_shift;
+        __entry->ns      = ns;
+    ),
+
+    TP_printk("handle=%u loc=%s phase=%s pages=%lu bytes=%lu ns=%llu",
+              __entry->handle, show_bafs_mem_loc(__entry->loc), show_bafs_pin_phase(__entry->phase),
+              __entry->n_pages, __entry->bytes, __entry->ns)
+);
+
+DECLARE_EVENT_CLASS(bafs_dma,
+
+    TP_PROTO(const struct bafs_mem_dma* dma),
+
+    TP_ARGS(dma),
+
+    TP_STRUCT__entry(
+        __field(u32,           handle)
+        __field(int,           ctrl_id)
+        __field(unsigned long, first_page)
+        __field(unsigned long, n_pages)
+        __field(unsigned long, bytes)
+    ),
+
+    TP_fast_assign(
+        __entry->handle     = dma->mem->mem_id + 1;
+        __entry->ctrl_id    = dma->ctrl->ctrl_id;
+        __entry->first_page = dma->first_page;
+        __entry->n_pages    = dma->n_addrs;
+        __entry->bytes      = dma->n_addrs << dma->mem->page_shift;
+    ),
+
+    TP_printk("handle=%u ctrl=%d first_page=%lu pages=%lu bytes=%lu",
+              __entry->handle, __entry->ctrl_id, __entry->first_page,
+              __entry->n_pages, __entry->bytes)
+);
+
+/* a new mapping was built for the controller */
+DEFINE_EVENT(bafs_dma, bafs_dma_map,
+    TP_PROTO(const struct bafs_mem_dma* dma),
+    TP_ARGS(dma)
+);
+
+/* an existing mapping of the window was handed out again */
+DEFINE_EVENT(bafs_dma, bafs_dma_map_cached,
+    TP_PROTO(const struct bafs_mem_dma* dma),
+    TP_ARGS(dma)
+);
+
+/* the last reference on a mapping is gone and it is torn down */
+DEFINE_EVENT(bafs_dma, bafs_dma_unmap,
+    TP_PROTO(const struct bafs_mem_dma* dma),
+    TP_ARGS(dma)
+);
+
+TRACE_EVENT(bafs_mem_release,
+
+    TP_PROTO(const struct bafs_mem* mem, enum STATE state),
+
+    TP_ARGS(mem, state),
+
+    TP_STRUCT__entry(
+        __field(u32,           handle)
+        __field(unsigned,      loc)
+        __field(int,           state)
+        __field(unsigned long, n_pages)
+        __field(unsigned long, bytes)
+    ),
+
+    TP_fast_assign(
+        __entry->handle  = mem->mem_id + 1;
+        __entry->loc     = mem->loc;
+        __entry->state   = state;
+        __entry->n_pages = mem->n_pages;
+        __entry->bytes   = mem->n_pages << mem->page_shift;
+    ),
+
+    TP_printk("handle=%u loc=%s state=%d pages=%lu bytes=%lu",
+              __entry->handle, show_bafs_mem_loc(__entry->loc), __entry->state,
+              __entry->n_pages, __entry->bytes)
+);
+
+#endif                          // _TRACE_BAFS_H_
+
+/* found through -I$(src)/include as <trace/events/bafs.h> */
+#include <trace/define_trace.h>
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    unsigned size;
+    unsigned i;
+    void* addr;
+    const char* ctrl_name;
+    bafs_mem_hnd_t handle;
+    struct bafs_dma_extents_t dma_handle;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 3) {
+        fprintf(stderr, "Please specify the memory size and a controller with a CMB.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoul(argv[1], NULL, 0);
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    ctrl_name = argv[2];
+
+    addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        perror("Error while reserving address space");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_reg_mem_flags(size, BAFS_MEM_CMB, BAFS_MEM_FLAG_WC, &ctrl_handle, &handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while registering cmb");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_pin_mem(&addr, size, &ctrl_handle, handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while mapping cmb");
+        exit(EXIT_FAILURE);
+    }
+
+    /* write combined stores land in device memory */
+    for (i = 0; i < size / sizeof(uint32_t); i++) {
+        ((volatile uint32_t*) addr)[i] = i;
+    }
+    for (i = 0; i < size / sizeof(uint32_t); i++) {
+        if (((volatile uint32_t*) addr)[i] != i) {
+            fprintf(stderr, "cmb readback mismatch at word %u\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("Wrote and read back %u bytes of cmb\n", size);
+
+    dma_handle.n_extents = size / PAGE_SIZE;
+    dma_handle.map_gran = 0;
+    dma_handle.n_ctrl_extents = NULL;
+    dma_handle.extents = malloc(sizeof(*dma_handle.extents) * dma_handle.n_extents);
+    if (dma_handle.extents == NULL) {
+        perror("Error allocating dma extents");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_dma_map_mem_extents(addr, &dma_handle, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while dma mapping cmb");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < dma_handle.n_extents; i++) {
+        printf("extent %u: bus addr 0x%llx len %llu\n", i,
+               (unsigned long long) dma_handle.extents[i].dma_addr, (unsigned long long) dma_handle.extents[i].len);
+    }
+
+
+    return EXIT_SUCCESS;
+
+
+}
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+
+
+struct worker {
+    pthread_t thread;
+    struct bafs_ctrl_t* ctrl_handle;
+    char* addr;
+    bafs_mem_hnd_t handle;
+    struct bafs_dma_extent extent;
+    struct bafs_dma_extents_t dma_handle;
+    int by_handle;
+    double secs;
+    unsigned long ops;
+    int ret;
+};
+
+static volatile int go;
+static volatile int stop;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int map_once(struct worker* w) {
+    w->dma_handle.n_extents = 1;
+    if (w->by_handle)
+        return bafs_ctrl_dma_map_mem_hnd(w->handle, 0, 0, &w->dma_handle, w->ctrl_handle);
+    return bafs_ctrl_dma_map_mem_range(w->addr, 0, 0, &w->dma_handle, w->ctrl_handle);
+}
+
+static int unmap_once(struct worker* w) {
+    if (w->by_handle)
+        return bafs_ctrl_dma_unmap_mem_hnd(w->handle, 0, 0, w->ctrl_handle);
+    return bafs_ctrl_dma_unmap_mem(w->addr, 0, 0, w->ctrl_handle);
+}
+
+/* the region stays mapped, so every map in the loop is a cache hit and the unmap drops it again */
+static void* run(void* arg) {
+    struct worker* w = arg;
+    double start;
+
+    w->ret = map_once(w);
+    if (w->ret)
+        return NULL;
+
+    while (!go)
+        ;
+
+    start = now();
+    while (!stop) {
+        w->ret = map_once(w);
+        if (!w->ret)
+            w->ret = unmap_once(w);
+        if (w->ret)
+            break;
+        w->ops += 2;
+    }
+    w->secs = now() - start;
+
+    if (!w->ret)
+        w->ret = unmap_once(w);
+    return NULL;
+}
+
+static double run_round(struct worker* workers, unsigned n_threads, int by_handle, double secs) {
+    unsigned i;
+    double rate = 0;
+    struct timespec ts;
+
+    go = 0;
+    stop = 0;
+    for (i = 0; i < n_threads; i++) {
+        workers[i].by_handle = by_handle;
+        workers[i].ops = 0;
+        workers[i].ret = 0;
+        if (pthread_create(&workers[i].thread, NULL, run, &workers[i])) {
+            perror("Error while starting thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    go = 1;
+    ts.tv_sec = (time_t) secs;
+    ts.tv_nsec = (long) ((secs - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+    stop = 1;
+
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].ret) {
+            errno = workers[i].ret;
+            perror(by_handle ? "Error while mapping by handle" : "Error while mapping by address");
+            exit(EXIT_FAILURE);
+        }
+        rate += workers[i].ops / workers[i].secs;
+    }
+
+    return rate;
+}
+
+/*
+ * Every thread maps and unmaps its own registration through one shared ctrl file,
+ * doubling the thread count each round. Lookups and reference counts that scale
+ * keep the per thread rate flat, a shared lock or cacheline makes it fall.
+ */
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    unsigned max_threads;
+    unsigned n;
+    unsigned i;
+    double secs;
+    double base[2] = {0, 0};
+    double rate;
+    int by_handle;
+    const char* ctrl_name;
+    struct worker* workers;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 4) {
+        fprintf(stderr, "Please specify the maximum number of threads, seconds per round and controller.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    max_threads = strtoul(argv[1], NULL, 0);
+    secs = strtod(argv[2], NULL);
+    ctrl_name = argv[3];
+
+    if ((max_threads == 0) || (secs <= 0)) {
+        fprintf(stderr, "Run at least one thread for a positive time.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    workers = calloc(max_threads, sizeof(*workers));
+    if (workers == NULL) {
+        perror("Error allocating workers");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < max_threads; i++) {
+        ret = posix_memalign((void**) &workers[i].addr, PAGE_SIZE, PAGE_SIZE);
+        if (ret) {
+            perror("Unable to allocate cpu memory with posix_memalign");
+            exit(EXIT_FAILURE);
+        }
+        ret = bafs_ctrl_reg_user_mem(workers[i].addr, PAGE_SIZE, &ctrl_handle, &workers[i].handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while registering user memory");
+            exit(EXIT_FAILURE);
+        }
+        workers[i].ctrl_handle = &ctrl_handle;
+        workers[i].dma_handle.map_gran = 0;
+        workers[i].dma_handle.n_ctrl_extents = NULL;
+        workers[i].dma_handle.extents = &workers[i].extent;
+    }
+
+    printf("%8s %8s %14s %14s %8s\n", "lookup", "threads", "ops/s", "ops/s/thread", "scaling");
+    for (by_handle = 0; by_handle < 2; by_handle++) {
+        for (n = 1; n <= max_threads; n *= 2) {
+            rate = run_round(workers, n, by_handle, secs);
+            if (n == 1)
+                base[by_handle] = rate;
+            printf("%8s %8u %14.0f %14.0f %8.2f\n", by_handle ? "handle" : "vaddr", n, rate, rate / n,
+                   rate / base[by_handle]);
+        }
+    }
+
+    for (i = 0; i < max_threads; i++) {
+        ret = bafs_ctrl_dereg_mem(workers[i].handle, &ctrl_handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while deregistering memory");
+            exit(EXIT_FAILURE);
+        }
+        free(workers[i].addr);
+    }
+
+    free(workers);
+
+
+    return EXIT_SUCCESS;
+
+
+}
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+
+
+/* value of the "name value" line of the stats file, exits if it is missing */
+static long long read_stat(const char* path, const char* name) {
+    FILE* f;
+    char line[256];
+    char key[64];
+    long long value;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if ((sscanf(line, "%63s %lld", key, &value) == 2) && !strcmp(key, name)) {
+            fclose(f);
+            return value;
+        }
+    }
+    fclose(f);
+
+    fprintf(stderr, "No %s in %s\n", name, path);
+    exit(EXIT_FAILURE);
+}
+
+/* number of calls recorded across the latency buckets of op */
+static unsigned long long count_latency(const char* path, const char* op) {
+    FILE* f;
+    char line[256];
+    char key[64];
+    char match[64];
+    unsigned long long lower;
+    unsigned long long n;
+    unsigned long long total = 0;
+
+    snprintf(match, sizeof(match), "%s_us", op);
+    f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if ((sscanf(line, "%63s %llu %llu", key, &lower, &n) == 3) && !strcmp(key, match))
+            total += n;
+    }
+    fclose(f);
+
+    return total;
+}
+
+static void expect(const char* what, long long got, long long want) {
+    if (got != want) {
+        fprintf(stderr, "%s: expected %lld, got %lld\n", what, want, got);
+        exit(EXIT_FAILURE);
+    }
+    printf("%-24s %lld\n", what, got);
+}
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    size_t size;
+    void* addr = NULL;
+    const char* ctrl_name;
+    const char* dev;
+    char path[256];
+    unsigned n_pages;
+    long long pinned;
+    long long maps;
+    long long iova;
+    long long ioctls;
+    unsigned long long n_maps;
+    bafs_mem_hnd_t handle;
+    struct bafs_dma_extents_t dma_handle;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 3) {
+        fprintf(stderr, "Please specify the memory size and controller, e.g. /dev/bafsc0.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoul(argv[1], NULL, 0);
+    ctrl_name = argv[2];
+
+    size = (size + PAGE_SIZE - 1) & ~((size_t) PAGE_SIZE - 1);
+    dev = strrchr(ctrl_name, '/');
+    dev = dev ? dev + 1 : ctrl_name;
+    snprintf(path, sizeof(path), "/sys/class/bafsc/%s/stats", dev);
+
+    ret = posix_memalign(&addr, PAGE_SIZE, size);
+    if (ret) {
+        perror("Unable to allocate cpu memory with posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    /* other users of the controller would move the counters, run it on an idle one */
+    pinned = read_stat(path, "pinned_user_bytes");
+    maps = read_stat(path, "dma_maps");
+    iova = read_stat(path, "iova_bytes");
+    ioctls = read_stat(path, "ioctls");
+    n_maps = count_latency(path, "map");
+
+    ret = bafs_ctrl_reg_user_mem(addr, size, &ctrl_handle, &handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while registering user memory");
+        exit(EXIT_FAILURE);
+    }
+
+    n_pages = size / PAGE_SIZE;
+    dma_handle.map_gran = 0;
+    dma_handle.n_ctrl_extents = NULL;
+    dma_handle.n_extents = n_pages;
+    dma_handle.extents = malloc(sizeof(*dma_handle.extents) * n_pages);
+    if (dma_handle.extents == NULL) {
+        perror("Error allocating dma extents");
+        exit(EXIT_FAILURE);
+    }
+    ret = bafs_ctrl_dma_map_mem_hnd(handle, 0, 0, &dma_handle, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while dma mapping memory");
+        exit(EXIT_FAILURE);
+    }
+
+    expect("pinned_user_bytes", read_stat(path, "pinned_user_bytes") - pinned, size);
+    expect("dma_maps", read_stat(path, "dma_maps") - maps, 1);
+    expect("iova_bytes", read_stat(path, "iova_bytes") - iova, size);
+    expect("ioctls", read_stat(path, "ioctls") - ioctls, 2);
+    expect("map latency samples", count_latency(path, "map") - n_maps, 1);
+
+    /* deregistering tears the mapping down and unpins the pages */
+    ret = bafs_ctrl_dereg_mem(handle, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while deregistering memory");
+        exit(EXIT_FAILURE);
+    }
+
+    expect("pinned_user_bytes after", read_stat(path, "pinned_user_bytes") - pinned, 0);
+    expect("dma_maps after", read_stat(path, "dma_maps") - maps, 0);
+    expect("iova_bytes after", read_stat(path, "iova_bytes") - iova, 0);
+
+    free(dma_handle.extents);
+    free(addr);
+
+
+    return EXIT_SUCCESS;
+
+
+}
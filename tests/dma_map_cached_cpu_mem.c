@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+#define DMA_CACHE_STATS "/sys/class/bafs/bafs/dma_cache_stats"
+
+
+static long long read_stat(const char* name) {
+    FILE* stats;
+    char line[128];
+    long long value = -1;
+    size_t len = strlen(name);
+
+    stats = fopen(DMA_CACHE_STATS, "r");
+    if (stats == NULL) {
+        perror("Error while opening " DMA_CACHE_STATS);
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), stats)) {
+        if ((strncmp(line, name, len) == 0) && (line[len] == ' '))
+            value = strtoll(line + len + 1, NULL, 0);
+    }
+    fclose(stats);
+
+    return value;
+}
+
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    unsigned size;
+    unsigned loc;
+    unsigned i;
+    unsigned n_maps;
+    void* addr = NULL;
+    int n_pages;
+    const char* ctrl_name;
+    long long hits;
+    long long misses;
+    struct bafs_dma_t first;
+    struct bafs_dma_t dma_handle;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 4) {
+        fprintf(stderr, "Please specify the memory size, number of maps and controller.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoul(argv[1], NULL, 0);
+    n_maps = strtoul(argv[2], NULL, 0);
+    ctrl_name = argv[3];
+    loc = BAFS_MEM_CPU;
+
+    if (n_maps < 2) {
+        fprintf(stderr, "Map at least twice to hit the cache.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully opened ctrl file\n");
+
+    ret = bafs_ctrl_map((void**)&addr, size, loc, &ctrl_handle);
+    if (ret) {
+        perror("Error while pinning memory");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully registered and pinned memory\n");
+
+    n_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    first.dma_addrs = malloc(sizeof(void*) * n_pages);
+    dma_handle.dma_addrs = malloc(sizeof(void*) * n_pages);
+    if ((first.dma_addrs == NULL) || (dma_handle.dma_addrs == NULL)) {
+        perror("Error allocating dma addresses");
+        exit(EXIT_FAILURE);
+    }
+
+    hits = read_stat("hits");
+    misses = read_stat("misses");
+
+    first.n_dma_addrs = n_pages;
+    ret = bafs_ctrl_dma_map_mem(addr, &first, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while dma mapping memory");
+        exit(EXIT_FAILURE);
+    }
+
+    /* every further map is served from the first mapping */
+    for (i = 1; i < n_maps; i++) {
+        dma_handle.n_dma_addrs = n_pages;
+        ret = bafs_ctrl_dma_map_mem(addr, &dma_handle, &ctrl_handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while dma mapping memory again");
+            exit(EXIT_FAILURE);
+        }
+        if ((dma_handle.n_dma_addrs != first.n_dma_addrs) ||
+            memcmp(dma_handle.dma_addrs, first.dma_addrs, sizeof(void*) * first.n_dma_addrs)) {
+            fprintf(stderr, "Map %u returned different dma addresses\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    hits = read_stat("hits") - hits;
+    misses = read_stat("misses") - misses;
+    printf("%u maps: %lld hits %lld misses\n", n_maps, hits, misses);
+
+    /* other processes can map at the same time, so only a lower bound holds */
+    if (hits < (long long) (n_maps - 1)) {
+        fprintf(stderr, "Expected at least %u cache hits\n", n_maps - 1);
+        exit(EXIT_FAILURE);
+    }
+
+    /* each map holds a reference, the mapping survives until the last unmap */
+    for (i = 0; i < n_maps; i++) {
+        ret = bafs_ctrl_dma_unmap_mem(addr, 0, 0, &ctrl_handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while dma unmapping memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ret = bafs_ctrl_dma_unmap_mem(addr, 0, 0, &ctrl_handle);
+    if (ret != ENOENT) {
+        fprintf(stderr, "Expected ENOENT after the last unmap, got %d\n", ret);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully released all %u map references\n", n_maps);
+
+    free(first.dma_addrs);
+    free(dma_handle.dma_addrs);
+
+
+    return EXIT_SUCCESS;
+
+
+}
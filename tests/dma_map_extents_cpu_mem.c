@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <bafs.h>
+
+
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    unsigned size;
+    unsigned loc;
+    unsigned i;
+    void* addr = NULL;
+    const char* ctrl_name;
+    struct bafs_dma_extents_t dma_handle;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 3) {
+        fprintf(stderr, "Please specify the memory size and controller.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoul(argv[1], NULL, 0);
+    ctrl_name = argv[2];
+    loc = BAFS_MEM_CPU;
+
+
+
+    ret = posix_memalign(&addr, 4096, size);
+    if (ret) {
+        perror("Unable to allocate cpu memory with posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully opened ctrl file\n");
+
+    ret = bafs_ctrl_map((void**)&addr, size, loc, &ctrl_handle);
+    if (ret) {
+        perror("Error while pinning memory");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully registered and pinned memory\n");
+
+    /* start small and grow to the size the driver asks for */
+    dma_handle.map_gran = 0;
+    dma_handle.n_extents = 1;
+    dma_handle.n_ctrl_extents = NULL;
+    dma_handle.extents = malloc(sizeof(struct bafs_dma_extent) * dma_handle.n_extents);
+    if (dma_handle.extents == NULL) {
+        perror("Error allocating dma extents");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_dma_map_mem_extents(addr, &dma_handle, &ctrl_handle);
+    if (ret == ENOSPC) {
+        printf("Retrying with %u extents\n", dma_handle.n_extents);
+        free(dma_handle.extents);
+        dma_handle.extents = malloc(sizeof(struct bafs_dma_extent) * dma_handle.n_extents);
+        if (dma_handle.extents == NULL) {
+            perror("Error allocating dma extents");
+            exit(EXIT_FAILURE);
+        }
+        ret = bafs_ctrl_dma_map_mem_extents(addr, &dma_handle, &ctrl_handle);
+    }
+    if (ret) {
+        errno = ret;
+        perror("Error while dma mapping memory");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Mapped %u bytes in %u extents\n", size, dma_handle.n_extents);
+    for (i = 0; i < dma_handle.n_extents; i++) {
+        printf("\t%llx + %llx\n", (unsigned long long) dma_handle.extents[i].dma_addr,
+               (unsigned long long) dma_handle.extents[i].len);
+    }
+
+
+    return EXIT_SUCCESS;
+
+
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    unsigned i;
+    unsigned long j;
+    size_t size;
+    void* addr = NULL;
+    const char* ctrl_name;
+    struct bafs_dma_table_t table_handle;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 3) {
+        fprintf(stderr, "Please specify the memory size and controller.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoull(argv[1], NULL, 0);
+    ctrl_name = argv[2];
+
+
+
+    /* bafs_ctrl_pin_mem maps with MAP_FIXED, reserve a range for it first */
+    addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        perror("Error while reserving address space");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_map(&addr, size, BAFS_MEM_CPU, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while pinning memory");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_dma_map_mem_table(addr, &table_handle, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while dma mapping memory table");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Mapped %u tables of %lu addrs, page size %lu, generation %llu\n", table_handle.n_ctrls,
+           table_handle.n_addrs, table_handle.page_size, table_handle.generation);
+
+    for (i = 0; i < table_handle.n_ctrls; i++) {
+        for (j = 0; (j < table_handle.n_addrs) && (j < 4); j++) {
+            printf("ctrl %u page %lu dma addr 0x%llx\n", i, j, (unsigned long long) table_handle.tables[i]->dma_addrs[j]);
+        }
+    }
+
+    if (bafs_dma_table_changed(&table_handle)) {
+        fprintf(stderr, "Table changed without a remap\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* mapping again supersedes the first tables */
+    {
+        struct bafs_dma_table_t again;
+
+        ret = bafs_ctrl_dma_map_mem_table(addr, &again, &ctrl_handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while dma mapping memory table again");
+            exit(EXIT_FAILURE);
+        }
+        if (!bafs_dma_table_changed(&table_handle)) {
+            fprintf(stderr, "Generation was not bumped by the remap\n");
+            exit(EXIT_FAILURE);
+        }
+        printf("Remap bumped generation to %llu\n", again.generation);
+        bafs_dma_table_release(&again);
+    }
+
+    bafs_dma_table_release(&table_handle);
+
+
+    return EXIT_SUCCESS;
+
+
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    size_t size;
+    unsigned long window;
+    unsigned long offset;
+    unsigned long n_windows = 0;
+    void* addr = NULL;
+    const char* ctrl_name;
+    bafs_mem_hnd_t handle;
+    struct bafs_dma_extents_t dma_handle;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 4) {
+        fprintf(stderr, "Please specify the memory size, window size and controller.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoul(argv[1], NULL, 0);
+    window = strtoul(argv[2], NULL, 0);
+    ctrl_name = argv[3];
+
+    if ((window == 0) || (window % PAGE_SIZE) || (window > size)) {
+        fprintf(stderr, "The window must be a non zero multiple of %d no larger than the memory.\n", PAGE_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    ret = posix_memalign(&addr, PAGE_SIZE, size);
+    if (ret) {
+        perror("Unable to allocate cpu memory with posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully opened ctrl file\n");
+
+    ret = bafs_ctrl_reg_user_mem(addr, size, &ctrl_handle, &handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while registering user memory");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully registered memory with handle %u\n", handle);
+
+    /* one extent per page is always enough for a window */
+    dma_handle.map_gran = 0;
+    dma_handle.n_ctrl_extents = NULL;
+    dma_handle.extents = malloc(sizeof(*dma_handle.extents) * (window / PAGE_SIZE));
+    if (dma_handle.extents == NULL) {
+        perror("Error allocating dma extents");
+        exit(EXIT_FAILURE);
+    }
+
+    /* slide the window over the region, only one window is mapped at a time */
+    for (offset = 0; offset < size; offset += window) {
+        dma_handle.n_extents = window / PAGE_SIZE;
+        ret = bafs_ctrl_dma_map_mem_range(addr, offset, window, &dma_handle, &ctrl_handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while dma mapping window");
+            exit(EXIT_FAILURE);
+        }
+
+        ret = bafs_ctrl_dma_unmap_mem(addr, offset, window, &ctrl_handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while dma unmapping window");
+            exit(EXIT_FAILURE);
+        }
+        n_windows++;
+    }
+
+    printf("Mapped and unmapped %lu windows of %lu bytes\n", n_windows, window);
+
+    /* the window is gone, a second unmap has nothing to drop */
+    ret = bafs_ctrl_dma_unmap_mem(addr, 0, window, &ctrl_handle);
+    if (ret != ENOENT) {
+        fprintf(stderr, "Expected ENOENT for an unmapped window, got %d\n", ret);
+        exit(EXIT_FAILURE);
+    }
+
+    /* deregistration drops the mappings that are still live */
+    dma_handle.n_extents = window / PAGE_SIZE;
+    ret = bafs_ctrl_dma_map_mem_range(addr, 0, window, &dma_handle, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while dma mapping window");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_dereg_mem(handle, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while deregistering memory");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_dereg_mem(handle, &ctrl_handle);
+    if (ret != ENOENT) {
+        fprintf(stderr, "Expected ENOENT for a deregistered handle, got %d\n", ret);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully deregistered memory\n");
+
+    free(dma_handle.extents);
+    free(addr);
+
+    return EXIT_SUCCESS;
+
+
+}
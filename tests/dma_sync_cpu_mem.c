@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+#define N_RANGES 64
+
+/*
+ * On coherent x86 nothing needs syncing, boot with swiotlb=force to exercise
+ * the bounce path.
+ */
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    unsigned size;
+    unsigned loc;
+    unsigned i;
+    unsigned n_ranges;
+    int needed = 0;
+    void* addr = NULL;
+    int n_pages;
+    const char* ctrl_name;
+    struct bafs_dma_t dma_handle;
+    struct bafs_dma_sync_range ranges[N_RANGES];
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 3) {
+        fprintf(stderr, "Please specify the memory size and controller.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoul(argv[1], NULL, 0);
+    ctrl_name = argv[2];
+    loc = BAFS_MEM_CPU;
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully opened ctrl file\n");
+
+    ret = bafs_ctrl_map((void**)&addr, size, loc, &ctrl_handle);
+    if (ret) {
+        perror("Error while pinning memory");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully registered and pinned memory\n");
+
+    n_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    dma_handle.dma_addrs = malloc(sizeof(void*) * n_pages);
+    if (dma_handle.dma_addrs == NULL) {
+        perror("Error allocating dma addresses");
+        exit(EXIT_FAILURE);
+    }
+    dma_handle.n_dma_addrs = n_pages;
+
+    ret = bafs_ctrl_dma_map_mem(addr, &dma_handle, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while dma mapping memory");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_dma_sync_needed(addr, &needed, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while querying dma sync");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Mapping %s syncing\n", needed ? "needs" : "does not need");
+
+    /* hand every page to the device in one call, then take them back */
+    n_ranges = (n_pages < N_RANGES) ? n_pages : N_RANGES;
+    memset(addr, 0xa5, size);
+    for (i = 0; i < n_ranges; i++) {
+        ranges[i].offset = (unsigned long long) i * (size / n_ranges);
+        ranges[i].len = (i == n_ranges - 1) ? (size - ranges[i].offset) : (size / n_ranges);
+        ranges[i].dir = BAFS_DMA_SYNC_FOR_DEVICE;
+        ranges[i].reserved = 0;
+    }
+
+    ret = bafs_ctrl_dma_sync_mem(addr, ranges, n_ranges, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while syncing for the device");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n_ranges; i++)
+        ranges[i].dir = BAFS_DMA_SYNC_FOR_CPU;
+
+    ret = bafs_ctrl_dma_sync_mem(addr, ranges, n_ranges, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while syncing for the cpu");
+        exit(EXIT_FAILURE);
+    }
+
+    /* nothing wrote to the memory in between, a bounced sync must not lose the pattern */
+    for (i = 0; i < size; i++) {
+        if (((unsigned char*) addr)[i] != 0xa5) {
+            fprintf(stderr, "Byte %u changed across the sync\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* a range past the region is rejected */
+    ranges[0].offset = size;
+    ranges[0].len = PAGE_SIZE;
+    ret = bafs_ctrl_dma_sync_mem(addr, ranges, 1, &ctrl_handle);
+    if (needed && (ret != EINVAL)) {
+        fprintf(stderr, "Expected EINVAL for a range past the region, got %d\n", ret);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully synced %u ranges both ways\n", n_ranges);
+
+    free(dma_handle.dma_addrs);
+
+
+    return EXIT_SUCCESS;
+
+
+}
@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/udmabuf.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+
+
+static int udmabuf_create(unsigned size) {
+    int memfd;
+    int devfd;
+    int buf_fd;
+    struct udmabuf_create create;
+
+    memfd = memfd_create("bafs_udmabuf", MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        return -1;
+    }
+    if (ftruncate(memfd, size) || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+        close(memfd);
+        return -1;
+    }
+
+    devfd = open("/dev/udmabuf", O_RDWR);
+    if (devfd < 0) {
+        close(memfd);
+        return -1;
+    }
+
+    memset(&create, 0, sizeof(create));
+    create.memfd = memfd;
+    create.offset = 0;
+    create.size = size;
+    buf_fd = ioctl(devfd, UDMABUF_CREATE, &create);
+
+    close(devfd);
+    close(memfd);
+    return buf_fd;
+}
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    unsigned size;
+    int buf_fd;
+    int exp_fd;
+    void* buf_addr;
+    void* addr;
+    void* exp_addr;
+    const char* ctrl_name;
+    bafs_mem_hnd_t handle;
+    struct bafs_dma_extents_t dma_handle;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 3) {
+        fprintf(stderr, "Please specify the memory size and controller.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoul(argv[1], NULL, 0);
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    ctrl_name = argv[2];
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    /* import: a udmabuf backed by a memfd, mmap'd so bafs can name it by address */
+    buf_fd = udmabuf_create(size);
+    if (buf_fd < 0) {
+        perror("Error while creating udmabuf");
+        exit(EXIT_FAILURE);
+    }
+
+    buf_addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, buf_fd, 0);
+    if (buf_addr == MAP_FAILED) {
+        perror("Error while mapping udmabuf");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_reg_dmabuf_mem(buf_fd, buf_addr, size, &ctrl_handle, &handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while importing dma-buf");
+        exit(EXIT_FAILURE);
+    }
+
+    dma_handle.n_extents = size / PAGE_SIZE;
+    dma_handle.map_gran = 0;
+    dma_handle.n_ctrl_extents = NULL;
+    dma_handle.extents = malloc(sizeof(*dma_handle.extents) * dma_handle.n_extents);
+    if (dma_handle.extents == NULL) {
+        perror("Error allocating dma extents");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_dma_map_mem_extents(buf_addr, &dma_handle, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while dma mapping imported dma-buf");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Imported udmabuf mapped in %u extents, first at 0x%llx\n", dma_handle.n_extents,
+           (unsigned long long) dma_handle.extents[0].dma_addr);
+
+    /* export: a bafs cpu region handed out as a dma-buf and mapped through it */
+    addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        perror("Error while reserving address space");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_reg_mem(size, BAFS_MEM_CPU, &ctrl_handle, &handle);
+    if (ret) {
+        perror("Error while registering memory");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_pin_mem(&addr, size, &ctrl_handle, handle);
+    if (ret) {
+        perror("Error while pinning memory");
+        exit(EXIT_FAILURE);
+    }
+
+    strcpy((char*) addr, "bafs");
+
+    ret = bafs_ctrl_export_dmabuf(addr, &exp_fd, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while exporting dma-buf");
+        exit(EXIT_FAILURE);
+    }
+
+    exp_addr = mmap(NULL, size, PROT_READ, MAP_SHARED, exp_fd, 0);
+    if (exp_addr == MAP_FAILED) {
+        perror("Error while mapping exported dma-buf");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Exported dma-buf fd %d reads back \"%s\"\n", exp_fd, (char*) exp_addr);
+    if (strcmp((char*) exp_addr, "bafs")) {
+        fprintf(stderr, "Exported dma-buf does not alias the region\n");
+        exit(EXIT_FAILURE);
+    }
+
+
+    return EXIT_SUCCESS;
+
+
+}
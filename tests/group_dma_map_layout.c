@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    size_t size;
+    unsigned n_ctrls;
+    unsigned long n_pages;
+    unsigned long p;
+    unsigned c;
+    void* addr = NULL;
+    const char* group_name;
+    bafs_mem_hnd_t handle;
+    struct bafs_dma_t major;
+    struct bafs_dma_t interleaved;
+
+    struct bafs_ctrl_t group_handle;
+
+    if (argc < 4) {
+        fprintf(stderr, "Please specify the memory size, the group and the number of controllers in it.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoull(argv[1], NULL, 0);
+    group_name = argv[2];
+    n_ctrls = strtoul(argv[3], NULL, 0);
+
+    ret = posix_memalign(&addr, PAGE_SIZE, size);
+    if (ret) {
+        perror("Unable to allocate cpu memory with posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(group_name, &group_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while openning group");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_reg_user_mem(addr, size, &group_handle, &handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while registering user memory");
+        exit(EXIT_FAILURE);
+    }
+
+    n_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    major.dma_addrs = malloc(sizeof(void*) * n_pages * n_ctrls);
+    interleaved.dma_addrs = malloc(sizeof(void*) * n_pages * n_ctrls);
+    if ((major.dma_addrs == NULL) || (interleaved.dma_addrs == NULL)) {
+        perror("Error allocating dma addresses");
+        exit(EXIT_FAILURE);
+    }
+
+    /* a short table is rejected and told how large it has to be */
+    interleaved.n_dma_addrs = 1;
+    ret = bafs_ctrl_dma_map_mem_layout(addr, &interleaved, BAFS_DMA_LAYOUT_INTERLEAVED, 0, 0, &group_handle);
+    if ((ret != ENOSPC) || (interleaved.n_dma_addrs != n_pages * n_ctrls)) {
+        fprintf(stderr, "Expected ENOSPC and %lu entries, got %d and %u\n",
+                n_pages * n_ctrls, ret, interleaved.n_dma_addrs);
+        exit(EXIT_FAILURE);
+    }
+
+    major.n_dma_addrs = n_pages * n_ctrls;
+    ret = bafs_ctrl_dma_map_mem_layout(addr, &major, BAFS_DMA_LAYOUT_CTRL_MAJOR, 0, 0, &group_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while dma mapping memory controller major");
+        exit(EXIT_FAILURE);
+    }
+
+    interleaved.n_dma_addrs = n_pages * n_ctrls;
+    ret = bafs_ctrl_dma_map_mem_layout(addr, &interleaved, BAFS_DMA_LAYOUT_INTERLEAVED, 0, 0, &group_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while dma mapping memory interleaved");
+        exit(EXIT_FAILURE);
+    }
+
+    /* both layouts hold the same addresses, only the order differs */
+    n_pages = major.n_dma_addrs / n_ctrls;
+    for (p = 0; p < n_pages; p++) {
+        for (c = 0; c < n_ctrls; c++) {
+            if (interleaved.dma_addrs[p * n_ctrls + c] != major.dma_addrs[c * n_pages + p]) {
+                fprintf(stderr, "Page %lu of controller %u differs between layouts\n", p, c);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    /* strides that make two entries collide are rejected */
+    interleaved.n_dma_addrs = n_pages * n_ctrls;
+    ret = bafs_ctrl_dma_map_mem_layout(addr, &interleaved, BAFS_DMA_LAYOUT_STRIDED, 1, 1, &group_handle);
+    if ((n_pages > 1) && (n_ctrls > 1) && (ret != EINVAL)) {
+        fprintf(stderr, "Expected EINVAL for overlapping strides, got %d\n", ret);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully mapped %lu pages on %u controllers in both layouts\n", n_pages, n_ctrls);
+
+    ret = bafs_ctrl_dereg_mem(handle, &group_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while deregistering memory");
+        exit(EXIT_FAILURE);
+    }
+
+    free(major.dma_addrs);
+    free(interleaved.dma_addrs);
+    free(addr);
+
+
+    return EXIT_SUCCESS;
+
+
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+#define MAP_PARALLEL "/sys/module/bafs_core/parameters/map_parallel"
+
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    size_t size;
+    unsigned n_ctrls;
+    unsigned long n_pages;
+    void* addr = NULL;
+    const char* group_name;
+    bafs_mem_hnd_t handle;
+    char mode[8] = "?";
+    double start;
+    double secs;
+    FILE* param;
+    struct bafs_dma_t dma_handle;
+
+    struct bafs_ctrl_t group_handle;
+
+    if (argc < 4) {
+        fprintf(stderr, "Please specify the memory size, the group and the number of controllers in it.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoull(argv[1], NULL, 0);
+    group_name = argv[2];
+    n_ctrls = strtoul(argv[3], NULL, 0);
+
+    /* echo 0 > MAP_PARALLEL to measure the serial path */
+    param = fopen(MAP_PARALLEL, "r");
+    if (param) {
+        if (fscanf(param, "%7s", mode) != 1) {
+            mode[0] = '?';
+            mode[1] = '\0';
+        }
+        fclose(param);
+    }
+
+    ret = posix_memalign(&addr, PAGE_SIZE, size);
+    if (ret) {
+        perror("Unable to allocate cpu memory with posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(group_name, &group_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while openning group");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_reg_user_mem(addr, size, &group_handle, &handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while registering user memory");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the group returns one address list per controller, back to back */
+    n_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    dma_handle.dma_addrs = malloc(sizeof(void*) * n_pages * n_ctrls);
+    if (dma_handle.dma_addrs == NULL) {
+        perror("Error allocating dma addresses");
+        exit(EXIT_FAILURE);
+    }
+    dma_handle.n_dma_addrs = n_pages * n_ctrls;
+
+    start = now();
+
+    ret = bafs_ctrl_dma_map_mem(addr, &dma_handle, &group_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while dma mapping memory");
+        exit(EXIT_FAILURE);
+    }
+
+    secs = now() - start;
+
+    printf("map_parallel=%s mapped %zu bytes on %u controllers in %.3f s: %.2f GB/s per controller\n",
+           mode, size, n_ctrls, secs, size / secs / 1e9);
+
+    ret = bafs_ctrl_dereg_mem(handle, &group_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while deregistering memory");
+        exit(EXIT_FAILURE);
+    }
+
+    free(dma_handle.dma_addrs);
+    free(addr);
+
+
+    return EXIT_SUCCESS;
+
+
+}
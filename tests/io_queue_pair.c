@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <bafs.h>
+
+#define DEPTH 64
+#define N_CMDS 1000
+
+
+/* submits flushes of namespace 1 through a pair of its own and checks every completion */
+static int worker(const char* ctrl_name, unsigned id) {
+    int ret = 0;
+    unsigned i;
+    unsigned sq_tail = 0;
+    unsigned cq_head = 0;
+    unsigned phase = 1;
+    uint32_t dw3;
+    uint32_t* cmd;
+    volatile uint32_t* cqe;
+    struct bafs_qp_t qp;
+    struct bafs_ctrl_t ctrl_handle;
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while openning ctrl");
+        return ret;
+    }
+
+    ret = bafs_ctrl_create_qp(DEPTH, &ctrl_handle, &qp);
+    if (ret) {
+        errno = ret;
+        perror("Error while creating queue pair");
+        return ret;
+    }
+
+    for (i = 0; i < N_CMDS; i++) {
+        cmd = (uint32_t*) qp.sq + sq_tail * 16;
+        memset(cmd, 0, 64);
+        cmd[0] = 0x00 | ((i % 0xffff) << 16);
+        cmd[1] = 1;
+        if (++sq_tail == qp.depth)
+            sq_tail = 0;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        *qp.sq_db = sq_tail;
+
+        cqe = (volatile uint32_t*) qp.cq + cq_head * 4;
+        while (((__atomic_load_n(&cqe[3], __ATOMIC_ACQUIRE) >> 16) & 1) != phase)
+            ;
+        dw3 = cqe[3];
+        if ((dw3 & 0xffff) != (i % 0xffff) || (dw3 >> 17) != 0) {
+            fprintf(stderr, "Worker %u: command %u completed with cid %u status %#x\n",
+                    id, i, dw3 & 0xffff, dw3 >> 17);
+            return EIO;
+        }
+        if (++cq_head == qp.depth) {
+            cq_head = 0;
+            phase ^= 1;
+        }
+        *qp.cq_db = cq_head;
+    }
+
+    printf("Worker %u: %u flushes on queue %u\n", id, N_CMDS, qp.qid);
+    bafs_qp_release(&qp);
+
+    return 0;
+}
+
+int main(int argc, char* argv[] ) {
+    unsigned i;
+    unsigned n_workers;
+    int status;
+    int failed = 0;
+    pid_t pid;
+    const char* ctrl_name;
+
+    if (argc < 3) {
+        fprintf(stderr, "Please specify the number of processes and a controller loaded with admin_queue=1, e.g. /dev/bafsc0.\n"
+                        "Controllers with fewer queues than a doorbell page holds also need admin_db_shared=1.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    n_workers = strtoul(argv[1], NULL, 0);
+    ctrl_name = argv[2];
+
+    /* every process gets its own fd and queue, none of them maps the admin queue */
+    for (i = 0; i < n_workers; i++) {
+        pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0)
+            exit(worker(ctrl_name, i) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    for (i = 0; i < n_workers; i++) {
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            failed++;
+    }
+
+    if (failed) {
+        fprintf(stderr, "%d of %u workers failed\n", failed, n_workers);
+        exit(EXIT_FAILURE);
+    }
+
+
+    return EXIT_SUCCESS;
+
+
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+
+/* larger than 4 GiB and than one kmalloc'd page table can describe */
+#define DEFAULT_SIZE (6ULL << 30)
+
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    size_t size;
+    size_t off;
+    size_t step;
+    volatile uint64_t* word;
+    void* addr = NULL;
+    const char* ctrl_name;
+    bafs_mem_hnd_t handle;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 2) {
+        fprintf(stderr, "Please specify the controller, and optionally the memory size.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ctrl_name = argv[1];
+    size = DEFAULT_SIZE;
+    if (argc > 2) {
+        size = strtoull(argv[2], NULL, 0);
+    }
+
+
+
+    /* bafs_ctrl_pin_mem maps with MAP_FIXED, reserve a range for it first */
+    addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        perror("Error while reserving address space");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    /* lazy, so only the pages touched below are backed */
+    ret = bafs_ctrl_reg_mem_flags(size, BAFS_MEM_CPU, BAFS_MEM_FLAG_LAZY, &ctrl_handle, &handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while registering memory");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_pin_mem(&addr, size, &ctrl_handle, handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while pinning memory");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Registered %zu bytes, %zu pages\n", size, size / PAGE_SIZE);
+
+    step = (size / 8) & ~((size_t) PAGE_SIZE - 1);
+    if (step == 0) {
+        step = PAGE_SIZE;
+    }
+
+    /* offsets past 4 GiB must reach their own pages */
+    for (off = 0; off < size; off += step) {
+        word = (volatile uint64_t*) ((char*) addr + off);
+        *word = off;
+    }
+    word = (volatile uint64_t*) ((char*) addr + size - sizeof(uint64_t));
+    *word = size;
+
+    ret = bafs_ctrl_prefault_mem(addr, size - PAGE_SIZE, PAGE_SIZE, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while prefaulting the last page");
+        exit(EXIT_FAILURE);
+    }
+
+    for (off = 0; off < size; off += step) {
+        word = (volatile uint64_t*) ((char*) addr + off);
+        if (*word != off) {
+            fprintf(stderr, "Mismatch at offset %zu\n", off);
+            exit(EXIT_FAILURE);
+        }
+    }
+    word = (volatile uint64_t*) ((char*) addr + size - sizeof(uint64_t));
+    if (*word != size) {
+        fprintf(stderr, "Mismatch in the last page\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully accessed offsets up to %zu\n", size);
+
+
+
+    return EXIT_SUCCESS;
+
+
+}
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* one cached map plus unmap is two lookups of the registration */
+static double time_by_vaddr(char* vaddr, unsigned long iters, struct bafs_dma_extents_t* dma_handle,
+                            struct bafs_ctrl_t* ctrl_handle) {
+    int ret;
+    unsigned long i;
+    double start = now();
+
+    for (i = 0; i < iters; i++) {
+        dma_handle->n_extents = 1;
+        ret = bafs_ctrl_dma_map_mem_range(vaddr, 0, 0, dma_handle, ctrl_handle);
+        if (!ret)
+            ret = bafs_ctrl_dma_unmap_mem(vaddr, 0, 0, ctrl_handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while mapping by address");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return (now() - start) / (2 * iters);
+}
+
+static double time_by_handle(bafs_mem_hnd_t handle, unsigned long iters, struct bafs_dma_extents_t* dma_handle,
+                             struct bafs_ctrl_t* ctrl_handle) {
+    int ret;
+    unsigned long i;
+    double start = now();
+
+    for (i = 0; i < iters; i++) {
+        dma_handle->n_extents = 1;
+        ret = bafs_ctrl_dma_map_mem_hnd(handle, 0, 0, dma_handle, ctrl_handle);
+        if (!ret)
+            ret = bafs_ctrl_dma_unmap_mem_hnd(handle, 0, 0, ctrl_handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while mapping by handle");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return (now() - start) / (2 * iters);
+}
+
+/*
+ * Registers up to max_regions one page regions and times the lookup of the
+ * oldest one, the last a list walk would reach. Every region stays pinned, so
+ * RLIMIT_MEMLOCK has to cover max_regions pages.
+ */
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    unsigned long max_regions;
+    unsigned long iters;
+    unsigned long n = 0;
+    unsigned long next = 1;
+    char* addr = NULL;
+    const char* ctrl_name;
+    bafs_mem_hnd_t* handles;
+    struct bafs_dma_extent extent;
+    struct bafs_dma_extents_t dma_handle;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 4) {
+        fprintf(stderr, "Please specify the max number of registrations, iterations and controller.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    max_regions = strtoul(argv[1], NULL, 0);
+    iters = strtoul(argv[2], NULL, 0);
+    ctrl_name = argv[3];
+
+    if ((max_regions == 0) || (iters == 0)) {
+        fprintf(stderr, "Need at least one registration and one iteration.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = posix_memalign((void**) &addr, PAGE_SIZE, max_regions * PAGE_SIZE);
+    handles = malloc(sizeof(*handles) * max_regions);
+    if (ret || (handles == NULL)) {
+        perror("Unable to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    dma_handle.map_gran = 0;
+    dma_handle.extents = &extent;
+    dma_handle.n_ctrl_extents = NULL;
+
+    printf("%12s %16s %16s\n", "regions", "by vaddr (ns)", "by handle (ns)");
+    while (n < max_regions) {
+        ret = bafs_ctrl_reg_user_mem(addr + n * PAGE_SIZE, PAGE_SIZE, &ctrl_handle, &handles[n]);
+        if (ret) {
+            errno = ret;
+            perror("Error while registering user memory");
+            exit(EXIT_FAILURE);
+        }
+        n++;
+
+        if ((n != next) && (n != max_regions))
+            continue;
+        next *= 10;
+
+        /* the first map is kept so the timed ones hit the dma map cache */
+        dma_handle.n_extents = 1;
+        ret = bafs_ctrl_dma_map_mem_range(addr, 0, 0, &dma_handle, &ctrl_handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while dma mapping memory");
+            exit(EXIT_FAILURE);
+        }
+
+        printf("%12lu %16.0f %16.0f\n", n,
+               time_by_vaddr(addr, iters, &dma_handle, &ctrl_handle) * 1e9,
+               time_by_handle(handles[0], iters, &dma_handle, &ctrl_handle) * 1e9);
+
+        ret = bafs_ctrl_dma_unmap_mem(addr, 0, 0, &ctrl_handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while dma unmapping memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* an address inside a region names it as well */
+    if (max_regions > 1) {
+        dma_handle.n_extents = 1;
+        ret = bafs_ctrl_dma_map_mem_range(addr + PAGE_SIZE + 64, 0, 0, &dma_handle, &ctrl_handle);
+        if (!ret)
+            ret = bafs_ctrl_dma_unmap_mem_hnd(handles[1], 0, 0, &ctrl_handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while mapping by an inner address");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (n = 0; n < max_regions; n++) {
+        ret = bafs_ctrl_dereg_mem(handles[n], &ctrl_handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while deregistering memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ret = bafs_ctrl_dma_map_mem_hnd(handles[0], 0, 0, &dma_handle, &ctrl_handle);
+    if (ret != ENOENT) {
+        fprintf(stderr, "Expected ENOENT for a deregistered handle, got %d\n", ret);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully looked up %lu registrations\n", max_regions);
+
+    free(handles);
+    free(addr);
+
+
+    return EXIT_SUCCESS;
+
+
+}
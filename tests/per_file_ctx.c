@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+
+
+struct worker {
+    pthread_t thread;
+    const char* ctrl_name;
+    unsigned long iters;
+    double secs;
+    int ret;
+};
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* each thread opens its own fd, so it registers into a table nobody else touches */
+static void* run(void* arg) {
+    struct worker* w = arg;
+    unsigned long i;
+    void* addr = NULL;
+    bafs_mem_hnd_t handle;
+    double start;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    w->ret = bafs_ctrl_open(w->ctrl_name, &ctrl_handle);
+    if (w->ret)
+        return NULL;
+
+    w->ret = posix_memalign(&addr, PAGE_SIZE, PAGE_SIZE);
+    if (w->ret)
+        return NULL;
+
+    start = now();
+    for (i = 0; i < w->iters; i++) {
+        w->ret = bafs_ctrl_reg_user_mem(addr, PAGE_SIZE, &ctrl_handle, &handle);
+        if (!w->ret)
+            w->ret = bafs_ctrl_dereg_mem(handle, &ctrl_handle);
+        if (w->ret)
+            break;
+    }
+    w->secs = now() - start;
+
+    free(addr);
+    return NULL;
+}
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    unsigned max_threads;
+    unsigned long iters;
+    unsigned n;
+    unsigned i;
+    double rate;
+    double base = 0;
+    void* addr = NULL;
+    const char* ctrl_name;
+    bafs_mem_hnd_t handle;
+    struct worker* workers;
+    struct bafs_dma_extent extent;
+    struct bafs_dma_extents_t dma_handle;
+
+    struct bafs_ctrl_t first;
+    struct bafs_ctrl_t second;
+
+    if (argc < 4) {
+        fprintf(stderr, "Please specify the maximum number of threads, iterations per thread and controller.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    max_threads = strtoul(argv[1], NULL, 0);
+    iters = strtoul(argv[2], NULL, 0);
+    ctrl_name = argv[3];
+
+    if ((max_threads == 0) || (iters == 0)) {
+        fprintf(stderr, "Run at least one thread for one iteration.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = posix_memalign(&addr, PAGE_SIZE, PAGE_SIZE);
+    if (ret) {
+        perror("Unable to allocate cpu memory with posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &first);
+    if (!ret)
+        ret = bafs_ctrl_open(ctrl_name, &second);
+    if (ret) {
+        errno = ret;
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_reg_user_mem(addr, PAGE_SIZE, &first, &handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while registering user memory");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the registration is invisible through the other fd, by handle and by address */
+    dma_handle.map_gran = 0;
+    dma_handle.n_ctrl_extents = NULL;
+    dma_handle.extents = &extent;
+    dma_handle.n_extents = 1;
+    ret = bafs_ctrl_dma_map_mem_hnd(handle, 0, 0, &dma_handle, &second);
+    if (ret != ENOENT) {
+        fprintf(stderr, "Expected ENOENT mapping a handle of another fd, got %d\n", ret);
+        exit(EXIT_FAILURE);
+    }
+    ret = bafs_ctrl_dma_map_mem_range(addr, 0, 0, &dma_handle, &second);
+    if (ret == 0) {
+        fprintf(stderr, "Mapped a registration of another fd by address\n");
+        exit(EXIT_FAILURE);
+    }
+    ret = bafs_ctrl_dereg_mem(handle, &second);
+    if (ret != ENOENT) {
+        fprintf(stderr, "Expected ENOENT deregistering through another fd, got %d\n", ret);
+        exit(EXIT_FAILURE);
+    }
+
+    /* the same range can be registered through the second fd on its own */
+    ret = bafs_ctrl_reg_user_mem(addr, PAGE_SIZE, &second, &handle);
+    if (!ret)
+        ret = bafs_ctrl_dereg_mem(handle, &second);
+    if (ret) {
+        errno = ret;
+        perror("Error while registering through the second fd");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Registrations stay private to their fd\n");
+
+    workers = calloc(max_threads, sizeof(*workers));
+    if (workers == NULL) {
+        perror("Error allocating workers");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%8s %14s %14s %8s\n", "threads", "regs/s", "regs/s/thread", "scaling");
+    for (n = 1; n <= max_threads; n *= 2) {
+        for (i = 0; i < n; i++) {
+            workers[i].ctrl_name = ctrl_name;
+            workers[i].iters = iters;
+            workers[i].ret = 0;
+            if (pthread_create(&workers[i].thread, NULL, run, &workers[i])) {
+                perror("Error while starting thread");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        rate = 0;
+        for (i = 0; i < n; i++) {
+            pthread_join(workers[i].thread, NULL);
+            if (workers[i].ret) {
+                errno = workers[i].ret;
+                perror("Error while registering from a thread");
+                exit(EXIT_FAILURE);
+            }
+            rate += workers[i].iters / workers[i].secs;
+        }
+        if (n == 1)
+            base = rate;
+        printf("%8u %14.0f %14.0f %8.2f\n", n, rate, rate / n, rate / base);
+    }
+
+    free(workers);
+    free(addr);
+
+
+    return EXIT_SUCCESS;
+
+
+}
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <bafs.h>
+
+#define NODE_PINNED_BYTES "/sys/class/bafs/bafs/node_pinned_bytes"
+
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    int node = -1;
+    unsigned size;
+    unsigned placement;
+    void* addr = NULL;
+    const char* ctrl_name;
+    bafs_mem_hnd_t handle;
+    char line[64];
+    FILE* stats;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 3) {
+        fprintf(stderr, "Please specify the memory size and controller, and optionally a node.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoul(argv[1], NULL, 0);
+    ctrl_name = argv[2];
+    placement = BAFS_MEM_PLACE_CTRL;
+    if (argc > 3) {
+        node = strtol(argv[3], NULL, 0);
+        placement = BAFS_MEM_PLACE_NODE;
+    }
+
+
+
+    ret = posix_memalign(&addr, 4096, size);
+    if (ret) {
+        perror("Unable to allocate cpu memory with posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_reg_mem_placement(size, BAFS_MEM_CPU, 0, placement, &node, &ctrl_handle, &handle);
+    if (ret) {
+        perror("Error while registering memory");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Successfully registered memory with handle: %u on node: %d\n", handle, node);
+
+    ret = bafs_ctrl_pin_mem(&addr, size, &ctrl_handle, handle);
+    if (ret) {
+        perror("Error while pinning memory");
+        exit(EXIT_FAILURE);
+    }
+
+    stats = fopen(NODE_PINNED_BYTES, "r");
+    if (stats == NULL) {
+        perror("Error while opening " NODE_PINNED_BYTES);
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), stats)) {
+        printf("%s", line);
+    }
+    fclose(stats);
+
+
+    return EXIT_SUCCESS;
+
+
+}
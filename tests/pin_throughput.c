@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <bafs.h>
+
+#define PIN_PARALLEL "/sys/module/bafs_core/parameters/pin_parallel"
+
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    unsigned size;
+    unsigned flags = 0;
+    void* addr = NULL;
+    const char* ctrl_name;
+    bafs_mem_hnd_t handle;
+    char mode[8] = "?";
+    double start;
+    double secs;
+    FILE* param;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 3) {
+        fprintf(stderr, "Please specify the memory size and controller, and optionally 2M for huge pages.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoul(argv[1], NULL, 0);
+    ctrl_name = argv[2];
+    if (argc > 3) {
+        flags = BAFS_MEM_FLAG_HUGE_2M;
+    }
+
+    /* echo 0 > PIN_PARALLEL to measure the serial path */
+    param = fopen(PIN_PARALLEL, "r");
+    if (param) {
+        if (fscanf(param, "%7s", mode) != 1) {
+            mode[0] = '?';
+            mode[1] = '\0';
+        }
+        fclose(param);
+    }
+
+    /* bafs_ctrl_pin_mem maps with MAP_FIXED, reserve a range for it first */
+    addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        perror("Error while reserving address space");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    start = now();
+
+    ret = bafs_ctrl_reg_mem_flags(size, BAFS_MEM_CPU, flags, &ctrl_handle, &handle);
+    if (ret) {
+        perror("Error while registering memory");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_pin_mem(&addr, size, &ctrl_handle, handle);
+    if (ret) {
+        perror("Error while pinning memory");
+        exit(EXIT_FAILURE);
+    }
+
+    secs = now() - start;
+
+    printf("pin_parallel=%s pinned %u bytes in %.3f s: %.2f GB/s\n", mode, size, secs, size / secs / 1e9);
+
+
+    return EXIT_SUCCESS;
+
+
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <bafs.h>
+
+#define POOL_STATS "/sys/class/bafs/bafs/pool_stats"
+
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    int i;
+    int iters = 8;
+    unsigned size;
+    void* addr = NULL;
+    const char* ctrl_name;
+    bafs_mem_hnd_t handle;
+    char line[128];
+    double start;
+    FILE* stats;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 3) {
+        fprintf(stderr, "Please specify the memory size and controller, and optionally the iterations.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoul(argv[1], NULL, 0);
+    ctrl_name = argv[2];
+    if (argc > 3) {
+        iters = strtol(argv[3], NULL, 0);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    /* short lived staging regions: after the first round pages should come back from the pool */
+    for (i = 0; i < iters; i++) {
+        start = now();
+
+        ret = bafs_ctrl_reg_mem(size, BAFS_MEM_CPU, &ctrl_handle, &handle);
+        if (ret) {
+            perror("Error while registering memory");
+            exit(EXIT_FAILURE);
+        }
+
+        /* bafs_ctrl_pin_mem maps with MAP_FIXED, reserve a range for it first */
+        addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            perror("Error while reserving address space");
+            exit(EXIT_FAILURE);
+        }
+
+        ret = bafs_ctrl_pin_mem(&addr, size, &ctrl_handle, handle);
+        if (ret) {
+            perror("Error while pinning memory");
+            exit(EXIT_FAILURE);
+        }
+
+        printf("iter %d: pinned %u bytes in %.3f ms\n", i, size, (now() - start) * 1e3);
+
+        munmap(addr, size);
+
+        /* give the scrubber a chance to zero what was just released */
+        usleep(100000);
+    }
+
+    stats = fopen(POOL_STATS, "r");
+    if (stats == NULL) {
+        perror("Error while opening " POOL_STATS);
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), stats)) {
+        printf("%s", line);
+    }
+    fclose(stats);
+
+
+    return EXIT_SUCCESS;
+
+
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include <bafs.h>
+
+#define NODE_PINNED_BYTES "/sys/class/bafs/bafs/node_pinned_bytes"
+
+
+static void print_pinned(const char* when) {
+    char line[64];
+    FILE* stats;
+
+    stats = fopen(NODE_PINNED_BYTES, "r");
+    if (stats == NULL) {
+        perror("Error while opening " NODE_PINNED_BYTES);
+        return;
+    }
+    printf("%s:\n", when);
+    while (fgets(line, sizeof(line), stats)) {
+        printf("%s", line);
+    }
+    fclose(stats);
+}
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    unsigned size;
+    unsigned hot;
+    void* addr = NULL;
+    const char* ctrl_name;
+    bafs_mem_hnd_t handle;
+    struct bafs_dma_extents_t dma_handle;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 4) {
+        fprintf(stderr, "Please specify the memory size, controller and hot prefix size.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoul(argv[1], NULL, 0);
+    ctrl_name = argv[2];
+    hot = strtoul(argv[3], NULL, 0);
+
+
+
+    /* bafs_ctrl_pin_mem maps with MAP_FIXED, reserve a range for it first */
+    addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        perror("Error while reserving address space");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_reg_mem_flags(size, BAFS_MEM_CPU, BAFS_MEM_FLAG_LAZY, &ctrl_handle, &handle);
+    if (ret) {
+        perror("Error while registering memory");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_pin_mem(&addr, size, &ctrl_handle, handle);
+    if (ret) {
+        perror("Error while pinning memory");
+        exit(EXIT_FAILURE);
+    }
+
+    print_pinned("After mmap");
+
+    ret = bafs_ctrl_prefault_mem(addr, 0, hot, &ctrl_handle);
+    if (ret) {
+        perror("Error while prefaulting memory");
+        exit(EXIT_FAILURE);
+    }
+
+    print_pinned("After prefault");
+
+    /* a touch past the hot prefix is populated by the fault handler */
+    ((volatile char*) addr)[size - 1] = 1;
+
+    print_pinned("After touch");
+
+    dma_handle.extents = malloc(sizeof(*dma_handle.extents));
+    if (dma_handle.extents == NULL) {
+        perror("Error allocating dma extents");
+        exit(EXIT_FAILURE);
+    }
+    dma_handle.n_extents = 1;
+    dma_handle.map_gran = 0;
+    dma_handle.n_ctrl_extents = NULL;
+
+    /* mapping populates the rest; one extent may not be enough, ENOSPC reports the count */
+    ret = bafs_ctrl_dma_map_mem_extents(addr, &dma_handle, &ctrl_handle);
+    if (ret && ret != ENOSPC) {
+        perror("Error while dma mapping memory");
+        exit(EXIT_FAILURE);
+    }
+
+    print_pinned("After dma map");
+
+
+    return EXIT_SUCCESS;
+
+
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include <bafs.h>
+
+#define DEPTH 64
+#define BURST 16
+#define N_BURSTS 100
+#define TIMEOUT_MS 5000
+
+
+/* submits bursts of flushes of namespace 1 and sleeps on the eventfd until they complete */
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    int efd;
+    unsigned i;
+    unsigned b;
+    unsigned done;
+    unsigned cid = 0;
+    unsigned sq_tail = 0;
+    unsigned cq_head = 0;
+    unsigned phase = 1;
+    unsigned long long wakeups = 0;
+    uint32_t dw3;
+    uint32_t* cmd;
+    uint64_t count;
+    volatile uint32_t* cqe;
+    const char* ctrl_name;
+    struct pollfd pfd;
+    struct bafs_qp_t qp;
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 2) {
+        fprintf(stderr, "Please specify a controller loaded with admin_queue=1 queue_irqs=1, e.g. /dev/bafsc0.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ctrl_name = argv[1];
+
+    efd = eventfd(0, EFD_CLOEXEC);
+    if (efd < 0) {
+        perror("Error while creating eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_create_qp_irq(DEPTH, 0, efd, &ctrl_handle, &qp);
+    if (ret) {
+        errno = ret;
+        perror("Error while creating queue pair with an interrupt");
+        exit(EXIT_FAILURE);
+    }
+    printf("Queue %u on vector %u\n", qp.qid, qp.irq_vector);
+
+    pfd.fd = efd;
+    pfd.events = POLLIN;
+
+    for (b = 0; b < N_BURSTS; b++) {
+        for (i = 0; i < BURST; i++) {
+            cmd = (uint32_t*) qp.sq + sq_tail * 16;
+            memset(cmd, 0, 64);
+            cmd[0] = 0x00 | (cid << 16);
+            cmd[1] = 1;
+            cid = (cid + 1) % 0xffff;
+            if (++sq_tail == qp.depth)
+                sq_tail = 0;
+        }
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        *qp.sq_db = sq_tail;
+
+        /* nothing spins here, the process only runs when the controller interrupts */
+        done = 0;
+        while (done < BURST) {
+            ret = poll(&pfd, 1, TIMEOUT_MS);
+            if (ret < 0) {
+                perror("Error while polling eventfd");
+                exit(EXIT_FAILURE);
+            }
+            if (ret == 0) {
+                fprintf(stderr, "No interrupt within %d ms, %u of burst %u completed\n", TIMEOUT_MS, done, b);
+                exit(EXIT_FAILURE);
+            }
+            if (read(efd, &count, sizeof(count)) != sizeof(count)) {
+                perror("Error while reading eventfd");
+                exit(EXIT_FAILURE);
+            }
+            wakeups++;
+
+            for (;;) {
+                cqe = (volatile uint32_t*) qp.cq + cq_head * 4;
+                dw3 = __atomic_load_n(&cqe[3], __ATOMIC_ACQUIRE);
+                if (((dw3 >> 16) & 1) != phase)
+                    break;
+                if ((dw3 >> 17) != 0) {
+                    fprintf(stderr, "Flush %u completed with status %#x\n", dw3 & 0xffff, dw3 >> 17);
+                    exit(EXIT_FAILURE);
+                }
+                done++;
+                if (++cq_head == qp.depth) {
+                    cq_head = 0;
+                    phase ^= 1;
+                }
+            }
+            *qp.cq_db = cq_head;
+        }
+    }
+
+    printf("%u flushes in %llu wakeups\n", N_BURSTS * BURST, wakeups);
+
+    bafs_qp_release(&qp);
+    close(efd);
+
+
+    return EXIT_SUCCESS;
+
+
+}
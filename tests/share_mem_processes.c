@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+
+
+static int send_fd(int sock, int fd) {
+    char byte = 0;
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+static int recv_fd(int sock) {
+    int fd = -1;
+    char byte;
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    if (recvmsg(sock, &msg, 0) != 1) {
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return fd;
+}
+
+static int map_first_extent(void* addr, unsigned size, struct bafs_ctrl_t* ctrl_handle, unsigned long long* dma_addr) {
+    int ret;
+    struct bafs_dma_extents_t dma_handle;
+
+    dma_handle.n_extents = size / PAGE_SIZE;
+    dma_handle.map_gran = 0;
+    dma_handle.n_ctrl_extents = NULL;
+    dma_handle.extents = malloc(sizeof(*dma_handle.extents) * dma_handle.n_extents);
+    if (dma_handle.extents == NULL) {
+        return ENOMEM;
+    }
+
+    ret = bafs_ctrl_dma_map_mem_extents(addr, &dma_handle, ctrl_handle);
+    if (ret == 0) {
+        *dma_addr = dma_handle.extents[0].dma_addr;
+    }
+    free(dma_handle.extents);
+    return ret;
+}
+
+/* worker: maps the owner's pages and its dma mapping without pinning anything itself */
+static int worker(int sock, unsigned size, const char* ctrl_name) {
+    int ret;
+    int buf_fd;
+    void* addr;
+    unsigned long long dma_addr = 0;
+    bafs_mem_hnd_t handle;
+    struct bafs_ctrl_t ctrl_handle;
+
+    buf_fd = recv_fd(sock);
+    if (buf_fd < 0) {
+        perror("Error while receiving shared fd");
+        return EXIT_FAILURE;
+    }
+
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, buf_fd, 0);
+    if (addr == MAP_FAILED) {
+        perror("Error while mapping shared registration");
+        return EXIT_FAILURE;
+    }
+    printf("worker %d reads \"%s\"\n", getpid(), (char*) addr);
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        return EXIT_FAILURE;
+    }
+
+    ret = bafs_ctrl_reg_dmabuf_mem(buf_fd, addr, size, &ctrl_handle, &handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while registering shared fd");
+        return EXIT_FAILURE;
+    }
+
+    ret = map_first_extent(addr, size, &ctrl_handle, &dma_addr);
+    if (ret) {
+        errno = ret;
+        perror("Error while dma mapping shared registration");
+        return EXIT_FAILURE;
+    }
+    printf("worker %d first dma addr 0x%llx\n", getpid(), dma_addr);
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    int i;
+    int n_workers = 2;
+    int status;
+    int buf_fd;
+    int socks[2];
+    unsigned size;
+    void* addr;
+    const char* ctrl_name;
+    unsigned long long dma_addr = 0;
+    bafs_mem_hnd_t handle;
+    pid_t pid;
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 3) {
+        fprintf(stderr, "Please specify the memory size and controller, and optionally the workers.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoul(argv[1], NULL, 0);
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    ctrl_name = argv[2];
+    if (argc > 3) {
+        n_workers = strtol(argv[3], NULL, 0);
+    }
+
+    addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        perror("Error while reserving address space");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_reg_mem(size, BAFS_MEM_CPU, &ctrl_handle, &handle);
+    if (ret) {
+        perror("Error while registering memory");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_pin_mem(&addr, size, &ctrl_handle, handle);
+    if (ret) {
+        perror("Error while pinning memory");
+        exit(EXIT_FAILURE);
+    }
+    strcpy((char*) addr, "pinned once");
+
+    /* the owner maps first, workers on the same controller reuse this mapping */
+    ret = map_first_extent(addr, size, &ctrl_handle, &dma_addr);
+    if (ret) {
+        errno = ret;
+        perror("Error while dma mapping memory");
+        exit(EXIT_FAILURE);
+    }
+    printf("owner first dma addr 0x%llx\n", dma_addr);
+
+    ret = bafs_ctrl_export_dmabuf(addr, &buf_fd, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while sharing registration");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n_workers; i++) {
+        if (socketpair(AF_UNIX, SOCK_DGRAM, 0, socks)) {
+            perror("Error while creating socketpair");
+            exit(EXIT_FAILURE);
+        }
+        pid = fork();
+        if (pid == 0) {
+            close(socks[0]);
+            exit(worker(socks[1], size, ctrl_name));
+        }
+        close(socks[1]);
+        if (send_fd(socks[0], buf_fd)) {
+            perror("Error while sending shared fd");
+            exit(EXIT_FAILURE);
+        }
+        close(socks[0]);
+    }
+
+    for (i = 0; i < n_workers; i++) {
+        wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+
+
+}
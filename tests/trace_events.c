@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <bafs.h>
+
+#define PAGE_SIZE 4096
+#define TRACEFS "/sys/kernel/tracing"
+#define DEBUG_PARAM "/sys/module/bafs_core/parameters/debug"
+
+
+static int write_file(const char* path, const char* value) {
+    FILE* f;
+
+    f = fopen(path, "w");
+    if (f == NULL)
+        return errno;
+    fputs(value, f);
+    return fclose(f) ? errno : 0;
+}
+
+static void must_write(const char* path, const char* value) {
+    int ret = write_file(path, value);
+
+    if (ret) {
+        errno = ret;
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* counts the lines of the trace buffer naming the event */
+static unsigned count_event(const char* event) {
+    FILE* trace;
+    char line[512];
+    char match[64];
+    unsigned n = 0;
+
+    snprintf(match, sizeof(match), " %s:", event);
+    trace = fopen(TRACEFS "/trace", "r");
+    if (trace == NULL) {
+        perror("Error while opening " TRACEFS "/trace");
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), trace)) {
+        if (strstr(line, match))
+            n++;
+    }
+    fclose(trace);
+
+    return n;
+}
+
+int main(int argc, char* argv[] ) {
+    int ret = 0;
+    unsigned i;
+    size_t size;
+    void* addr = NULL;
+    const char* ctrl_name;
+    unsigned n_pages;
+    bafs_mem_hnd_t handle;
+    struct bafs_dma_extents_t dma_handle;
+    static const char* events[] = {
+        "bafs_reg_mem", "bafs_mem_pin", "bafs_dma_map", "bafs_dma_map_cached", "bafs_dma_unmap", "bafs_mem_release",
+    };
+
+    struct bafs_ctrl_t ctrl_handle;
+
+    if (argc < 3) {
+        fprintf(stderr, "Please specify the memory size and controller, run as root with tracefs mounted.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size = strtoul(argv[1], NULL, 0);
+    ctrl_name = argv[2];
+
+    /* the events carry what the debug messages did, the messages stay off */
+    must_write(DEBUG_PARAM, "0");
+    must_write(TRACEFS "/trace", "");
+    must_write(TRACEFS "/events/bafs/enable", "1");
+
+    ret = posix_memalign(&addr, PAGE_SIZE, size);
+    if (ret) {
+        perror("Unable to allocate cpu memory with posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_open(ctrl_name, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while openning ctrl");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = bafs_ctrl_reg_user_mem(addr, size, &ctrl_handle, &handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while registering user memory");
+        exit(EXIT_FAILURE);
+    }
+
+    /* one extent per page is always enough, the second map hits the first mapping */
+    n_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    dma_handle.map_gran = 0;
+    dma_handle.n_ctrl_extents = NULL;
+    dma_handle.extents = malloc(sizeof(*dma_handle.extents) * n_pages);
+    if (dma_handle.extents == NULL) {
+        perror("Error allocating dma extents");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < 2; i++) {
+        dma_handle.n_extents = n_pages;
+        ret = bafs_ctrl_dma_map_mem_hnd(handle, 0, 0, &dma_handle, &ctrl_handle);
+        if (ret) {
+            errno = ret;
+            perror("Error while dma mapping memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ret = bafs_ctrl_dereg_mem(handle, &ctrl_handle);
+    if (ret) {
+        errno = ret;
+        perror("Error while deregistering memory");
+        exit(EXIT_FAILURE);
+    }
+
+    must_write(TRACEFS "/events/bafs/enable", "0");
+
+    for (i = 0; i < sizeof(events) / sizeof(events[0]); i++) {
+        if (count_event(events[i]) == 0) {
+            fprintf(stderr, "No %s event was recorded\n", events[i]);
+            exit(EXIT_FAILURE);
+        }
+        printf("%-20s recorded\n", events[i]);
+    }
+
+    free(dma_handle.extents);
+    free(addr);
+
+
+    return EXIT_SUCCESS;
+
+
+}